@@ -0,0 +1,121 @@
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "alloc_bitmap.h"
+
+#define SHARD_BITS_SHIFT (ALLOC_BITMAP_SHARD_SHIFT + 3)
+#define SHARD_WORDS (ALLOC_BITMAP_SHARD_SIZE / sizeof(uint64_t))
+
+alloc_bitmap::alloc_bitmap(uint64_t size, uint64_t ashift)
+    : bm_size(size), bm_ashift(ashift), bm_fd(-1) {
+  uint64_t nbits = (size + (1ULL << ashift) - 1) >> ashift;
+  bm_nshards = (nbits + (1ULL << SHARD_BITS_SHIFT) - 1) >> SHARD_BITS_SHIFT;
+  bm_shards.reset(new std::atomic<std::atomic<uint64_t>*>[bm_nshards]());
+
+  uint64_t bytes = bm_nshards * ALLOC_BITMAP_SHARD_SIZE;
+  uint64_t physmem = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  if (bytes > physmem / 2) {
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path = std::string(tmpdir != nullptr ? tmpdir : "/var/tmp") + "/alloc_bitmap.XXXXXX";
+    bm_fd = mkstemp(&path[0]);
+    if (bm_fd < 0 || unlink(path.c_str()) != 0 || ftruncate(bm_fd, bytes) != 0) {
+      std::cerr << "failed to create bitmap file " << path << ", err: " << strerror(errno)
+                << ", keeping the bitmap in memory" << std::endl;
+      if (bm_fd >= 0) {
+        close(bm_fd);
+      }
+      bm_fd = -1;
+    }
+  }
+}
+
+alloc_bitmap::~alloc_bitmap() {
+  for (uint64_t i = 0; i < bm_nshards; i++) {
+    auto words = bm_shards[i].load();
+    if (words != nullptr) {
+      munmap(words, ALLOC_BITMAP_SHARD_SIZE);
+    }
+  }
+  if (bm_fd >= 0) {
+    close(bm_fd);
+  }
+}
+
+std::atomic<uint64_t> *alloc_bitmap::shard(uint64_t idx) {
+  assert(idx < bm_nshards);
+  auto words = bm_shards[idx].load(std::memory_order_acquire);
+  if (words != nullptr) {
+    return words;
+  }
+
+  void *m;
+  if (bm_fd >= 0) {
+    m = mmap(nullptr, ALLOC_BITMAP_SHARD_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, bm_fd,
+             idx << ALLOC_BITMAP_SHARD_SHIFT);
+  } else {
+    m = mmap(nullptr, ALLOC_BITMAP_SHARD_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if (m == MAP_FAILED) {
+    std::cerr << "failed to map bitmap shard " << idx << ", err: " << strerror(errno) << std::endl;
+    abort();
+  }
+
+  // another thread may have installed this shard meanwhile, then we use theirs
+  auto fresh = (std::atomic<uint64_t>*)m;
+  if (!bm_shards[idx].compare_exchange_strong(words, fresh, std::memory_order_acq_rel)) {
+    munmap(m, ALLOC_BITMAP_SHARD_SIZE);
+    return words;
+  }
+  return fresh;
+}
+
+uint64_t alloc_bitmap::set(uint64_t offset, uint64_t size) {
+  uint64_t bit = offset >> bm_ashift;
+  uint64_t end = (offset + size + (1ULL << bm_ashift) - 1) >> bm_ashift;
+  assert(end <= bm_nshards << SHARD_BITS_SHIFT);
+
+  uint64_t already = 0;
+  while (bit < end) {
+    auto words = shard(bit >> SHARD_BITS_SHIFT);
+    uint64_t word_end = std::min<uint64_t>(end, (bit & ~63ULL) + 64);
+    uint64_t nbits = word_end - bit;
+    uint64_t mask = (nbits == 64 ? ~0ULL : (1ULL << nbits) - 1) << (bit & 63);
+    uint64_t old = words[(bit >> 6) % SHARD_WORDS].fetch_or(mask, std::memory_order_relaxed);
+    already += __builtin_popcountll(old & mask);
+    bit = word_end;
+  }
+  return already;
+}
+
+uint64_t alloc_bitmap::find(uint64_t bit, uint64_t end, bool value) const {
+  while (bit < end) {
+    uint64_t idx = bit >> SHARD_BITS_SHIFT;
+    uint64_t shard_end = std::min(end, (idx + 1) << SHARD_BITS_SHIFT);
+    auto words = bm_shards[idx].load(std::memory_order_acquire);
+    if (words == nullptr) {
+      // never touched, all zero
+      if (!value) {
+        return bit;
+      }
+      bit = shard_end;
+      continue;
+    }
+    while (bit < shard_end) {
+      uint64_t w = words[(bit >> 6) % SHARD_WORDS].load(std::memory_order_relaxed);
+      w = (value ? w : ~w) & (~0ULL << (bit & 63));
+      if (w != 0) {
+        return std::min<uint64_t>(end, (bit & ~63ULL) + __builtin_ctzll(w));
+      }
+      bit = (bit & ~63ULL) + 64;
+    }
+  }
+  return end;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/*
+ * One bit per 1 << ashift sector of a vdev, set as blocks are found
+ * referenced.  The bitmap is split into shards of ALLOC_BITMAP_SHARD_SIZE
+ * bytes that are mapped on first touch, so untouched parts of the vdev cost
+ * nothing.  Bits are set with atomic fetch_or and shards are installed with
+ * compare-and-swap, so any number of traversal threads can mark blocks
+ * without a lock.
+ *
+ * When the whole bitmap would be larger than half of physical memory the
+ * shards are mapped from an unlinked temporary file in $TMPDIR (or
+ * /var/tmp) instead of anonymous memory, so the kernel can write cold
+ * shards back rather than the process running out of memory.
+ */
+#define ALLOC_BITMAP_SHARD_SHIFT 20
+#define ALLOC_BITMAP_SHARD_SIZE (1ULL << ALLOC_BITMAP_SHARD_SHIFT)
+
+class alloc_bitmap {
+ public:
+  alloc_bitmap(uint64_t size, uint64_t ashift);
+  ~alloc_bitmap();
+  alloc_bitmap(const alloc_bitmap &) = delete;
+  alloc_bitmap &operator=(const alloc_bitmap &) = delete;
+
+  // mark [offset, offset + size) referenced, returns how many of its sectors already were
+  uint64_t set(uint64_t offset, uint64_t size);
+
+  /*
+   * f(offset, size) for every maximal run of sectors within
+   * [offset, offset + size) whose bit equals value.  Must not race with set().
+   */
+  template <typename F>
+  void walk(uint64_t offset, uint64_t size, bool value, F f) const;
+
+  uint64_t size() const { return bm_size; }
+  uint64_t ashift() const { return bm_ashift; }
+  bool file_backed() const { return bm_fd >= 0; }
+
+ private:
+  std::atomic<uint64_t> *shard(uint64_t idx);
+  // the first bit in [bit, end) equal to value, or end
+  uint64_t find(uint64_t bit, uint64_t end, bool value) const;
+
+  uint64_t bm_size;
+  uint64_t bm_ashift;
+  uint64_t bm_nshards;
+  int bm_fd;
+  std::unique_ptr<std::atomic<std::atomic<uint64_t>*>[]> bm_shards;
+};
+
+template <typename F>
+void alloc_bitmap::walk(uint64_t offset, uint64_t size, bool value, F f) const {
+  uint64_t end = (offset + size) >> bm_ashift;
+  for (uint64_t bit = find(offset >> bm_ashift, end, value); bit < end;) {
+    uint64_t run = find(bit, end, !value);
+    f(bit << bm_ashift, (run - bit) << bm_ashift);
+    bit = find(run, end, value);
+  }
+}
@@ -0,0 +1,402 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "block_index.h"
+#include "metaslab.h"
+#include "parallel.h"
+#include "traverse.h"
+
+#define BLOCK_INDEX_SINKS 64
+
+static bool entry_before(const block_index_entry &a, const block_index_entry &b) {
+  if (a.vdev != b.vdev) {
+    return a.vdev < b.vdev;
+  }
+  if (a.offset != b.offset) {
+    return a.offset < b.offset;
+  }
+  if (a.objset != b.objset) {
+    return a.objset < b.objset;
+  }
+  return a.object < b.object;
+}
+
+static void put_varint(std::vector<uint8_t> &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+static uint64_t get_varint(const uint8_t **p, const uint8_t *end) {
+  uint64_t v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t b = *(*p)++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      break;
+    }
+  }
+  return v;
+}
+
+static uint64_t zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void encode_entry(std::vector<uint8_t> &out, const block_index_entry &e, const block_index_entry &prev) {
+  put_varint(out, e.vdev - prev.vdev);
+  put_varint(out, e.vdev == prev.vdev ? e.offset - prev.offset : e.offset);
+  put_varint(out, e.asize >> SPA_MINBLOCKSHIFT);
+  put_varint(out, zigzag(e.objset - prev.objset));
+  put_varint(out, zigzag(e.object - prev.object));
+  put_varint(out, zigzag(e.level));
+  put_varint(out, zigzag(e.blkid - prev.blkid));
+  put_varint(out, zigzag(e.birth - prev.birth));
+}
+
+static void decode_entry(const uint8_t **p, const uint8_t *end, block_index_entry *e) {
+  uint64_t vdev_delta = get_varint(p, end);
+  uint64_t offset = get_varint(p, end);
+  e->offset = vdev_delta == 0 ? e->offset + offset : offset;
+  e->vdev += vdev_delta;
+  e->asize = get_varint(p, end) << SPA_MINBLOCKSHIFT;
+  e->objset += unzigzag(get_varint(p, end));
+  e->object += unzigzag(get_varint(p, end));
+  e->level = unzigzag(get_varint(p, end));
+  e->blkid += unzigzag(get_varint(p, end));
+  e->birth += unzigzag(get_varint(p, end));
+}
+
+static void decode_chunk(const block_index &bi, uint64_t idx,
+                         const std::function<bool(const block_index_entry &)> &cb) {
+  auto &c = bi.chunks[idx];
+  const uint8_t *p = bi.data + c.bc_file_off;
+  const uint8_t *end = (const uint8_t*)bi.chunks;
+  block_index_entry e = {};
+  for (uint64_t i = 0; i < c.bc_count; i++) {
+    decode_entry(&p, end, &e);
+    if (!cb(e)) {
+      return;
+    }
+  }
+}
+
+bool block_index_open(const std::string &path, block_index *bi) {
+  memset(bi, 0, sizeof(*bi));
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(block_index_header)) {
+    close(fd);
+    return false;
+  }
+  void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    std::cerr << "failed to mmap " << path << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  bi->data = (const uint8_t*)m;
+  bi->size = st.st_size;
+  bi->hdr = (const block_index_header*)bi->data;
+  bi->chunks = (const block_index_chunk*)(bi->data + bi->hdr->bi_chunks_off);
+  if (bi->hdr->bi_magic != BLOCK_INDEX_MAGIC || bi->hdr->bi_version != BLOCK_INDEX_VERSION ||
+      bi->hdr->bi_chunks_off + bi->hdr->bi_nchunks * sizeof(block_index_chunk) != bi->size) {
+    std::cerr << path << " is not a block index" << std::endl;
+    block_index_close(bi);
+    return false;
+  }
+  // queries touch a handful of pages all over the file
+  madvise((void*)bi->data, bi->size, MADV_RANDOM);
+  return true;
+}
+
+void block_index_close(block_index *bi) {
+  if (bi->data != nullptr) {
+    munmap((void*)bi->data, bi->size);
+  }
+  memset(bi, 0, sizeof(*bi));
+}
+
+std::vector<block_index_entry> block_index_query(const block_index &bi, uint64_t vdev, uint64_t offset) {
+  // the last chunk starting at or before the offset holds the only entries that can cover it
+  auto chunks_end = bi.chunks + bi.hdr->bi_nchunks;
+  auto it = std::upper_bound(bi.chunks, chunks_end, std::make_pair(vdev, offset),
+                             [](const std::pair<uint64_t, uint64_t> &key, const block_index_chunk &c) {
+    return key < std::make_pair(c.bc_vdev, c.bc_offset);
+  });
+  std::vector<block_index_entry> out;
+  if (it == bi.chunks) {
+    return out;
+  }
+  decode_chunk(bi, it - bi.chunks - 1, [&](const block_index_entry &e) {
+    if (e.vdev > vdev || (e.vdev == vdev && e.offset > offset)) {
+      return false;
+    }
+    if (e.vdev == vdev && offset < e.offset + e.asize) {
+      out.push_back(e);
+    }
+    return true;
+  });
+  return out;
+}
+
+namespace {
+
+// traversal threads append to one of several locked vectors, picked by thread
+struct entry_sink {
+  std::mutex lock;
+  std::vector<block_index_entry> entries;
+};
+
+}
+
+static void add_bp(entry_sink *sinks, const zbookmark_phys_t &zb, const blkptr_t *bp, const void *dev_base_ptr) {
+  if (BP_IS_HOLE(bp) || BP_IS_EMBEDDED(bp)) {
+    return;
+  }
+  auto &sink = sinks[std::hash<std::thread::id>()(std::this_thread::get_id()) % BLOCK_INDEX_SINKS];
+  // every copy of a gang header holds the same members, which get their entries once from the first one readable
+  const zio_gbh_phys_t *gbh = nullptr;
+  for (auto &dva : bp->blk_dva) {
+    if (!DVA_IS_VALID(&dva)) {
+      continue;
+    }
+    // a gang DVA's asize covers its members, which get entries of their own
+    bool gang = DVA_GET_GANG(&dva);
+    block_index_entry e = {DVA_GET_VDEV(&dva), DVA_GET_OFFSET(&dva), gang ? SPA_GANGBLOCKSIZE : DVA_GET_ASIZE(&dva),
+                           zb.zb_objset, zb.zb_object, zb.zb_level, zb.zb_blkid, bp->blk_birth};
+    {
+      std::lock_guard<std::mutex> guard(sink.lock);
+      sink.entries.push_back(e);
+    }
+    if (gang && e.vdev == 0 && gbh == nullptr) {
+      auto copy = (const zio_gbh_phys_t*)((const uint8_t*)dev_base_ptr + e.offset);
+      if (copy->zg_tail.zec_magic == ZEC_MAGIC) {
+        gbh = copy;
+      }
+    }
+  }
+  if (gbh != nullptr) {
+    for (auto &member : gbh->zg_blkptr) {
+      add_bp(sinks, zb, &member, dev_base_ptr);
+    }
+  }
+}
+
+// drop old entries whose space is free now: their blocks were freed since the old index was written
+static void drop_freed(const objset_phys_t *mos, const void *dev_base_ptr, unsigned nthreads,
+                       const std::vector<block_index_entry> &old, std::vector<uint8_t> *drop) {
+  std::vector<top_vdev_info> vdevs;
+  unflushed_log log;
+  if (!load_vdev_tree(mos, dev_base_ptr, &vdevs) || !load_unflushed_log(mos, vdevs, dev_base_ptr, &log)) {
+    return;
+  }
+  struct ms_ref {
+    const top_vdev_info *vd;
+    uint64_t id;
+    uint64_t sm_obj;
+    const std::vector<unflushed_entry> *unflushed;
+  };
+  std::vector<ms_ref> metaslabs;
+  for (auto &vd : vdevs) {
+    auto sm_objs = load_metaslab_array(mos, vd, dev_base_ptr);
+    for (uint64_t m = 0; m < vd.ms_count; m++) {
+      auto u = log.metaslabs.find(std::make_pair(vd.id, m));
+      metaslabs.push_back(ms_ref{&vd, m, sm_objs[m], u == log.metaslabs.end() ? nullptr : &u->second});
+    }
+  }
+
+  // each metaslab owns a disjoint run of the sorted entries
+  parallel_for(metaslabs.size(), nthreads, [&](uint64_t i) {
+    auto &ms = metaslabs[i];
+    uint64_t start = ms.id << ms.vd->ms_shift, end = start + (1ULL << ms.vd->ms_shift);
+    block_index_entry key = {};
+    key.vdev = ms.vd->id;
+    key.offset = start;
+    size_t j = std::lower_bound(old.begin(), old.end(), key, entry_before) - old.begin();
+    if (j == old.size() || old[j].vdev != ms.vd->id || old[j].offset >= end) {
+      return;
+    }
+
+    range_tree free_tree(start, ms.vd->ashift);
+    uint64_t entries;
+    space_map_phys_t smp;
+    if (!metaslab_load_free(mos, *ms.vd, ms.id, ms.sm_obj, dev_base_ptr, &free_tree, &entries, &smp,
+                            ms.unflushed)) {
+      return;
+    }
+    free_tree.walk([&](uint64_t seg_start, uint64_t seg_size) {
+      while (j < old.size() && old[j].vdev == ms.vd->id && old[j].offset + old[j].asize <= seg_start) {
+        j++;
+      }
+      for (size_t k = j; k < old.size() && old[k].vdev == ms.vd->id && old[k].offset < seg_start + seg_size; k++) {
+        (*drop)[k] = 1;
+      }
+    });
+  });
+}
+
+static bool write_index(const std::string &path, uint64_t pool_guid, uint64_t txg,
+                        const std::vector<block_index_entry> &entries) {
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr) {
+    std::cerr << "failed to create " << tmp << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  block_index_header hdr = {};
+  hdr.bi_magic = BLOCK_INDEX_MAGIC;
+  hdr.bi_version = BLOCK_INDEX_VERSION;
+  hdr.bi_pool_guid = pool_guid;
+  hdr.bi_txg = txg;
+  hdr.bi_nentries = entries.size();
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  std::vector<block_index_chunk> chunks;
+  uint64_t file_off = sizeof(hdr);
+  std::vector<uint8_t> buf;
+  for (size_t i = 0, n; i < entries.size(); i += n) {
+    // entries sharing a DVA (dedup) never straddle chunks, so a lookup only decodes one chunk
+    n = std::min<size_t>(BLOCK_INDEX_CHUNK, entries.size() - i);
+    while (i + n < entries.size() && entries[i + n].vdev == entries[i + n - 1].vdev &&
+           entries[i + n].offset == entries[i + n - 1].offset) {
+      n++;
+    }
+    chunks.push_back(block_index_chunk{entries[i].vdev, entries[i].offset, file_off, n});
+    buf.clear();
+    block_index_entry prev = {};
+    for (size_t k = i; k < i + n; k++) {
+      encode_entry(buf, entries[k], prev);
+      prev = entries[k];
+    }
+    fwrite(buf.data(), 1, buf.size(), f);
+    file_off += buf.size();
+  }
+
+  // keep the chunk table 8 byte aligned, it is read in place from the mapping
+  uint64_t pad = P2ROUNDUP(file_off, sizeof(uint64_t)) - file_off;
+  static const uint8_t zeros[sizeof(uint64_t)] = {};
+  fwrite(zeros, 1, pad, f);
+  hdr.bi_chunks_off = file_off + pad;
+  hdr.bi_nchunks = chunks.size();
+  fwrite(chunks.data(), sizeof(block_index_chunk), chunks.size(), f);
+  fseek(f, 0, SEEK_SET);
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  if (ferror(f) || fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+    std::cerr << "failed to write " << path << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool block_index_build(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                       uint64_t pool_guid, uint64_t txg, unsigned nthreads, const block_index *old,
+                       const std::string &path) {
+  uint64_t min_txg = 0;
+  std::vector<block_index_entry> old_entries;
+  if (old != nullptr) {
+    if (old->hdr->bi_pool_guid != pool_guid) {
+      std::cerr << "index belongs to another pool" << std::endl;
+      return false;
+    }
+    old_entries.reserve(old->hdr->bi_nentries);
+    for (uint64_t i = 0; i < old->hdr->bi_nchunks; i++) {
+      decode_chunk(*old, i, [&](const block_index_entry &e) {
+        old_entries.push_back(e);
+        return true;
+      });
+    }
+    /*
+     * The blocks a destroyed dataset owned that a later snapshot or the head
+     * still references were born before the old index, so a refresh would
+     * not find their new owner.  Start over instead.
+     */
+    std::set<uint64_t> live = {0};
+    for (auto &ds : list_datasets(mos, "", dev_base_ptr, true, true)) {
+      live.insert(ds.ds_obj);
+    }
+    for (auto &e : old_entries) {
+      if (live.count(e.objset) == 0) {
+        std::cerr << "dataset " << e.objset << " of the index is gone, rebuilding it" << std::endl;
+        old = nullptr;
+        std::vector<block_index_entry>().swap(old_entries);
+        break;
+      }
+    }
+  }
+  if (old != nullptr) {
+    min_txg = old->hdr->bi_txg;
+  }
+
+  std::unique_ptr<entry_sink[]> sinks(new entry_sink[BLOCK_INDEX_SINKS]);
+  traverse_stats stats;
+  traverse_pool(mos, mos_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &zb, const blkptr_t *bp) {
+    // blocks waiting in a bpobj are on their way out
+    if (zb.zb_objset != ZB_DESTROYED_OBJSET) {
+      add_bp(sinks.get(), zb, bp, dev_base_ptr);
+    }
+  }, &stats, min_txg);
+
+  std::vector<block_index_entry> entries;
+  for (int i = 0; i < BLOCK_INDEX_SINKS; i++) {
+    entries.insert(entries.end(), sinks[i].entries.begin(), sinks[i].entries.end());
+    std::vector<block_index_entry>().swap(sinks[i].entries);
+  }
+  std::sort(entries.begin(), entries.end(), entry_before);
+  uint64_t added = entries.size(), kept = 0;
+
+  if (old != nullptr) {
+    // space that was freed, or freed and reallocated to a newer block, no longer belongs to the old owner
+    std::vector<uint8_t> drop(old_entries.size(), 0);
+    drop_freed(mos, dev_base_ptr, nthreads, old_entries, &drop);
+    for (size_t i = 0; i < old_entries.size(); i++) {
+      auto &e = old_entries[i];
+      block_index_entry key = e;
+      key.offset = e.offset + e.asize;
+      key.objset = 0;
+      key.object = 0;
+      auto it = std::lower_bound(entries.begin(), entries.begin() + added, key, entry_before);
+      if (it != entries.begin() && (it - 1)->vdev == e.vdev && (it - 1)->offset + (it - 1)->asize > e.offset) {
+        drop[i] = 1;
+      }
+    }
+    for (size_t i = 0; i < old_entries.size(); i++) {
+      if (!drop[i]) {
+        entries.push_back(old_entries[i]);
+        kept++;
+      }
+    }
+    std::inplace_merge(entries.begin(), entries.begin() + added, entries.end(), entry_before);
+  }
+
+  std::cerr << "traversed " << stats.blocks << " blocks, " << added << " new entries";
+  if (old != nullptr) {
+    std::cerr << ", kept " << kept << " of " << old->hdr->bi_nentries << " from txg " << old->hdr->bi_txg;
+  }
+  std::cerr << std::endl;
+  return write_index(path, pool_guid, txg, entries);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "zfs_reader.h"
+
+/*
+ * A persistent reverse block map: DVA range -> the block that owns it.
+ *
+ * The file is a header, the entries sorted by (vdev, offset) and packed
+ * in chunks of about BLOCK_INDEX_CHUNK entries, then one block_index_chunk
+ * per chunk.  Entries are varint encoded as deltas from the previous entry
+ * of the chunk, so a run of blocks of the same file costs a few bytes each.
+ * A lookup binary searches the chunk table and decodes a single chunk.
+ *
+ * Every block born up to bi_txg is in the index, so it can be refreshed by
+ * traversing only what was born since.
+ */
+#define BLOCK_INDEX_MAGIC 0x7a66736b6c626964ULL   // "diblksfz" on disk
+#define BLOCK_INDEX_VERSION 1
+#define BLOCK_INDEX_CHUNK 256
+
+struct block_index_header {
+  uint64_t bi_magic;
+  uint64_t bi_version;
+  uint64_t bi_pool_guid;
+  uint64_t bi_txg;
+  uint64_t bi_nentries;
+  uint64_t bi_nchunks;
+  uint64_t bi_chunks_off;     // file offset of the chunk table
+};
+
+struct block_index_chunk {
+  uint64_t bc_vdev;           // of the chunk's first entry
+  uint64_t bc_offset;
+  uint64_t bc_file_off;       // where its encoded entries start
+  uint64_t bc_count;
+};
+
+struct block_index_entry {
+  uint64_t vdev;
+  uint64_t offset;
+  uint64_t asize;
+  uint64_t objset;            // as in zbookmark_phys_t, 0 for the MOS
+  uint64_t object;
+  int64_t level;
+  uint64_t blkid;
+  uint64_t birth;
+};
+
+struct block_index {
+  const uint8_t *data;
+  size_t size;
+  const block_index_header *hdr;
+  const block_index_chunk *chunks;
+};
+
+// map an index file, false if it is missing or not an index
+bool block_index_open(const std::string &path, block_index *bi);
+
+void block_index_close(block_index *bi);
+
+// every entry whose range covers offset on vdev, more than one for dedup'd blocks
+std::vector<block_index_entry> block_index_query(const block_index &bi, uint64_t vdev, uint64_t offset);
+
+/*
+ * Traverse the pool and write a new index of every block born up to txg.
+ * With old, only blocks born after old's txg are traversed; old entries
+ * are kept unless their space has been freed or reallocated since.  If a
+ * dataset that owns old entries has been destroyed, the whole pool is
+ * traversed again instead.
+ */
+bool block_index_build(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                       uint64_t pool_guid, uint64_t txg, unsigned nthreads, const block_index *old,
+                       const std::string &path);
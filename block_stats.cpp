@@ -0,0 +1,278 @@
+#include <cinttypes>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "block_stats.h"
+
+static const char *dmu_ot_names[DMU_OT_NUMTYPES] = {
+    "unallocated",
+    "object directory",
+    "object array",
+    "packed nvlist",
+    "packed nvlist size",
+    "bpobj",
+    "bpobj header",
+    "SPA space map header",
+    "SPA space map",
+    "ZIL intent log",
+    "DMU dnode",
+    "DMU objset",
+    "DSL directory",
+    "DSL directory child map",
+    "DSL dataset snap map",
+    "DSL props",
+    "DSL dataset",
+    "ZFS znode",
+    "ZFS V0 ACL",
+    "ZFS plain file",
+    "ZFS directory",
+    "ZFS master node",
+    "ZFS delete queue",
+    "zvol object",
+    "zvol prop",
+    "other uint8[]",
+    "other uint64[]",
+    "other ZAP",
+    "persistent error log",
+    "SPA history",
+    "SPA history offsets",
+    "Pool properties",
+    "DSL permissions",
+    "ZFS ACL",
+    "ZFS SYSACL",
+    "FUID table",
+    "FUID table size",
+    "DSL dataset next clones",
+    "scan work queue",
+    "ZFS user/group/project used",
+    "ZFS user/group/project quota",
+    "snapshot refcount tags",
+    "DDT ZAP algorithm",
+    "DDT statistics",
+    "System attributes",
+    "SA master node",
+    "SA attr registration",
+    "SA attr layouts",
+    "scan translations",
+    "deduplicated block",
+    "DSL deadlist map",
+    "DSL deadlist map hdr",
+    "DSL dir clones",
+    "bpobj subobj",
+};
+
+static const char *dmu_bswap_names[DMU_BSWAP_NUMFUNCS] = {
+    "uint8", "uint16", "uint32", "uint64", "zap", "dnode", "objset", "znode", "oldacl", "acl",
+};
+
+static const char *zio_compress_names[ZIO_COMPRESS_FUNCTIONS] = {
+    "inherit", "on", "uncompressed", "lzjb", "empty", "gzip-1", "gzip-2", "gzip-3", "gzip-4", "gzip-5",
+    "gzip-6", "gzip-7", "gzip-8", "gzip-9", "zle", "lz4", "zstd",
+};
+
+std::string dmu_object_type_name(int type) {
+  if (type & DMU_OT_NEWTYPE) {
+    int bswap = type & DMU_OT_BYTESWAP_MASK;
+    std::string name = bswap < DMU_BSWAP_NUMFUNCS ? dmu_bswap_names[bswap] : "unknown";
+    name += (type & DMU_OT_METADATA) ? " metadata" : " data";
+    if (type & DMU_OT_ENCRYPTED) {
+      name += " (encrypted)";
+    }
+    return name;
+  }
+  return type < DMU_OT_NUMTYPES ? dmu_ot_names[type] : "type " + std::to_string(type);
+}
+
+const char *zio_compress_name(int compress) {
+  return compress < ZIO_COMPRESS_FUNCTIONS ? zio_compress_names[compress] : "unknown";
+}
+
+static int size_bucket(uint64_t size) {
+  return size == 0 ? 0 : std::min(63 - __builtin_clzll(size), BLOCK_STATS_HIST_SIZE - 1);
+}
+
+static void block_size_stats_add(block_size_stats *s, uint64_t lsize, uint64_t psize, uint64_t asize) {
+  s->count++;
+  s->lsize += lsize;
+  s->psize += psize;
+  s->asize += asize;
+  s->lsize_hist[size_bucket(lsize)]++;
+  s->psize_hist[size_bucket(psize)]++;
+  s->asize_hist[size_bucket(asize)]++;
+}
+
+static void block_size_stats_merge(block_size_stats *dst, const block_size_stats &src) {
+  auto d = (uint64_t*)dst;
+  auto s = (const uint64_t*)&src;
+  for (size_t i = 0; i < sizeof(block_size_stats) / sizeof(uint64_t); i++) {
+    d[i] += s[i];
+  }
+}
+
+namespace {
+
+// which block_stats this thread counts into, valid for one collect_block_stats() call
+struct block_stats_slot {
+  uint64_t generation;
+  block_stats *stats;
+};
+
+}
+
+static std::atomic<uint64_t> block_stats_generation(0);
+static thread_local block_stats_slot block_stats_local = {0, nullptr};
+
+void collect_block_stats(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                         unsigned nthreads, block_stats *stats) {
+  uint64_t generation = ++block_stats_generation;
+  std::vector<std::unique_ptr<block_stats>> locals;
+  std::mutex locals_lock;
+
+  traverse_stats ts;
+  traverse_pool(mos, mos_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &zb, const blkptr_t *bp) {
+    if (block_stats_local.generation != generation) {
+      std::lock_guard<std::mutex> guard(locals_lock);
+      locals.emplace_back(new block_stats());
+      block_stats_local = block_stats_slot{generation, locals.back().get()};
+    }
+    auto s = block_stats_local.stats;
+    uint64_t lsize = BP_GET_LSIZE(bp), psize = BP_GET_PSIZE(bp), asize = bp_get_asize(bp);
+    if (BP_IS_EMBEDDED(bp)) {
+      s->embedded++;
+      psize = BPE_GET_PSIZE(bp);
+    }
+    block_size_stats_add(&s->total, lsize, psize, asize);
+    block_size_stats_add(&s->by_type[BP_GET_TYPE(bp)], lsize, psize, asize);
+    block_size_stats_add(&s->by_compress[BP_GET_COMPRESS(bp)], lsize, psize, asize);
+    block_size_stats_add(&s->by_level[BP_GET_LEVEL(bp)], lsize, psize, asize);
+    block_size_stats_add(&s->by_dataset[zb.zb_objset], lsize, psize, asize);
+  }, &ts);
+
+  *stats = block_stats();
+  stats->traverse = ts;
+  for (auto &l : locals) {
+    stats->embedded += l->embedded;
+    block_size_stats_merge(&stats->total, l->total);
+    for (int i = 0; i < BLOCK_STATS_TYPES; i++) {
+      block_size_stats_merge(&stats->by_type[i], l->by_type[i]);
+    }
+    for (int i = 0; i < BLOCK_STATS_COMPRESS; i++) {
+      block_size_stats_merge(&stats->by_compress[i], l->by_compress[i]);
+    }
+    for (int i = 0; i < BLOCK_STATS_LEVELS; i++) {
+      block_size_stats_merge(&stats->by_level[i], l->by_level[i]);
+    }
+    for (auto &ds : l->by_dataset) {
+      block_size_stats_merge(&stats->by_dataset[ds.first], ds.second);
+    }
+  }
+}
+
+static std::string dataset_name(const std::map<uint64_t, std::string> &names, uint64_t objset) {
+  if (objset == 0) {
+    return "(MOS)";
+  }
+  if (objset == ZB_DESTROYED_OBJSET) {
+    return "(freeing)";
+  }
+  auto it = names.find(objset);
+  return it == names.end() ? "objset " + std::to_string(objset) : it->second;
+}
+
+static void print_header(const char *title) {
+  printf("\n%s\n", title);
+  printf("%10s %7s %7s %7s %7s %7s %6s\n", "blocks", "LSIZE", "PSIZE", "ASIZE", "avg L", "avg P", "L/P");
+}
+
+static void print_row(const std::string &name, const block_size_stats &s) {
+  uint64_t n = std::max<uint64_t>(s.count, 1);
+  printf("%10" PRIu64 " %7s %7s %7s %7s %7s %6.2f  %s\n", s.count, nicenum(s.lsize).c_str(),
+         nicenum(s.psize).c_str(), nicenum(s.asize).c_str(), nicenum(s.lsize / n).c_str(),
+         nicenum(s.psize / n).c_str(), s.psize == 0 ? 1.0 : (double)s.lsize / s.psize, name.c_str());
+}
+
+void print_block_stats(const block_stats &stats, const std::map<uint64_t, std::string> &names) {
+  printf("%" PRIu64 " blocks in %" PRIu64 " objsets, %" PRIu64 " embedded\n", stats.total.count,
+         stats.traverse.objsets, stats.embedded);
+
+  print_header("by object type:");
+  for (int i = 0; i < BLOCK_STATS_TYPES; i++) {
+    if (stats.by_type[i].count != 0) {
+      print_row(dmu_object_type_name(i), stats.by_type[i]);
+    }
+  }
+  print_header("by compression:");
+  for (int i = 0; i < BLOCK_STATS_COMPRESS; i++) {
+    if (stats.by_compress[i].count != 0) {
+      print_row(zio_compress_name(i), stats.by_compress[i]);
+    }
+  }
+  print_header("by level:");
+  for (int i = 0; i < BLOCK_STATS_LEVELS; i++) {
+    if (stats.by_level[i].count != 0) {
+      print_row("L" + std::to_string(i), stats.by_level[i]);
+    }
+  }
+  print_header("by dataset:");
+  for (auto &ds : stats.by_dataset) {
+    print_row(dataset_name(names, ds.first), ds.second);
+  }
+  print_header("total:");
+  print_row("", stats.total);
+}
+
+static void write_hist(FILE *f, const uint64_t *hist) {
+  fputc(',', f);
+  bool first = true;
+  for (int i = 0; i < BLOCK_STATS_HIST_SIZE; i++) {
+    if (hist[i] != 0) {
+      fprintf(f, "%s%d:%" PRIu64, first ? "" : " ", i, hist[i]);
+      first = false;
+    }
+  }
+}
+
+static void write_row(FILE *f, const char *dimension, const std::string &key, const block_size_stats &s) {
+  if (s.count == 0) {
+    return;
+  }
+  fprintf(f, "%s,\"%s\",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64, dimension, key.c_str(), s.count, s.lsize,
+          s.psize, s.asize);
+  write_hist(f, s.lsize_hist);
+  write_hist(f, s.psize_hist);
+  write_hist(f, s.asize_hist);
+  fputc('\n', f);
+}
+
+bool write_block_stats_csv(const block_stats &stats, const std::map<uint64_t, std::string> &names,
+                           const std::string &path) {
+  FILE *f = fopen(path.c_str(), "w");
+  if (f == nullptr) {
+    perror(path.c_str());
+    return false;
+  }
+  fprintf(f, "dimension,key,count,lsize,psize,asize,lsize_hist,psize_hist,asize_hist\n");
+  write_row(f, "total", "", stats.total);
+  for (int i = 0; i < BLOCK_STATS_TYPES; i++) {
+    write_row(f, "type", dmu_object_type_name(i), stats.by_type[i]);
+  }
+  for (int i = 0; i < BLOCK_STATS_COMPRESS; i++) {
+    write_row(f, "compress", zio_compress_name(i), stats.by_compress[i]);
+  }
+  for (int i = 0; i < BLOCK_STATS_LEVELS; i++) {
+    write_row(f, "level", std::to_string(i), stats.by_level[i]);
+  }
+  for (auto &ds : stats.by_dataset) {
+    write_row(f, "dataset", dataset_name(names, ds.first), ds.second);
+  }
+  bool ok = ferror(f) == 0;
+  ok = fclose(f) == 0 && ok;
+  if (!ok) {
+    perror(path.c_str());
+  }
+  return ok;
+}
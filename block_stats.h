@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "zfs_reader.h"
+#include "traverse.h"
+
+// size histogram buckets, by floor(log2(size in bytes))
+#define BLOCK_STATS_HIST_SIZE 32
+#define BLOCK_STATS_TYPES 256       // BP_GET_TYPE() is 8 bits
+#define BLOCK_STATS_COMPRESS 128    // BP_GET_COMPRESS() is 7 bits
+#define BLOCK_STATS_LEVELS 32       // BP_GET_LEVEL() is 5 bits
+
+struct block_size_stats {
+  uint64_t count;
+  uint64_t lsize;
+  uint64_t psize;
+  uint64_t asize;
+  uint64_t lsize_hist[BLOCK_STATS_HIST_SIZE];
+  uint64_t psize_hist[BLOCK_STATS_HIST_SIZE];
+  uint64_t asize_hist[BLOCK_STATS_HIST_SIZE];
+};
+
+struct block_stats {
+  traverse_stats traverse;
+  uint64_t embedded;
+  block_size_stats total;
+  block_size_stats by_type[BLOCK_STATS_TYPES];
+  block_size_stats by_compress[BLOCK_STATS_COMPRESS];
+  block_size_stats by_level[BLOCK_STATS_LEVELS];
+  std::map<uint64_t, block_size_stats> by_dataset;    // by zb_objset, 0 is the MOS
+};
+
+/*
+ * Traverse the pool and aggregate every block pointer's sizes by object
+ * type, compression, level and dataset.  Each traversal thread counts into
+ * its own block_stats, and they are summed once the traversal is done.
+ */
+void collect_block_stats(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                         unsigned nthreads, block_stats *stats);
+
+// names is the dataset name of each zb_objset, from list_datasets()
+void print_block_stats(const block_stats &stats, const std::map<uint64_t, std::string> &names);
+
+/*
+ * One CSV row per non-empty group: dimension,key,count,lsize,psize,asize
+ * followed by the three histograms as space separated "log2:count" pairs.
+ */
+bool write_block_stats_csv(const block_stats &stats, const std::map<uint64_t, std::string> &names,
+                           const std::string &path);
+
+std::string dmu_object_type_name(int type);
+const char *zio_compress_name(int compress);
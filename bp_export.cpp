@@ -0,0 +1,132 @@
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "bp_export.h"
+#include "parquet.h"
+
+enum bp_export_column {
+  BPX_TYPE,
+  BPX_LEVEL,
+  BPX_LSIZE,
+  BPX_PSIZE,
+  BPX_ASIZE,
+  BPX_COMPRESS,
+  BPX_CHECKSUM,
+  BPX_BIRTH,
+  BPX_VDEV,
+  BPX_OFFSET,
+  BPX_OBJSET,
+  BPX_OBJECT,
+  BPX_BLKID,
+  BPX_COLUMNS
+};
+
+static const parquet_column bp_export_columns[BPX_COLUMNS] = {
+    {"type", PARQUET_INT32},
+    {"level", PARQUET_INT32},
+    {"lsize", PARQUET_INT64},
+    {"psize", PARQUET_INT64},
+    {"asize", PARQUET_INT64},
+    {"compression", PARQUET_INT32},
+    {"checksum", PARQUET_INT32},
+    {"birth", PARQUET_INT64},
+    {"vdev", PARQUET_INT64},
+    {"offset", PARQUET_INT64},
+    {"objset", PARQUET_INT64},
+    {"object", PARQUET_INT64},
+    {"blkid", PARQUET_INT64},
+};
+
+namespace {
+
+struct bp_export_buffer {
+  uint64_t rows = 0;
+  std::vector<std::vector<uint8_t>> values;
+
+  bp_export_buffer() : values(BPX_COLUMNS) {
+    for (int c = 0; c < BPX_COLUMNS; c++) {
+      values[c].reserve(BP_EXPORT_ROWS * (bp_export_columns[c].type == PARQUET_INT32 ? 4 : 8));
+    }
+  }
+
+  void put(int c, int64_t v) {
+    auto &col = values[c];
+    if (bp_export_columns[c].type == PARQUET_INT32) {
+      int32_t v32 = v;
+      col.insert(col.end(), (const uint8_t*)&v32, (const uint8_t*)(&v32 + 1));
+    } else {
+      col.insert(col.end(), (const uint8_t*)&v, (const uint8_t*)(&v + 1));
+    }
+  }
+
+  void clear() {
+    rows = 0;
+    for (auto &col : values) {
+      col.clear();
+    }
+  }
+};
+
+// which buffer this thread fills, valid for one bp_export() call
+struct bp_export_slot {
+  uint64_t generation;
+  bp_export_buffer *buffer;
+};
+
+}
+
+static std::atomic<uint64_t> bp_export_generation(0);
+static thread_local bp_export_slot bp_export_local = {0, nullptr};
+
+bool bp_export(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr, unsigned nthreads,
+               const std::string &path, traverse_stats *stats, uint64_t *rows) {
+  parquet_writer w;
+  if (!parquet_open(path, std::vector<parquet_column>(bp_export_columns, bp_export_columns + BPX_COLUMNS), &w)) {
+    return false;
+  }
+  uint64_t generation = ++bp_export_generation;
+  std::vector<std::unique_ptr<bp_export_buffer>> buffers;
+  std::mutex buffers_lock;
+  std::atomic<bool> ok(true);
+
+  traverse_pool(mos, mos_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &zb, const blkptr_t *bp) {
+    if (bp_export_local.generation != generation) {
+      std::lock_guard<std::mutex> guard(buffers_lock);
+      buffers.emplace_back(new bp_export_buffer());
+      bp_export_local = bp_export_slot{generation, buffers.back().get()};
+    }
+    auto b = bp_export_local.buffer;
+    bool embedded = BP_IS_EMBEDDED(bp);
+    b->put(BPX_TYPE, BP_GET_TYPE(bp));
+    b->put(BPX_LEVEL, BP_GET_LEVEL(bp));
+    b->put(BPX_LSIZE, BP_GET_LSIZE(bp));
+    b->put(BPX_PSIZE, embedded ? BPE_GET_PSIZE(bp) : BP_GET_PSIZE(bp));
+    b->put(BPX_ASIZE, bp_get_asize(bp));
+    b->put(BPX_COMPRESS, BP_GET_COMPRESS(bp));
+    b->put(BPX_CHECKSUM, BP_GET_CHECKSUM(bp));
+    b->put(BPX_BIRTH, bp->blk_birth);
+    b->put(BPX_VDEV, embedded ? -1 : (int64_t)DVA_GET_VDEV(&bp->blk_dva[0]));
+    b->put(BPX_OFFSET, embedded ? -1 : (int64_t)DVA_GET_OFFSET(&bp->blk_dva[0]));
+    b->put(BPX_OBJSET, zb.zb_objset);
+    b->put(BPX_OBJECT, zb.zb_object);
+    b->put(BPX_BLKID, zb.zb_blkid);
+    if (++b->rows == BP_EXPORT_ROWS) {
+      if (!parquet_write_row_group(&w, b->values, b->rows)) {
+        ok = false;
+      }
+      b->clear();
+    }
+  }, stats);
+
+  *rows = 0;
+  for (auto &b : buffers) {
+    if (!parquet_write_row_group(&w, b->values, b->rows)) {
+      ok = false;
+    }
+  }
+  *rows = w.rows;
+  return parquet_close(&w) && ok;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "zfs_reader.h"
+#include "traverse.h"
+
+// rows each traversal thread buffers before writing them out as one row group
+#define BP_EXPORT_ROWS (128 * 1024)
+
+/*
+ * Write every block pointer the traversal visits to a Parquet file, one
+ * row per block pointer with columns type, level, lsize, psize, asize,
+ * compression, checksum, birth, vdev, offset, objset, object and blkid.
+ * vdev and offset are DVA 0's, -1 for embedded blocks.  Each traversal
+ * thread fills its own column buffers, so threads only meet to append a
+ * finished row group to the file.
+ */
+bool bp_export(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr, unsigned nthreads,
+               const std::string &path, traverse_stats *stats, uint64_t *rows);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "spa.h"
+
+/*
+ * A bpobj is an object holding an array of blkptr_t, and optionally an
+ * array of sub-bpobj object numbers.  It is how the pool keeps blocks
+ * that are freed but not yet released, e.g. the free_bpobj.
+ */
+typedef struct bpobj_phys {
+  /*
+   * This is the bonus buffer for the dead lists.  The object's
+   * contents is an array of bpo_entries blkptr_t's, representing
+   * a total of bpo_bytes physical space.
+   */
+  uint64_t	bpo_num_blkptrs;
+  uint64_t	bpo_bytes;
+  uint64_t	bpo_comp;
+  uint64_t	bpo_uncomp;
+  uint64_t	bpo_subobjs;
+  uint64_t	bpo_num_subobjs;
+  uint64_t	bpo_num_freed;
+} bpobj_phys_t;
+
+#define	BPOBJ_SIZE_V0	(2 * sizeof (uint64_t))
+#define	BPOBJ_SIZE_V1	(4 * sizeof (uint64_t))
+#define	BPOBJ_SIZE_V2	(6 * sizeof (uint64_t))
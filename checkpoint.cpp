@@ -0,0 +1,108 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+bool checkpoint_open(const std::string &path, const std::string &scan, const blkptr_t *rootbp, scan_checkpoint *ck) {
+  ck->path = path;
+  ck->scan = scan;
+  ck->rootbp = *rootbp;
+  ck->resumed = false;
+  ck->done.clear();
+  ck->state.clear();
+  ck->pending.clear();
+  ck->written = std::chrono::steady_clock::now();
+
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    std::cerr << "failed to open " << path << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  checkpoint_header hdr;
+  bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.ck_magic == CHECKPOINT_MAGIC &&
+            hdr.ck_version == CHECKPOINT_VERSION;
+  if (!ok) {
+    std::cerr << path << " is not a scan checkpoint, starting over" << std::endl;
+  } else if (strncmp(hdr.ck_scan, scan.c_str(), sizeof(hdr.ck_scan)) != 0 ||
+             memcmp(&hdr.ck_rootbp, rootbp, sizeof(blkptr_t)) != 0) {
+    std::cerr << path << " belongs to another scan or pool state, starting over" << std::endl;
+    ok = false;
+  }
+  if (ok) {
+    std::vector<std::pair<uint64_t, uint64_t>> done(hdr.ck_ndone);
+    ck->state.resize(hdr.ck_state_size);
+    if (fread(done.data(), sizeof(done[0]), done.size(), f) != done.size() ||
+        fread(ck->state.data(), 1, ck->state.size(), f) != ck->state.size()) {
+      std::cerr << path << " is truncated, starting over" << std::endl;
+      ck->state.clear();
+    } else {
+      ck->done.insert(done.begin(), done.end());
+      ck->resumed = true;
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+bool checkpoint_done(const scan_checkpoint &ck, const zbookmark_phys_t &zb) {
+  return ck.done.count(std::make_pair(zb.zb_objset, zb.zb_blkid)) != 0;
+}
+
+void checkpoint_finish(scan_checkpoint *ck, const zbookmark_phys_t &zb) {
+  std::lock_guard<std::mutex> guard(ck->lock);
+  ck->pending.push_back(std::make_pair(zb.zb_objset, zb.zb_blkid));
+}
+
+static bool write_checkpoint(const scan_checkpoint &ck) {
+  std::string tmp = ck.path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr) {
+    std::cerr << "failed to create " << tmp << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  checkpoint_header hdr = {};
+  hdr.ck_magic = CHECKPOINT_MAGIC;
+  hdr.ck_version = CHECKPOINT_VERSION;
+  strncpy(hdr.ck_scan, ck.scan.c_str(), sizeof(hdr.ck_scan));
+  hdr.ck_rootbp = ck.rootbp;
+  hdr.ck_ndone = ck.done.size();
+  hdr.ck_state_size = ck.state.size();
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  for (auto &d : ck.done) {
+    fwrite(&d, sizeof(d), 1, f);
+  }
+  fwrite(ck.state.data(), 1, ck.state.size(), f);
+  // the rename must not land before the data, or a crash leaves an empty checkpoint
+  if (ferror(f) || fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0 ||
+      rename(tmp.c_str(), ck.path.c_str()) != 0) {
+    std::cerr << "failed to write " << ck.path << ", err: " << strerror(errno) << std::endl;
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool checkpoint_commit(scan_checkpoint *ck, const std::vector<uint8_t> &state, bool force) {
+  std::lock_guard<std::mutex> guard(ck->lock);
+  ck->done.insert(ck->pending.begin(), ck->pending.end());
+  ck->pending.clear();
+  ck->state = state;
+  auto now = std::chrono::steady_clock::now();
+  if (!force && now - ck->written < std::chrono::seconds(CHECKPOINT_INTERVAL)) {
+    return true;
+  }
+  ck->written = now;
+  return write_checkpoint(*ck);
+}
+
+void checkpoint_remove(scan_checkpoint *ck) {
+  if (unlink(ck->path.c_str()) != 0 && errno != ENOENT) {
+    std::cerr << "failed to remove " << ck->path << ", err: " << strerror(errno) << std::endl;
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "zfs_reader.h"
+
+/*
+ * A resumable scan's progress: which of the traversal's dnode blocks are
+ * finished, plus whatever results the scan has gathered for them, which are
+ * opaque here.  The file is a header, the finished bookmarks as
+ * <objset, blkid> pairs and the scan's state.  It only applies to the pool
+ * state whose root blkptr it records and to the scan named in it.
+ */
+#define CHECKPOINT_MAGIC 0x74706b636e616373ULL   // "scanckpt" on disk
+#define CHECKPOINT_VERSION 1
+// seconds between checkpoint writes
+#define CHECKPOINT_INTERVAL 60
+
+struct checkpoint_header {
+  uint64_t ck_magic;
+  uint64_t ck_version;
+  char ck_scan[16];
+  blkptr_t ck_rootbp;
+  uint64_t ck_ndone;
+  uint64_t ck_state_size;
+};
+
+struct scan_checkpoint {
+  std::string path;
+  std::string scan;
+  blkptr_t rootbp;
+  bool resumed;
+  std::set<std::pair<uint64_t, uint64_t>> done;
+  std::vector<uint8_t> state;
+
+  std::mutex lock;
+  std::vector<std::pair<uint64_t, uint64_t>> pending;
+  std::chrono::steady_clock::time_point written;
+};
+
+/*
+ * Start scan, resuming from path if it holds a checkpoint of the same scan
+ * and pool state.  A checkpoint of anything else is reported and ignored;
+ * false only if path can't be read.
+ */
+bool checkpoint_open(const std::string &path, const std::string &scan, const blkptr_t *rootbp, scan_checkpoint *ck);
+
+// whether the dnode block at zb was finished before the scan was resumed
+bool checkpoint_done(const scan_checkpoint &ck, const zbookmark_phys_t &zb);
+
+// zb is finished but its results are not yet in the scan's state; thread safe
+void checkpoint_finish(scan_checkpoint *ck, const zbookmark_phys_t &zb);
+
+/*
+ * Everything finished so far is accounted for in state: record it, and
+ * write the checkpoint if CHECKPOINT_INTERVAL has passed since the last
+ * write or with force.
+ */
+bool checkpoint_commit(scan_checkpoint *ck, const std::vector<uint8_t> &state, bool force);
+
+// the scan completed, its checkpoint is no longer needed
+void checkpoint_remove(scan_checkpoint *ck);
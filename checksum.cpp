@@ -0,0 +1,215 @@
+#include <cstring>
+#include <endian.h>
+
+#include "checksum.h"
+#include "perf_counters.h"
+#include "probes.h"
+#include "stage_stats.h"
+#include "zio.h"
+
+void fletcher_2_native(const void *buf, size_t size, zio_cksum_t *zc) {
+  auto ip = (const uint64_t*)buf;
+  auto end = ip + size / sizeof(uint64_t);
+  uint64_t a0 = 0, a1 = 0, b0 = 0, b1 = 0;
+  for (; ip < end; ip += 2) {
+    a0 += ip[0];
+    a1 += ip[1];
+    b0 += a0;
+    b1 += a1;
+  }
+  zc->zc_word[0] = a0;
+  zc->zc_word[1] = a1;
+  zc->zc_word[2] = b0;
+  zc->zc_word[3] = b1;
+}
+
+void fletcher_2_byteswap(const void *buf, size_t size, zio_cksum_t *zc) {
+  auto ip = (const uint64_t*)buf;
+  auto end = ip + size / sizeof(uint64_t);
+  uint64_t a0 = 0, a1 = 0, b0 = 0, b1 = 0;
+  for (; ip < end; ip += 2) {
+    a0 += __builtin_bswap64(ip[0]);
+    a1 += __builtin_bswap64(ip[1]);
+    b0 += a0;
+    b1 += a1;
+  }
+  zc->zc_word[0] = a0;
+  zc->zc_word[1] = a1;
+  zc->zc_word[2] = b0;
+  zc->zc_word[3] = b1;
+}
+
+void fletcher_4_incremental_native(const void *buf, size_t size, zio_cksum_t *zc) {
+  auto ip = (const uint32_t*)buf;
+  auto end = ip + size / sizeof(uint32_t);
+  uint64_t a = zc->zc_word[0], b = zc->zc_word[1], c = zc->zc_word[2], d = zc->zc_word[3];
+  for (; ip < end; ip++) {
+    a += *ip;
+    b += a;
+    c += b;
+    d += c;
+  }
+  zc->zc_word[0] = a;
+  zc->zc_word[1] = b;
+  zc->zc_word[2] = c;
+  zc->zc_word[3] = d;
+}
+
+void fletcher_4_native(const void *buf, size_t size, zio_cksum_t *zc) {
+  memset(zc, 0, sizeof(*zc));
+  fletcher_4_incremental_native(buf, size, zc);
+}
+
+void fletcher_4_byteswap(const void *buf, size_t size, zio_cksum_t *zc) {
+  auto ip = (const uint32_t*)buf;
+  auto end = ip + size / sizeof(uint32_t);
+  uint64_t a = 0, b = 0, c = 0, d = 0;
+  for (; ip < end; ip++) {
+    a += __builtin_bswap32(*ip);
+    b += a;
+    c += b;
+    d += c;
+  }
+  zc->zc_word[0] = a;
+  zc->zc_word[1] = b;
+  zc->zc_word[2] = c;
+  zc->zc_word[3] = d;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t ror32(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(uint32_t h[8], const uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = k + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    k = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+  h[5] += f;
+  h[6] += g;
+  h[7] += k;
+}
+
+void sha256(const void *buf, size_t size, zio_cksum_t *zc) {
+  uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  auto p = (const uint8_t*)buf;
+  size_t full = size / 64 * 64;
+  for (size_t off = 0; off < full; off += 64) {
+    sha256_block(h, p + off);
+  }
+  // the tail, a 1 bit, zeros and the bit length fill one or two more blocks
+  uint8_t tail[128] = {};
+  size_t rest = size - full;
+  memcpy(tail, p + full, rest);
+  tail[rest] = 0x80;
+  size_t tail_len = rest + 9 <= 64 ? 64 : 128;
+  uint64_t bits = (uint64_t)size * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_len - 1 - i] = bits >> (8 * i);
+  }
+  for (size_t off = 0; off < tail_len; off += 64) {
+    sha256_block(h, tail + off);
+  }
+  for (int i = 0; i < 4; i++) {
+    zc->zc_word[i] = (uint64_t)h[2 * i] << 32 | h[2 * i + 1];
+  }
+}
+
+checksum_result checksum_verify(const blkptr_t *bp, const void *data) {
+  if (BP_IS_EMBEDDED(bp)) {
+    return CHECKSUM_UNVERIFIED;
+  }
+  bool byteswap = BP_SHOULD_BYTESWAP(bp);
+  size_t size = BP_GET_PSIZE(bp);
+  zio_cksum_t zc;
+  // the checksums that can't be used for dedup are the ones folded in half for encrypted blocks
+  bool secure = false;
+  uint64_t start = stage_begin();
+  perf_sample ps;
+  perf_begin(&ps);
+  switch (BP_GET_CHECKSUM(bp)) {
+    case ZIO_CHECKSUM_FLETCHER_2:
+      (byteswap ? fletcher_2_byteswap : fletcher_2_native)(data, size, &zc);
+      break;
+    case ZIO_CHECKSUM_ON:
+    case ZIO_CHECKSUM_FLETCHER_4:
+      (byteswap ? fletcher_4_byteswap : fletcher_4_native)(data, size, &zc);
+      break;
+    case ZIO_CHECKSUM_SHA256:
+      secure = true;
+      sha256(data, size, &zc);
+      break;
+    case ZIO_CHECKSUM_NOPARITY:
+      // stores no checksum at all, like the data of a dump volume
+      return CHECKSUM_UNVERIFIED;
+    default:
+      return CHECKSUM_UNVERIFIED;
+  }
+  perf_end(PERF_CHECKSUM, ps, size);
+  stage_end(STAGE_CHECKSUM, start, size);
+  /*
+   * An encrypted or authenticated block keeps its MAC in the last two
+   * words, only the first two are the checksum.  objset blocks carry their
+   * MACs inside the block instead.
+   */
+  if (BP_USES_CRYPT(bp) && BP_GET_TYPE(bp) != DMU_OT_OBJSET) {
+    if (!secure) {
+      zc.zc_word[0] ^= zc.zc_word[2];
+      zc.zc_word[1] ^= zc.zc_word[3];
+    }
+    if (zc.zc_word[0] == bp->blk_cksum.zc_word[0] && zc.zc_word[1] == bp->blk_cksum.zc_word[1]) {
+      return CHECKSUM_OK;
+    }
+  } else if (memcmp(&zc, &bp->blk_cksum, sizeof(zc)) == 0) {
+    return CHECKSUM_OK;
+  }
+  PROBE5(checksum__error, DVA_GET_OFFSET(&bp->blk_dva[0]), size, BP_GET_CHECKSUM(bp), BP_GET_LEVEL(bp),
+         BP_GET_TYPE(bp));
+  return CHECKSUM_BAD;
+}
+
+bool gang_header_verify(const blkptr_t *bp, const zio_gbh_phys_t *gbh) {
+  if (gbh->zg_tail.zec_magic != ZEC_MAGIC) {
+    return false;
+  }
+  zio_gbh_phys_t copy = *gbh;
+  const dva_t *dva = &bp->blk_dva[0];
+  copy.zg_tail.zec_cksum = zio_cksum_t{{DVA_GET_VDEV(dva), DVA_GET_OFFSET(dva), BP_PHYSICAL_BIRTH(bp), 0}};
+  zio_cksum_t zc;
+  sha256(&copy, sizeof(copy), &zc);
+  return memcmp(&zc, &gbh->zg_tail.zec_cksum, sizeof(zc)) == 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "zfs_reader.h"
+
+/*
+ * The block checksums of zio_checksum_table that can be computed here:
+ * fletcher-2, fletcher-4 and SHA-256.  Like zio_checksum_compute() they run
+ * over the block as stored, PSIZE bytes.
+ */
+void fletcher_2_native(const void *buf, size_t size, zio_cksum_t *zc);
+void fletcher_2_byteswap(const void *buf, size_t size, zio_cksum_t *zc);
+void fletcher_4_native(const void *buf, size_t size, zio_cksum_t *zc);
+void fletcher_4_byteswap(const void *buf, size_t size, zio_cksum_t *zc);
+
+// continue a fletcher-4 over more data, as the send stream record checksums do
+void fletcher_4_incremental_native(const void *buf, size_t size, zio_cksum_t *zc);
+
+// the digest as four big endian words, which is how ZFS stores it
+void sha256(const void *buf, size_t size, zio_cksum_t *zc);
+
+enum checksum_result {
+  CHECKSUM_OK,
+  CHECKSUM_BAD,
+  CHECKSUM_UNVERIFIED,        // no checksum, an embedded one (log blocks, gang headers) or an unknown function
+};
+
+// check data, the PSIZE bytes behind one of bp's DVAs, against the checksum in bp
+checksum_result checksum_verify(const blkptr_t *bp, const void *data);
+
+/*
+ * Whether gbh, read from one of the DVAs of the gang block bp, is a gang
+ * header: the ZEC magic, and the embedded SHA-256 computed with the verifier
+ * {vdev, offset, physical birth, 0} of bp's first DVA, which every copy shares.
+ */
+bool gang_header_verify(const blkptr_t *bp, const zio_gbh_phys_t *gbh);
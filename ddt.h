@@ -0,0 +1,92 @@
+#pragma once
+
+#include "spa.h"
+
+/*
+ * On-disk DDT formats.
+ *
+ * There are three DDT classes (ditto, duplicate and unique), each of which
+ * is a ZAP object in the MOS named DDT-<checksum>-<type>-<class>.
+ */
+enum ddt_type {
+  DDT_TYPE_ZAP = 0,
+  DDT_TYPES
+};
+
+enum ddt_class {
+  DDT_CLASS_DITTO = 0,
+  DDT_CLASS_DUPLICATE,
+  DDT_CLASS_UNIQUE,
+  DDT_CLASSES
+};
+
+/*
+ * On-disk ddt entry:  key (name) and physical storage (value).
+ */
+typedef struct ddt_key {
+  zio_cksum_t	ddk_cksum;	/* 256-bit block checksum */
+  /*
+   * Encoded with logical & physical size, encryption, and compression,
+   * as follows:
+   *   +-------+-------+-------+-------+-------+-------+-------+-------+
+   *   |   0   |   0   |   0   |X| comp|     PSIZE     |     LSIZE     |
+   *   +-------+-------+-------+-------+-------+-------+-------+-------+
+   */
+  uint64_t	ddk_prop;
+} ddt_key_t;
+
+#define	DDK_GET_LSIZE(ddk)	\
+	BF64_GET_SB((ddk)->ddk_prop, 0, 16, SPA_MINBLOCKSHIFT, 1)
+#define	DDK_SET_LSIZE(ddk, x)	\
+	BF64_SET_SB((ddk)->ddk_prop, 0, 16, SPA_MINBLOCKSHIFT, 1, x)
+
+#define	DDK_GET_PSIZE(ddk)	\
+	BF64_GET_SB((ddk)->ddk_prop, 16, 16, SPA_MINBLOCKSHIFT, 1)
+#define	DDK_SET_PSIZE(ddk, x)	\
+	BF64_SET_SB((ddk)->ddk_prop, 16, 16, SPA_MINBLOCKSHIFT, 1, x)
+
+#define	DDK_GET_COMPRESS(ddk)		BF64_GET((ddk)->ddk_prop, 32, 7)
+#define	DDK_SET_COMPRESS(ddk, x)	BF64_SET((ddk)->ddk_prop, 32, 7, x)
+
+#define	DDK_GET_CRYPT(ddk)		BF64_GET((ddk)->ddk_prop, 39, 1)
+
+#define	DDT_KEY_WORDS	(sizeof (ddt_key_t) / sizeof (uint64_t))
+
+typedef struct ddt_phys {
+  dva_t		ddp_dva[SPA_DVAS_PER_BP];
+  uint64_t	ddp_refcnt;
+  uint64_t	ddp_phys_birth;
+} ddt_phys_t;
+
+enum ddt_phys_type {
+  DDT_PHYS_DITTO = 0,
+  DDT_PHYS_SINGLE = 1,
+  DDT_PHYS_DOUBLE = 2,
+  DDT_PHYS_TRIPLE = 3,
+  DDT_PHYS_TYPES
+};
+
+/*
+ * ZAP values are the ddt_phys_t array, compressed.  The first byte holds
+ * the compression function and whether the rest is in host byte order.
+ */
+#define	DDT_COMPRESS_BYTEORDER_MASK	0x80
+#define	DDT_COMPRESS_FUNCTION_MASK	0x7f
+
+/*
+ * In-core ddt statistics, kept per refcount bucket in a histogram.
+ */
+typedef struct ddt_stat {
+  uint64_t	dds_blocks;	/* blocks			*/
+  uint64_t	dds_lsize;	/* logical size			*/
+  uint64_t	dds_psize;	/* physical size		*/
+  uint64_t	dds_dsize;	/* deflated allocated size	*/
+  uint64_t	dds_ref_blocks;	/* referenced blocks		*/
+  uint64_t	dds_ref_lsize;	/* referenced lsize * refcnt	*/
+  uint64_t	dds_ref_psize;	/* referenced psize * refcnt	*/
+  uint64_t	dds_ref_dsize;	/* referenced dsize * refcnt	*/
+} ddt_stat_t;
+
+typedef struct ddt_histogram {
+  ddt_stat_t	ddh_stat[64];	/* power-of-two histogram buckets */
+} ddt_histogram_t;
@@ -0,0 +1,306 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "ddt_reader.h"
+#include "parallel.h"
+
+static const char *ddt_class_names[DDT_CLASSES] = {"ditto", "duplicate", "unique"};
+
+namespace {
+
+struct ddt_batch {
+  size_t n;
+  ddt_key_t keys[DDT_BATCH_ENTRIES];
+  uint8_t values[DDT_BATCH_ENTRIES][1 + sizeof(ddt_phys_t) * DDT_PHYS_TYPES];
+  uint16_t value_len[DDT_BATCH_ENTRIES];
+};
+
+// a range of leaf blocks of one DDT zap
+struct ddt_task {
+  size_t object;
+  uint64_t first;
+  uint64_t last;
+};
+
+}
+
+static int highbit64(uint64_t v) {
+  return v == 0 ? 0 : 64 - __builtin_clzll(v);
+}
+
+void ddt_stat_generate(const ddt_key_t &key, const ddt_phys_t *phys, ddt_stat_t *dds) {
+  uint64_t lsize = DDK_GET_LSIZE(&key);
+  uint64_t psize = DDK_GET_PSIZE(&key);
+  memset(dds, 0, sizeof(*dds));
+  for (int p = 0; p < DDT_PHYS_TYPES; p++) {
+    auto ddp = &phys[p];
+    if (ddp->ddp_phys_birth == 0) {
+      continue;
+    }
+    uint64_t dsize = 0;
+    for (int d = 0; d < SPA_DVAS_PER_BP; d++) {
+      dsize += DVA_GET_ASIZE(&ddp->ddp_dva[d]);
+    }
+    uint64_t refcnt = ddp->ddp_refcnt;
+    dds->dds_blocks += 1;
+    dds->dds_lsize += lsize;
+    dds->dds_psize += psize;
+    dds->dds_dsize += dsize;
+    dds->dds_ref_blocks += refcnt;
+    dds->dds_ref_lsize += lsize * refcnt;
+    dds->dds_ref_psize += psize * refcnt;
+    dds->dds_ref_dsize += dsize * refcnt;
+  }
+}
+
+void ddt_histogram_add_stat(ddt_histogram_t *ddh, const ddt_stat_t &dds) {
+  if (dds.dds_ref_blocks == 0) {
+    return;
+  }
+  auto dst = &ddh->ddh_stat[highbit64(dds.dds_ref_blocks) - 1];
+  dst->dds_blocks += dds.dds_blocks;
+  dst->dds_lsize += dds.dds_lsize;
+  dst->dds_psize += dds.dds_psize;
+  dst->dds_dsize += dds.dds_dsize;
+  dst->dds_ref_blocks += dds.dds_ref_blocks;
+  dst->dds_ref_lsize += dds.dds_ref_lsize;
+  dst->dds_ref_psize += dds.dds_ref_psize;
+  dst->dds_ref_dsize += dds.dds_ref_dsize;
+}
+
+void ddt_histogram_add(ddt_histogram_t *dst, const ddt_histogram_t &src) {
+  auto d = (uint64_t*)dst;
+  auto s = (const uint64_t*)&src;
+  for (size_t i = 0; i < sizeof(ddt_histogram_t) / sizeof(uint64_t); i++) {
+    d[i] += s[i];
+  }
+}
+
+void ddt_histogram_total(const ddt_histogram_t &ddh, ddt_stat_t *total) {
+  memset(total, 0, sizeof(*total));
+  auto t = (uint64_t*)total;
+  for (auto &dds : ddh.ddh_stat) {
+    auto s = (const uint64_t*)&dds;
+    for (size_t i = 0; i < sizeof(ddt_stat_t) / sizeof(uint64_t); i++) {
+      t[i] += s[i];
+    }
+  }
+}
+
+// decode a zap value into the entry's ddt_phys_t's, false if it is not one we understand
+static bool ddt_decode_value(const uint8_t *value, size_t len, ddt_phys_t *phys) {
+  size_t phys_len = sizeof(ddt_phys_t) * DDT_PHYS_TYPES;
+  memset(phys, 0, phys_len);
+  if (len < 1) {
+    return false;
+  }
+  uint8_t version = value[0];
+  int cpfunc = version & DDT_COMPRESS_FUNCTION_MASK;
+  if (cpfunc == ZIO_COMPRESS_ZLE) {
+    if (zle_decompress(value + 1, phys, len - 1, phys_len, 64) != phys_len) {
+      return false;
+    }
+  } else if (cpfunc == ZIO_COMPRESS_OFF) {
+    if (len - 1 != phys_len) {
+      return false;
+    }
+    memcpy(phys, value + 1, phys_len);
+  } else {
+    return false;
+  }
+
+  // the flag is set when the writer was little endian
+  bool little_endian = (version & DDT_COMPRESS_BYTEORDER_MASK) != 0;
+  if (little_endian != (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)) {
+    auto words = (uint64_t*)phys;
+    for (size_t i = 0; i < phys_len / sizeof(uint64_t); i++) {
+      words[i] = __builtin_bswap64(words[i]);
+    }
+  }
+  return true;
+}
+
+static void ddt_decode_batch(ddt_batch *batch, ddt_histogram_t *ddh, uint64_t *bad) {
+  for (size_t i = 0; i < batch->n; i++) {
+    ddt_phys_t phys[DDT_PHYS_TYPES];
+    if (!ddt_decode_value(batch->values[i], batch->value_len[i], phys)) {
+      (*bad)++;
+      continue;
+    }
+    ddt_stat_t dds;
+    ddt_stat_generate(batch->keys[i], phys, &dds);
+    ddt_histogram_add_stat(ddh, dds);
+  }
+  batch->n = 0;
+}
+
+// "DDT-sha256-zap-duplicate" -> DDT_CLASS_DUPLICATE
+static bool ddt_parse_name(const std::string &name, enum ddt_class *cls) {
+  if (name.compare(0, 4, "DDT-") != 0 || name == DMU_POOL_DDT_STATS) {
+    return false;
+  }
+  auto dash = name.rfind('-');
+  for (int c = 0; c < DDT_CLASSES; c++) {
+    if (name.compare(dash + 1, std::string::npos, ddt_class_names[c]) == 0) {
+      *cls = (enum ddt_class)c;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool ddt_load(const objset_phys_t *mos, const void *dev_base_ptr, unsigned nthreads, ddt_report *report) {
+  report->objects.clear();
+  memset(&report->histogram, 0, sizeof(report->histogram));
+  report->entries = 0;
+  report->bad_entries = 0;
+
+  auto dir_data = read_dnode(mos, DMU_POOL_DIRECTORY_OBJECT, dev_base_ptr);
+  zap_iterate((const dnode_phys_t*)dir_data.data(), dev_base_ptr, [&](const zap_attribute &za) {
+    ddt_object_info info = {};
+    if (ddt_parse_name(za.za_name, &info.ddt_class)) {
+      info.name = za.za_name;
+      info.object = za.za_first_integer;
+      report->objects.push_back(info);
+    }
+    return true;
+  });
+  if (report->objects.empty()) {
+    return false;
+  }
+  std::sort(report->objects.begin(), report->objects.end(), [](const ddt_object_info &a, const ddt_object_info &b) {
+    return a.ddt_class < b.ddt_class || (a.ddt_class == b.ddt_class && a.name < b.name);
+  });
+
+  std::vector<std::vector<uint8_t>> dnodes;
+  std::vector<ddt_task> tasks;
+  for (size_t i = 0; i < report->objects.size(); i++) {
+    auto &info = report->objects[i];
+    dnodes.push_back(read_dnode(mos, info.object, dev_base_ptr));
+    auto dn = (const dnode_phys_t*)dnodes.back().data();
+    info.disk_bytes = DN_USED_BYTES(dn);
+    info.core_bytes = (dn->dn_maxblkid + 1) * dn->dn_datablkszsec * ZFS_SEC_SIZE;
+    uint64_t leaves = zap_leaf_blocks(dn, dev_base_ptr);
+    if (leaves == 0) {
+      // a micro zap, one task for all of it
+      tasks.push_back(ddt_task{i, 0, 0});
+      continue;
+    }
+    for (uint64_t first = 1; first < leaves; first += DDT_LEAVES_PER_TASK) {
+      tasks.push_back(ddt_task{i, first, std::min<uint64_t>(first + DDT_LEAVES_PER_TASK, leaves)});
+    }
+  }
+
+  std::unique_ptr<std::atomic<uint64_t>[]> entries(new std::atomic<uint64_t>[report->objects.size()]);
+  for (size_t i = 0; i < report->objects.size(); i++) {
+    entries[i] = 0;
+  }
+  std::mutex lock;
+  parallel_for(tasks.size(), nthreads, [&](uint64_t t) {
+    auto &task = tasks[t];
+    auto dn = (const dnode_phys_t*)dnodes[task.object].data();
+    std::unique_ptr<ddt_batch> batch(new ddt_batch);
+    batch->n = 0;
+    ddt_histogram_t ddh = {};
+    uint64_t n = 0, bad = 0;
+
+    auto add = [&](const zap_attribute &za) {
+      n++;
+      if (za.za_key.size() != DDT_KEY_WORDS || za.za_value.size() > sizeof(batch->values[0])) {
+        bad++;
+        return true;
+      }
+      memcpy(&batch->keys[batch->n], za.za_key.data(), sizeof(ddt_key_t));
+      memcpy(batch->values[batch->n], za.za_value.data(), za.za_value.size());
+      batch->value_len[batch->n] = za.za_value.size();
+      if (++batch->n == DDT_BATCH_ENTRIES) {
+        ddt_decode_batch(batch.get(), &ddh, &bad);
+      }
+      return true;
+    };
+    if (task.first == 0) {
+      zap_iterate(dn, dev_base_ptr, add);
+    } else {
+      zap_iterate_blocks(dn, dev_base_ptr, task.first, task.last, add);
+    }
+    ddt_decode_batch(batch.get(), &ddh, &bad);
+
+    entries[task.object] += n;
+    std::lock_guard<std::mutex> guard(lock);
+    ddt_histogram_add(&report->histogram, ddh);
+    report->bad_entries += bad;
+  });
+
+  for (size_t i = 0; i < report->objects.size(); i++) {
+    report->objects[i].entries = entries[i];
+    report->entries += entries[i];
+  }
+  return true;
+}
+
+// block counts are printed like sizes, without the unit
+static std::string count_str(uint64_t n) {
+  auto s = nicenum(n);
+  if (s.back() == 'B') {
+    s.pop_back();
+  }
+  return s;
+}
+
+void print_ddt_histogram(const ddt_histogram_t &ddh) {
+  printf("bucket              allocated                       referenced\n");
+  printf("______   ______________________________   ______________________________\n");
+  printf("refcnt   blocks   LSIZE   PSIZE   DSIZE   blocks   LSIZE   PSIZE   DSIZE\n");
+  printf("------   ------   -----   -----   -----   ------   -----   -----   -----\n");
+  auto row = [](const char *label, const ddt_stat_t &dds) {
+    printf("%6s   %6s   %5s   %5s   %5s   %6s   %5s   %5s   %5s\n", label,
+           count_str(dds.dds_blocks).c_str(), nicenum(dds.dds_lsize).c_str(),
+           nicenum(dds.dds_psize).c_str(), nicenum(dds.dds_dsize).c_str(),
+           count_str(dds.dds_ref_blocks).c_str(), nicenum(dds.dds_ref_lsize).c_str(),
+           nicenum(dds.dds_ref_psize).c_str(), nicenum(dds.dds_ref_dsize).c_str());
+  };
+  for (int h = 0; h < 64; h++) {
+    if (ddh.ddh_stat[h].dds_blocks == 0) {
+      continue;
+    }
+    row(count_str(1ULL << h).c_str(), ddh.ddh_stat[h]);
+  }
+  ddt_stat_t total;
+  ddt_histogram_total(ddh, &total);
+  row("Total", total);
+  printf("\n");
+}
+
+void print_ddt_summary(const ddt_stat_t &total) {
+  auto ratio = [](uint64_t a, uint64_t b) {
+    return b == 0 ? 1.0 : (double)a / b;
+  };
+  double dedup = ratio(total.dds_ref_dsize, total.dds_dsize);
+  double compress = ratio(total.dds_ref_lsize, total.dds_ref_psize);
+  double copies = ratio(total.dds_ref_dsize, total.dds_ref_psize);
+  printf("dedup = %.2f, compress = %.2f, copies = %.2f, dedup * compress / copies = %.2f\n",
+         dedup, compress, copies, dedup * compress / copies);
+}
+
+void print_ddt_report(const ddt_report &report) {
+  for (auto &info : report.objects) {
+    printf("%s: %" PRIu64 " entries, size %s on disk, %s in core\n", info.name.c_str(), info.entries,
+           nicenum(info.disk_bytes).c_str(), nicenum(info.core_bytes).c_str());
+  }
+  if (report.bad_entries != 0) {
+    printf("%" PRIu64 " entries could not be decoded\n", report.bad_entries);
+  }
+  printf("\nDDT histogram (aggregated over all DDTs):\n\n");
+  print_ddt_histogram(report.histogram);
+  ddt_stat_t total;
+  ddt_histogram_total(report.histogram, &total);
+  print_ddt_summary(total);
+  printf("loading all %" PRIu64 " entries takes about %s of kernel memory\n", report.entries,
+         nicenum(report.entries * DDT_ENTRY_CORE_SIZE).c_str());
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "zfs_reader.h"
+#include "ddt.h"
+
+// entries decoded together; a loader thread holds one batch and nothing else
+#define DDT_BATCH_ENTRIES 1024
+// fat zap leaf blocks per unit of parallel work
+#define DDT_LEAVES_PER_TASK 64
+// roughly what one ddt_entry_t costs the kernel once loaded, for sizing memory
+#define DDT_ENTRY_CORE_SIZE 320
+
+// one DDT-<checksum>-<type>-<class> zap of the MOS
+struct ddt_object_info {
+  std::string name;
+  uint64_t object;
+  enum ddt_class ddt_class;
+  uint64_t entries;
+  uint64_t disk_bytes;        // allocated on disk
+  uint64_t core_bytes;        // the zap's data blocks, as zdb reports "in core"
+};
+
+struct ddt_report {
+  std::vector<ddt_object_info> objects;
+  ddt_histogram_t histogram;  // all classes together
+  uint64_t entries;
+  uint64_t bad_entries;       // values that did not decode
+};
+
+/*
+ * Decode every entry of every DDT in the pool, on nthreads threads.  Each
+ * thread streams its share of zap leaves through a fixed-size batch, so
+ * memory does not grow with the table.  Returns false if the pool has no
+ * DDT at all.
+ */
+bool ddt_load(const objset_phys_t *mos, const void *dev_base_ptr, unsigned nthreads, ddt_report *report);
+
+// the statistics of one entry, summed over its ddt_phys_t's
+void ddt_stat_generate(const ddt_key_t &key, const ddt_phys_t *phys, ddt_stat_t *dds);
+
+// add an entry's statistics to the bucket of its reference count
+void ddt_histogram_add_stat(ddt_histogram_t *ddh, const ddt_stat_t &dds);
+void ddt_histogram_add(ddt_histogram_t *dst, const ddt_histogram_t &src);
+void ddt_histogram_total(const ddt_histogram_t &ddh, ddt_stat_t *total);
+
+// zdb -DD style histogram and the dedup/compress/copies ratios
+void print_ddt_histogram(const ddt_histogram_t &ddh);
+void print_ddt_summary(const ddt_stat_t &total);
+
+void print_ddt_report(const ddt_report &report);
@@ -0,0 +1,343 @@
+/*
+ * Microbenchmarks of the reader's decode primitives over synthetic buffers:
+ * decompression through read_block(), the checksum kernels, blkptr field
+ * decoding, dnode block scanning, label nvlist unpacking and ZAP leaf
+ * decoding.
+ *
+ *   decode_bench [-t <seconds per run>] [-r <runs>] [name filter]
+ *
+ * Each benchmark is calibrated until one run takes the requested time, then
+ * run several times; the fastest run is reported, which is the most stable
+ * figure on a machine that is not otherwise idle.
+ */
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <lz4.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "zfs_reader.h"
+#include "traverse.h"
+#include "image_writer.h"
+#include "checksum.h"
+#include "zap_impl.h"
+#include "zap_leaf.h"
+
+#define BENCH_BLOCK_SIZE (128 << 10)
+
+static double bench_seconds = 0.2;
+static int bench_runs = 5;
+static const char *bench_filter = nullptr;
+
+// keep the compiler from dropping work whose result is otherwise unused
+template <typename T>
+static inline void bench_keep(const T &v) {
+  asm volatile("" : : "g"(&v) : "memory");
+}
+
+/*
+ * Run f, which processes bytes and items per call, and print the best of
+ * bench_runs runs as GB/s and ns per item.
+ */
+static void bench(const std::string &name, uint64_t bytes, uint64_t items, const std::function<void()> &f) {
+  if (bench_filter != nullptr && name.find(bench_filter) == std::string::npos) {
+    return;
+  }
+  typedef std::chrono::steady_clock clock;
+  auto run = [&](uint64_t iters) {
+    auto start = clock::now();
+    for (uint64_t i = 0; i < iters; i++) {
+      f();
+    }
+    return std::chrono::duration<double>(clock::now() - start).count();
+  };
+  f();
+  uint64_t iters = 1;
+  for (double t = run(iters); t < bench_seconds; t = run(iters)) {
+    iters = t < bench_seconds / 100 ? iters * 10 : (uint64_t)(iters * bench_seconds / t * 1.1) + 1;
+  }
+  double best = 1e30;
+  for (int r = 0; r < bench_runs; r++) {
+    best = std::min(best, run(iters) / iters);
+  }
+  printf("%-24s %10.3f GB/s %12.1f ns/op %10" PRIu64 " iters\n", name.c_str(), bytes != 0 ? bytes / best / 1e9 : 0.0,
+         best * 1e9 / items, iters);
+}
+
+/*
+ * A flat "device" holding blocks back to back, with a block pointer for
+ * each, so the benchmarks go through read_block() like the tools do.
+ */
+struct bench_dev {
+  std::vector<uint8_t> data = std::vector<uint8_t>(SPA_MINBLOCKSIZE, 0);
+
+  blkptr_t add(const std::vector<uint8_t> &stored, uint64_t lsize, int compress, int type, int level = 0) {
+    uint64_t off = data.size();
+    uint64_t asize = P2ROUNDUP(stored.size(), SPA_MINBLOCKSIZE);
+    data.insert(data.end(), stored.begin(), stored.end());
+    data.resize(off + asize, 0);
+    blkptr_t bp;
+    memset(&bp, 0, sizeof(bp));
+    DVA_SET_OFFSET(&bp.blk_dva[0], off);
+    DVA_SET_ASIZE(&bp.blk_dva[0], asize);
+    BP_SET_LSIZE(&bp, lsize);
+    BP_SET_PSIZE(&bp, asize);
+    BP_SET_COMPRESS(&bp, compress);
+    BP_SET_CHECKSUM(&bp, ZIO_CHECKSUM_FLETCHER_4);
+    BP_SET_TYPE(&bp, type);
+    BP_SET_LEVEL(&bp, level);
+    BP_SET_BYTEORDER(&bp, ZFS_HOST_BYTEORDER);
+    bp.blk_birth = 1;
+    return bp;
+  }
+};
+
+static void bench_decompress() {
+  auto text = synthetic_text(BENCH_BLOCK_SIZE, 1, 5);
+  auto sparse = synthetic_text(BENCH_BLOCK_SIZE, 2, 60);
+  bench_dev dev;
+  std::vector<std::pair<std::string, blkptr_t>> cases;
+  cases.emplace_back("copy", dev.add(text, text.size(), ZIO_COMPRESS_OFF, DMU_OT_PLAIN_FILE_CONTENTS));
+
+  // zfs prefixes lz4 output with its length, big endian
+  std::vector<uint8_t> lz4(sizeof(uint32_t) + LZ4_compressBound(text.size()));
+  int n = LZ4_compress_default((const char*)text.data(), (char*)lz4.data() + sizeof(uint32_t), text.size(),
+                               lz4.size() - sizeof(uint32_t));
+  *(uint32_t*)lz4.data() = __builtin_bswap32(n);
+  lz4.resize(sizeof(uint32_t) + n);
+  cases.emplace_back("lz4", dev.add(lz4, text.size(), ZIO_COMPRESS_LZ4, DMU_OT_PLAIN_FILE_CONTENTS));
+
+  std::vector<uint8_t> gz(compressBound(text.size()));
+  uLongf gz_len = gz.size();
+  compress2(gz.data(), &gz_len, text.data(), text.size(), 6);
+  gz.resize(gz_len);
+  cases.emplace_back("gzip-6", dev.add(gz, text.size(), ZIO_COMPRESS_GZIP_6, DMU_OT_PLAIN_FILE_CONTENTS));
+
+  cases.emplace_back("zle", dev.add(zle_compress(sparse.data(), sparse.size()), sparse.size(), ZIO_COMPRESS_ZLE,
+                                    DMU_OT_PLAIN_FILE_CONTENTS));
+
+  for (auto &c : cases) {
+    bench("decompress " + c.first, BP_GET_LSIZE(&c.second), 1, [&]() {
+      auto out = read_block(&c.second, dev.data.data());
+      bench_keep(out[0]);
+    });
+  }
+
+#ifdef HAVE_ZSTD
+  // read_block() doesn't decode zstd yet, this is the library on the same data
+  std::vector<uint8_t> zst(ZSTD_compressBound(text.size()));
+  zst.resize(ZSTD_compress(zst.data(), zst.size(), text.data(), text.size(), 3));
+  std::vector<uint8_t> zst_out(text.size());
+  bench("decompress zstd-3 (lib)", text.size(), 1, [&]() {
+    bench_keep(ZSTD_decompress(zst_out.data(), zst_out.size(), zst.data(), zst.size()));
+  });
+#endif
+  // lzjb has no decoder in this tree
+}
+
+static void bench_checksums() {
+  auto data = synthetic_text(BENCH_BLOCK_SIZE, 3, 5);
+  zio_cksum_t zc;
+  bench("fletcher2", data.size(), 1, [&]() {
+    fletcher_2_native(data.data(), data.size(), &zc);
+    bench_keep(zc);
+  });
+  bench("fletcher4", data.size(), 1, [&]() {
+    fletcher_4_native(data.data(), data.size(), &zc);
+    bench_keep(zc);
+  });
+  bench("fletcher4 byteswap", data.size(), 1, [&]() {
+    fletcher_4_byteswap(data.data(), data.size(), &zc);
+    bench_keep(zc);
+  });
+  bench("sha256", data.size(), 1, [&]() {
+    sha256(data.data(), data.size(), &zc);
+    bench_keep(zc);
+  });
+}
+
+// an indirect block's worth of block pointers, decoded field by field
+static void bench_blkptrs() {
+  bench_dev dev;
+  std::vector<blkptr_t> bps;
+  auto data = synthetic_text(SPA_MINBLOCKSIZE, 4, 0);
+  for (int i = 0; i < 1024; i++) {
+    bps.push_back(dev.add(data, data.size(), i % 3 == 0 ? ZIO_COMPRESS_LZ4 : ZIO_COMPRESS_OFF,
+                          DMU_OT_PLAIN_FILE_CONTENTS, i % 2));
+    if (i % 17 == 0) {
+      memset(&bps.back(), 0, sizeof(blkptr_t));
+    }
+  }
+  bench("blkptr decode", bps.size() * sizeof(blkptr_t), bps.size(), [&]() {
+    uint64_t sum = 0;
+    for (auto &bp : bps) {
+      if (BP_IS_HOLE(&bp)) {
+        continue;
+      }
+      sum += BP_GET_LSIZE(&bp) + BP_GET_PSIZE(&bp) + BP_GET_COMPRESS(&bp) + BP_GET_LEVEL(&bp) + BP_GET_TYPE(&bp) +
+             DVA_GET_OFFSET(&bp.blk_dva[0]) + DVA_GET_ASIZE(&bp.blk_dva[0]) + bp.blk_birth;
+    }
+    bench_keep(sum);
+  });
+}
+
+// dnode blocks with a mix of free slots and large dnodes, scanned by the traversal's dnode_block_objects()
+static void bench_dnodes() {
+  std::vector<dnode_phys_t> dnodes(1024);
+  memset(dnodes.data(), 0, dnodes.size() * sizeof(dnode_phys_t));
+  uint64_t x = 5;
+  for (size_t i = 0; i < dnodes.size(); i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    if (x >> 62 == 0) {
+      continue;
+    }
+    dnodes[i].dn_type = DMU_OT_PLAIN_FILE_CONTENTS;
+    dnodes[i].dn_nblkptr = 1;
+    dnodes[i].dn_extra_slots = (x >> 60) % 4 == 0 && i % 32 < 31 ? 1 : 0;
+    i += dnodes[i].dn_extra_slots;
+  }
+  std::vector<uint64_t> objects;
+  bench("dnode block scan", dnodes.size() * sizeof(dnode_phys_t), dnodes.size(), [&]() {
+    dnode_block_objects(dnodes.data(), dnodes.size(), &objects);
+    bench_keep(objects.size());
+  });
+}
+
+// the config nvlist of a label on a pool with a 12 disk raidz
+static void bench_nvlist() {
+  nvlist_t *config, *tree;
+  nvlist_alloc(&config, NV_UNIQUE_NAME, 0);
+  nvlist_add_uint64(config, "version", 5000);
+  nvlist_add_string(config, "name", "tank");
+  nvlist_add_uint64(config, "state", 0);
+  nvlist_add_uint64(config, "txg", 123456);
+  nvlist_add_uint64(config, "pool_guid", 0x1234567890abcdefULL);
+  nvlist_add_string(config, "hostname", "bench");
+  nvlist_alloc(&tree, NV_UNIQUE_NAME, 0);
+  nvlist_add_string(tree, "type", "raidz");
+  nvlist_add_uint64(tree, "ashift", 12);
+  nvlist_add_uint64(tree, "nparity", 2);
+  std::vector<nvlist_t*> children(12);
+  for (size_t i = 0; i < children.size(); i++) {
+    nvlist_alloc(&children[i], NV_UNIQUE_NAME, 0);
+    nvlist_add_string(children[i], "type", "disk");
+    nvlist_add_uint64(children[i], "id", i);
+    nvlist_add_uint64(children[i], "guid", 0xfeed0000 + i);
+    nvlist_add_string(children[i], "path", ("/dev/disk/by-id/bench-" + std::to_string(i) + "-part1").c_str());
+  }
+  nvlist_add_nvlist_array(tree, "children", children.data(), children.size());
+  nvlist_add_nvlist(config, "vdev_tree", tree);
+  char *packed = nullptr;
+  size_t packed_size = 0;
+  nvlist_pack(config, &packed, &packed_size, NV_ENCODE_XDR, 0);
+
+  bench("nvlist unpack", packed_size, 1, [&]() {
+    nvlist_t *list;
+    nvlist_unpack(packed, packed_size, &list, 0);
+    uint64_t txg = 0;
+    nvlist_lookup_uint64(list, "txg", &txg);
+    bench_keep(txg);
+    nvlist_free(list);
+  });
+  free(packed);
+  for (auto c : children) {
+    nvlist_free(c);
+  }
+  nvlist_free(tree);
+  nvlist_free(config);
+}
+
+// a fat ZAP with one leaf of directory entries, iterated with zap_iterate()
+static void bench_zap() {
+  const int bs = 14;
+  std::vector<uint8_t> header(1 << bs, 0), leaf_block(1 << bs, 0);
+  auto zap = (zap_phys_t*)header.data();
+  zap->zap_block_type = ZBT_HEADER;
+  zap->zap_magic = ZAP_MAGIC;
+  zap->zap_freeblk = 2;
+
+  auto leaf = (zap_leaf_phys_t*)leaf_block.data();
+  leaf->l_hdr.lh_block_type = ZBT_LEAF;
+  leaf->l_hdr.lh_magic = ZAP_LEAF_MAGIC;
+  auto chunks = (zap_leaf_chunk_t*)(leaf->l_hash + ZAP_LEAF_HASH_NUMENTRIES_BS(bs));
+  int nchunks = ZAP_LEAF_NUMCHUNKS_BS(bs), next = 0, entries = 0;
+  // an entry, its name and its value take a chunk each
+  for (; next + 3 <= nchunks; entries++) {
+    char name[ZAP_LEAF_ARRAY_BYTES];
+    int len = snprintf(name, sizeof(name), "file%06d.dat", entries) + 1;
+    auto &le = chunks[next].l_entry;
+    le.le_type = ZAP_CHUNK_ENTRY;
+    le.le_value_intlen = 8;
+    le.le_next = ZAP_CHAIN_END;
+    le.le_name_chunk = next + 1;
+    le.le_name_numints = len;
+    le.le_value_chunk = next + 2;
+    le.le_value_numints = 1;
+    auto &la_name = chunks[next + 1].l_array;
+    la_name.la_type = ZAP_CHUNK_ARRAY;
+    memcpy(la_name.la_array, name, len);
+    la_name.la_next = ZAP_CHAIN_END;
+    auto &la_value = chunks[next + 2].l_array;
+    la_value.la_type = ZAP_CHUNK_ARRAY;
+    // zap leaf integers are big endian
+    uint64_t value = __builtin_bswap64(1000 + entries);
+    memcpy(la_value.la_array, &value, sizeof(value));
+    la_value.la_next = ZAP_CHAIN_END;
+    next += 3;
+  }
+  leaf->l_hdr.lh_nentries = entries;
+
+  bench_dev dev;
+  dnode_phys_t dn;
+  memset(&dn, 0, sizeof(dn));
+  dn.dn_type = DMU_OT_DIRECTORY_CONTENTS;
+  dn.dn_indblkshift = 17;
+  dn.dn_nlevels = 1;
+  dn.dn_nblkptr = 3;
+  dn.dn_datablkszsec = (1 << bs) / ZFS_SEC_SIZE;
+  dn.dn_maxblkid = 1;
+  dn.dn_blkptr[0] = dev.add(header, header.size(), ZIO_COMPRESS_OFF, DMU_OT_DIRECTORY_CONTENTS);
+  dn.dn_blkptr[1] = dev.add(leaf_block, leaf_block.size(), ZIO_COMPRESS_OFF, DMU_OT_DIRECTORY_CONTENTS);
+
+  bench("zap leaf decode", leaf_block.size(), entries, [&]() {
+    uint64_t sum = 0;
+    zap_iterate(&dn, dev.data.data(), [&](const zap_attribute &za) {
+      sum += za.za_first_integer + za.za_name.size();
+      return true;
+    });
+    bench_keep(sum);
+  });
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-t" && i + 1 < argc) {
+      bench_seconds = atof(argv[++i]);
+    } else if (arg == "-r" && i + 1 < argc) {
+      bench_runs = std::max(1, atoi(argv[++i]));
+    } else if (arg[0] != '-') {
+      bench_filter = argv[i];
+    } else {
+      fprintf(stderr, "usage: decode_bench [-t <seconds per run>] [-r <runs>] [name filter]\n");
+      return 1;
+    }
+  }
+  bench_decompress();
+  bench_checksums();
+  bench_blkptrs();
+  bench_dnodes();
+  bench_nvlist();
+  bench_zap();
+  return 0;
+}
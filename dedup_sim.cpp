@@ -0,0 +1,250 @@
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "dedup_sim.h"
+#include "ddt_reader.h"
+#include "traverse.h"
+
+namespace {
+
+// a distinct block; sizes are in 512 byte sectors, a zero key marks a free slot
+struct dedup_slot {
+  uint64_t key[2];
+  uint32_t refcnt;
+  uint16_t lsize;
+  uint16_t psize;
+  uint32_t dsize;
+  uint32_t pad;
+};
+
+struct dedup_shard {
+  std::mutex lock;
+  std::vector<dedup_slot> slots;
+  uint64_t used = 0;
+};
+
+}
+
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// level 0 blocks of files and zvols, what dedup=on would see
+static bool dedup_candidate(const zbookmark_phys_t &zb, const blkptr_t *bp) {
+  if (zb.zb_objset == ZB_DESTROYED_OBJSET || BP_IS_EMBEDDED(bp) || BP_GET_LEVEL(bp) != 0) {
+    return false;
+  }
+  auto type = BP_GET_TYPE(bp);
+  return type == DMU_OT_PLAIN_FILE_CONTENTS || type == DMU_OT_ZVOL;
+}
+
+/*
+ * The DDT key is the 256 bit checksum plus lsize, psize and compression.
+ * Folding it into 128 bits keeps the chance of a false match negligible
+ * while halving the table.
+ */
+static void dedup_key(const blkptr_t *bp, uint64_t key[2]) {
+  uint64_t prop = bp->blk_prop & ((1ULL << 39) - 1);
+  auto w = bp->blk_cksum.zc_word;
+  key[0] = mix64(w[0] ^ mix64(w[2] ^ prop));
+  key[1] = mix64(w[1] ^ mix64(w[3] + prop * 0x9e3779b97f4a7c15ULL));
+  if (key[0] == 0 && key[1] == 0) {
+    key[1] = 1;
+  }
+}
+
+static void dedup_shard_grow(dedup_shard *shard) {
+  std::vector<dedup_slot> old;
+  old.swap(shard->slots);
+  shard->slots.assign(old.empty() ? 1024 : old.size() * 2, dedup_slot());
+  uint64_t mask = shard->slots.size() - 1;
+  for (auto &s : old) {
+    if (s.key[0] == 0 && s.key[1] == 0) {
+      continue;
+    }
+    uint64_t i = s.key[1] & mask;
+    while (shard->slots[i].refcnt != 0) {
+      i = (i + 1) & mask;
+    }
+    shard->slots[i] = s;
+  }
+}
+
+static void dedup_shard_add(dedup_shard *shard, const uint64_t key[2], const blkptr_t *bp) {
+  std::lock_guard<std::mutex> guard(shard->lock);
+  if ((shard->used + 1) * 10 > shard->slots.size() * 7) {
+    dedup_shard_grow(shard);
+  }
+  uint64_t mask = shard->slots.size() - 1;
+  for (uint64_t i = key[1] & mask;; i = (i + 1) & mask) {
+    auto &s = shard->slots[i];
+    if (s.refcnt == 0) {
+      s.key[0] = key[0];
+      s.key[1] = key[1];
+      s.refcnt = 1;
+      s.lsize = BP_GET_LSIZE(bp) >> SPA_MINBLOCKSHIFT;
+      s.psize = BP_GET_PSIZE(bp) >> SPA_MINBLOCKSHIFT;
+      s.dsize = bp_get_asize(bp) >> SPA_MINBLOCKSHIFT;
+      shard->used++;
+      return;
+    }
+    if (s.key[0] == key[0] && s.key[1] == key[1]) {
+      s.refcnt++;
+      return;
+    }
+  }
+}
+
+void dedup_simulate(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                    unsigned nthreads, dedup_sim_result *result) {
+  memset(result, 0, sizeof(*result));
+  std::unique_ptr<dedup_shard[]> shards(new dedup_shard[DEDUP_SIM_SHARDS]);
+  std::atomic<uint64_t> blocks(0);
+
+  traverse_stats stats;
+  traverse_pool(mos, mos_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &zb, const blkptr_t *bp) {
+    if (!dedup_candidate(zb, bp)) {
+      return;
+    }
+    uint64_t key[2];
+    dedup_key(bp, key);
+    dedup_shard_add(&shards[key[0] >> (64 - DEDUP_SIM_SHARD_SHIFT)], key, bp);
+    blocks++;
+  }, &stats);
+
+  result->blocks = blocks;
+  for (int i = 0; i < DEDUP_SIM_SHARDS; i++) {
+    result->table_bytes += shards[i].slots.size() * sizeof(dedup_slot);
+    for (auto &s : shards[i].slots) {
+      if (s.refcnt == 0) {
+        continue;
+      }
+      ddt_stat_t dds;
+      dds.dds_blocks = 1;
+      dds.dds_lsize = (uint64_t)s.lsize << SPA_MINBLOCKSHIFT;
+      dds.dds_psize = (uint64_t)s.psize << SPA_MINBLOCKSHIFT;
+      dds.dds_dsize = (uint64_t)s.dsize << SPA_MINBLOCKSHIFT;
+      dds.dds_ref_blocks = s.refcnt;
+      dds.dds_ref_lsize = dds.dds_lsize * s.refcnt;
+      dds.dds_ref_psize = dds.dds_psize * s.refcnt;
+      dds.dds_ref_dsize = dds.dds_dsize * s.refcnt;
+      ddt_histogram_add_stat(&result->histogram, dds);
+      result->entries++;
+    }
+  }
+}
+
+void print_dedup_sim(const dedup_sim_result &result) {
+  printf("Simulated DDT histogram:\n\n");
+  print_ddt_histogram(result.histogram);
+  ddt_stat_t total;
+  ddt_histogram_total(result.histogram, &total);
+  print_ddt_summary(total);
+  printf("%" PRIu64 " blocks, %" PRIu64 " DDT entries, about %s in core (simulation used %s)\n",
+         result.blocks, result.entries, nicenum(result.entries * DDT_ENTRY_CORE_SIZE).c_str(),
+         nicenum(result.table_bytes).c_str());
+}
+
+namespace {
+
+struct dedup_sketch {
+  std::atomic<uint8_t> registers[DEDUP_SKETCH_CLASSES][1 << DEDUP_SKETCH_PRECISION];
+  std::atomic<uint64_t> blocks[DEDUP_SKETCH_CLASSES];
+  std::atomic<uint64_t> dsize[DEDUP_SKETCH_CLASSES];
+};
+
+}
+
+static void dedup_sketch_add(dedup_sketch *sk, int cls, uint64_t hash) {
+  const int p = DEDUP_SKETCH_PRECISION;
+  uint64_t idx = hash >> (64 - p);
+  // the guard bit caps the rank at 64 - p + 1
+  uint8_t rank = __builtin_clzll((hash << p) | (1ULL << (p - 1))) + 1;
+  auto &reg = sk->registers[cls][idx];
+  uint8_t cur = reg.load(std::memory_order_relaxed);
+  while (cur < rank && !reg.compare_exchange_weak(cur, rank, std::memory_order_relaxed)) {
+  }
+}
+
+static double dedup_sketch_count(const dedup_sketch &sk, int cls) {
+  const double m = 1 << DEDUP_SKETCH_PRECISION;
+  double sum = 0;
+  int zeros = 0;
+  for (auto &reg : sk.registers[cls]) {
+    uint8_t r = reg.load(std::memory_order_relaxed);
+    sum += std::ldexp(1.0, -r);
+    zeros += r == 0;
+  }
+  double alpha = 0.7213 / (1 + 1.079 / m);
+  double e = alpha * m * m / sum;
+  if (e <= 2.5 * m && zeros != 0) {
+    // linear counting is more accurate while most registers are empty
+    e = m * std::log(m / zeros);
+  }
+  return e;
+}
+
+void dedup_estimate(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                    unsigned nthreads, dedup_sketch_result *result) {
+  memset(result, 0, sizeof(*result));
+  std::unique_ptr<dedup_sketch> sk(new dedup_sketch);
+  for (int c = 0; c < DEDUP_SKETCH_CLASSES; c++) {
+    for (auto &reg : sk->registers[c]) {
+      reg = 0;
+    }
+    sk->blocks[c] = 0;
+    sk->dsize[c] = 0;
+  }
+  std::atomic<uint64_t> lsize(0), psize(0);
+
+  traverse_stats stats;
+  traverse_pool(mos, mos_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &zb, const blkptr_t *bp) {
+    if (!dedup_candidate(zb, bp)) {
+      return;
+    }
+    uint64_t key[2];
+    dedup_key(bp, key);
+    int cls = 63 - __builtin_clzll(BP_GET_PSIZE(bp));
+    dedup_sketch_add(sk.get(), cls, key[0]);
+    sk->blocks[cls]++;
+    sk->dsize[cls] += bp_get_asize(bp);
+    lsize += BP_GET_LSIZE(bp);
+    psize += BP_GET_PSIZE(bp);
+  }, &stats);
+
+  result->lsize = lsize;
+  result->psize = psize;
+  for (int c = 0; c < DEDUP_SKETCH_CLASSES; c++) {
+    uint64_t blocks = sk->blocks[c];
+    if (blocks == 0) {
+      continue;
+    }
+    double unique = std::min<double>(dedup_sketch_count(*sk, c), blocks);
+    result->blocks += blocks;
+    result->dsize += sk->dsize[c];
+    result->unique_blocks += unique;
+    result->unique_dsize += unique * sk->dsize[c] / blocks;
+  }
+}
+
+void print_dedup_estimate(const dedup_sketch_result &result) {
+  double dedup = result.unique_dsize == 0 ? 1.0 : result.dsize / result.unique_dsize;
+  double compress = result.psize == 0 ? 1.0 : (double)result.lsize / result.psize;
+  printf("%" PRIu64 " blocks, about %.0f distinct\n", result.blocks, result.unique_blocks);
+  printf("allocated %s, about %s deduplicated\n", nicenum(result.dsize).c_str(),
+         nicenum((uint64_t)result.unique_dsize).c_str());
+  printf("dedup = %.2f (estimated), compress = %.2f\n", dedup, compress);
+  printf("DDT would hold about %.0f entries, %s in core\n", result.unique_blocks,
+         nicenum((uint64_t)(result.unique_blocks * DDT_ENTRY_CORE_SIZE)).c_str());
+}
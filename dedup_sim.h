@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+#include "zfs_reader.h"
+#include "ddt.h"
+
+/*
+ * Estimate what dedup would save on data that is already written, like
+ * zdb -S: every level 0 file or zvol block is keyed by its checksum and
+ * sizes, and the refcount of each key makes up a DDT histogram.  This is
+ * only meaningful for pools whose checksum is strong (sha256, skein, ...);
+ * with fletcher4 unrelated blocks may collide.
+ */
+
+// table shards, each with its own lock, picked by the top bits of the key
+#define DEDUP_SIM_SHARD_SHIFT 8
+#define DEDUP_SIM_SHARDS (1 << DEDUP_SIM_SHARD_SHIFT)
+
+struct dedup_sim_result {
+  ddt_histogram_t histogram;
+  uint64_t blocks;            // candidate blocks seen
+  uint64_t entries;           // distinct keys, the size the DDT would have
+  uint64_t table_bytes;       // memory the simulation itself used
+};
+
+// exact: one 32 byte slot per distinct block
+void dedup_simulate(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                    unsigned nthreads, dedup_sim_result *result);
+
+void print_dedup_sim(const dedup_sim_result &result);
+
+/*
+ * HyperLogLog sketches of the distinct keys, one per power-of-two psize
+ * class, so that space estimates weight blocks by size.  Memory is fixed
+ * at DEDUP_SKETCH_CLASSES << DEDUP_SKETCH_PRECISION bytes whatever the
+ * pool size, at the price of a ~1% error per class.
+ */
+#define DEDUP_SKETCH_PRECISION 14
+#define DEDUP_SKETCH_CLASSES 64
+
+struct dedup_sketch_result {
+  uint64_t blocks;
+  uint64_t lsize;
+  uint64_t psize;
+  uint64_t dsize;
+  double unique_blocks;       // estimated distinct keys
+  double unique_dsize;        // estimated allocated bytes once deduplicated
+};
+
+void dedup_estimate(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                    unsigned nthreads, dedup_sketch_result *result);
+
+void print_dedup_estimate(const dedup_sketch_result &result);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "spa.h"
+
+struct dsl_dir;
+
+/*
+ * DS_FLAG_INCONSISTENT indicates that the dataset may be in an
+ * inconsistent state, and needs to be destroyed (eg. it's a partial
+ * receive or a clone that is being destroyed).
+ */
+#define	DS_FLAG_INCONSISTENT	(1ULL<<0)
+#define	DS_IS_INCONSISTENT(ds)	\
+	(dsl_dataset_phys(ds)->ds_flags & DS_FLAG_INCONSISTENT)
+
+/*
+ * Do not allow this dataset to be promoted.
+ */
+#define	DS_FLAG_NOPROMOTE	(1ULL<<1)
+
+/*
+ * DS_FLAG_UNIQUE_ACCURATE is set if ds_unique_bytes has been correctly
+ * calculated for head datasets (starting with SPA_VERSION_UNIQUE_ACCURATE,
+ * refquota/refreservations).
+ */
+#define	DS_FLAG_UNIQUE_ACCURATE	(1ULL<<2)
+
+/*
+ * DS_FLAG_DEFER_DESTROY is set after 'zfs destroy -d' has been called
+ * on a dataset. This allows the dataset to be destroyed using 'zfs release'.
+ */
+#define	DS_FLAG_DEFER_DESTROY	(1ULL<<3)
+#define	DS_IS_DEFER_DESTROY(ds)	\
+	(dsl_dataset_phys(ds)->ds_flags & DS_FLAG_DEFER_DESTROY)
+
+/*
+ * DS_FLAG_CI_DATASET is set if the dataset contains a file system whose
+ * name lookups should be performed case-insensitively.
+ */
+#define	DS_FLAG_CI_DATASET	(1ULL<<16)
+
+typedef struct dsl_dataset_phys {
+  uint64_t ds_dir_obj;		/* DMU_OT_DSL_DIR */
+  uint64_t ds_prev_snap_obj;	/* DMU_OT_DSL_DATASET */
+  uint64_t ds_prev_snap_txg;
+  uint64_t ds_next_snap_obj;	/* DMU_OT_DSL_DATASET */
+  uint64_t ds_snapnames_zapobj;	/* DMU_OT_DSL_DS_SNAP_MAP 0 for snaps */
+  uint64_t ds_num_children;	/* clone/snap children; ==0 for head */
+  uint64_t ds_creation_time;	/* seconds since 1970 */
+  uint64_t ds_creation_txg;
+  uint64_t ds_deadlist_obj;	/* DMU_OT_DEADLIST */
+  /*
+   * ds_referenced_bytes, ds_compressed_bytes, and ds_uncompressed_bytes
+   * include all blocks referenced by this dataset, including those
+   * shared with any other datasets.
+   */
+  uint64_t ds_referenced_bytes;
+  uint64_t ds_compressed_bytes;
+  uint64_t ds_uncompressed_bytes;
+  uint64_t ds_unique_bytes;	/* only relevant to snapshots */
+  /*
+   * The ds_fsid_guid is a 56-bit ID that can change to avoid
+   * collisions.  The ds_guid is a 64-bit ID that will never
+   * change, so there is a small probability that it will collide.
+   */
+  uint64_t ds_fsid_guid;
+  uint64_t ds_guid;
+  uint64_t ds_flags;		/* DS_FLAG_* */
+  blkptr_t ds_bp;
+  uint64_t ds_next_clones_obj;	/* DMU_OT_DSL_CLONES */
+  uint64_t ds_props_obj;		/* DMU_OT_DSL_PROPS for snaps */
+  uint64_t ds_userrefs_obj;	/* DMU_OT_USERREFS */
+  uint64_t ds_pad[5]; /* pad out to 320 bytes for good measure */
+} dsl_dataset_phys_t;
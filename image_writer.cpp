@@ -0,0 +1,1426 @@
+#include <cassert>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <lz4.h>
+#include <zlib.h>
+
+#include "image_writer.h"
+#include "checksum.h"
+#include "bpobj.h"
+#include "space_map.h"
+#include "zap_impl.h"
+#include "zap_leaf.h"
+#include "zfs_znode.h"
+
+// vdev_label_t: 8K pad, 8K boot header, 112K config nvlist, 128K uberblock ring
+#define VDEV_LABELS 4
+#define VDEV_LABEL_SIZE (256 << 10)
+#define VDEV_PHYS_OFFSET (16 << 10)
+#define VDEV_PHYS_SIZE (112 << 10)
+#define VDEV_UBERBLOCK_OFFSET (128 << 10)
+#define VDEV_UBERBLOCK_RING (128 << 10)
+#define UBERBLOCK_SHIFT 10
+#define MAX_UBERBLOCK_SHIFT 13
+// the first two labels and the boot block come before the allocatable space, the data_off of the reader
+#define VDEV_LABEL_START_SIZE (2 * VDEV_LABEL_SIZE + (7 << 19))
+#define VDEV_LABEL_END_SIZE (2 * VDEV_LABEL_SIZE)
+
+#define UBERBLOCK_MAGIC 0x00bab10cULL
+#define MMP_MAGIC 0xa11cea11ULL
+#define SPA_VERSION_FEATURES 5000ULL
+#define POOL_STATE_EXPORTED 1ULL
+#define SPA_MINDEVSIZE (64ULL << 20)
+
+// metaslab sizing of vdev_metaslab_set_size()
+#define VDEV_DEFAULT_MS_SHIFT 29
+#define VDEV_DEFAULT_MS_COUNT 200
+#define VDEV_MIN_MS_COUNT 16
+#define VDEV_MAX_MS_SHIFT 34
+
+#define ZPL_VERSION_ZNODE 4ULL          // the last ZPL version with znode_phys_t bonus buffers
+#define ZNODE_PHYS_SIZE 264             // znode_phys_t including the zfs_acl_phys_t tail
+#define DEADLIST_PHYS_SIZE 320          // dsl_deadlist_phys_t
+#define SPACE_MAP_BLOCK_SIZE 4096
+#define BPOBJ_BLOCK_SIZE (128 << 10)
+#define FZAP_DEFAULT_BLOCK_SHIFT 14      // fzap_default_block_shift
+#define ZAP_HASHBITS 28                 // zap_hashbits() without ZAP_FLAG_HASH64
+#define ZFS_CRC64_POLY 0xC96C5795D7870F42ULL
+
+// sequential writes are collected up to this much before a pwrite()
+#define IMAGE_WRITE_BUFFER (8 << 20)
+
+// the MOS meta dnode of a pool with more than 96 objects
+#define MOS_META_DNODE_LEVELS 2
+
+// ZPL objects, the directories and then the files follow the root
+#define ZPL_UNLINKED_OBJ 2
+#define ZPL_ROOT_OBJ 3
+
+// MOS objects, the space maps of the metaslabs come last
+enum {
+  MOS_DIRECTORY = DMU_POOL_DIRECTORY_OBJECT,
+  MOS_CONFIG,
+  MOS_FEATURES_FOR_READ,
+  MOS_FEATURES_FOR_WRITE,
+  MOS_FEATURE_DESCRIPTIONS,
+  MOS_SYNC_BPOBJ,
+  MOS_FREE_BPOBJ,
+  MOS_ROOT_DIR,
+  MOS_ROOT_CHILD_MAP,
+  MOS_ROOT_PROPS,
+  MOS_MOS_DIR,
+  MOS_MOS_CHILD_MAP,
+  MOS_MOS_PROPS,
+  MOS_FREE_DIR,
+  MOS_FREE_CHILD_MAP,
+  MOS_FREE_PROPS,
+  MOS_DATASET,
+  MOS_SNAPNAMES,
+  MOS_DEADLIST,
+  MOS_METASLAB_ARRAY,
+  MOS_SPACE_MAPS,
+};
+
+std::vector<uint8_t> synthetic_text(size_t size, uint64_t seed, int zero_percent) {
+  static const char *words[] = {"the", "block", "pointer", "zfs", "dnode", "objset", "level", "checksum",
+                                "0x7f3a", "data", "birth", "txg", "=", "\n", "{", "}", "  "};
+  std::vector<uint8_t> out;
+  out.reserve(size);
+  uint64_t x = seed | 1;
+  while (out.size() < size) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    if ((int)(x % 100) < zero_percent) {
+      out.insert(out.end(), std::min<size_t>(64 + x % 512, size - out.size()), 0);
+      continue;
+    }
+    auto w = words[(x >> 8) % (sizeof(words) / sizeof(words[0]))];
+    out.insert(out.end(), w, w + strlen(w));
+    out.push_back(' ');
+  }
+  out.resize(size);
+  return out;
+}
+
+std::vector<uint8_t> zle_compress(const uint8_t *src, size_t size) {
+  const int n = 64;
+  std::vector<uint8_t> out;
+  for (size_t i = 0; i < size;) {
+    size_t run = 0;
+    while (i + run < size && src[i + run] == 0 && run < 256 - n) {
+      run++;
+    }
+    if (run > 0) {
+      out.push_back(run - 1 + n);
+      i += run;
+      continue;
+    }
+    size_t len = 0;
+    while (i + len < size && src[i + len] != 0 && len < (size_t)n) {
+      len++;
+    }
+    out.push_back(len - 1);
+    out.insert(out.end(), src + i, src + i + len);
+    i += len;
+  }
+  return out;
+}
+
+// splitmix64, for guids, salts, file sizes and the choice of data blocks
+static uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static int highbit64(uint64_t x) {
+  return x == 0 ? 0 : 64 - __builtin_clzll(x);
+}
+
+static void compute_checksum(int checksum, const void *data, size_t size, zio_cksum_t *zc) {
+  switch (checksum) {
+    case ZIO_CHECKSUM_FLETCHER_2:
+      fletcher_2_native(data, size, zc);
+      break;
+    case ZIO_CHECKSUM_FLETCHER_4:
+      fletcher_4_native(data, size, zc);
+      break;
+    case ZIO_CHECKSUM_SHA256:
+      sha256(data, size, zc);
+      break;
+    default:
+      memset(zc, 0, sizeof(*zc));
+  }
+}
+
+/*
+ * Embedded checksums (labels, uberblocks, gang headers) live in a zio_eck_t
+ * at the end of the block and are computed with the verifier in its place.
+ */
+static void embedded_checksum(void *data, size_t size, const zio_cksum_t &verifier) {
+  auto eck = (zio_eck_t*)((uint8_t*)data + size - sizeof(zio_eck_t));
+  eck->zec_magic = ZEC_MAGIC;
+  eck->zec_cksum = verifier;
+  zio_cksum_t zc;
+  sha256(data, size, &zc);
+  eck->zec_cksum = zc;
+}
+
+// compress like zio_compress_data(): 0 if the result doesn't save at least an eighth
+static size_t compress_data(int compress, const uint8_t *src, size_t lsize, std::vector<uint8_t> *dst) {
+  size_t d_len = lsize - lsize / 8;
+  if (compress == ZIO_COMPRESS_LZ4) {
+    // zfs prefixes lz4 output with its length, big endian
+    if (d_len <= sizeof(uint32_t)) {
+      return 0;
+    }
+    dst->resize(d_len);
+    int n = LZ4_compress_default((const char*)src, (char*)dst->data() + sizeof(uint32_t), lsize,
+                                 d_len - sizeof(uint32_t));
+    if (n <= 0) {
+      return 0;
+    }
+    uint32_t be = __builtin_bswap32(n);
+    memcpy(dst->data(), &be, sizeof(be));
+    return n + sizeof(uint32_t);
+  } else if (compress >= ZIO_COMPRESS_GZIP_1 && compress <= ZIO_COMPRESS_GZIP_9) {
+    dst->resize(d_len);
+    uLongf len = d_len;
+    if (compress2(dst->data(), &len, src, lsize, compress - ZIO_COMPRESS_GZIP_1 + 1) != Z_OK) {
+      return 0;
+    }
+    return len;
+  } else if (compress == ZIO_COMPRESS_ZLE) {
+    *dst = zle_compress(src, lsize);
+    return dst->size() <= d_len ? dst->size() : 0;
+  }
+  return 0;
+}
+
+// a block ready to be placed: its bytes as stored and their checksum
+struct prepared_block {
+  std::vector<uint8_t> stored;  // PSIZE bytes, or the payload of an embedded block pointer
+  uint64_t lsize;
+  int compress;
+  bool embedded;
+  zio_cksum_t cksum;
+};
+
+/*
+ * Compress data as zio_write_compress() would: a compressed block is padded
+ * to the allocation size and kept only if that is still smaller than lsize,
+ * and level 0 blocks that compress to BPE_PAYLOAD_SIZE bytes or less go into
+ * the block pointer itself when may_embed.
+ */
+static void prepare_block(const void *data, uint64_t lsize, int compress, int checksum, bool may_embed, int ashift,
+                          prepared_block *pb) {
+  auto src = (const uint8_t*)data;
+  pb->lsize = lsize;
+  pb->compress = ZIO_COMPRESS_OFF;
+  pb->embedded = false;
+  size_t clen = compress != ZIO_COMPRESS_OFF ? compress_data(compress, src, lsize, &pb->stored) : 0;
+  if (clen != 0 && may_embed && clen <= BPE_PAYLOAD_SIZE) {
+    pb->stored.resize(clen);
+    pb->compress = compress;
+    pb->embedded = true;
+    return;
+  }
+  uint64_t rounded = P2ROUNDUP((uint64_t)clen, 1ULL << ashift);
+  if (clen != 0 && rounded < lsize) {
+    pb->stored.resize(clen);
+    pb->stored.resize(rounded, 0);
+    pb->compress = compress;
+  } else {
+    pb->stored.assign(src, src + lsize);
+  }
+  compute_checksum(checksum, pb->stored.data(), pb->stored.size(), &pb->cksum);
+}
+
+// the inverse of decode_embedded_bp_compressed()
+static void encode_embedded_bp(blkptr_t *bp, const std::vector<uint8_t> &payload) {
+  auto bp64 = (uint64_t*)bp;
+  uint64_t w = 0;
+  for (size_t i = 0; i < payload.size(); i++) {
+    w |= (uint64_t)payload[i] << ((i % sizeof(w)) * 8);
+    if (i % sizeof(w) == sizeof(w) - 1 || i == payload.size() - 1) {
+      *bp64++ = w;
+      if (!BPE_IS_PAYLOADWORD(bp, bp64)) {
+        bp64++;
+      }
+      w = 0;
+    }
+  }
+}
+
+// space charged to an objset, for the DSL accounting
+struct space_usage {
+  uint64_t asize;
+  uint64_t psize;
+  uint64_t lsize;
+};
+
+/*
+ * Allocates from the data region of the vdev front to back and writes the
+ * blocks through a buffer, so the image is written sequentially apart from
+ * blocks that are filled in after space was reserved for them.
+ */
+struct pool_writer {
+  int fd;
+  int ashift;
+  uint64_t txg;
+  uint64_t capacity;
+  uint64_t next;
+  bool full;
+  bool io_error;
+  std::vector<uint8_t> buf;     // pending bytes of [buf_off, buf_off + buf.size())
+  uint64_t buf_off;
+  int md_compress;              // for indirect, dnode, ZAP and objset blocks of the objset being written
+  int md_checksum;
+  space_usage *usage;
+  image_stats *stats;
+
+  pool_writer(int fd, int ashift, uint64_t txg, uint64_t capacity, image_stats *stats)
+      : fd(fd), ashift(ashift), txg(txg), capacity(capacity), next(0), full(false), io_error(false), buf_off(0),
+        md_compress(ZIO_COMPRESS_OFF), md_checksum(ZIO_CHECKSUM_FLETCHER_4), usage(nullptr), stats(stats) {}
+
+  uint64_t asize(uint64_t size) const {
+    return P2ROUNDUP(size, 1ULL << ashift);
+  }
+
+  uint64_t alloc(uint64_t size) {
+    uint64_t off = next;
+    if (next + asize(size) > capacity) {
+      full = true;
+    }
+    next += asize(size);
+    return off;
+  }
+
+  void pwrite_all(const uint8_t *data, size_t len, uint64_t off) {
+    while (len > 0 && !io_error) {
+      ssize_t n = pwrite(fd, data, len, VDEV_LABEL_START_SIZE + off);
+      if (n < 0) {
+        std::cerr << "failed to write the image, err: " << strerror(errno) << std::endl;
+        io_error = true;
+        return;
+      }
+      data += n;
+      len -= n;
+      off += n;
+    }
+  }
+
+  void flush() {
+    pwrite_all(buf.data(), buf.size(), buf_off);
+    buf_off += buf.size();
+    buf.clear();
+  }
+
+  void put(uint64_t off, const void *data, size_t len) {
+    if (full || io_error) {
+      return;
+    }
+    uint64_t end = buf_off + buf.size();
+    if (off < buf_off) {
+      // reserved earlier and already flushed
+      pwrite_all((const uint8_t*)data, len, off);
+      return;
+    }
+    if (off > end + IMAGE_WRITE_BUFFER) {
+      flush();
+      buf_off = off;
+    }
+    size_t pos = off - buf_off;
+    if (buf.size() < pos + len) {
+      buf.resize(pos + len, 0);
+    }
+    memcpy(buf.data() + pos, data, len);
+    if (buf.size() >= IMAGE_WRITE_BUFFER) {
+      flush();
+    }
+  }
+
+  void charge(uint64_t asize, uint64_t psize, uint64_t lsize) {
+    if (usage != nullptr) {
+      usage->asize += asize;
+      usage->psize += psize;
+      usage->lsize += lsize;
+    }
+  }
+
+  // write a plain block at off and fill in everything but the DVA's asize
+  blkptr_t plain_bp(uint64_t off, uint64_t lsize, uint64_t psize, int compress, int checksum, const zio_cksum_t &cksum,
+                    int type, int level, uint64_t fill) {
+    blkptr_t bp;
+    memset(&bp, 0, sizeof(bp));
+    DVA_SET_OFFSET(&bp.blk_dva[0], off);
+    DVA_SET_ASIZE(&bp.blk_dva[0], asize(psize));
+    BP_SET_LSIZE(&bp, lsize);
+    BP_SET_PSIZE(&bp, psize);
+    BP_SET_COMPRESS(&bp, compress);
+    BP_SET_CHECKSUM(&bp, checksum);
+    BP_SET_TYPE(&bp, type);
+    BP_SET_LEVEL(&bp, level);
+    BP_SET_BYTEORDER(&bp, ZFS_HOST_BYTEORDER);
+    BP_SET_BIRTH(&bp, txg, txg);
+    bp.blk_fill = fill;
+    bp.blk_cksum = cksum;
+    stats->blocks++;
+    return bp;
+  }
+
+  /*
+   * Allocate and write pb.  A gang block is split like zio_write_gang_block()
+   * does into up to SPA_GBH_NBLKPTRS members behind a gang header, and its
+   * DVA covers the header and the members.
+   */
+  blkptr_t place(const prepared_block &pb, int checksum, int type, int level, uint64_t fill, bool gang) {
+    blkptr_t bp;
+    memset(&bp, 0, sizeof(bp));
+    if (pb.embedded) {
+      encode_embedded_bp(&bp, pb.stored);
+      BP_SET_EMBEDDED(&bp, 1);
+      BPE_SET_ETYPE(&bp, BP_EMBEDDED_TYPE_DATA);
+      BPE_SET_LSIZE(&bp, pb.lsize);
+      BPE_SET_PSIZE(&bp, pb.stored.size());
+      BP_SET_COMPRESS(&bp, pb.compress);
+      BP_SET_TYPE(&bp, type);
+      BP_SET_LEVEL(&bp, level);
+      BP_SET_BYTEORDER(&bp, ZFS_HOST_BYTEORDER);
+      bp.blk_birth = txg;
+      stats->blocks++;
+      stats->embedded++;
+      charge(0, 0, pb.lsize);
+      return bp;
+    }
+
+    uint64_t psize = pb.stored.size();
+    if (!gang) {
+      uint64_t off = alloc(psize);
+      put(off, pb.stored.data(), psize);
+      bp = plain_bp(off, pb.lsize, psize, pb.compress, checksum, pb.cksum, type, level, fill);
+      charge(asize(psize), psize, pb.lsize);
+      return bp;
+    }
+
+    zio_gbh_phys_t gbh;
+    memset(&gbh, 0, sizeof(gbh));
+    uint64_t hdr = alloc(SPA_GANGBLOCKSIZE);
+    uint64_t total = asize(SPA_GANGBLOCKSIZE);
+    uint64_t done = 0;
+    for (int g = 0; done < psize; g++) {
+      uint64_t msize = std::min<uint64_t>(P2ROUNDUP((psize - done) / (SPA_GBH_NBLKPTRS - g), SPA_MINBLOCKSIZE),
+                                psize - done);
+      uint64_t off = alloc(msize);
+      put(off, pb.stored.data() + done, msize);
+      zio_cksum_t zc;
+      compute_checksum(checksum, pb.stored.data() + done, msize, &zc);
+      gbh.zg_blkptr[g] = plain_bp(off, msize, msize, ZIO_COMPRESS_OFF, checksum, zc, type, level, 1);
+      total += asize(msize);
+      done += msize;
+    }
+    // the gang header checksum is verified against its own DVA and birth
+    zio_cksum_t verifier = {{0, hdr, txg, 0}};
+    embedded_checksum(&gbh, sizeof(gbh), verifier);
+    put(hdr, &gbh, sizeof(gbh));
+
+    bp = plain_bp(hdr, pb.lsize, psize, pb.compress, checksum, pb.cksum, type, level, fill);
+    DVA_SET_ASIZE(&bp.blk_dva[0], total);
+    DVA_SET_GANG(&bp.blk_dva[0], 1);
+    stats->gang++;
+    charge(total, psize, pb.lsize);
+    return bp;
+  }
+};
+
+static dnode_phys_t new_dnode(int type, uint64_t blksz, int indblkshift, int bonustype, int bonuslen) {
+  dnode_phys_t dn;
+  memset(&dn, 0, sizeof(dn));
+  dn.dn_type = type;
+  dn.dn_indblkshift = indblkshift;
+  dn.dn_nlevels = 1;
+  dn.dn_nblkptr = std::min<int>(1 + ((DN_OLD_MAX_BONUSLEN - bonuslen) >> SPA_BLKPTRSHIFT), DN_MAX_NBLKPTR);
+  dn.dn_bonustype = bonustype;
+  dn.dn_bonuslen = bonuslen;
+  dn.dn_datablkszsec = blksz / ZFS_SEC_SIZE;
+  dn.dn_flags = DNODE_FLAG_USED_BYTES;
+  return dn;
+}
+
+// levels of indirection for nblocks blocks under nblkptr block pointers
+static int tree_levels(uint64_t nblocks, int nblkptr, int epbs) {
+  int nlevels = 1;
+  while (nlevels * epbs < 64 && nblocks > ((uint64_t)nblkptr << ((nlevels - 1) * epbs))) {
+    nlevels++;
+  }
+  return nlevels;
+}
+
+/*
+ * The indirect blocks of one object, built bottom up as its level 0 block
+ * pointers arrive in blkid order: a full indirect block is written as soon
+ * as its last child is in, the partial ones at the end.
+ */
+struct block_tree {
+  pool_writer *w;
+  dnode_phys_t *dn;
+  int epbs;
+  std::vector<std::vector<blkptr_t>> levels;
+
+  block_tree(pool_writer *w, dnode_phys_t *dn, uint64_t nblocks, int min_levels = 1)
+      : w(w), dn(dn), epbs(dn->dn_indblkshift - SPA_BLKPTRSHIFT) {
+    int nlevels = std::max(tree_levels(nblocks, dn->dn_nblkptr, epbs), min_levels);
+    dn->dn_nlevels = nlevels;
+    dn->dn_maxblkid = nblocks > 0 ? nblocks - 1 : 0;
+    levels.resize(nlevels);
+  }
+
+  void add(const blkptr_t &bp) {
+    account(bp);
+    levels[0].push_back(bp);
+    for (size_t l = 0; l + 1 < levels.size() && levels[l].size() == (1ULL << epbs); l++) {
+      write_indirect(l);
+    }
+  }
+
+  void finish() {
+    for (size_t l = 0; l + 1 < levels.size(); l++) {
+      if (!levels[l].empty()) {
+        write_indirect(l);
+      }
+    }
+    assert(levels.back().size() <= dn->dn_nblkptr);
+    std::copy(levels.back().begin(), levels.back().end(), dn->dn_blkptr);
+  }
+
+ private:
+  void account(const blkptr_t &bp) {
+    if (!BP_IS_EMBEDDED(&bp)) {
+      dn->dn_used += DVA_GET_ASIZE(&bp.blk_dva[0]);
+    }
+  }
+
+  void write_indirect(size_t l) {
+    std::vector<blkptr_t> block(1ULL << epbs);
+    memset(block.data(), 0, block.size() * sizeof(blkptr_t));
+    std::copy(levels[l].begin(), levels[l].end(), block.begin());
+    uint64_t fill = 0;
+    for (auto &bp : levels[l]) {
+      fill += bp.blk_fill;
+    }
+    prepared_block pb;
+    prepare_block(block.data(), block.size() * sizeof(blkptr_t), w->md_compress, w->md_checksum, false, w->ashift,
+                  &pb);
+    auto bp = w->place(pb, w->md_checksum, dn->dn_type, l + 1, fill, false);
+    account(bp);
+    levels[l].clear();
+    levels[l + 1].push_back(bp);
+  }
+};
+
+// write data as the contents of the object dn, in blocks of its block size
+static void write_object(pool_writer *w, dnode_phys_t *dn, const void *data, size_t size) {
+  uint64_t blksz = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  uint64_t nblocks = (size + blksz - 1) / blksz;
+  block_tree tree(w, dn, nblocks);
+  std::vector<uint8_t> block(blksz);
+  for (uint64_t blkid = 0; blkid < nblocks; blkid++) {
+    uint64_t off = blkid * blksz, len = std::min<uint64_t>(blksz, size - off);
+    std::fill(block.begin(), block.end(), 0);
+    memcpy(block.data(), (const uint8_t*)data + off, len);
+    prepared_block pb;
+    prepare_block(block.data(), blksz, w->md_compress, w->md_checksum, true, w->ashift, &pb);
+    tree.add(w->place(pb, w->md_checksum, dn->dn_type, 0, 1, false));
+  }
+  tree.finish();
+}
+
+/*
+ * The dnodes of an objset, added in object order and written DNODES_PER_BLOCK
+ * at a time under the meta dnode.  Object 0, the meta dnode itself, takes the
+ * first slot.
+ */
+struct dnode_stream {
+  pool_writer *w;
+  dnode_phys_t meta;
+  block_tree tree;
+  std::vector<dnode_phys_t> block;
+  size_t used;
+  uint64_t fill;              // allocated dnodes in block
+  uint64_t total_fill;
+  uint64_t next_object;
+
+  dnode_stream(pool_writer *w, uint64_t nobjects, int min_levels)
+      : w(w), meta(new_dnode(DMU_OT_DNODE, DNODE_BLOCK_SIZE, DN_MAX_INDBLKSHIFT, DMU_OT_NONE, 0)),
+        tree(w, &meta, (nobjects + DNODES_PER_BLOCK - 1) / DNODES_PER_BLOCK, min_levels), block(DNODES_PER_BLOCK),
+        used(1), fill(0), total_fill(0), next_object(1) {
+    memset(block.data(), 0, block.size() * sizeof(dnode_phys_t));
+  }
+
+  void add(const dnode_phys_t &dn) {
+    next_object++;
+    block[used++] = dn;
+    fill += dn.dn_type != DMU_OT_NONE;
+    if (used == DNODES_PER_BLOCK) {
+      write_block();
+    }
+  }
+
+  // write the objset_phys_t of type os_type, returns its block pointer
+  blkptr_t finish(int os_type) {
+    if (used > 0) {
+      write_block();
+    }
+    tree.finish();
+    objset_phys_t os;
+    memset(&os, 0, sizeof(os));
+    os.os_meta_dnode = meta;
+    os.os_type = os_type;
+    prepared_block pb;
+    prepare_block(&os, sizeof(os), w->md_compress, w->md_checksum, false, w->ashift, &pb);
+    return w->place(pb, w->md_checksum, DMU_OT_OBJSET, 0, total_fill, false);
+  }
+
+ private:
+  void write_block() {
+    prepared_block pb;
+    prepare_block(block.data(), DNODE_BLOCK_SIZE, w->md_compress, w->md_checksum, false, w->ashift, &pb);
+    tree.add(w->place(pb, w->md_checksum, DMU_OT_DNODE, 0, fill, false));
+    total_fill += fill;
+    memset(block.data(), 0, block.size() * sizeof(dnode_phys_t));
+    used = 0;
+    fill = 0;
+  }
+};
+
+/*
+ * dmu_objset_create_impl() gives the meta dnode of a dataset's objset the
+ * levels to address DN_MAX_OBJECT dnodes up front, the MOS only grows them
+ * as it needs.
+ */
+static int meta_dnode_levels() {
+  int levels = 1;
+  while (((uint64_t)DN_MAX_NBLKPTR << (DNODES_PER_BLOCK_SHIFT + (levels - 1) * (DN_MAX_INDBLKSHIFT - SPA_BLKPTRSHIFT))) <
+         DN_MAX_OBJECT) {
+    levels++;
+  }
+  return levels;
+}
+
+static const uint64_t *crc64_table() {
+  static uint64_t table[256];
+  static bool init = false;
+  if (!init) {
+    for (int i = 0; i < 256; i++) {
+      uint64_t ct = i;
+      for (int j = 0; j < 8; j++) {
+        ct = (ct >> 1) ^ (-(ct & 1) & ZFS_CRC64_POLY);
+      }
+      table[i] = ct;
+    }
+    init = true;
+  }
+  return table;
+}
+
+// zap_hash() for string keys without normalization
+static uint64_t zap_hash(uint64_t salt, const std::string &name) {
+  auto table = crc64_table();
+  uint64_t h = salt;
+  for (unsigned char c : name) {
+    h = (h >> 8) ^ table[(h ^ c) & 0xff];
+  }
+  return h & ~((1ULL << (64 - ZAP_HASHBITS)) - 1);
+}
+
+struct zap_entry {
+  std::string name;
+  uint64_t value;
+  uint64_t hash;
+  uint32_t cd;
+};
+
+// name chunks, value chunk and the entry chunk itself
+static int zap_entry_chunks(const zap_entry &e) {
+  return 2 + ZAP_LEAF_ARRAY_NCHUNKS(e.name.size() + 1);
+}
+
+static uint16_t zap_leaf_array(zap_leaf_chunk_t *chunks, uint16_t *next, const uint8_t *data, size_t len) {
+  uint16_t first = *next;
+  for (size_t off = 0; off < len; off += ZAP_LEAF_ARRAY_BYTES) {
+    auto &la = chunks[(*next)++].l_array;
+    la.la_type = ZAP_CHUNK_ARRAY;
+    memcpy(la.la_array, data + off, std::min<size_t>(ZAP_LEAF_ARRAY_BYTES, len - off));
+    la.la_next = off + ZAP_LEAF_ARRAY_BYTES < len ? *next : ZAP_CHAIN_END;
+  }
+  return first;
+}
+
+static void build_zap_leaf(uint8_t *block, const std::vector<const zap_entry*> &entries, uint64_t prefix,
+                           int prefix_len) {
+  const int bs = FZAP_DEFAULT_BLOCK_SHIFT;
+  auto leaf = (zap_leaf_phys_t*)block;
+  leaf->l_hdr.lh_block_type = ZBT_LEAF;
+  leaf->l_hdr.lh_magic = ZAP_LEAF_MAGIC;
+  leaf->l_hdr.lh_prefix = prefix;
+  leaf->l_hdr.lh_prefix_len = prefix_len;
+  leaf->l_hdr.lh_nentries = entries.size();
+  std::fill(leaf->l_hash, leaf->l_hash + ZAP_LEAF_HASH_NUMENTRIES_BS(bs), ZAP_CHAIN_END);
+  auto chunks = (zap_leaf_chunk_t*)(leaf->l_hash + ZAP_LEAF_HASH_NUMENTRIES_BS(bs));
+  int nchunks = ZAP_LEAF_NUMCHUNKS_BS(bs);
+
+  // entry chunks first, then the arrays holding names and values
+  uint16_t chunk = 0, next = entries.size();
+  for (auto e : entries) {
+    auto &le = chunks[chunk].l_entry;
+    le.le_type = ZAP_CHUNK_ENTRY;
+    le.le_value_intlen = 8;
+    le.le_name_numints = e->name.size() + 1;
+    le.le_name_chunk = zap_leaf_array(chunks, &next, (const uint8_t*)e->name.c_str(), e->name.size() + 1);
+    // zap leaf integers are big endian
+    uint64_t value = __builtin_bswap64(e->value);
+    le.le_value_numints = 1;
+    le.le_value_chunk = zap_leaf_array(chunks, &next, (const uint8_t*)&value, sizeof(value));
+    le.le_cd = e->cd;
+    le.le_hash = e->hash;
+    // LEAF_HASH(): the hash bits right after the prefix pick the chain
+    int shift = ZAP_LEAF_HASH_SHIFT_BS(bs);
+    uint64_t idx = (e->hash >> (64 - shift - prefix_len)) & ((1ULL << shift) - 1);
+    le.le_next = leaf->l_hash[idx];
+    leaf->l_hash[idx] = chunk++;
+  }
+  leaf->l_hdr.lh_nfree = nchunks - next;
+  leaf->l_hdr.lh_freelist = next < nchunks ? next : ZAP_CHAIN_END;
+  for (int i = next; i < nchunks; i++) {
+    chunks[i].l_free.lf_type = ZAP_CHUNK_FREE;
+    chunks[i].l_free.lf_next = i + 1 < nchunks ? i + 1 : ZAP_CHAIN_END;
+  }
+}
+
+/*
+ * The blocks of a ZAP object mapping names to uint64 values, a micro ZAP
+ * when the entries fit one, otherwise a fat ZAP of 2^shift leaves with the
+ * smallest shift whose leaves hold all their entries, or always a fat ZAP
+ * when fat_only.  *blksz is the block size of the object.
+ */
+static std::vector<uint8_t> build_zap(const std::vector<std::pair<std::string, uint64_t>> &in, uint64_t salt,
+                                      bool fat_only, uint64_t *blksz, bool *fat) {
+  std::vector<zap_entry> entries;
+  bool micro = !fat_only && in.size() < MZAP_MAX_BLKSZ / MZAP_ENT_LEN;
+  for (auto &kv : in) {
+    entries.push_back(zap_entry{kv.first, kv.second, zap_hash(salt, kv.first), 0});
+    micro = micro && kv.first.size() < MZAP_NAME_LEN;
+  }
+  // names with the same hash are told apart by the collision differentiator
+  std::map<uint64_t, uint32_t> cds;
+  for (auto &e : entries) {
+    e.cd = cds[e.hash]++;
+  }
+
+  *fat = !micro;
+  if (micro) {
+    *blksz = SPA_MINBLOCKSIZE;
+    while (*blksz < (entries.size() + 1) * MZAP_ENT_LEN) {
+      *blksz *= 2;
+    }
+    std::vector<uint8_t> block(*blksz, 0);
+    auto mzap = (mzap_phys_t*)block.data();
+    mzap->mz_block_type = ZBT_MICRO;
+    mzap->mz_salt = salt;
+    for (size_t i = 0; i < entries.size(); i++) {
+      mzap->mz_chunk[i].mze_value = entries[i].value;
+      mzap->mz_chunk[i].mze_cd = entries[i].cd;
+      memcpy(mzap->mz_chunk[i].mze_name, entries[i].name.c_str(), entries[i].name.size() + 1);
+    }
+    return block;
+  }
+
+  const int bs = FZAP_DEFAULT_BLOCK_SHIFT;
+  *blksz = 1ULL << bs;
+  uint64_t total_chunks = 0;
+  for (auto &e : entries) {
+    total_chunks += zap_entry_chunks(e);
+  }
+  int shift = highbit64(total_chunks / ZAP_LEAF_NUMCHUNKS_BS(bs));
+  std::vector<std::vector<const zap_entry*>> leaves;
+  for (;; shift++) {
+    assert(shift <= ZAP_HASHBITS);
+    leaves.assign(1ULL << shift, {});
+    std::vector<int> used(leaves.size(), 0);
+    bool fits = true;
+    for (auto &e : entries) {
+      uint64_t l = shift == 0 ? 0 : e.hash >> (64 - shift);
+      leaves[l].push_back(&e);
+      used[l] += zap_entry_chunks(e);
+      fits = fits && used[l] <= ZAP_LEAF_NUMCHUNKS_BS(bs);
+    }
+    if (fits) {
+      break;
+    }
+  }
+
+  // up to 2^(bs - 4) pointers fit in the second half of the header block, more need a table of their own
+  int embedded_shift = bs - 3 - 1;
+  uint64_t tbl_blks = shift > embedded_shift ? 1ULL << (shift + 3 - bs) : 0;
+  uint64_t first_leaf = 1 + tbl_blks;
+  std::vector<uint8_t> out((first_leaf + leaves.size()) << bs, 0);
+  auto zap = (zap_phys_t*)out.data();
+  zap->zap_block_type = ZBT_HEADER;
+  zap->zap_magic = ZAP_MAGIC;
+  zap->zap_freeblk = first_leaf + leaves.size();
+  zap->zap_num_leafs = leaves.size();
+  zap->zap_num_entries = entries.size();
+  zap->zap_salt = salt;
+  auto words = (uint64_t*)out.data();
+  if (tbl_blks == 0) {
+    zap->zap_ptrtbl.zt_shift = embedded_shift;
+    for (uint64_t i = 0; i < (1ULL << embedded_shift); i++) {
+      words[(1ULL << embedded_shift) + i] = first_leaf + (i >> (embedded_shift - shift));
+    }
+  } else {
+    zap->zap_ptrtbl.zt_blk = 1;
+    zap->zap_ptrtbl.zt_numblks = tbl_blks;
+    zap->zap_ptrtbl.zt_shift = shift;
+    for (uint64_t i = 0; i < leaves.size(); i++) {
+      words[((uint64_t)1 << (bs - 3)) + i] = first_leaf + i;
+    }
+  }
+  for (uint64_t l = 0; l < leaves.size(); l++) {
+    build_zap_leaf(out.data() + ((first_leaf + l) << bs), leaves[l], l, shift);
+  }
+  return out;
+}
+
+static dnode_phys_t zap_object(pool_writer *w, int type, const std::vector<std::pair<std::string, uint64_t>> &entries,
+                               uint64_t salt, int bonustype = DMU_OT_NONE, const void *bonus = nullptr,
+                               int bonuslen = 0) {
+  uint64_t blksz;
+  bool fat;
+  // the pool directory of a ZFS pool is a fat ZAP, which zfs_label's default output expects
+  auto data = build_zap(entries, salt | 1, type == DMU_OT_OBJECT_DIRECTORY, &blksz, &fat);
+  w->stats->fat_zaps += fat && type == DMU_OT_DIRECTORY_CONTENTS;
+  auto dn = new_dnode(type, blksz, DN_MAX_INDBLKSHIFT, bonustype, bonuslen);
+  if (bonuslen > 0) {
+    memcpy(DN_BONUS(&dn), bonus, bonuslen);
+  }
+  write_object(w, &dn, data.data(), data.size());
+  return dn;
+}
+
+static dnode_phys_t bonus_object(int type, uint64_t blksz, int bonustype, const void *bonus, int bonuslen) {
+  auto dn = new_dnode(type, blksz, DN_MAX_INDBLKSHIFT, bonustype, bonuslen);
+  memcpy(DN_BONUS(&dn), bonus, bonuslen);
+  return dn;
+}
+
+/*
+ * Where everything of the filesystem goes.  Directory d (0 is the root) is
+ * a child of (d - 1) / fanout, file j lives in directory j * (dirs + 1) / files,
+ * so every directory holds a contiguous range of files.
+ */
+struct fs_layout {
+  const image_options &o;
+  std::vector<uint64_t> first_file;   // of each directory, and files at the end
+
+  explicit fs_layout(const image_options &o) : o(o) {
+    for (uint64_t d = 0; d <= o.dirs + 1; d++) {
+      first_file.push_back(((unsigned __int128)d * o.files + o.dirs) / (o.dirs + 1));
+    }
+  }
+
+  uint64_t objects() const {
+    return ZPL_ROOT_OBJ + 1 + o.dirs + o.files;
+  }
+
+  uint64_t dir_obj(uint64_t d) const {
+    return ZPL_ROOT_OBJ + d;
+  }
+
+  uint64_t file_obj(uint64_t j) const {
+    return ZPL_ROOT_OBJ + 1 + o.dirs + j;
+  }
+
+  uint64_t parent_dir(uint64_t d) const {
+    return d == 0 ? 0 : (d - 1) / o.fanout;
+  }
+
+  uint64_t file_dir(uint64_t j) const {
+    return ((unsigned __int128)j * (o.dirs + 1)) / o.files;
+  }
+
+  uint64_t first_subdir(uint64_t d) const {
+    return std::min<unsigned __int128>((unsigned __int128)d * o.fanout + 1, o.dirs + 1);
+  }
+
+  uint64_t end_subdir(uint64_t d) const {
+    return std::min<unsigned __int128>((unsigned __int128)d * o.fanout + o.fanout + 1, o.dirs + 1);
+  }
+
+  uint64_t file_size(uint64_t j) const {
+    uint64_t span = o.max_file_size - o.min_file_size;
+    return o.min_file_size + (span == 0 ? 0 : mix64(o.seed ^ mix64(file_obj(j))) % (span + 1));
+  }
+};
+
+static void fill_znode(uint8_t *bonus, const image_options &o, uint64_t mode, uint64_t size, uint64_t parent,
+                       uint64_t links) {
+  auto zp = (znode_phys_t*)bonus;
+  zp->zp_atime[0] = zp->zp_mtime[0] = zp->zp_ctime[0] = zp->zp_crtime[0] = o.timestamp;
+  zp->zp_gen = o.txg;
+  zp->zp_mode = mode;
+  zp->zp_size = size;
+  zp->zp_parent = parent;
+  zp->zp_links = links;
+}
+
+/*
+ * The full record sized data blocks the files are cut from, prepared once.
+ * File j's block blkid is variant mix(seed, object, blkid) % variants;
+ * shorter and partial blocks are a prefix of their variant, zero padded.
+ */
+struct data_variants {
+  const image_options &o;
+  std::vector<std::vector<uint8_t>> text;
+  std::vector<prepared_block> full;
+
+  explicit data_variants(const image_options &o) : o(o), text(o.variants), full(o.variants) {
+    for (uint64_t v = 0; v < o.variants; v++) {
+      text[v] = synthetic_text(o.recordsize, mix64(o.seed + v), o.zero_percent);
+      prepare_block(text[v].data(), o.recordsize, o.compress, o.checksum, true, o.ashift, &full[v]);
+    }
+  }
+
+  uint64_t pick(uint64_t object, uint64_t blkid) const {
+    return mix64(o.seed ^ mix64(object) ^ mix64(blkid << 20)) % o.variants;
+  }
+};
+
+static void write_file(pool_writer *w, const image_options &o, const data_variants &dv, uint64_t object,
+                       uint64_t size, dnode_phys_t *dn) {
+  // a file of one block has it sized to the file, larger files use the recordsize
+  uint64_t blksz = size <= o.recordsize ? std::max<uint64_t>(P2ROUNDUP(size, ZFS_SEC_SIZE), ZFS_SEC_SIZE) : o.recordsize;
+  *dn = new_dnode(DMU_OT_PLAIN_FILE_CONTENTS, blksz, o.indblkshift, DMU_OT_ZNODE, ZNODE_PHYS_SIZE);
+  uint64_t nblocks = (size + blksz - 1) / blksz;
+  block_tree tree(w, dn, nblocks);
+  std::vector<uint8_t> partial;
+  for (uint64_t blkid = 0; blkid < nblocks && !w->full; blkid++) {
+    uint64_t v = dv.pick(object, blkid);
+    uint64_t len = std::min(blksz, size - blkid * blksz);
+    bool gang = o.gang_percent > 0 && mix64(o.seed ^ mix64(object) ^ blkid) % 100 < (uint64_t)o.gang_percent;
+    prepared_block pb;
+    const prepared_block *p = &dv.full[v];
+    if (len != o.recordsize) {
+      partial.assign(blksz, 0);
+      memcpy(partial.data(), dv.text[v].data(), len);
+      prepare_block(partial.data(), blksz, o.compress, o.checksum, true, o.ashift, &pb);
+      p = &pb;
+    }
+    gang = gang && !p->embedded;
+    tree.add(w->place(*p, o.checksum, DMU_OT_PLAIN_FILE_CONTENTS, 0, 1, gang));
+  }
+  tree.finish();
+}
+
+static bool write_filesystem(pool_writer *w, const image_options &o, blkptr_t *os_bp) {
+  fs_layout layout(o);
+  data_variants dv(o);
+  dnode_stream dns(w, layout.objects(), meta_dnode_levels());
+  uint64_t salt = mix64(o.seed ^ 0x5a4c);
+
+  dns.add(zap_object(w, DMU_OT_MASTER_NODE, {{ZPL_VERSION_STR, ZPL_VERSION_ZNODE},
+                                             {ZFS_ROOT_OBJ, ZPL_ROOT_OBJ},
+                                             {ZFS_UNLINKED_SET, ZPL_UNLINKED_OBJ},
+                                             {"normalization", 0},
+                                             {"utf8only", 0},
+                                             {"casesensitivity", 0}}, salt + MASTER_NODE_OBJ));
+  dns.add(zap_object(w, DMU_OT_UNLINKED_SET, {}, salt + ZPL_UNLINKED_OBJ));
+
+  for (uint64_t d = 0; d <= o.dirs && !w->full; d++) {
+    std::vector<std::pair<std::string, uint64_t>> entries;
+    char name[32];
+    for (uint64_t k = layout.first_subdir(d); k < layout.end_subdir(d); k++) {
+      snprintf(name, sizeof(name), "dir%06" PRIu64, k);
+      entries.emplace_back(name, ((uint64_t)DT_DIR << 60) | layout.dir_obj(k));
+    }
+    uint64_t subdirs = entries.size();
+    for (uint64_t j = layout.first_file[d]; j < layout.first_file[d + 1]; j++) {
+      snprintf(name, sizeof(name), "file%08" PRIu64, j);
+      entries.emplace_back(name, ((uint64_t)DT_REG << 60) | layout.file_obj(j));
+    }
+    uint8_t znode[ZNODE_PHYS_SIZE] = {};
+    fill_znode(znode, o, S_IFDIR | 0755, entries.size(), layout.dir_obj(layout.parent_dir(d)), 2 + subdirs);
+    dns.add(zap_object(w, DMU_OT_DIRECTORY_CONTENTS, entries, salt + layout.dir_obj(d), DMU_OT_ZNODE, znode,
+                       ZNODE_PHYS_SIZE));
+  }
+
+  auto last_report = std::chrono::steady_clock::now();
+  for (uint64_t j = 0; j < o.files && !w->full && !w->io_error; j++) {
+    uint64_t size = layout.file_size(j);
+    dnode_phys_t dn;
+    write_file(w, o, dv, layout.file_obj(j), size, &dn);
+    fill_znode((uint8_t*)DN_BONUS(&dn), o, S_IFREG | 0644, size, layout.dir_obj(layout.file_dir(j)), 1);
+    dns.add(dn);
+    w->stats->data_bytes += size;
+    if (j % 4096 == 4095 && std::chrono::steady_clock::now() - last_report > std::chrono::seconds(10)) {
+      last_report = std::chrono::steady_clock::now();
+      std::cerr << j + 1 << " of " << o.files << " files, " << nicenum(w->next) << " allocated" << std::endl;
+    }
+  }
+  if (w->full || w->io_error) {
+    return false;
+  }
+  assert(dns.next_object == layout.objects());
+  *os_bp = dns.finish(DMU_OST_ZFS);
+  w->stats->objects = layout.objects() - 1;
+  return true;
+}
+
+struct pool_geometry {
+  uint64_t osize;             // of the vdev, in whole labels
+  uint64_t asize;             // between the front and back labels
+  uint64_t ms_shift;
+  uint64_t ms_count;
+  uint64_t pool_guid;
+  uint64_t vdev_guid;
+};
+
+static nvlist_t *vdev_config(const std::string &path, const pool_geometry &g, const image_options &o) {
+  nvlist_t *vd;
+  nvlist_alloc(&vd, NV_UNIQUE_NAME, 0);
+  nvlist_add_string(vd, "type", "file");
+  nvlist_add_uint64(vd, "id", 0);
+  nvlist_add_uint64(vd, "guid", g.vdev_guid);
+  nvlist_add_string(vd, "path", path.c_str());
+  nvlist_add_uint64(vd, "metaslab_array", MOS_METASLAB_ARRAY);
+  nvlist_add_uint64(vd, "metaslab_shift", g.ms_shift);
+  nvlist_add_uint64(vd, "ashift", o.ashift);
+  nvlist_add_uint64(vd, "asize", g.asize);
+  nvlist_add_uint64(vd, "is_log", 0);
+  nvlist_add_uint64(vd, "create_txg", o.txg);
+  return vd;
+}
+
+/*
+ * The config nvlist, as spa_config_generate() puts it in the MOS (the whole
+ * vdev tree) or in a label (the top level vdev the label belongs to).
+ */
+static bool pack_config(const std::string &path, const pool_geometry &g, const image_options &o, bool label,
+                        std::vector<uint8_t> *out) {
+  nvlist_t *config, *vd, *features;
+  nvlist_alloc(&config, NV_UNIQUE_NAME, 0);
+  nvlist_add_uint64(config, "version", SPA_VERSION_FEATURES);
+  nvlist_add_string(config, "name", o.pool_name.c_str());
+  nvlist_add_uint64(config, "state", POOL_STATE_EXPORTED);
+  nvlist_add_uint64(config, "txg", o.txg);
+  nvlist_add_uint64(config, "pool_guid", g.pool_guid);
+  nvlist_add_uint64(config, "errata", 0);
+  nvlist_add_string(config, "hostname", "");
+  nvlist_add_uint64(config, "vdev_children", 1);
+  vd = vdev_config(path, g, o);
+  if (label) {
+    nvlist_add_uint64(config, "top_guid", g.vdev_guid);
+    nvlist_add_uint64(config, "guid", g.vdev_guid);
+    nvlist_add_nvlist(config, "vdev_tree", vd);
+  } else {
+    nvlist_t *root;
+    nvlist_alloc(&root, NV_UNIQUE_NAME, 0);
+    nvlist_add_string(root, "type", "root");
+    nvlist_add_uint64(root, "id", 0);
+    nvlist_add_uint64(root, "guid", g.pool_guid);
+    nvlist_add_uint64(root, "create_txg", o.txg);
+    nvlist_add_nvlist_array(root, "children", &vd, 1);
+    nvlist_add_nvlist(config, "vdev_tree", root);
+    nvlist_free(root);
+  }
+  nvlist_alloc(&features, NV_UNIQUE_NAME, 0);
+  nvlist_add_nvlist(config, "features_for_read", features);
+
+  char *packed = nullptr;
+  size_t packed_size = 0;
+  bool ok = nvlist_pack(config, &packed, &packed_size, NV_ENCODE_XDR, 0) == 0;
+  if (ok) {
+    out->assign(packed, packed + packed_size);
+    free(packed);
+  } else {
+    std::cerr << "failed to pack the pool config" << std::endl;
+  }
+  nvlist_free(features);
+  nvlist_free(vd);
+  nvlist_free(config);
+  return ok;
+}
+
+// the uncompressed size of an object of nblocks blocks and its indirect blocks
+static uint64_t object_tree_size(uint64_t nblocks, int nblkptr, uint64_t blksz, int indblkshift, int min_levels) {
+  int epbs = indblkshift - SPA_BLKPTRSHIFT;
+  int nlevels = std::max(tree_levels(nblocks, nblkptr, epbs), min_levels);
+  uint64_t total = nblocks * blksz;
+  for (uint64_t n = nblocks, l = 1; l < (uint64_t)nlevels; l++) {
+    n = (n + (1ULL << epbs) - 1) >> epbs;
+    total += n << indblkshift;
+  }
+  return total;
+}
+
+/*
+ * Write the MOS.  Its blocks are uncompressed so the size of the space maps
+ * and the meta dnode tree written last is known before the space maps have
+ * to say how much of the vdev is allocated.
+ */
+static bool write_mos(pool_writer *w, const std::string &path, const pool_geometry &g, const image_options &o,
+                      const blkptr_t &ds_bp, const space_usage &ds_usage, blkptr_t *rootbp) {
+  space_usage mos_usage = {0, 0, 0};
+  w->usage = &mos_usage;
+  w->md_compress = ZIO_COMPRESS_OFF;
+  w->md_checksum = ZIO_CHECKSUM_FLETCHER_4;
+  uint64_t nobjects = MOS_SPACE_MAPS + g.ms_count;
+  std::vector<dnode_phys_t> mos(nobjects);
+  memset(mos.data(), 0, mos.size() * sizeof(dnode_phys_t));
+  uint64_t salt = mix64(o.seed ^ 0x4d4f53);
+
+  mos[MOS_DIRECTORY] = zap_object(w, DMU_OT_OBJECT_DIRECTORY, {{DMU_POOL_ROOT_DATASET, MOS_ROOT_DIR},
+                                                               {DMU_POOL_CONFIG, MOS_CONFIG},
+                                                               {DMU_POOL_FEATURES_FOR_READ, MOS_FEATURES_FOR_READ},
+                                                               {DMU_POOL_FEATURES_FOR_WRITE, MOS_FEATURES_FOR_WRITE},
+                                                               {DMU_POOL_FEATURE_DESCRIPTIONS, MOS_FEATURE_DESCRIPTIONS},
+                                                               {DMU_POOL_SYNC_BPOBJ, MOS_SYNC_BPOBJ},
+                                                               {DMU_POOL_FREE_BPOBJ, MOS_FREE_BPOBJ},
+                                                               {DMU_POOL_CREATION_VERSION, SPA_VERSION_FEATURES}},
+                                      salt + MOS_DIRECTORY);
+
+  std::vector<uint8_t> config;
+  if (!pack_config(path, g, o, false, &config)) {
+    return false;
+  }
+  uint64_t nvsize = config.size();
+  mos[MOS_CONFIG] = bonus_object(DMU_OT_PACKED_NVLIST, SPA_CONFIG_BLOCKSIZE, DMU_OT_PACKED_NVLIST_SIZE, &nvsize,
+                                 sizeof(nvsize));
+  write_object(w, &mos[MOS_CONFIG], config.data(), config.size());
+
+  // the feature refcounts of what the image uses
+  mos[MOS_FEATURES_FOR_READ] = zap_object(w, DMU_OT_ZAP_OTHER, {{"org.illumos:lz4_compress", 1},
+                                                                {"com.delphix:embedded_data", w->stats->embedded > 0},
+                                                                {"org.open-zfs:large_blocks", o.recordsize > SPA_OLD_MAXBLOCKSIZE}},
+                                          salt + MOS_FEATURES_FOR_READ);
+  mos[MOS_FEATURES_FOR_WRITE] = zap_object(w, DMU_OT_ZAP_OTHER, {{"com.delphix:spacemap_histogram", g.ms_count},
+                                                                 {"com.delphix:spacemap_v2", 1}},
+                                           salt + MOS_FEATURES_FOR_WRITE);
+  mos[MOS_FEATURE_DESCRIPTIONS] = zap_object(w, DMU_OT_ZAP_OTHER, {}, salt + MOS_FEATURE_DESCRIPTIONS);
+
+  bpobj_phys_t bpo = {};
+  mos[MOS_SYNC_BPOBJ] = bonus_object(DMU_OT_BPOBJ, BPOBJ_BLOCK_SIZE, DMU_OT_BPOBJ_HDR, &bpo, sizeof(bpo));
+  mos[MOS_FREE_BPOBJ] = mos[MOS_SYNC_BPOBJ];
+
+  mos[MOS_ROOT_CHILD_MAP] = zap_object(w, DMU_OT_DSL_DIR_CHILD_MAP, {{"$MOS", MOS_MOS_DIR}, {"$FREE", MOS_FREE_DIR}},
+                                       salt + MOS_ROOT_CHILD_MAP);
+  mos[MOS_ROOT_PROPS] = zap_object(w, DMU_OT_DSL_PROPS, {{"compression", (uint64_t)o.compress},
+                                                         {"checksum", (uint64_t)o.checksum},
+                                                         {"recordsize", o.recordsize}},
+                                   salt + MOS_ROOT_PROPS);
+  for (uint64_t obj : {MOS_MOS_CHILD_MAP, MOS_FREE_CHILD_MAP}) {
+    mos[obj] = zap_object(w, DMU_OT_DSL_DIR_CHILD_MAP, {}, salt + obj);
+  }
+  for (uint64_t obj : {MOS_MOS_PROPS, MOS_FREE_PROPS}) {
+    mos[obj] = zap_object(w, DMU_OT_DSL_PROPS, {}, salt + obj);
+  }
+  mos[MOS_SNAPNAMES] = zap_object(w, DMU_OT_DSL_DS_SNAP_MAP, {}, salt + MOS_SNAPNAMES);
+  uint8_t deadlist[DEADLIST_PHYS_SIZE] = {};
+  mos[MOS_DEADLIST] = zap_object(w, DMU_OT_DEADLIST, {}, salt + MOS_DEADLIST, DMU_OT_DEADLIST_HDR, deadlist,
+                                 sizeof(deadlist));
+
+  std::vector<uint64_t> ms_array(g.ms_count);
+  for (uint64_t m = 0; m < g.ms_count; m++) {
+    ms_array[m] = MOS_SPACE_MAPS + m;
+  }
+  uint64_t array_blksz = std::min<uint64_t>(std::max<uint64_t>(1ULL << highbit64(ms_array.size() * 8 - 1),
+                                                               SPA_MINBLOCKSIZE), SPA_OLD_MAXBLOCKSIZE);
+  mos[MOS_METASLAB_ARRAY] = new_dnode(DMU_OT_OBJECT_ARRAY, array_blksz, DN_MAX_INDBLKSHIFT, DMU_OT_NONE, 0);
+  write_object(w, &mos[MOS_METASLAB_ARRAY], ms_array.data(), ms_array.size() * sizeof(uint64_t));
+  if (w->full) {
+    return false;
+  }
+
+  /*
+   * What's left is one block for each space map of a metaslab with
+   * allocations in it, the dnode blocks with their indirect blocks and the
+   * objset, all uncompressed.  Find how many metaslabs that spills into.
+   */
+  uint64_t tail = object_tree_size((nobjects + DNODES_PER_BLOCK - 1) / DNODES_PER_BLOCK, DN_MAX_NBLKPTR,
+                                   DNODE_BLOCK_SIZE, DN_MAX_INDBLKSHIFT, MOS_META_DNODE_LEVELS) +
+                  w->asize(sizeof(objset_phys_t));
+  uint64_t sm_asize = w->asize(SPACE_MAP_BLOCK_SIZE);
+  uint64_t used_ms = 0, end;
+  for (;;) {
+    end = w->next + used_ms * sm_asize + tail;
+    uint64_t n = (end + (1ULL << g.ms_shift) - 1) >> g.ms_shift;
+    if (n <= used_ms) {
+      break;
+    }
+    used_ms = n;
+  }
+  if (end > w->capacity) {
+    w->full = true;
+    return false;
+  }
+
+  // the DSL dirs and the dataset, with the space of the MOS as it will be
+  uint64_t mos_asize = mos_usage.asize + used_ms * sm_asize + tail;
+  uint64_t mos_psize = mos_usage.psize + used_ms * SPACE_MAP_BLOCK_SIZE + tail;
+  uint64_t mos_lsize = mos_usage.lsize + used_ms * SPACE_MAP_BLOCK_SIZE + tail;
+  dsl_dir_phys_t dd;
+  memset(&dd, 0, sizeof(dd));
+  dd.dd_creation_time = o.timestamp;
+  dd.dd_head_dataset_obj = MOS_DATASET;
+  dd.dd_child_dir_zapobj = MOS_ROOT_CHILD_MAP;
+  dd.dd_props_zapobj = MOS_ROOT_PROPS;
+  dd.dd_used_bytes = ds_usage.asize + mos_asize;
+  dd.dd_compressed_bytes = ds_usage.psize + mos_psize;
+  dd.dd_uncompressed_bytes = ds_usage.lsize + mos_lsize;
+  dd.dd_used_breakdown[DD_USED_HEAD] = ds_usage.asize;
+  dd.dd_used_breakdown[DD_USED_CHILD] = mos_asize;
+  mos[MOS_ROOT_DIR] = bonus_object(DMU_OT_DSL_DIR, SPA_MINBLOCKSIZE, DMU_OT_DSL_DIR, &dd, sizeof(dd));
+
+  memset(&dd, 0, sizeof(dd));
+  dd.dd_creation_time = o.timestamp;
+  dd.dd_parent_obj = MOS_ROOT_DIR;
+  dd.dd_child_dir_zapobj = MOS_MOS_CHILD_MAP;
+  dd.dd_props_zapobj = MOS_MOS_PROPS;
+  dd.dd_used_bytes = mos_asize;
+  dd.dd_compressed_bytes = mos_psize;
+  dd.dd_uncompressed_bytes = mos_lsize;
+  dd.dd_used_breakdown[DD_USED_HEAD] = mos_asize;
+  mos[MOS_MOS_DIR] = bonus_object(DMU_OT_DSL_DIR, SPA_MINBLOCKSIZE, DMU_OT_DSL_DIR, &dd, sizeof(dd));
+  dd.dd_child_dir_zapobj = MOS_FREE_CHILD_MAP;
+  dd.dd_props_zapobj = MOS_FREE_PROPS;
+  dd.dd_used_bytes = dd.dd_compressed_bytes = dd.dd_uncompressed_bytes = dd.dd_used_breakdown[DD_USED_HEAD] = 0;
+  mos[MOS_FREE_DIR] = bonus_object(DMU_OT_DSL_DIR, SPA_MINBLOCKSIZE, DMU_OT_DSL_DIR, &dd, sizeof(dd));
+
+  dsl_dataset_phys_t ds;
+  memset(&ds, 0, sizeof(ds));
+  ds.ds_dir_obj = MOS_ROOT_DIR;
+  ds.ds_snapnames_zapobj = MOS_SNAPNAMES;
+  ds.ds_creation_time = o.timestamp;
+  ds.ds_creation_txg = o.txg;
+  ds.ds_deadlist_obj = MOS_DEADLIST;
+  ds.ds_referenced_bytes = ds.ds_unique_bytes = ds_usage.asize;
+  ds.ds_compressed_bytes = ds_usage.psize;
+  ds.ds_uncompressed_bytes = ds_usage.lsize;
+  ds.ds_fsid_guid = mix64(o.seed ^ 0xf5) >> 8;
+  ds.ds_guid = mix64(o.seed ^ 0xd5);
+  ds.ds_flags = DS_FLAG_UNIQUE_ACCURATE;
+  ds.ds_bp = ds_bp;
+  mos[MOS_DATASET] = bonus_object(DMU_OT_DSL_DATASET, SPA_MINBLOCKSIZE, DMU_OT_DSL_DATASET, &ds, sizeof(ds));
+
+  // a space map per metaslab, one two word entry allocating everything up to end
+  std::vector<uint64_t> sm_off(used_ms);
+  for (auto &off : sm_off) {
+    off = w->alloc(SPACE_MAP_BLOCK_SIZE);
+  }
+  for (uint64_t m = 0; m < g.ms_count; m++) {
+    uint64_t start = m << g.ms_shift, ms_size = 1ULL << g.ms_shift;
+    space_map_phys_t smp;
+    memset(&smp, 0, sizeof(smp));
+    smp.smp_object = MOS_SPACE_MAPS + m;
+    auto &dn = mos[MOS_SPACE_MAPS + m];
+    dn = new_dnode(DMU_OT_SPACE_MAP, SPACE_MAP_BLOCK_SIZE, DN_MAX_INDBLKSHIFT, DMU_OT_SPACE_MAP_HEADER, sizeof(smp));
+    uint64_t alloc = start < end ? std::min(end - start, ms_size) : 0;
+    if (alloc == 0) {
+      smp.smp_histogram[std::min(g.ms_shift - o.ashift, (uint64_t)SPACE_MAP_HISTOGRAM_SIZE - 1)]++;
+      memcpy(DN_BONUS(&dn), &smp, sizeof(smp));
+      continue;
+    }
+    std::vector<uint64_t> block(SPACE_MAP_BLOCK_SIZE / sizeof(uint64_t), 0);
+    block[0] = (3ULL << 62) | (((alloc >> o.ashift) - 1) << SM_VDEV_BITS);
+    block[1] = ((uint64_t)SM_ALLOC << SM2_OFFSET_BITS) | 0;
+    smp.smp_length = 2 * sizeof(uint64_t);
+    smp.smp_alloc = alloc;
+    if (alloc < ms_size) {
+      int bucket = highbit64(ms_size - alloc) - 1 - o.ashift;
+      smp.smp_histogram[std::min(bucket, SPACE_MAP_HISTOGRAM_SIZE - 1)]++;
+    }
+    memcpy(DN_BONUS(&dn), &smp, sizeof(smp));
+    zio_cksum_t zc;
+    compute_checksum(w->md_checksum, block.data(), SPACE_MAP_BLOCK_SIZE, &zc);
+    w->put(sm_off[m], block.data(), SPACE_MAP_BLOCK_SIZE);
+    auto bp = w->plain_bp(sm_off[m], SPACE_MAP_BLOCK_SIZE, SPACE_MAP_BLOCK_SIZE, ZIO_COMPRESS_OFF, w->md_checksum, zc,
+                          DMU_OT_SPACE_MAP, 0, 1);
+    w->charge(sm_asize, SPACE_MAP_BLOCK_SIZE, SPACE_MAP_BLOCK_SIZE);
+    dn.dn_blkptr[0] = bp;
+    dn.dn_used = sm_asize;
+  }
+
+  dnode_stream dns(w, nobjects, MOS_META_DNODE_LEVELS);
+  for (uint64_t obj = 1; obj < nobjects; obj++) {
+    dns.add(mos[obj]);
+  }
+  *rootbp = dns.finish(DMU_OST_META);
+  assert(w->full || w->next == end);
+  w->usage = nullptr;
+  return !w->full;
+}
+
+static uint64_t label_offset(uint64_t osize, int l) {
+  return l * VDEV_LABEL_SIZE + (l < VDEV_LABELS / 2 ? 0 : osize - VDEV_LABELS * VDEV_LABEL_SIZE);
+}
+
+// the same config and uberblock in all four labels, each with its own embedded checksums
+static bool write_labels(int fd, const std::string &path, const pool_geometry &g, const image_options &o,
+                         const blkptr_t &rootbp) {
+  std::vector<uint8_t> config;
+  if (!pack_config(path, g, o, true, &config)) {
+    return false;
+  }
+  if (config.size() > VDEV_PHYS_SIZE - sizeof(zio_eck_t)) {
+    std::cerr << "the pool config doesn't fit in a label" << std::endl;
+    return false;
+  }
+  uint64_t ub_shift = std::min<uint64_t>(std::max(o.ashift, UBERBLOCK_SHIFT), MAX_UBERBLOCK_SHIFT);
+  uint64_t ub_size = 1ULL << ub_shift;
+  uint64_t ub_slot = o.txg % (VDEV_UBERBLOCK_RING >> ub_shift);
+
+  for (int l = 0; l < VDEV_LABELS; l++) {
+    std::vector<uint8_t> label(VDEV_LABEL_SIZE, 0);
+    uint64_t base = label_offset(g.osize, l);
+    auto phys = label.data() + VDEV_PHYS_OFFSET;
+    memcpy(phys, config.data(), config.size());
+    embedded_checksum(phys, VDEV_PHYS_SIZE, zio_cksum_t{{base + VDEV_PHYS_OFFSET, 0, 0, 0}});
+
+    uint64_t ub_off = VDEV_UBERBLOCK_OFFSET + ub_slot * ub_size;
+    auto ub = (uberblock*)(label.data() + ub_off);
+    ub->ub_magic = UBERBLOCK_MAGIC;
+    ub->ub_version = SPA_VERSION_FEATURES;
+    ub->ub_txg = o.txg;
+    ub->ub_guid_sum = g.pool_guid + g.vdev_guid;
+    ub->ub_timestamp = o.timestamp;
+    ub->ub_rootbp = rootbp;
+    ub->ub_software_version = SPA_VERSION_FEATURES;
+    ub->ub_mmp_magic = MMP_MAGIC;
+    embedded_checksum(ub, ub_size, zio_cksum_t{{base + ub_off, 0, 0, 0}});
+
+    if (pwrite(fd, label.data(), label.size(), base) != (ssize_t)label.size()) {
+      std::cerr << "failed to write label " << l << ", err: " << strerror(errno) << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool check_options(const image_options &o) {
+  auto fail = [](const std::string &msg) {
+    std::cerr << msg << std::endl;
+    return false;
+  };
+  if (o.size < SPA_MINDEVSIZE) {
+    return fail("the image must be at least " + nicenum(SPA_MINDEVSIZE));
+  }
+  if (o.pool_name.empty() || o.pool_name.find_first_of("/@$ ") != std::string::npos) {
+    return fail("invalid pool name " + o.pool_name);
+  }
+  if (o.ashift < SPA_MINBLOCKSHIFT || o.ashift > 12) {
+    return fail("ashift must be 9 to 12");
+  }
+  if (o.recordsize < SPA_MINBLOCKSIZE || o.recordsize > SPA_MAXBLOCKSIZE || (o.recordsize & (o.recordsize - 1)) != 0) {
+    return fail("recordsize must be a power of two from 512 to " + nicenum(SPA_MAXBLOCKSIZE));
+  }
+  if (o.indblkshift < DN_MIN_INDBLKSHIFT || o.indblkshift > DN_MAX_INDBLKSHIFT) {
+    return fail("indirect block shift must be " + std::to_string(DN_MIN_INDBLKSHIFT) + " to " +
+                std::to_string(DN_MAX_INDBLKSHIFT));
+  }
+  if (o.compress != ZIO_COMPRESS_OFF && o.compress != ZIO_COMPRESS_LZ4 && o.compress != ZIO_COMPRESS_ZLE &&
+      !(o.compress >= ZIO_COMPRESS_GZIP_1 && o.compress <= ZIO_COMPRESS_GZIP_9)) {
+    return fail("compression must be off, lz4, zle or gzip-1 to gzip-9, which the reader can decompress");
+  }
+  if (o.checksum != ZIO_CHECKSUM_OFF && o.checksum != ZIO_CHECKSUM_FLETCHER_2 &&
+      o.checksum != ZIO_CHECKSUM_FLETCHER_4 && o.checksum != ZIO_CHECKSUM_SHA256) {
+    return fail("checksum must be off, fletcher2, fletcher4 or sha256");
+  }
+  if (o.min_file_size > o.max_file_size) {
+    return fail("the minimum file size is larger than the maximum");
+  }
+  if (o.fanout == 0 || o.variants == 0 || o.gang_percent < 0 || o.gang_percent > 100 || o.zero_percent < 0 ||
+      o.zero_percent > 100 || o.txg == 0) {
+    return fail("fanout, variants and txg must be positive, percentages 0 to 100");
+  }
+  return true;
+}
+
+bool write_image(const std::string &path, const image_options &opts, image_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!check_options(opts)) {
+    return false;
+  }
+
+  pool_geometry g;
+  g.osize = opts.size / VDEV_LABEL_SIZE * VDEV_LABEL_SIZE;
+  g.asize = g.osize - VDEV_LABEL_START_SIZE - VDEV_LABEL_END_SIZE;
+  uint64_t ms_count = g.asize >> VDEV_DEFAULT_MS_SHIFT;
+  if (ms_count < VDEV_MIN_MS_COUNT) {
+    g.ms_shift = highbit64(g.asize / VDEV_MIN_MS_COUNT);
+  } else if (ms_count > VDEV_DEFAULT_MS_COUNT) {
+    g.ms_shift = highbit64(g.asize / VDEV_DEFAULT_MS_COUNT);
+  } else {
+    g.ms_shift = VDEV_DEFAULT_MS_SHIFT;
+  }
+  g.ms_shift = std::min<uint64_t>(std::max<uint64_t>(g.ms_shift, SPA_MAXBLOCKSHIFT), VDEV_MAX_MS_SHIFT);
+  g.ms_count = g.asize >> g.ms_shift;
+  g.pool_guid = mix64(opts.seed ^ 0x9001);
+  g.vdev_guid = mix64(opts.seed ^ 0x9002);
+  stats->capacity = g.ms_count << g.ms_shift;
+  stats->metaslabs = g.ms_count;
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "failed to open " << path << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  // a sparse file, only what is written takes space
+  if (ftruncate(fd, opts.size) != 0) {
+    std::cerr << "failed to size " << path << ", err: " << strerror(errno) << std::endl;
+    close(fd);
+    return false;
+  }
+
+  pool_writer w(fd, opts.ashift, opts.txg, stats->capacity, stats);
+  space_usage ds_usage = {0, 0, 0};
+  w.usage = &ds_usage;
+  w.md_compress = ZIO_COMPRESS_LZ4;
+  w.md_checksum = opts.checksum == ZIO_CHECKSUM_OFF ? ZIO_CHECKSUM_FLETCHER_4 : opts.checksum;
+  blkptr_t ds_bp, rootbp;
+  bool ok = write_filesystem(&w, opts, &ds_bp) && write_mos(&w, path, g, opts, ds_bp, ds_usage, &rootbp);
+  w.flush();
+  if (w.full) {
+    std::cerr << "the pool doesn't fit in " << nicenum(opts.size) << ", " << nicenum(stats->capacity)
+              << " allocatable" << std::endl;
+  }
+  ok = ok && !w.io_error && write_labels(fd, path, g, opts, rootbp);
+  stats->allocated = w.next;
+  if (close(fd) != 0 && ok) {
+    std::cerr << "failed to close " << path << ", err: " << strerror(errno) << std::endl;
+    ok = false;
+  }
+  if (!ok) {
+    unlink(path.c_str());
+  }
+  return ok;
+}
+
+void print_image_stats(const image_options &opts, const image_stats &stats) {
+  printf("pool %s: %" PRIu64 " metaslabs, %s of %s allocated\n", opts.pool_name.c_str(), stats.metaslabs,
+         nicenum(stats.allocated).c_str(), nicenum(stats.capacity).c_str());
+  printf("%" PRIu64 " objects, %" PRIu64 " files with %s of data, %" PRIu64 " directories (%" PRIu64 " fat ZAPs)\n",
+         stats.objects, opts.files, nicenum(stats.data_bytes).c_str(), opts.dirs + 1, stats.fat_zaps);
+  printf("%" PRIu64 " block pointers, %" PRIu64 " embedded, %" PRIu64 " gang\n", stats.blocks, stats.embedded,
+         stats.gang);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "zfs_reader.h"
+
+/*
+ * Synthetic pool images, so traversal and extraction can be benchmarked on
+ * machines without ZFS.  The image is a single file vdev holding a pool
+ * whose root dataset is a filesystem with a tree of directories and files:
+ *
+ *   - four labels with the config nvlist and one uberblock in each ring
+ *   - a MOS with the object directory, config, feature ZAPs, the DSL dirs of
+ *     the pool, $MOS and $FREE, the dataset, and a space map per metaslab
+ *     describing exactly the allocated space
+ *   - a ZPL (version 4, znode bonus buffers) objset with dirs directories of
+ *     fanout subdirectories each and files files spread evenly over them
+ *
+ * Everything, guids and timestamps included, derives from the options, so
+ * the same options give a byte identical image.  Blocks are allocated back
+ * to back from the start of the vdev.  File contents are made of variants
+ * distinct text blocks, so writing even a large image costs little more than
+ * the I/O; file metadata and indirect blocks are compressed with lz4 like
+ * ZFS does, the MOS is written uncompressed.
+ */
+struct image_options {
+  std::string pool_name = "bench";
+  uint64_t size = 10ULL << 30;          // of the image file
+  uint64_t files = 100000;
+  uint64_t dirs = 1000;                 // besides the root directory
+  uint64_t fanout = 32;                 // subdirectories per directory
+  uint64_t min_file_size = 0;
+  uint64_t max_file_size = 128 << 10;   // sizes are uniform in [min, max]
+  uint64_t recordsize = 128 << 10;
+  int indblkshift = 17;
+  int compress = ZIO_COMPRESS_LZ4;      // of file data: off, lz4, gzip-N or zle
+  int checksum = ZIO_CHECKSUM_FLETCHER_4;  // off, fletcher2, fletcher4 or sha256
+  int ashift = 12;
+  int gang_percent = 0;                 // of the file data blocks written as gang blocks
+  int zero_percent = 5;                 // runs of zeros in file data, for compressibility
+  uint64_t variants = 64;               // distinct full record sized data blocks
+  uint64_t seed = 1;
+  uint64_t txg = 16;                    // birth of every block
+  uint64_t timestamp = 1600000000;      // creation and modification times
+};
+
+struct image_stats {
+  uint64_t objects;           // of the filesystem, directories included
+  uint64_t data_bytes;        // logical size of all files
+  uint64_t blocks;            // block pointers written, gang members and embedded ones included
+  uint64_t embedded;
+  uint64_t gang;
+  uint64_t fat_zaps;          // directories too large for a micro ZAP
+  uint64_t allocated;         // of the vdev, labels excluded
+  uint64_t capacity;          // allocatable bytes of the vdev
+  uint64_t metaslabs;
+};
+
+/*
+ * Write the pool to path, replacing the file.  Returns false, leaving no
+ * image behind, if the options are out of range, the pool doesn't fit in
+ * opts.size, or on I/O errors.
+ */
+bool write_image(const std::string &path, const image_options &opts, image_stats *stats);
+
+void print_image_stats(const image_options &opts, const image_stats &stats);
+
+// deterministic data that compresses like file contents: words, numbers and runs of zeros
+std::vector<uint8_t> synthetic_text(size_t size, uint64_t seed, int zero_percent);
+
+// the inverse of zle_decompress() with n = 64: n < 64 is n + 1 literal bytes, n >= 64 is n - 63 zeros
+std::vector<uint8_t> zle_compress(const uint8_t *src, size_t size);
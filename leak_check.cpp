@@ -0,0 +1,214 @@
+#include <cassert>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include "leak_check.h"
+#include "alloc_bitmap.h"
+#include "metaslab.h"
+#include "parallel.h"
+
+namespace {
+
+struct leak_check_ctx {
+  const void *dev_base_ptr;
+  std::vector<std::unique_ptr<alloc_bitmap>> bitmaps;   // by vdev id, null for holes
+  std::atomic<uint64_t> referenced;
+  std::atomic<uint64_t> double_alloc;
+  std::atomic<uint64_t> referenced_free;
+  std::atomic<uint64_t> leaked;
+  std::atomic<uint64_t> bad_dvas;
+  std::atomic<uint64_t> bad_space_maps;
+  std::mutex report_lock;
+  leak_check_result *res;
+
+  leak_check_ctx() : referenced(0), double_alloc(0), referenced_free(0), leaked(0), bad_dvas(0),
+                     bad_space_maps(0) {}
+
+  void report(std::vector<leak_check_range> *ranges, uint64_t vdev, uint64_t offset, uint64_t size) {
+    std::lock_guard<std::mutex> guard(report_lock);
+    if (ranges->size() < LEAK_CHECK_MAX_REPORT) {
+      ranges->push_back(leak_check_range{vdev, offset, size});
+    }
+  }
+};
+
+}
+
+// false if the DVA is outside of every vdev
+static bool mark_dva(leak_check_ctx *ctx, const dva_t *dva, bool dedup) {
+  uint64_t vdev = DVA_GET_VDEV(dva);
+  uint64_t offset = DVA_GET_OFFSET(dva);
+  uint64_t asize = DVA_GET_ASIZE(dva);
+  if (vdev >= ctx->bitmaps.size() || !ctx->bitmaps[vdev] || offset + asize > ctx->bitmaps[vdev]->size()) {
+    ctx->bad_dvas++;
+    return false;
+  }
+  auto &bm = *ctx->bitmaps[vdev];
+
+  // a gang DVA's asize covers the whole gang tree, the header itself is allocated as one sector of the vdev
+  uint64_t size = DVA_GET_GANG(dva) ? P2ROUNDUP(SPA_GANGBLOCKSIZE, 1ULL << bm.ashift()) : asize;
+  uint64_t already = bm.set(offset, size);
+  ctx->referenced += size;
+  // dedup'd blocks are legitimately referenced many times
+  if (already != 0 && !dedup) {
+    ctx->double_alloc += size;
+    ctx->report(&ctx->res->double_alloc_ranges, vdev, offset, size);
+  }
+  return true;
+}
+
+static void mark_bp(leak_check_ctx *ctx, const blkptr_t *bp) {
+  if (BP_IS_HOLE(bp) || BP_IS_EMBEDDED(bp)) {
+    return;
+  }
+  // every copy of a gang header holds the same members, which are marked once from the first one readable
+  const zio_gbh_phys_t *gbh = nullptr;
+  for (auto &dva : bp->blk_dva) {
+    if (DVA_IS_VALID(&dva) && mark_dva(ctx, &dva, BP_GET_DEDUP(bp)) && DVA_GET_GANG(&dva) &&
+        DVA_GET_VDEV(&dva) == 0 && gbh == nullptr) {
+      // gang headers are never compressed, the members are read straight out of the mapping
+      auto copy = (const zio_gbh_phys_t*)((const uint8_t*)ctx->dev_base_ptr + DVA_GET_OFFSET(&dva));
+      if (copy->zg_tail.zec_magic == ZEC_MAGIC) {
+        gbh = copy;
+      }
+    }
+  }
+  if (gbh != nullptr) {
+    for (auto &member : gbh->zg_blkptr) {
+      if (!BP_IS_HOLE(&member)) {
+        mark_bp(ctx, &member);
+      }
+    }
+  }
+}
+
+// compare one metaslab's space map with what the traversal marked
+static void check_metaslab(leak_check_ctx *ctx, const objset_phys_t *mos, const top_vdev_info &vd,
+                           uint64_t ms_id, uint64_t sm_obj, const std::vector<unflushed_entry> *unflushed) {
+  uint64_t start = ms_id << vd.ms_shift, end = start + (1ULL << vd.ms_shift);
+  range_tree free_tree(start, vd.ashift);
+  uint64_t entries;
+  space_map_phys_t smp;
+  if (!metaslab_load_free(mos, vd, ms_id, sm_obj, ctx->dev_base_ptr, &free_tree, &entries, &smp, unflushed)) {
+    ctx->bad_space_maps++;
+    return;
+  }
+
+  auto &bm = *ctx->bitmaps[vd.id];
+  auto referenced_free = [&](uint64_t offset, uint64_t size) {
+    ctx->referenced_free += size;
+    ctx->report(&ctx->res->referenced_free_ranges, vd.id, offset, size);
+  };
+  auto leaked = [&](uint64_t offset, uint64_t size) {
+    ctx->leaked += size;
+    ctx->report(&ctx->res->leaked_ranges, vd.id, offset, size);
+  };
+
+  // free segments must have no referenced sectors, the gaps between them no unreferenced ones
+  uint64_t alloc_start = start;
+  free_tree.walk([&](uint64_t offset, uint64_t size) {
+    if (offset > alloc_start) {
+      bm.walk(alloc_start, offset - alloc_start, false, leaked);
+    }
+    bm.walk(offset, size, true, referenced_free);
+    alloc_start = offset + size;
+  });
+  if (end > alloc_start) {
+    bm.walk(alloc_start, end - alloc_start, false, leaked);
+  }
+}
+
+bool leak_check(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr, unsigned nthreads,
+                leak_check_result *res) {
+  *res = leak_check_result();
+  std::vector<top_vdev_info> vdevs;
+  if (!load_vdev_tree(mos, dev_base_ptr, &vdevs)) {
+    return false;
+  }
+  // without the unflushed changes every metaslab touched since its last flush would look wrong
+  unflushed_log log;
+  res->bad_log = !load_unflushed_log(mos, vdevs, dev_base_ptr, &log);
+  if (res->bad_log) {
+    return false;
+  }
+  res->log_space_maps = log.log_space_maps;
+  res->unflushed_entries = log.entries;
+
+  leak_check_ctx ctx;
+  ctx.dev_base_ptr = dev_base_ptr;
+  ctx.res = res;
+  for (auto &vd : vdevs) {
+    if (vd.id >= ctx.bitmaps.size()) {
+      ctx.bitmaps.resize(vd.id + 1);
+    }
+    ctx.bitmaps[vd.id].reset(new alloc_bitmap(vd.ms_count << vd.ms_shift, vd.ashift));
+    res->file_backed |= ctx.bitmaps[vd.id]->file_backed();
+  }
+
+  traverse_pool(mos, mos_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &, const blkptr_t *bp) {
+    mark_bp(&ctx, bp);
+  }, &res->traverse);
+
+  struct ms_ref {
+    const top_vdev_info *vd;
+    uint64_t id;
+    uint64_t sm_obj;
+    const std::vector<unflushed_entry> *unflushed;
+  };
+  std::vector<ms_ref> metaslabs;
+  for (auto &vd : vdevs) {
+    auto sm_objs = load_metaslab_array(mos, vd, dev_base_ptr);
+    for (uint64_t m = 0; m < vd.ms_count; m++) {
+      auto u = log.metaslabs.find(std::make_pair(vd.id, m));
+      metaslabs.push_back(ms_ref{&vd, m, sm_objs[m], u == log.metaslabs.end() ? nullptr : &u->second});
+    }
+  }
+  parallel_for(metaslabs.size(), nthreads, [&](uint64_t i) {
+    check_metaslab(&ctx, mos, *metaslabs[i].vd, metaslabs[i].id, metaslabs[i].sm_obj, metaslabs[i].unflushed);
+  });
+
+  res->referenced = ctx.referenced;
+  res->double_alloc = ctx.double_alloc;
+  res->referenced_free = ctx.referenced_free;
+  res->leaked = ctx.leaked;
+  res->bad_dvas = ctx.bad_dvas;
+  res->bad_space_maps = ctx.bad_space_maps;
+  return res->double_alloc == 0 && res->referenced_free == 0 && res->leaked == 0 && res->bad_dvas == 0 &&
+      res->bad_space_maps == 0;
+}
+
+static void print_ranges(const char *what, uint64_t bytes, const std::vector<leak_check_range> &ranges) {
+  std::cout << what << ": " << std::dec << bytes << " bytes" << std::endl;
+  for (auto &r : ranges) {
+    std::cout << "  vdev " << std::dec << r.vdev << " offset 0x" << std::hex << r.offset << " size 0x"
+              << r.size << std::endl;
+  }
+  std::cout << std::dec;
+}
+
+void print_leak_check(const leak_check_result &res) {
+  std::cout << "traversed " << std::dec << res.traverse.blocks << " blocks in " << res.traverse.objsets
+            << " objsets, " << res.referenced << " bytes referenced" << std::endl;
+  if (res.bad_log) {
+    std::cout << "the log space maps could not be read, space maps were not compared" << std::endl;
+    return;
+  }
+  if (res.log_space_maps != 0) {
+    std::cout << res.unflushed_entries << " unflushed entries of " << res.log_space_maps
+              << " log space maps replayed" << std::endl;
+  }
+  if (res.file_backed) {
+    std::cout << "allocation bitmaps were file backed" << std::endl;
+  }
+  print_ranges("double allocated", res.double_alloc, res.double_alloc_ranges);
+  print_ranges("referenced but free", res.referenced_free, res.referenced_free_ranges);
+  print_ranges("allocated but unreferenced", res.leaked, res.leaked_ranges);
+  if (res.bad_dvas != 0) {
+    std::cout << res.bad_dvas << " DVAs outside of any vdev" << std::endl;
+  }
+  if (res.bad_space_maps != 0) {
+    std::cout << res.bad_space_maps << " metaslabs with malformed space maps not checked" << std::endl;
+  }
+}
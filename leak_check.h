@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "zfs_reader.h"
+#include "traverse.h"
+
+// only the first few problem ranges of each kind are kept for the report
+#define LEAK_CHECK_MAX_REPORT 20
+
+struct leak_check_range {
+  uint64_t vdev;
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct leak_check_result {
+  traverse_stats traverse;
+  uint64_t referenced;            // bytes, every DVA counted once
+  uint64_t double_alloc;          // bytes referenced by more than one non-dedup block
+  uint64_t referenced_free;       // bytes referenced but free in the space maps
+  uint64_t leaked;                // bytes allocated in the space maps but not referenced
+  uint64_t bad_dvas;              // DVAs on an unknown vdev or past its end
+  uint64_t bad_space_maps;        // metaslabs skipped because their space map is malformed
+  uint64_t log_space_maps;        // of the log spacemap feature, replayed over the metaslabs
+  uint64_t unflushed_entries;
+  bool bad_log;                   // the log space maps could not be read, so the comparison is off
+  bool file_backed;               // some bitmap did not fit in memory
+  std::vector<leak_check_range> double_alloc_ranges;
+  std::vector<leak_check_range> referenced_free_ranges;
+  std::vector<leak_check_range> leaked_ranges;
+};
+
+/*
+ * Like zdb -b: mark every DVA reachable from the pool in a per vdev
+ * alloc_bitmap, then replay each metaslab's space map and its unflushed
+ * log space map entries and compare.  Both phases run on nthreads threads.
+ * Returns false if any problem was found.
+ */
+bool leak_check(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr, unsigned nthreads,
+                leak_check_result *res);
+
+void print_leak_check(const leak_check_result &res);
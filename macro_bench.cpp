@@ -0,0 +1,593 @@
+/*
+ * End to end benchmarks of the tools' workloads over a corpus of pool
+ * images, for the regressions decode_bench can't see: page faults, read
+ * patterns, thread scaling and a cold page cache.
+ *
+ *   macro_bench [-s <scenarios>] [-b <backends>] [-t <threads>] [-c cold,warm] [-r <runs>]
+ *               [-d <dataset>] [-o <results file>] <image or directory of images>...
+ *   macro_bench compare <baseline results> <results> [<threshold %>]
+ *
+ * Every combination of image, backend, scenario, thread count and cache
+ * state is run -r times.  A run opens the pool from nothing: the backend
+ * brings in the device, the label, uberblocks and MOS are read, then the
+ * scenario does its work.  Cold runs first drop the image from the page
+ * cache with posix_fadvise(POSIX_FADV_DONTNEED), warm runs follow an
+ * untimed one.  Every run is a line of the tab separated results file;
+ * compare matches two of them by image, scenario, backend, threads and
+ * cache and reports the change in median time, exiting 1 if anything got
+ * slower by more than the threshold (10% unless given) and by more than
+ * timer noise.
+ */
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <libnvpair.h>
+#include "zfs_reader.h"
+#include "traverse.h"
+#include "scrub.h"
+#include "zpl.h"
+#include "zil_replay.h"
+#include "tar_export.h"
+#include "parallel.h"
+#include "vdev_map.h"
+
+// chunk size of the read backend
+#define BENCH_READ_CHUNK (16 << 20)
+// a slowdown smaller than this is timer noise, never a regression
+#define BENCH_NOISE_SECONDS 0.005
+
+/*
+ * How the device gets into memory for the reader, which only knows a
+ * pointer to it: mapped under one of the vdev_map policies, or read.  The
+ * scrub scenario reads file data through the fd in any case, like the tool.
+ */
+struct bench_backend {
+  const char *name;
+  bool loads;                 // copies the image's data into memory, so it must fit
+  vdev_map_policy policy;     // of the mapping, unless it loads
+};
+
+// pread() of every data extent into anonymous memory up front, holes stay zero
+static const char *map_read(int fd, uint64_t size) {
+  void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (m == MAP_FAILED) {
+    return nullptr;
+  }
+  auto buf = (char*)m;
+  off_t off = 0;
+  while ((uint64_t)off < size) {
+    off_t data = lseek(fd, off, SEEK_DATA);
+    if (data < 0) {
+      break;
+    }
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole < 0) {
+      hole = size;
+    }
+    for (off = data; off < hole;) {
+      ssize_t n = pread(fd, buf + off, std::min<off_t>(hole - off, BENCH_READ_CHUNK), off);
+      if (n <= 0) {
+        std::cerr << "failed to read the image, err: " << strerror(n < 0 ? errno : EIO) << std::endl;
+        munmap(m, size);
+        return nullptr;
+      }
+      off += n;
+    }
+  }
+  return buf;
+}
+
+// mmap is the mapping main() had before it had policies
+static const bench_backend backends[] = {
+  {"mmap", false, VDEV_MAP_PLAIN},
+  {"auto", false, VDEV_MAP_AUTO},
+  {"phased", false, VDEV_MAP_PHASED},
+  {"random", false, VDEV_MAP_RANDOM},
+  {"populate", false, VDEV_MAP_POPULATE},
+  {"window", false, VDEV_MAP_WINDOW},
+  {"read", true, VDEV_MAP_PLAIN},
+};
+
+struct bench_pool {
+  int fd;
+  uint64_t size;
+  const bench_backend *backend;
+  vdev_map map;
+  const char *vdev;
+  pool_info info;
+};
+
+static void bench_close(bench_pool *pool) {
+  pool_close(&pool->info);
+  if (pool->vdev != nullptr) {
+    vdev_map_close(&pool->map);
+    pool->vdev = nullptr;
+  }
+  if (pool->fd >= 0) {
+    close(pool->fd);
+    pool->fd = -1;
+  }
+}
+
+// bring in the device with the backend, then open the pool on it like main() does
+static bool bench_open(const std::string &path, const bench_backend &backend, bench_pool *pool) {
+  pool->backend = &backend;
+  pool->vdev = nullptr;
+  pool->info.config = nullptr;
+  pool->fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (pool->fd < 0 || fstat(pool->fd, &st) != 0) {
+    std::cerr << "failed to open " << path << ", err: " << strerror(errno) << std::endl;
+    bench_close(pool);
+    return false;
+  }
+  pool->size = st.st_size;
+  if (backend.loads) {
+    // unmapped like a mapping, and PLAIN as there is no file behind it to advise about
+    pool->map = vdev_map{map_read(pool->fd, pool->size), pool->size, pool->fd, VDEV_MAP_PLAIN};
+  } else {
+    vdev_map_open(pool->fd, pool->size, backend.policy, &pool->map);
+  }
+  pool->vdev = pool->map.ptr;
+  if (pool->vdev == nullptr) {
+    std::cerr << "failed to bring in " << path << " with " << backend.name << std::endl;
+    bench_close(pool);
+    return false;
+  }
+  if (!pool_open(pool->vdev, &pool->info)) {
+    std::cerr << "failed to open the pool on " << path << std::endl;
+    bench_close(pool);
+    return false;
+  }
+  return true;
+}
+
+struct bench_result {
+  uint64_t items;             // blocks, block copies, directory entries or files
+  uint64_t bytes;             // read or produced, 0 if the scenario doesn't count them
+};
+
+static bool open_fs(const bench_pool &pool, const std::string &dataset, zpl_fs *fs, zil_overlay *ov) {
+  dataset_info ds;
+  const std::string &name = dataset.empty() ? pool.info.name : dataset;
+  if (!find_dataset(pool.info.mos(), pool.info.name.c_str(), name, pool.info.dev_base_ptr, &ds) ||
+      !zpl_open(&ds.ds.ds_bp, pool.info.dev_base_ptr, fs)) {
+    std::cerr << "no filesystem " << name << " in pool " << pool.info.name << std::endl;
+    return false;
+  }
+  zil_replay(*fs, &fs->os()->os_zil_header, ov);
+  return true;
+}
+
+static bool run_open(const bench_pool &, const std::string &, unsigned, bench_result *r) {
+  r->items = 1;
+  return true;
+}
+
+static bool run_traverse(const bench_pool &pool, const std::string &, unsigned nthreads, bench_result *r) {
+  traverse_stats stats;
+  traverse_pool(pool.info.mos(), &pool.info.ub->ub_rootbp, pool.info.dev_base_ptr, nthreads,
+                [](const zbookmark_phys_t &, const blkptr_t *) {}, &stats);
+  r->items = stats.blocks;
+  return true;
+}
+
+static bool run_scrub(const bench_pool &pool, const std::string &, unsigned nthreads, bench_result *r) {
+  scrub_options opts = {SCRUB_QUEUE_BYTES, 0, 0, "", &pool.map};
+  scrub_report report;
+  bool ok = scrub_pool(pool.info.mos(), &pool.info.ub->ub_rootbp, pool.info.dev_base_ptr, pool.fd, VDEV_DATA_OFFSET,
+                       nthreads, opts, &report);
+  if (!report.errors.empty()) {
+    std::cerr << report.errors.size() << " scrub errors" << std::endl;
+  }
+  r->items = report.copies;
+  r->bytes = report.bytes;
+  return ok;
+}
+
+// readdir and stat of every entry, like ls -lR, one level of the tree at a time across the threads
+static bool run_dirwalk(const bench_pool &pool, const std::string &dataset, unsigned nthreads, bench_result *r) {
+  zpl_fs fs;
+  zil_overlay ov;
+  if (!open_fs(pool, dataset, &fs, &ov)) {
+    return false;
+  }
+  std::vector<uint64_t> level = {fs.root_obj};
+  std::atomic<uint64_t> entries(0);
+  while (!level.empty()) {
+    std::vector<uint64_t> next;
+    std::mutex lock;
+    parallel_for(level.size(), nthreads, [&](uint64_t i) {
+      std::vector<uint64_t> subdirs;
+      uint64_t n = 0;
+      zil_overlay_readdir(ov, level[i], [&](const std::string &, uint64_t obj, int) {
+        zpl_attr attr;
+        if (zil_overlay_getattr(ov, obj, &attr) && S_ISDIR(attr.mode)) {
+          subdirs.push_back(obj);
+        }
+        n++;
+        return true;
+      });
+      entries += n;
+      std::lock_guard<std::mutex> guard(lock);
+      next.insert(next.end(), subdirs.begin(), subdirs.end());
+    });
+    level.swap(next);
+  }
+  r->items = entries;
+  return true;
+}
+
+// the tar command into /dev/null
+static bool run_extract(const bench_pool &pool, const std::string &dataset, unsigned nthreads, bench_result *r) {
+  zpl_fs fs;
+  zil_overlay ov;
+  if (!open_fs(pool, dataset, &fs, &ov)) {
+    return false;
+  }
+  FILE *out = fopen("/dev/null", "w");
+  if (out == nullptr) {
+    std::cerr << "failed to open /dev/null, err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  tar_stats stats;
+  bool ok = tar_export(ov, nthreads, out, &stats);
+  fclose(out);
+  r->items = stats.files;
+  r->bytes = stats.bytes;
+  return ok;
+}
+
+struct bench_scenario {
+  const char *name;
+  bool threaded;              // runs with each thread count, otherwise once on one thread
+  bool (*run)(const bench_pool &pool, const std::string &dataset, unsigned nthreads, bench_result *r);
+};
+
+static const bench_scenario scenarios[] = {
+  {"open", false, run_open},
+  {"traverse", true, run_traverse},
+  {"scrub", true, run_scrub},
+  {"dirwalk", true, run_dirwalk},
+  {"extract", true, run_extract},
+};
+
+static std::vector<std::string> split(const std::string &s, char sep) {
+  std::vector<std::string> out;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, sep)) {
+    if (!item.empty()) {
+      out.push_back(item);
+    }
+  }
+  return out;
+}
+
+static std::string basename_of(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// a directory stands for the regular files in it, in name order
+static void add_images(const std::string &path, std::vector<std::string> *images) {
+  struct stat st;
+  DIR *dir;
+  if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || (dir = opendir(path.c_str())) == nullptr) {
+    images->push_back(path);
+    return;
+  }
+  std::vector<std::string> files;
+  while (auto de = readdir(dir)) {
+    std::string file = path + "/" + de->d_name;
+    if (de->d_name[0] != '.' && stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+      files.push_back(file);
+    }
+  }
+  closedir(dir);
+  std::sort(files.begin(), files.end());
+  images->insert(images->end(), files.begin(), files.end());
+}
+
+static void drop_cache(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+    std::cerr << "failed to drop " << path << " from the page cache" << std::endl;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+struct bench_row {
+  std::string image;
+  uint64_t size;
+  std::string scenario;
+  std::string backend;
+  unsigned threads;
+  std::string cache;
+  int run;
+  double seconds;
+  bench_result result;
+  uint64_t minflt;
+  uint64_t majflt;
+};
+
+static const char *row_header = "image\tsize\tscenario\tbackend\tthreads\tcache\trun\tseconds\titems\tbytes\tminflt\tmajflt";
+
+static void print_row(FILE *f, const bench_row &row) {
+  fprintf(f, "%s\t%" PRIu64 "\t%s\t%s\t%u\t%s\t%d\t%.6f\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+          row.image.c_str(), row.size, row.scenario.c_str(), row.backend.c_str(), row.threads, row.cache.c_str(),
+          row.run, row.seconds, row.result.items, row.result.bytes, row.minflt, row.majflt);
+}
+
+// one timed run, or an untimed one to warm the cache when row is null
+static bool bench_run(const std::string &path, const bench_backend &backend, const bench_scenario &scenario,
+                      const std::string &dataset, unsigned nthreads, bench_row *row) {
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  auto start = std::chrono::steady_clock::now();
+  bench_pool pool;
+  bench_result result = {0, 0};
+  bool ok = bench_open(path, backend, &pool);
+  ok = ok && scenario.run(pool, dataset, nthreads, &result);
+  bench_close(&pool);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  getrusage(RUSAGE_SELF, &after);
+  if (row != nullptr) {
+    row->seconds = elapsed.count();
+    row->result = result;
+    row->minflt = after.ru_minflt - before.ru_minflt;
+    row->majflt = after.ru_majflt - before.ru_majflt;
+  }
+  return ok;
+}
+
+static double median(std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  size_t n = v.size();
+  return n == 0 ? 0 : n % 2 == 1 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static std::string row_key(const bench_row &row) {
+  return row.image + " " + row.scenario + " " + row.backend + " " + std::to_string(row.threads) + "t " + row.cache;
+}
+
+static bool read_results(const std::string &path, std::map<std::string, std::vector<double>> *seconds) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "failed to open " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#' || line == row_header) {
+      continue;
+    }
+    auto f = split(line, '\t');
+    if (f.size() < 8) {
+      std::cerr << "malformed line in " << path << ": " << line << std::endl;
+      return false;
+    }
+    bench_row row;
+    row.image = f[0];
+    row.scenario = f[2];
+    row.backend = f[3];
+    row.threads = strtoul(f[4].c_str(), nullptr, 10);
+    row.cache = f[5];
+    (*seconds)[row_key(row)].push_back(strtod(f[7].c_str(), nullptr));
+  }
+  return true;
+}
+
+static int compare(const std::string &baseline, const std::string &results, double threshold) {
+  std::map<std::string, std::vector<double>> old_seconds, new_seconds;
+  if (!read_results(baseline, &old_seconds) || !read_results(results, &new_seconds)) {
+    return 2;
+  }
+  int regressions = 0;
+  for (auto &kv : new_seconds) {
+    auto old = old_seconds.find(kv.first);
+    if (old == old_seconds.end()) {
+      printf("%-56s %10s %9.3fs\n", kv.first.c_str(), "-", median(kv.second));
+      continue;
+    }
+    double before = median(old->second), after = median(kv.second);
+    double change = before > 0 ? (after / before - 1) * 100 : 0;
+    bool regressed = change > threshold && after - before > BENCH_NOISE_SECONDS;
+    regressions += regressed;
+    printf("%-56s %9.3fs %9.3fs %+7.1f%%%s\n", kv.first.c_str(), before, after, change,
+           regressed ? "  REGRESSION" : "");
+  }
+  for (auto &kv : old_seconds) {
+    if (new_seconds.count(kv.first) == 0) {
+      printf("%-56s %9.3fs %10s\n", kv.first.c_str(), median(kv.second), "-");
+    }
+  }
+  printf("%d of %zu regressed by more than %.0f%%\n", regressions, new_seconds.size(), threshold);
+  return regressions > 0 ? 1 : 0;
+}
+
+static const char *usage =
+    "usage: macro_bench [-s <scenarios>] [-b <backends>] [-t <threads>] [-c cold,warm] [-r <runs>]\n"
+    "                   [-d <dataset>] [-o <results file>] <image or directory of images>...\n"
+    "       macro_bench compare <baseline results> <results> [<threshold %>]\n"
+    "scenarios: open,traverse,scrub,dirwalk,extract\n"
+    "backends: mmap,auto,phased,random,populate,window,read\n";
+
+int main(int argc, char **argv) {
+  if (argc > 1 && std::string(argv[1]) == "compare") {
+    if (argc < 4) {
+      std::cerr << usage;
+      return 2;
+    }
+    return compare(argv[2], argv[3], argc > 4 ? atof(argv[4]) : 10);
+  }
+
+  std::vector<std::string> scenario_names, backend_names = {"mmap"}, caches = {"cold", "warm"}, images;
+  std::vector<unsigned> threads = {1};
+  if (parallel_threads() > 1) {
+    threads.push_back(parallel_threads());
+  }
+  for (auto &s : scenarios) {
+    scenario_names.push_back(s.name);
+  }
+  int runs = 3;
+  std::string dataset, output = "macro_bench.tsv";
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg[0] != '-') {
+      add_images(arg, &images);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << usage;
+      return 2;
+    }
+    std::string val = argv[++i];
+    if (arg == "-s") {
+      scenario_names = split(val, ',');
+    } else if (arg == "-b") {
+      backend_names = split(val, ',');
+    } else if (arg == "-t") {
+      threads.clear();
+      for (auto &t : split(val, ',')) {
+        threads.push_back(std::max(1, atoi(t.c_str())));
+      }
+    } else if (arg == "-c") {
+      caches = split(val, ',');
+    } else if (arg == "-r") {
+      runs = std::max(1, atoi(val.c_str()));
+    } else if (arg == "-d") {
+      dataset = val;
+    } else if (arg == "-o") {
+      output = val;
+    } else {
+      std::cerr << usage;
+      return 2;
+    }
+  }
+
+  std::vector<const bench_scenario*> run_scenarios;
+  std::vector<const bench_backend*> run_backends;
+  for (auto &name : scenario_names) {
+    auto s = std::find_if(std::begin(scenarios), std::end(scenarios), [&](const bench_scenario &s) {
+      return name == s.name;
+    });
+    if (s == std::end(scenarios)) {
+      std::cerr << "unknown scenario " << name << std::endl << usage;
+      return 2;
+    }
+    run_scenarios.push_back(s);
+  }
+  for (auto &name : backend_names) {
+    auto b = std::find_if(std::begin(backends), std::end(backends), [&](const bench_backend &b) {
+      return name == b.name;
+    });
+    if (b == std::end(backends)) {
+      std::cerr << "unknown backend " << name << std::endl << usage;
+      return 2;
+    }
+    run_backends.push_back(b);
+  }
+  for (auto &cache : caches) {
+    if (cache != "cold" && cache != "warm") {
+      std::cerr << "cache must be cold or warm, not " << cache << std::endl;
+      return 2;
+    }
+  }
+  if (images.empty()) {
+    std::cerr << usage;
+    return 2;
+  }
+
+  FILE *out = fopen(output.c_str(), "w");
+  if (out == nullptr) {
+    std::cerr << "failed to open " << output << ", err: " << strerror(errno) << std::endl;
+    return 2;
+  }
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  time_t now = time(nullptr);
+  char date[64];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+  fprintf(out, "# macro_bench %s host %s cpus %u\n%s\n", date, host, parallel_threads(), row_header);
+
+  uint64_t memory = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  bool failed = false;
+  for (auto &path : images) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      std::cerr << "failed to stat " << path << ", err: " << strerror(errno) << std::endl;
+      failed = true;
+      continue;
+    }
+    for (auto backend : run_backends) {
+      if (backend->loads && (uint64_t)st.st_blocks * 512 > memory / 2) {
+        std::cerr << "skipping " << backend->name << " on " << path << ", " << nicenum(st.st_blocks * 512)
+                  << " of data doesn't fit in half of memory" << std::endl;
+        continue;
+      }
+      for (auto scenario : run_scenarios) {
+        for (unsigned nthreads : threads) {
+          if (!scenario->threaded && nthreads != threads[0]) {
+            continue;
+          }
+          unsigned used_threads = scenario->threaded ? nthreads : 1;
+          for (auto &cache : caches) {
+            bench_row row;
+            row.image = basename_of(path);
+            row.size = st.st_size;
+            row.scenario = scenario->name;
+            row.backend = backend->name;
+            row.threads = used_threads;
+            row.cache = cache;
+            std::vector<double> seconds;
+            bool ok = cache == "cold" || bench_run(path, *backend, *scenario, dataset, used_threads, nullptr);
+            for (int r = 0; ok && r < runs; r++) {
+              if (cache == "cold") {
+                drop_cache(path);
+              }
+              row.run = r;
+              ok = bench_run(path, *backend, *scenario, dataset, used_threads, &row);
+              if (ok) {
+                print_row(out, row);
+                seconds.push_back(row.seconds);
+              }
+            }
+            fflush(out);
+            if (!ok) {
+              std::cerr << scenario->name << " failed on " << path << " with " << backend->name << std::endl;
+              failed = true;
+              continue;
+            }
+            double m = median(seconds);
+            printf("%-56s %9.3fs %10s/s %12.0f items/s\n", row_key(row).c_str(), m,
+                   nicenum(m > 0 ? row.result.bytes / m : 0).c_str(), m > 0 ? row.result.items / m : 0);
+          }
+        }
+      }
+    }
+  }
+  fclose(out);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,372 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+#include "metaslab.h"
+#include "parallel.h"
+
+bool load_vdev_tree(const objset_phys_t *mos, const void *dev_base_ptr, std::vector<top_vdev_info> *vdevs) {
+  auto dir_data = read_dnode(mos, DMU_POOL_DIRECTORY_OBJECT, dev_base_ptr);
+  uint64_t config_obj;
+  if (!zap_lookup((const dnode_phys_t*)dir_data.data(), DMU_POOL_CONFIG, dev_base_ptr, &config_obj)) {
+    std::cerr << "no " << DMU_POOL_CONFIG << " in the MOS object directory" << std::endl;
+    return false;
+  }
+
+  // a packed nvlist object keeps its packed size in the bonus buffer
+  auto config_data = read_dnode(mos, config_obj, dev_base_ptr);
+  auto config_dn = (const dnode_phys_t*)config_data.data();
+  assert(config_dn->dn_type == DMU_OT_PACKED_NVLIST);
+  uint64_t nvsize = *(const uint64_t*)DN_BONUS(config_dn);
+  auto packed = read_object(config_dn, 0, nvsize, dev_base_ptr);
+
+  nvlist_t *config;
+  if (nvlist_unpack((char*)packed.data(), packed.size(), &config, 0) != 0) {
+    std::cerr << "failed to unpack the pool config" << std::endl;
+    return false;
+  }
+  nvlist_t *root;
+  nvlist_t **children;
+  uint_t nchildren;
+  if (nvlist_lookup_nvlist(config, "vdev_tree", &root) != 0 ||
+      nvlist_lookup_nvlist_array(root, "children", &children, &nchildren) != 0) {
+    std::cerr << "no vdev_tree in the pool config" << std::endl;
+    nvlist_free(config);
+    return false;
+  }
+
+  for (uint_t i = 0; i < nchildren; i++) {
+    top_vdev_info vd = {};
+    if (nvlist_lookup_uint64(children[i], "id", &vd.id) != 0 ||
+        nvlist_lookup_uint64(children[i], "metaslab_array", &vd.ms_array) != 0 ||
+        nvlist_lookup_uint64(children[i], "metaslab_shift", &vd.ms_shift) != 0 ||
+        nvlist_lookup_uint64(children[i], "ashift", &vd.ashift) != 0 ||
+        nvlist_lookup_uint64(children[i], "asize", &vd.asize) != 0) {
+      // holes and indirect vdevs of removed devices have no metaslabs
+      continue;
+    }
+    nvlist_lookup_uint64(children[i], "com.delphix:vdev_zap_top", &vd.top_zap);
+    vd.ms_count = vd.asize >> vd.ms_shift;
+    vdevs->push_back(vd);
+  }
+  nvlist_free(config);
+  return true;
+}
+
+std::vector<uint64_t> load_metaslab_array(const objset_phys_t *mos, const top_vdev_info &vd,
+                                          const void *dev_base_ptr) {
+  auto array_data = read_dnode(mos, vd.ms_array, dev_base_ptr);
+  auto array_dn = (const dnode_phys_t*)array_data.data();
+  auto raw = read_object(array_dn, 0, vd.ms_count * sizeof(uint64_t), dev_base_ptr);
+  auto objs = (const uint64_t*)raw.data();
+  return std::vector<uint64_t>(objs, objs + vd.ms_count);
+}
+
+// space_map_iterate(), with the vdev of two word entries and SM_NO_VDEVID for the others
+static bool space_map_iterate_vdev(const objset_phys_t *mos, uint64_t sm_obj, uint64_t sm_start, uint64_t sm_shift,
+                                   const void *dev_base_ptr,
+                                   const std::function<bool(maptype_t, uint64_t, uint64_t, uint64_t)> &cb,
+                                   space_map_phys_t *smp) {
+  auto sm_data = read_dnode(mos, sm_obj, dev_base_ptr);
+  auto sm_dn = (const dnode_phys_t*)sm_data.data();
+  if (sm_dn->dn_type != DMU_OT_SPACE_MAP) {
+    std::cerr << "object " << sm_obj << " is not a space map" << std::endl;
+    return false;
+  }
+  // pools without the spacemap_histogram feature have the short V0 header
+  memset(smp, 0, sizeof(*smp));
+  memcpy(smp, DN_BONUS(sm_dn), std::min<size_t>(sm_dn->dn_bonuslen, sizeof(*smp)));
+
+  uint64_t blksz = sm_dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  for (uint64_t blkid = 0; blkid * blksz < smp->smp_length; blkid++) {
+    auto data = read_dnode_block(sm_dn, blkid, dev_base_ptr);
+    auto words = (const uint64_t*)data.data();
+    uint64_t nwords = std::min(blksz, smp->smp_length - blkid * blksz) / sizeof(uint64_t);
+
+    // two word entries are never split across blocks, a debug entry pads the block instead
+    for (uint64_t i = 0; i < nwords; i++) {
+      uint64_t e = words[i];
+      uint64_t offset, run, vdev = SM_NO_VDEVID;
+      maptype_t type;
+      if (SM_PREFIX_DECODE(e) == SM_DEBUG_PREFIX) {
+        continue;
+      } else if (SM_PREFIX_DECODE(e) == SM2_PREFIX) {
+        if (i + 1 == nwords) {
+          std::cerr << "space map " << sm_obj << " has a two word entry across a block boundary" << std::endl;
+          return false;
+        }
+        uint64_t e2 = words[++i];
+        vdev = SM_VDEV_DECODE(e);
+        run = SM2_RUN_DECODE(e);
+        type = (maptype_t)SM2_TYPE_DECODE(e2);
+        offset = SM2_OFFSET_DECODE(e2);
+      } else {
+        run = SM_RUN_DECODE(e);
+        type = (maptype_t)SM_TYPE_DECODE(e);
+        offset = SM_OFFSET_DECODE(e);
+      }
+      if (!cb(type, vdev, sm_start + (offset << sm_shift), run << sm_shift)) {
+        return true;
+      }
+    }
+  }
+  return true;
+}
+
+bool space_map_iterate(const objset_phys_t *mos, uint64_t sm_obj, uint64_t sm_start, uint64_t sm_shift,
+                       const void *dev_base_ptr, const space_map_cb_t &cb, space_map_phys_t *smp) {
+  return space_map_iterate_vdev(mos, sm_obj, sm_start, sm_shift, dev_base_ptr,
+                                [&](maptype_t type, uint64_t, uint64_t offset, uint64_t size) {
+    return cb(type, offset, size);
+  }, smp);
+}
+
+// the txg from which on each of vd's metaslabs lacks the log entries, all 0 on pools without log space maps
+static bool load_unflushed_txgs(const objset_phys_t *mos, const top_vdev_info &vd, const void *dev_base_ptr,
+                                std::vector<uint64_t> *txgs) {
+  txgs->assign(vd.ms_count, 0);
+  uint64_t obj;
+  if (vd.top_zap == 0) {
+    return true;
+  }
+  auto zap_data = read_dnode(mos, vd.top_zap, dev_base_ptr);
+  if (!zap_lookup((const dnode_phys_t*)zap_data.data(), VDEV_TOP_ZAP_MS_UNFLUSHED_PHYS_TXGS, dev_base_ptr, &obj)) {
+    return true;
+  }
+  auto array_data = read_dnode(mos, obj, dev_base_ptr);
+  auto raw = read_object((const dnode_phys_t*)array_data.data(), 0, vd.ms_count * sizeof(uint64_t), dev_base_ptr);
+  if (raw.size() < vd.ms_count * sizeof(uint64_t)) {
+    std::cerr << "short unflushed txg array for vdev " << vd.id << std::endl;
+    return false;
+  }
+  memcpy(txgs->data(), raw.data(), vd.ms_count * sizeof(uint64_t));
+  return true;
+}
+
+bool load_unflushed_log(const objset_phys_t *mos, const std::vector<top_vdev_info> &vdevs, const void *dev_base_ptr,
+                        unflushed_log *log) {
+  *log = unflushed_log();
+  auto dir_data = read_dnode(mos, DMU_POOL_DIRECTORY_OBJECT, dev_base_ptr);
+  uint64_t zap_obj;
+  if (!zap_lookup((const dnode_phys_t*)dir_data.data(), DMU_POOL_LOG_SPACEMAP_ZAP, dev_base_ptr, &zap_obj)) {
+    return true;
+  }
+  log->present = true;
+
+  // the logs are named by their txg in hex, as by spa_generate_syncing_log_sm()
+  std::map<uint64_t, uint64_t> logs;
+  auto zap_data = read_dnode(mos, zap_obj, dev_base_ptr);
+  zap_iterate((const dnode_phys_t*)zap_data.data(), dev_base_ptr, [&](const zap_attribute &za) {
+    logs[strtoull(za.za_name.c_str(), nullptr, 16)] = za.za_first_integer;
+    return true;
+  });
+  log->log_space_maps = logs.size();
+
+  std::map<uint64_t, const top_vdev_info*> by_id;
+  std::map<uint64_t, std::vector<uint64_t>> unflushed_txgs;
+  for (auto &vd : vdevs) {
+    by_id[vd.id] = &vd;
+    if (!load_unflushed_txgs(mos, vd, dev_base_ptr, &unflushed_txgs[vd.id])) {
+      return false;
+    }
+  }
+
+  for (auto &l : logs) {
+    uint64_t txg = l.first;
+    space_map_phys_t smp;
+    // log entries always carry their vdev and are in bytes from the start of it
+    bool ok = space_map_iterate_vdev(mos, l.second, 0, SPA_MINBLOCKSHIFT, dev_base_ptr,
+                                     [&](maptype_t type, uint64_t vdev, uint64_t offset, uint64_t size) {
+      auto vd = by_id.find(vdev);
+      if (vd == by_id.end()) {
+        // removed vdevs keep their log entries until the logs are flushed, there is nothing to apply them to
+        return true;
+      }
+      uint64_t ms = offset >> vd->second->ms_shift;
+      if (ms >= vd->second->ms_count || txg < unflushed_txgs[vdev][ms]) {
+        return true;
+      }
+      log->metaslabs[std::make_pair(vdev, ms)].push_back(unflushed_entry{type, offset, size});
+      log->entries++;
+      return true;
+    }, &smp);
+    if (!ok) {
+      std::cerr << "log space map " << l.second << " of txg " << txg << " is malformed" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * zfs_frag_table from metaslab.c: how fragmented free space of a given
+ * size is, indexed by log2(size) - SPA_MINBLOCKSHIFT.
+ */
+static const int zfs_frag_table[] = {
+    100,    /* 512B */
+    100,    /* 1K   */
+    98,     /* 2K   */
+    95,     /* 4K   */
+    90,     /* 8K   */
+    80,     /* 16K  */
+    70,     /* 32K  */
+    60,     /* 64K  */
+    50,     /* 128K */
+    40,     /* 256K */
+    30,     /* 512K */
+    20,     /* 1M   */
+    15,     /* 2M   */
+    10,     /* 4M   */
+    5,      /* 8M   */
+    0       /* 16M  */
+};
+#define FRAGMENTATION_TABLE_SIZE (sizeof(zfs_frag_table) / sizeof(zfs_frag_table[0]))
+
+int metaslab_fragmentation(const uint64_t *hist_bytes) {
+  uint64_t total = 0, fragmented = 0;
+  for (int i = SPA_MINBLOCKSHIFT; i < METASLAB_HIST_SIZE; i++) {
+    size_t idx = std::min<size_t>(i - SPA_MINBLOCKSHIFT, FRAGMENTATION_TABLE_SIZE - 1);
+    // scaled down by the smallest bucket so a large metaslab can't overflow
+    uint64_t space = hist_bytes[i] >> SPA_MINBLOCKSHIFT;
+    total += space;
+    fragmented += space * zfs_frag_table[idx];
+  }
+  return total == 0 ? 0 : (int)(fragmented / total);
+}
+
+bool metaslab_load_free(const objset_phys_t *mos, const top_vdev_info &vd, uint64_t ms_id, uint64_t sm_obj,
+                        const void *dev_base_ptr, range_tree *free_tree, uint64_t *entries, space_map_phys_t *smp,
+                        const std::vector<unflushed_entry> *unflushed) {
+  uint64_t start = ms_id << vd.ms_shift, size = 1ULL << vd.ms_shift;
+  // a metaslab starts out entirely free, the log then allocates and frees parts of it
+  free_tree->add(start, size);
+  memset(smp, 0, sizeof(*smp));
+  *entries = 0;
+
+  bool in_range = true;
+  auto apply = [&](maptype_t type, uint64_t offset, uint64_t len) {
+    (*entries)++;
+    if (offset < start || offset + len > start + size) {
+      in_range = false;
+      return false;
+    }
+    if (type == SM_FREE) {
+      free_tree->add(offset, len);
+    } else {
+      free_tree->remove(offset, len);
+    }
+    return true;
+  };
+  if (sm_obj != 0 && !space_map_iterate(mos, sm_obj, start, vd.ashift, dev_base_ptr, apply, smp)) {
+    return false;
+  }
+  if (unflushed != nullptr) {
+    for (auto &e : *unflushed) {
+      if (!apply(e.type, e.offset, e.size)) {
+        break;
+      }
+    }
+  }
+  return in_range;
+}
+
+static void metaslab_load(const objset_phys_t *mos, const top_vdev_info &vd, metaslab_info *ms,
+                          const void *dev_base_ptr) {
+  range_tree free_tree(ms->start, vd.ashift);
+  space_map_phys_t smp;
+  ms->error = !metaslab_load_free(mos, vd, ms->id, ms->sm_obj, dev_base_ptr, &free_tree, &ms->entries, &smp);
+  ms->sm_alloc = smp.smp_alloc;
+
+  ms->free = free_tree.space();
+  ms->segs = free_tree.numsegs();
+  free_tree.walk([&](uint64_t, uint64_t size) {
+    int bucket = 63 - __builtin_clzll(size);
+    ms->hist[bucket]++;
+    ms->hist_bytes[bucket] += size;
+    ms->max_seg = std::max(ms->max_seg, size);
+  });
+  ms->fragmentation = metaslab_fragmentation(ms->hist_bytes);
+}
+
+std::vector<metaslab_info> metaslab_scan(const objset_phys_t *mos, const std::vector<top_vdev_info> &vdevs,
+                                         const void *dev_base_ptr, unsigned nthreads) {
+  std::vector<metaslab_info> out;
+  std::vector<const top_vdev_info*> owner;
+  for (auto &vd : vdevs) {
+    auto sm_objs = load_metaslab_array(mos, vd, dev_base_ptr);
+    for (uint64_t m = 0; m < vd.ms_count; m++) {
+      metaslab_info ms = {};
+      ms.vdev = vd.id;
+      ms.id = m;
+      ms.start = m << vd.ms_shift;
+      ms.size = 1ULL << vd.ms_shift;
+      ms.sm_obj = sm_objs[m];
+      out.push_back(ms);
+      owner.push_back(&vd);
+    }
+  }
+
+  parallel_for(out.size(), nthreads, [&](uint64_t i) {
+    metaslab_load(mos, *owner[i], &out[i], dev_base_ptr);
+  });
+  return out;
+}
+
+void print_metaslab_report(const std::vector<top_vdev_info> &vdevs, const std::vector<metaslab_info> &ms,
+                           bool verbose) {
+  for (auto &vd : vdevs) {
+    uint64_t size = 0, free = 0, segs = 0, errors = 0, mismatched = 0;
+    uint64_t frag_sum = 0, nms = 0;
+    uint64_t hist[METASLAB_HIST_SIZE] = {}, hist_bytes[METASLAB_HIST_SIZE] = {};
+
+    std::cout << "vdev " << std::dec << vd.id << ": " << vd.ms_count << " metaslabs of "
+              << nicenum(1ULL << vd.ms_shift) << ", ashift " << vd.ashift << std::endl;
+    for (auto &m : ms) {
+      if (m.vdev != vd.id) {
+        continue;
+      }
+      if (verbose) {
+        std::cout << "  metaslab " << std::setw(5) << m.id << " offset " << std::hex << std::setw(12) << m.start
+                  << std::dec << " spacemap " << std::setw(6) << m.sm_obj << " free " << std::setw(7)
+                  << nicenum(m.free) << " segs " << std::setw(7) << m.segs << " frag " << std::setw(3)
+                  << m.fragmentation << "%" << (m.error ? " (bad space map)" : "") << std::endl;
+      }
+      size += m.size;
+      free += m.free;
+      segs += m.segs;
+      errors += m.error;
+      // the log spacemap feature keeps unflushed changes out of the metaslab's own space map
+      mismatched += m.sm_obj != 0 && (int64_t)(m.size - m.free) != m.sm_alloc;
+      frag_sum += m.fragmentation;
+      nms++;
+      for (int i = 0; i < METASLAB_HIST_SIZE; i++) {
+        hist[i] += m.hist[i];
+        hist_bytes[i] += m.hist_bytes[i];
+      }
+    }
+
+    std::cout << "  size " << nicenum(size) << ", free " << nicenum(free) << " in " << segs << " segments, "
+              << "fragmentation " << (nms == 0 ? 0 : frag_sum / nms) << "% (free space weighted "
+              << metaslab_fragmentation(hist_bytes) << "%)" << std::endl;
+    if (mismatched != 0) {
+      std::cout << "  " << mismatched << " metaslabs disagree with smp_alloc, unflushed log spacemap entries?"
+                << std::endl;
+    }
+    if (errors != 0) {
+      std::cout << "  " << errors << " metaslabs with malformed space maps" << std::endl;
+    }
+
+    std::cout << "  free segment histogram:" << std::endl;
+    uint64_t max = *std::max_element(hist, hist + METASLAB_HIST_SIZE);
+    for (int i = 0; i < METASLAB_HIST_SIZE; i++) {
+      if (hist[i] == 0) {
+        continue;
+      }
+      std::cout << "  " << std::setw(6) << nicenum(1ULL << i) << ": " << std::setw(9) << hist[i] << " "
+                << std::setw(8) << nicenum(hist_bytes[i]) << " "
+                << std::string(max == 0 ? 0 : (hist[i] * 40 + max - 1) / max, '*') << std::endl;
+    }
+  }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "zfs_reader.h"
+#include "space_map.h"
+#include "range_tree.h"
+
+// free segment histogram buckets, by floor(log2(size in bytes))
+#define METASLAB_HIST_SIZE 64
+
+// in a top level vdev's ZAP: one uint64_t per metaslab, the oldest txg whose log entries it lacks
+#define VDEV_TOP_ZAP_MS_UNFLUSHED_PHYS_TXGS "com.delphix:ms_unflushed_phys_txgs"
+
+// a top level vdev from the pool config in the MOS
+struct top_vdev_info {
+  uint64_t id;
+  uint64_t ashift;
+  uint64_t asize;
+  uint64_t ms_shift;
+  uint64_t ms_array;      // object array of space map object ids, one per metaslab
+  uint64_t ms_count;
+  uint64_t top_zap;       // the vdev's own ZAP, 0 on pools from before it
+};
+
+// read the top level vdevs that have metaslabs (no holes or removed vdevs)
+bool load_vdev_tree(const objset_phys_t *mos, const void *dev_base_ptr, std::vector<top_vdev_info> *vdevs);
+
+// space map object ids of vd's metaslabs, 0 for metaslabs that were never written
+std::vector<uint64_t> load_metaslab_array(const objset_phys_t *mos, const top_vdev_info &vd, const void *dev_base_ptr);
+
+// return false to stop the iteration
+typedef std::function<bool(maptype_t type, uint64_t offset, uint64_t size)> space_map_cb_t;
+
+/*
+ * Visit every alloc/free entry of space map sm_obj, in log order.  Offsets
+ * are byte offsets in the vdev (sm_start already added).  Returns false if
+ * the space map is malformed.
+ */
+bool space_map_iterate(const objset_phys_t *mos, uint64_t sm_obj, uint64_t sm_start, uint64_t sm_shift,
+                       const void *dev_base_ptr, const space_map_cb_t &cb, space_map_phys_t *smp);
+
+/*
+ * With the log spacemap feature every txg's allocations and frees go to a
+ * log space map of the whole pool, named by its txg in the ZAP
+ * DMU_POOL_LOG_SPACEMAP_ZAP, and reach the metaslabs' own space maps only
+ * when a metaslab is flushed.  A metaslab's space map is current only with
+ * the log entries from its unflushed txg on replayed over it.
+ */
+struct unflushed_entry {
+  maptype_t type;
+  uint64_t offset;            // in the vdev, bytes
+  uint64_t size;
+};
+
+struct unflushed_log {
+  bool present;               // the pool has log space maps at all
+  uint64_t log_space_maps;
+  uint64_t entries;           // that some metaslab still lacks
+  // by (vdev, metaslab), oldest txg first
+  std::map<std::pair<uint64_t, uint64_t>, std::vector<unflushed_entry>> metaslabs;
+};
+
+// read every log space map; false, with a message, if any of them or the unflushed txgs can't be read
+bool load_unflushed_log(const objset_phys_t *mos, const std::vector<top_vdev_info> &vdevs, const void *dev_base_ptr,
+                        unflushed_log *log);
+
+/*
+ * Replay the space map of metaslab ms_id of vd into the empty free_tree,
+ * then its unflushed log entries if given.  Returns false if the space map
+ * is malformed or either strays outside the metaslab, free_tree then holds
+ * what was replayed up to that point.
+ */
+bool metaslab_load_free(const objset_phys_t *mos, const top_vdev_info &vd, uint64_t ms_id, uint64_t sm_obj,
+                        const void *dev_base_ptr, range_tree *free_tree, uint64_t *entries, space_map_phys_t *smp,
+                        const std::vector<unflushed_entry> *unflushed = nullptr);
+
+struct metaslab_info {
+  uint64_t vdev;
+  uint64_t id;
+  uint64_t start;
+  uint64_t size;
+  uint64_t sm_obj;
+  uint64_t entries;
+  int64_t sm_alloc;           // smp_alloc as recorded in the space map header
+  uint64_t free;              // free space after replaying the space map
+  uint64_t segs;              // free segments
+  uint64_t max_seg;
+  int fragmentation;          // percent, weighted like metaslab_compute_fragmentation()
+  bool error;
+  uint64_t hist[METASLAB_HIST_SIZE];        // free segments per bucket
+  uint64_t hist_bytes[METASLAB_HIST_SIZE];  // free bytes per bucket
+};
+
+/*
+ * Replay the space map of every metaslab of every vdev into a free range
+ * tree, on nthreads threads, and summarize each one.  The trees are dropped
+ * as soon as a metaslab is summarized, so memory stays bounded by the
+ * metaslabs in flight rather than the pool size.
+ */
+std::vector<metaslab_info> metaslab_scan(const objset_phys_t *mos, const std::vector<top_vdev_info> &vdevs,
+                                         const void *dev_base_ptr, unsigned nthreads);
+
+// fragmentation of a histogram, in percent
+int metaslab_fragmentation(const uint64_t *hist_bytes);
+
+void print_metaslab_report(const std::vector<top_vdev_info> &vdevs, const std::vector<metaslab_info> &ms,
+                           bool verbose);
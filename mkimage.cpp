@@ -0,0 +1,143 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <iostream>
+
+#include "image_writer.h"
+
+static const char *usage =
+    "usage: mkimage <image> [-s <size>] [-n <files>] [-d <dirs>] [-w <fanout>] [-b <min size>[,<max size>]]\n"
+    "               [-r <recordsize>] [-I <indblkshift>] [-c off|lz4|zle|gzip-<1..9>] [-k off|fletcher2|fletcher4|sha256]\n"
+    "               [-a <ashift>] [-g <gang %>] [-z <zero %>] [-V <variants>] [-S <seed>] [-p <pool name>]\n";
+
+// a byte count with an optional K, M, G or T suffix
+static bool parse_size(const char *arg, uint64_t *size, const char **end = nullptr) {
+  char *p;
+  *size = strtoull(arg, &p, 0);
+  if (p == arg) {
+    return false;
+  }
+  const char *suffixes = "KMGT";
+  if (*p != '\0' && strchr(suffixes, toupper(*p)) != nullptr) {
+    *size <<= 10 * (strchr(suffixes, toupper(*p)) - suffixes + 1);
+    p++;
+  }
+  if (end != nullptr) {
+    *end = p;
+    return true;
+  }
+  return *p == '\0';
+}
+
+static bool parse_compress(const std::string &arg, int *compress) {
+  if (arg == "off") {
+    *compress = ZIO_COMPRESS_OFF;
+  } else if (arg == "on" || arg == "lz4") {
+    *compress = ZIO_COMPRESS_LZ4;
+  } else if (arg == "zle") {
+    *compress = ZIO_COMPRESS_ZLE;
+  } else if (arg == "gzip") {
+    *compress = ZIO_COMPRESS_GZIP_6;
+  } else if (arg.size() == 6 && arg.compare(0, 5, "gzip-") == 0 && arg[5] >= '1' && arg[5] <= '9') {
+    *compress = ZIO_COMPRESS_GZIP_1 + arg[5] - '1';
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool parse_checksum(const std::string &arg, int *checksum) {
+  if (arg == "off") {
+    *checksum = ZIO_CHECKSUM_OFF;
+  } else if (arg == "fletcher2") {
+    *checksum = ZIO_CHECKSUM_FLETCHER_2;
+  } else if (arg == "on" || arg == "fletcher4") {
+    *checksum = ZIO_CHECKSUM_FLETCHER_4;
+  } else if (arg == "sha256") {
+    *checksum = ZIO_CHECKSUM_SHA256;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  image_options opts;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    std::string flag = argv[i];
+    if (flag[0] != '-') {
+      if (path != nullptr) {
+        std::cerr << usage;
+        return 1;
+      }
+      path = argv[i];
+      continue;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << usage;
+      return 1;
+    }
+    const char *arg = argv[++i];
+    const char *end;
+    bool ok = true;
+    if (flag == "-s") {
+      ok = parse_size(arg, &opts.size);
+    } else if (flag == "-n") {
+      ok = parse_size(arg, &opts.files);
+    } else if (flag == "-d") {
+      ok = parse_size(arg, &opts.dirs);
+    } else if (flag == "-w") {
+      ok = parse_size(arg, &opts.fanout);
+    } else if (flag == "-b") {
+      ok = parse_size(arg, &opts.min_file_size, &end);
+      opts.max_file_size = opts.min_file_size;
+      if (ok && *end == ',') {
+        ok = parse_size(end + 1, &opts.max_file_size);
+      } else {
+        ok = ok && *end == '\0';
+      }
+    } else if (flag == "-r") {
+      ok = parse_size(arg, &opts.recordsize);
+    } else if (flag == "-I") {
+      opts.indblkshift = atoi(arg);
+    } else if (flag == "-c") {
+      ok = parse_compress(arg, &opts.compress);
+    } else if (flag == "-k") {
+      ok = parse_checksum(arg, &opts.checksum);
+    } else if (flag == "-a") {
+      opts.ashift = atoi(arg);
+    } else if (flag == "-g") {
+      opts.gang_percent = atoi(arg);
+    } else if (flag == "-z") {
+      opts.zero_percent = atoi(arg);
+    } else if (flag == "-V") {
+      ok = parse_size(arg, &opts.variants);
+    } else if (flag == "-S") {
+      opts.seed = strtoull(arg, nullptr, 0);
+    } else if (flag == "-p") {
+      opts.pool_name = arg;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "invalid argument " << arg << " for " << flag << std::endl << usage;
+      return 1;
+    }
+  }
+  if (path == nullptr) {
+    std::cerr << usage;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  image_stats stats;
+  if (!write_image(path, opts, &stats)) {
+    return 1;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  print_image_stats(opts, stats);
+  printf("wrote %s in %.1fs\n", path, elapsed.count());
+  return 0;
+}
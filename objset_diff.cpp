@@ -0,0 +1,263 @@
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+#include "objset_diff.h"
+#include "block_stats.h"
+#include "parallel.h"
+
+namespace {
+
+/*
+ * A position in one side's block tree.  Trees of different depth are lined
+ * up by giving both a virtual root one level above the deeper one: a
+ * virtual node sits above the dnode's top level and only its first child
+ * holds anything.
+ */
+struct diff_node {
+  const blkptr_t *bp;
+  bool virt;
+};
+
+struct diff_side {
+  const dnode_phys_t *dn;
+  int top;
+};
+
+struct diff_ctx {
+  const void *dev_base_ptr;
+  const zpl_fs *from_fs;
+  const zpl_fs *to_fs;
+  std::atomic<uint64_t> indirect_reads;
+
+  diff_ctx(const void *dev_base_ptr, const zpl_fs *from_fs, const zpl_fs *to_fs)
+      : dev_base_ptr(dev_base_ptr), from_fs(from_fs), to_fs(to_fs), indirect_reads(0) {}
+};
+
+// a level 0 position whose block pointers differ
+struct diff_block {
+  uint64_t blkid;
+  blkptr_t from;
+  blkptr_t to;
+};
+
+typedef std::function<void(uint64_t blkid, const blkptr_t *from, const blkptr_t *to)> diff_block_cb_t;
+
+}
+
+static const blkptr_t hole_bp = {};
+
+// same DVA and birth is the same block, without reading it
+static bool bp_same(const blkptr_t *a, const blkptr_t *b) {
+  if (BP_IS_HOLE(a) && BP_IS_HOLE(b)) {
+    return true;
+  }
+  if (BP_IS_EMBEDDED(a) || BP_IS_EMBEDDED(b)) {
+    return memcmp(a, b, sizeof(blkptr_t)) == 0;
+  }
+  return memcmp(&a->blk_dva[0], &b->blk_dva[0], sizeof(dva_t)) == 0 && a->blk_birth == b->blk_birth;
+}
+
+static void diff_children(diff_ctx *ctx, const diff_side &side, diff_node node, int level, uint64_t epb,
+                          std::vector<uint8_t> *buf, std::vector<diff_node> *out) {
+  out->assign(epb, diff_node{&hole_bp, false});
+  if (node.virt) {
+    if (level - 1 == side.top) {
+      for (int i = 0; i < side.dn->dn_nblkptr; i++) {
+        (*out)[i] = diff_node{&side.dn->dn_blkptr[i], false};
+      }
+    } else {
+      (*out)[0] = diff_node{nullptr, true};
+    }
+    return;
+  }
+  if (BP_IS_HOLE(node.bp)) {
+    return;
+  }
+  *buf = read_block(node.bp, ctx->dev_base_ptr);
+  ctx->indirect_reads++;
+  auto bps = (const blkptr_t*)buf->data();
+  for (uint64_t i = 0; i < epb && i < buf->size() / sizeof(blkptr_t); i++) {
+    (*out)[i] = diff_node{&bps[i], false};
+  }
+}
+
+static void diff_nodes(diff_ctx *ctx, const diff_side &a, diff_node an, const diff_side &b, diff_node bn, int level,
+                       uint64_t index, uint64_t epb, const diff_block_cb_t &cb) {
+  if (!an.virt && !bn.virt && bp_same(an.bp, bn.bp)) {
+    return;
+  }
+  if (level == 0) {
+    cb(index, an.bp, bn.bp);
+    return;
+  }
+  std::vector<uint8_t> abuf, bbuf;
+  std::vector<diff_node> ac, bc;
+  diff_children(ctx, a, an, level, epb, &abuf, &ac);
+  diff_children(ctx, b, bn, level, epb, &bbuf, &bc);
+  for (uint64_t i = 0; i < epb; i++) {
+    diff_nodes(ctx, a, ac[i], b, bc[i], level - 1, index * epb + i, epb, cb);
+  }
+}
+
+// every level 0 position where the trees of two dnodes with the same indirect block size differ
+static void diff_trees(diff_ctx *ctx, const dnode_phys_t *from, const dnode_phys_t *to, const diff_block_cb_t &cb) {
+  diff_side a{from, from->dn_nlevels - 1};
+  diff_side b{to, to->dn_nlevels - 1};
+  uint64_t epb = 1ULL << (from->dn_indblkshift - SPA_BLKPTRSHIFT);
+  diff_nodes(ctx, a, diff_node{nullptr, true}, b, diff_node{nullptr, true}, std::max(a.top, b.top) + 1, 0, epb, cb);
+}
+
+static void diff_object_data(diff_ctx *ctx, const dnode_phys_t *from, const dnode_phys_t *to, diff_object *obj) {
+  uint64_t blksz = to->dn_datablkszsec * ZFS_SEC_SIZE;
+  if (from->dn_datablkszsec != to->dn_datablkszsec || from->dn_indblkshift != to->dn_indblkshift) {
+    // a block size change rewrites the whole object
+    uint64_t from_end = (from->dn_maxblkid + 1) * from->dn_datablkszsec * ZFS_SEC_SIZE;
+    obj->ranges.push_back(diff_range{0, std::max(from_end, (to->dn_maxblkid + 1) * blksz)});
+    return;
+  }
+  diff_trees(ctx, from, to, [&](uint64_t blkid, const blkptr_t *, const blkptr_t *) {
+    uint64_t off = blkid * blksz;
+    if (!obj->ranges.empty() && obj->ranges.back().offset + obj->ranges.back().length == off) {
+      obj->ranges.back().length += blksz;
+    } else {
+      obj->ranges.push_back(diff_range{off, blksz});
+    }
+  });
+}
+
+static bool bonus_differs(const dnode_phys_t *from, const dnode_phys_t *to) {
+  if (from->dn_bonustype != to->dn_bonustype || from->dn_bonuslen != to->dn_bonuslen) {
+    return true;
+  }
+  if (memcmp(DN_BONUS(from), DN_BONUS(to), from->dn_bonuslen) != 0) {
+    return true;
+  }
+  bool from_spill = from->dn_flags & DNODE_FLAG_SPILL_BLKPTR, to_spill = to->dn_flags & DNODE_FLAG_SPILL_BLKPTR;
+  return from_spill != to_spill || (from_spill && !bp_same(DN_SPILL_BLKPTR(from), DN_SPILL_BLKPTR(to)));
+}
+
+// a file or directory freed and its object number reused, which zfs diff tells by the generation
+static bool object_reused(diff_ctx *ctx, const dnode_phys_t *from, const dnode_phys_t *to) {
+  if (ctx->from_fs == nullptr || ctx->to_fs == nullptr) {
+    return false;
+  }
+  zpl_attr a, b;
+  return zpl_dnode_attr(*ctx->from_fs, from, &a) && zpl_dnode_attr(*ctx->to_fs, to, &b) && a.gen != b.gen;
+}
+
+static void diff_dnode_block(diff_ctx *ctx, const diff_block &blk, uint64_t blksz, std::vector<diff_object> *out) {
+  auto read = [&](const blkptr_t *bp) {
+    return BP_IS_HOLE(bp) ? std::vector<uint8_t>(blksz, 0) : read_block(bp, ctx->dev_base_ptr);
+  };
+  auto from_data = read(&blk.from), to_data = read(&blk.to);
+  auto from_dn = (const dnode_phys_t*)from_data.data(), to_dn = (const dnode_phys_t*)to_data.data();
+  uint64_t per_blk = blksz >> DNODE_SHIFT;
+
+  // slots inside a large dnode are not objects of their own
+  uint64_t from_next = 0, to_next = 0;
+  for (uint64_t i = 0; i < per_blk; i++) {
+    const dnode_phys_t *a = nullptr, *b = nullptr;
+    if (i >= from_next) {
+      a = from_dn[i].dn_type != DMU_OT_NONE ? &from_dn[i] : nullptr;
+      from_next = i + (a != nullptr ? a->dn_extra_slots + 1 : 1);
+    }
+    if (i >= to_next) {
+      b = to_dn[i].dn_type != DMU_OT_NONE ? &to_dn[i] : nullptr;
+      to_next = i + (b != nullptr ? b->dn_extra_slots + 1 : 1);
+    }
+    uint64_t object = blk.blkid * per_blk + i;
+    if (a == nullptr && b == nullptr) {
+      continue;
+    }
+    uint64_t slots = 0;
+    bool replaced = a != nullptr && b != nullptr && a->dn_type != b->dn_type;
+    if (a != nullptr && b != nullptr && !replaced) {
+      slots = std::min<uint64_t>(std::max(a->dn_extra_slots, b->dn_extra_slots) + 1, per_blk - i);
+      if (memcmp(a, b, slots << DNODE_SHIFT) == 0) {
+        continue;
+      }
+      replaced = object_reused(ctx, a, b);
+    }
+    if (b == nullptr || replaced) {
+      out->push_back(diff_object{object, DIFF_DELETED, a->dn_type, false, {}});
+    }
+    if (a == nullptr || replaced) {
+      out->push_back(diff_object{object, DIFF_CREATED, b->dn_type, false, {}});
+      continue;
+    }
+    if (b == nullptr) {
+      continue;
+    }
+
+    diff_object obj{object, DIFF_MODIFIED, b->dn_type, bonus_differs(a, b), {}};
+    diff_object_data(ctx, a, b, &obj);
+    // the dnode changed in some other way, e.g. its block pointers moved with identical contents
+    if (obj.ranges.empty()) {
+      obj.metadata = true;
+    }
+    out->push_back(obj);
+  }
+}
+
+void diff_objsets(const blkptr_t *from_bp, const blkptr_t *to_bp, const void *dev_base_ptr, const zpl_fs *from_fs,
+                  const zpl_fs *to_fs, unsigned nthreads, std::vector<diff_object> *out, diff_stats *stats) {
+  diff_ctx ctx(dev_base_ptr, from_fs, to_fs);
+  out->clear();
+  memset(stats, 0, sizeof(*stats));
+  if (bp_same(from_bp, to_bp)) {
+    return;
+  }
+  auto from_os = read_objset(from_bp, dev_base_ptr), to_os = read_objset(to_bp, dev_base_ptr);
+  auto from_mdn = &((const objset_phys_t*)from_os.data())->os_meta_dnode;
+  auto to_mdn = &((const objset_phys_t*)to_os.data())->os_meta_dnode;
+  assert(from_mdn->dn_datablkszsec == to_mdn->dn_datablkszsec && from_mdn->dn_indblkshift == to_mdn->dn_indblkshift);
+
+  // the changed dnode blocks are cheap to find, comparing their dnodes is the work to spread out
+  std::vector<diff_block> blocks;
+  diff_trees(&ctx, from_mdn, to_mdn, [&](uint64_t blkid, const blkptr_t *from, const blkptr_t *to) {
+    blocks.push_back(diff_block{blkid, *from, *to});
+  });
+  stats->dnode_blocks = blocks.size();
+
+  uint64_t blksz = to_mdn->dn_datablkszsec * ZFS_SEC_SIZE;
+  std::mutex lock;
+  parallel_for(blocks.size(), nthreads, [&](uint64_t i) {
+    std::vector<diff_object> local;
+    diff_dnode_block(&ctx, blocks[i], blksz, &local);
+    std::lock_guard<std::mutex> guard(lock);
+    out->insert(out->end(), local.begin(), local.end());
+  });
+  std::stable_sort(out->begin(), out->end(), [](const diff_object &a, const diff_object &b) {
+    return a.object < b.object;
+  });
+  stats->indirect_reads = ctx.indirect_reads;
+}
+
+static std::string object_name(const zpl_fs *fs, const diff_object &obj) {
+  std::string path;
+  if (fs != nullptr) {
+    path = zpl_path(*fs, obj.object);
+  }
+  return path.empty() ? "object " + std::to_string(obj.object) : path;
+}
+
+void print_diff(const std::vector<diff_object> &objects, const zpl_fs *from_fs, const zpl_fs *to_fs) {
+  for (auto &obj : objects) {
+    static const char kinds[] = {'+', '-', 'M'};
+    auto name = object_name(obj.kind == DIFF_DELETED ? from_fs : to_fs, obj);
+    printf("%c %s (%s)", kinds[obj.kind], name.c_str(), dmu_object_type_name(obj.type).c_str());
+    if (obj.metadata) {
+      printf(" metadata");
+    }
+    for (auto &r : obj.ranges) {
+      printf(" [0x%" PRIx64 ", 0x%" PRIx64 ")", r.offset, r.offset + r.length);
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "zfs_reader.h"
+#include "zpl.h"
+
+/*
+ * Block level diff of two versions of an objset, e.g. two snapshots of a
+ * dataset or a snapshot and its head.  The meta dnode trees, and then the
+ * trees of every object whose dnode changed, are walked side by side and
+ * any pair of block pointers with the same DVA and birth txg is skipped
+ * without being read, so the cost follows the amount of change rather
+ * than the size of the dataset.
+ */
+
+enum diff_kind {
+  DIFF_CREATED,
+  DIFF_DELETED,
+  DIFF_MODIFIED,
+};
+
+struct diff_range {
+  uint64_t offset;
+  uint64_t length;
+};
+
+struct diff_object {
+  uint64_t object;
+  diff_kind kind;
+  int type;                   // dn_type, of the newer dnode unless deleted
+  bool metadata;              // bonus buffer or spill block changed
+  std::vector<diff_range> ranges;     // changed data, empty for created and deleted objects
+};
+
+struct diff_stats {
+  uint64_t dnode_blocks;      // meta dnode blocks that differ
+  uint64_t indirect_reads;    // indirect blocks read on either side
+};
+
+// objects that differ between the objsets behind from_bp and to_bp, sorted by object.
+// with both sides opened as filesystems, a file whose object number was reused is
+// reported deleted and created rather than modified
+void diff_objsets(const blkptr_t *from_bp, const blkptr_t *to_bp, const void *dev_base_ptr, const zpl_fs *from_fs,
+                  const zpl_fs *to_fs, unsigned nthreads, std::vector<diff_object> *out, diff_stats *stats);
+
+// zfs diff style listing; with a ZPL objset on either side objects are shown by path
+void print_diff(const std::vector<diff_object> &objects, const zpl_fs *from_fs, const zpl_fs *to_fs);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+inline unsigned parallel_threads() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+/*
+ * Run f(i) for every i in [0, n) on nthreads threads.  Indices are handed
+ * out one at a time, so uneven work items (a huge space map next to empty
+ * ones) still keep every thread busy.  f must be safe to call concurrently.
+ */
+template <typename F>
+void parallel_for(uint64_t n, unsigned nthreads, F f) {
+  std::atomic<uint64_t> next(0);
+  auto worker = [&]() {
+    for (uint64_t i = next++; i < n; i = next++) {
+      f(i);
+    }
+  };
+  if (nthreads <= 1 || n <= 1) {
+    worker();
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < nthreads && t < n; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : threads) {
+    t.join();
+  }
+}
@@ -0,0 +1,242 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <zlib.h>
+
+#include "parquet.h"
+
+#define PARQUET_MAGIC "PAR1"
+
+// parquet.thrift enum values used here
+#define PARQUET_PAGE_DATA 0
+#define PARQUET_ENCODING_PLAIN 0
+#define PARQUET_ENCODING_RLE 3
+#define PARQUET_CODEC_GZIP 2
+#define PARQUET_REPETITION_REQUIRED 0
+
+// thrift compact protocol field types
+#define TCT_I32 5
+#define TCT_I64 6
+#define TCT_BINARY 8
+#define TCT_LIST 9
+#define TCT_STRUCT 12
+
+namespace {
+
+struct thrift_writer {
+  std::vector<uint8_t> buf;
+  std::vector<int16_t> last_field = {0};
+
+  void varint(uint64_t v) {
+    while (v >= 0x80) {
+      buf.push_back((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+    buf.push_back((uint8_t)v);
+  }
+
+  void zigzag(int64_t v) {
+    varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+  }
+
+  // a short form header carries the id as a delta from the previous field of the struct
+  void field(int16_t id, uint8_t type) {
+    int delta = id - last_field.back();
+    if (delta > 0 && delta <= 15) {
+      buf.push_back((uint8_t)(delta << 4 | type));
+    } else {
+      buf.push_back(type);
+      zigzag(id);
+    }
+    last_field.back() = id;
+  }
+
+  void i32(int16_t id, int32_t v) {
+    field(id, TCT_I32);
+    zigzag(v);
+  }
+
+  void i64(int16_t id, int64_t v) {
+    field(id, TCT_I64);
+    zigzag(v);
+  }
+
+  void binary(const std::string &s) {
+    varint(s.size());
+    buf.insert(buf.end(), s.begin(), s.end());
+  }
+
+  void string(int16_t id, const std::string &s) {
+    field(id, TCT_BINARY);
+    binary(s);
+  }
+
+  void list(int16_t id, uint8_t elem_type, size_t size) {
+    field(id, TCT_LIST);
+    if (size < 15) {
+      buf.push_back((uint8_t)(size << 4 | elem_type));
+    } else {
+      buf.push_back(0xf0 | elem_type);
+      varint(size);
+    }
+  }
+
+  // a struct field, or with id 0 a struct element of a list
+  void begin_struct(int16_t id = 0) {
+    if (id != 0) {
+      field(id, TCT_STRUCT);
+    }
+    last_field.push_back(0);
+  }
+
+  void end_struct() {
+    buf.push_back(0);
+    last_field.pop_back();
+  }
+};
+
+}
+
+static bool gzip(const uint8_t *src, size_t len, std::vector<uint8_t> *out) {
+  z_stream zs = {};
+  // 16 + MAX_WBITS asks for a gzip wrapper, which is what the parquet GZIP codec means
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+  out->resize(deflateBound(&zs, len));
+  zs.next_in = (Bytef*)src;
+  zs.avail_in = len;
+  zs.next_out = out->data();
+  zs.avail_out = out->size();
+  int err = deflate(&zs, Z_FINISH);
+  out->resize(zs.total_out);
+  deflateEnd(&zs);
+  return err == Z_STREAM_END;
+}
+
+static std::vector<uint8_t> page_header(uint64_t rows, uint64_t uncompressed, uint64_t compressed) {
+  thrift_writer t;
+  t.begin_struct();
+  t.i32(1, PARQUET_PAGE_DATA);
+  t.i32(2, uncompressed);
+  t.i32(3, compressed);
+  t.begin_struct(5);
+  t.i32(1, rows);
+  t.i32(2, PARQUET_ENCODING_PLAIN);
+  t.i32(3, PARQUET_ENCODING_RLE);
+  t.i32(4, PARQUET_ENCODING_RLE);
+  t.end_struct();
+  t.end_struct();
+  return t.buf;
+}
+
+bool parquet_open(const std::string &path, const std::vector<parquet_column> &columns, parquet_writer *w) {
+  w->f = fopen(path.c_str(), "wb");
+  if (w->f == nullptr) {
+    std::cerr << "failed to create " << path << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  w->path = path;
+  w->columns = columns;
+  w->row_groups.clear();
+  w->rows = 0;
+  w->error = fwrite(PARQUET_MAGIC, 1, 4, w->f) != 4;
+  w->offset = 4;
+  return !w->error;
+}
+
+bool parquet_write_row_group(parquet_writer *w, const std::vector<std::vector<uint8_t>> &values, uint64_t rows) {
+  assert(values.size() == w->columns.size());
+  if (rows == 0) {
+    return true;
+  }
+  std::vector<std::vector<uint8_t>> pages(values.size());
+  parquet_row_group_meta rg;
+  rg.rows = rows;
+  for (size_t c = 0; c < values.size(); c++) {
+    std::vector<uint8_t> data;
+    if (!gzip(values[c].data(), values[c].size(), &data)) {
+      std::cerr << "failed to compress column " << w->columns[c].name << std::endl;
+      return false;
+    }
+    pages[c] = page_header(rows, values[c].size(), data.size());
+    uint64_t header = pages[c].size();
+    pages[c].insert(pages[c].end(), data.begin(), data.end());
+    rg.chunks.push_back(parquet_chunk_meta{0, pages[c].size(), header + values[c].size()});
+  }
+
+  std::lock_guard<std::mutex> guard(w->lock);
+  for (size_t c = 0; c < pages.size(); c++) {
+    rg.chunks[c].offset = w->offset;
+    w->error |= fwrite(pages[c].data(), 1, pages[c].size(), w->f) != pages[c].size();
+    w->offset += pages[c].size();
+  }
+  w->rows += rows;
+  w->row_groups.push_back(std::move(rg));
+  return !w->error;
+}
+
+bool parquet_close(parquet_writer *w) {
+  thrift_writer t;
+  t.begin_struct();
+  t.i32(1, 1);
+
+  t.list(2, TCT_STRUCT, w->columns.size() + 1);
+  t.begin_struct();
+  t.string(4, "schema");
+  t.i32(5, w->columns.size());
+  t.end_struct();
+  for (auto &col : w->columns) {
+    t.begin_struct();
+    t.i32(1, col.type);
+    t.i32(3, PARQUET_REPETITION_REQUIRED);
+    t.string(4, col.name);
+    t.end_struct();
+  }
+
+  t.i64(3, w->rows);
+  t.list(4, TCT_STRUCT, w->row_groups.size());
+  for (auto &rg : w->row_groups) {
+    t.begin_struct();
+    t.list(1, TCT_STRUCT, rg.chunks.size());
+    uint64_t total = 0;
+    for (size_t c = 0; c < rg.chunks.size(); c++) {
+      auto &chunk = rg.chunks[c];
+      total += chunk.uncompressed;
+      t.begin_struct();
+      t.i64(2, chunk.offset);
+      t.begin_struct(3);
+      t.i32(1, w->columns[c].type);
+      t.list(2, TCT_I32, 2);
+      t.zigzag(PARQUET_ENCODING_PLAIN);
+      t.zigzag(PARQUET_ENCODING_RLE);
+      t.list(3, TCT_BINARY, 1);
+      t.binary(w->columns[c].name);
+      t.i32(4, PARQUET_CODEC_GZIP);
+      t.i64(5, rg.rows);
+      t.i64(6, chunk.uncompressed);
+      t.i64(7, chunk.compressed);
+      t.i64(9, chunk.offset);
+      t.end_struct();
+      t.end_struct();
+    }
+    t.i64(2, total);
+    t.i64(3, rg.rows);
+    t.end_struct();
+  }
+  t.string(6, "zfs-experiments");
+  t.end_struct();
+
+  uint32_t len = t.buf.size();
+  w->error |= fwrite(t.buf.data(), 1, t.buf.size(), w->f) != t.buf.size();
+  w->error |= fwrite(&len, sizeof(len), 1, w->f) != 1;
+  w->error |= fwrite(PARQUET_MAGIC, 1, 4, w->f) != 4;
+  w->error |= fclose(w->f) != 0;
+  w->f = nullptr;
+  if (w->error) {
+    std::cerr << "failed to write " << w->path << ", err: " << strerror(errno) << std::endl;
+  }
+  return !w->error;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * A minimal Apache Parquet writer: flat schemas of required INT32/INT64
+ * columns, PLAIN encoded, one gzip compressed data page per column chunk.
+ * That is enough for pandas, DuckDB, Spark and friends to read the file.
+ * The file metadata is Thrift compact protocol, encoded by hand.
+ *
+ * Row groups may be written from several threads; each call compresses its
+ * pages before taking the lock, which only covers the write itself.
+ */
+enum parquet_type {
+  PARQUET_INT32 = 1,
+  PARQUET_INT64 = 2,
+};
+
+struct parquet_column {
+  std::string name;
+  parquet_type type;
+};
+
+struct parquet_chunk_meta {
+  uint64_t offset;            // of the data page header
+  uint64_t compressed;        // page header and compressed data
+  uint64_t uncompressed;      // page header and plain data
+};
+
+struct parquet_row_group_meta {
+  uint64_t rows;
+  std::vector<parquet_chunk_meta> chunks;
+};
+
+struct parquet_writer {
+  FILE *f;
+  std::string path;
+  uint64_t offset;
+  uint64_t rows;
+  bool error;
+  std::vector<parquet_column> columns;
+  std::vector<parquet_row_group_meta> row_groups;
+  std::mutex lock;
+};
+
+bool parquet_open(const std::string &path, const std::vector<parquet_column> &columns, parquet_writer *w);
+
+// values[i] holds rows little endian values of columns[i], 4 or 8 bytes each by its type
+bool parquet_write_row_group(parquet_writer *w, const std::vector<std::vector<uint8_t>> &values, uint64_t rows);
+
+// write the footer and close the file
+bool parquet_close(parquet_writer *w);
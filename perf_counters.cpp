@@ -0,0 +1,168 @@
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf_counters.h"
+
+bool perf_counters_enabled = false;
+
+namespace {
+
+struct perf_totals {
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t v[PERF_EVENTS];
+};
+
+// a thread's event group, folded into the totals when the thread exits
+struct perf_thread {
+  int fds[PERF_EVENTS] = {-1, -1, -1, -1};
+  bool opened = false;
+  perf_totals totals[PERF_KERNELS] = {};
+  ~perf_thread();
+};
+
+}
+
+static std::mutex perf_lock;
+static perf_totals perf_all[PERF_KERNELS];
+static FILE *perf_out = nullptr;
+static thread_local perf_thread perf_local;
+
+static const uint64_t perf_configs[PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int perf_open(uint64_t config, int group_fd) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+// open the calling thread's group, all counters or none
+static bool perf_open_group(int *fds) {
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    fds[e] = perf_open(perf_configs[e], e == 0 ? -1 : fds[0]);
+    if (fds[e] < 0) {
+      int err = errno;
+      for (int i = 0; i < e; i++) {
+        close(fds[i]);
+        fds[i] = -1;
+      }
+      errno = err;
+      return false;
+    }
+  }
+  return true;
+}
+
+perf_thread::~perf_thread() {
+  if (!opened) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(perf_lock);
+    for (int k = 0; k < PERF_KERNELS; k++) {
+      perf_all[k].calls += totals[k].calls;
+      perf_all[k].bytes += totals[k].bytes;
+      for (int e = 0; e < PERF_EVENTS; e++) {
+        perf_all[k].v[e] += totals[k].v[e];
+      }
+    }
+  }
+  for (int fd : fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+void perf_read(perf_sample *s) {
+  auto t = &perf_local;
+  if (!t->opened) {
+    t->opened = true;
+    // a thread that can't open its group (out of file descriptors) just isn't counted
+    perf_open_group(t->fds);
+  }
+  if (t->fds[0] < 0) {
+    return;
+  }
+  // PERF_FORMAT_GROUP: the number of events, then their values in the order they joined the group
+  uint64_t buf[1 + PERF_EVENTS];
+  if (read(t->fds[0], buf, sizeof(buf)) != sizeof(buf) || buf[0] != PERF_EVENTS) {
+    return;
+  }
+  memcpy(s->v, buf + 1, sizeof(s->v));
+  s->valid = true;
+}
+
+void perf_end(int kernel, const perf_sample &begin, uint64_t bytes) {
+  if (!begin.valid) {
+    return;
+  }
+  perf_sample end;
+  perf_read(&end);
+  if (!end.valid) {
+    return;
+  }
+  auto &tot = perf_local.totals[kernel];
+  tot.calls++;
+  tot.bytes += bytes;
+  for (int e = 0; e < PERF_EVENTS; e++) {
+    tot.v[e] += end.v[e] - begin.v[e];
+  }
+}
+
+void perf_counters_print(FILE *out) {
+  static const char *names[PERF_KERNELS] = {"lz4", "checksum", "dnode decode"};
+  std::lock_guard<std::mutex> guard(perf_lock);
+  fprintf(out, "%-13s %10s %10s %14s %6s %11s %13s %9s\n", "kernel", "calls", "MB", "cycles", "IPC", "bytes/cycle",
+          "misses/KB", "br MPKI");
+  for (int k = 0; k < PERF_KERNELS; k++) {
+    auto &t = perf_all[k];
+    if (t.calls == 0) {
+      continue;
+    }
+    double cycles = t.v[PERF_CYCLES], instructions = t.v[PERF_INSTRUCTIONS];
+    fprintf(out, "%-13s %10" PRIu64 " %10.1f %14" PRIu64 " %6.2f %11.3f %13.2f %9.2f\n", names[k], t.calls,
+            t.bytes / 1048576.0, t.v[PERF_CYCLES], cycles != 0 ? instructions / cycles : 0.0,
+            cycles != 0 ? t.bytes / cycles : 0.0, t.bytes != 0 ? t.v[PERF_CACHE_MISSES] * 1024.0 / t.bytes : 0.0,
+            instructions != 0 ? 1000.0 * t.v[PERF_BRANCH_MISSES] / instructions : 0.0);
+  }
+  fflush(out);
+}
+
+static void perf_counters_exit() {
+  // the main thread's counters are folded in by its thread_local destructor, which runs before this
+  perf_counters_print(perf_out);
+}
+
+bool perf_counters_start(FILE *out) {
+  if (perf_counters_enabled) {
+    return true;
+  }
+  int fds[PERF_EVENTS];
+  if (!perf_open_group(fds)) {
+    fprintf(out, "hardware counters unavailable: %s\n", strerror(errno));
+    return false;
+  }
+  for (int fd : fds) {
+    close(fd);
+  }
+  perf_out = out;
+  perf_counters_enabled = true;
+  atexit(perf_counters_exit);
+  return true;
+}
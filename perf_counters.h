@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+/*
+ * Hardware counters around the hot kernels, to see what a new decoder or
+ * checksum implementation does on a given CPU without an external
+ * profiler.  Each thread opens its own perf_event group on first use
+ * (cycles, instructions, cache misses, branch misses), counting only that
+ * thread in user space.  Off unless perf_counters_start() succeeded; a
+ * measured call then costs two read() system calls, so only the totals per
+ * kernel are meaningful, not the absolute run time.
+ */
+enum perf_kernel {
+  PERF_LZ4,                   // LZ4 block decompression
+  PERF_CHECKSUM,              // checksum_verify()
+  PERF_DNODE_DECODE,          // finding the dnodes in a dnode block
+  PERF_KERNELS
+};
+
+enum perf_event_kind {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_EVENTS
+};
+
+extern bool perf_counters_enabled;
+
+struct perf_sample {
+  bool valid;
+  uint64_t v[PERF_EVENTS];
+};
+
+// read the thread's counters before a kernel
+void perf_read(perf_sample *s);
+
+inline void perf_begin(perf_sample *s) {
+  s->valid = false;
+  if (perf_counters_enabled) {
+    perf_read(s);
+  }
+}
+
+// charge the counters since begin and bytes processed to kernel
+void perf_end(int kernel, const perf_sample &begin, uint64_t bytes);
+
+/*
+ * Turn the counters on and print them per kernel to out at exit.  False,
+ * with the reason printed, if the kernel doesn't let us count (see
+ * perf_event_paranoid).  Call before any worker threads are started.
+ */
+bool perf_counters_start(FILE *out);
+
+void perf_counters_print(FILE *out);
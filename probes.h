@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ * USDT probes, provider zfs_label, for bpftrace and friends:
+ *
+ *   block__read__start, block__read__done    (vdev, offset, psize, level, type)
+ *   decompress__start, decompress__done      (offset, compress, psize, lsize)
+ *   cache__hit, cache__miss                  (objset block ptr, blkid) of the metadata cache
+ *   checksum__error                          (offset, psize, checksum, level, type)
+ *   visit__start, visit__done                (objset, object, level, blkid, type)
+ *
+ * A probe is a nop in the text until a tracer attaches, e.g.
+ * bpftrace -e 'usdt:./zfs_label:zfs_label:block__read__start { @[arg3] = count(); }'.
+ * Without sys/sdt.h (systemtap-sdt-dev) they compile to nothing.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(zfs_label, name, a, b)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(zfs_label, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(zfs_label, name, a, b, c, d, e)
+#else
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#define PROBE5(name, a, b, c, d, e) do {} while (0)
+#endif
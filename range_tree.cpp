@@ -0,0 +1,108 @@
+#include <cassert>
+#include <algorithm>
+
+#include "range_tree.h"
+
+range_tree::pos range_tree::first_ending_at_or_after(uint32_t s) const {
+  if (rt_leaves.empty()) {
+    return pos{0, 0};
+  }
+  // the last leaf starting at or before s, or the first leaf
+  size_t l = std::upper_bound(rt_first.begin(), rt_first.end(), s) - rt_first.begin();
+  l = l == 0 ? 0 : l - 1;
+  auto &leaf = rt_leaves[l];
+  // segments are disjoint, so their ends are sorted too
+  size_t i = std::lower_bound(leaf.begin(), leaf.end(), s, [](const range_seg32 &rs, uint32_t v) {
+    return rs.rs_end < v;
+  }) - leaf.begin();
+  if (i == leaf.size()) {
+    return pos{l + 1, 0};
+  }
+  return pos{l, i};
+}
+
+void range_tree::erase(const pos &p) {
+  auto &leaf = rt_leaves[p.leaf];
+  rt_space -= (uint64_t)(leaf[p.idx].rs_end - leaf[p.idx].rs_start) << rt_shift;
+  rt_numsegs--;
+  leaf.erase(leaf.begin() + p.idx);
+  if (leaf.empty()) {
+    rt_leaves.erase(rt_leaves.begin() + p.leaf);
+    rt_first.erase(rt_first.begin() + p.leaf);
+  } else {
+    rt_first[p.leaf] = leaf.front().rs_start;
+  }
+}
+
+void range_tree::insert(range_seg32 rs) {
+  rt_space += (uint64_t)(rs.rs_end - rs.rs_start) << rt_shift;
+  rt_numsegs++;
+  if (rt_leaves.empty()) {
+    rt_leaves.emplace_back(1, rs);
+    rt_first.push_back(rs.rs_start);
+    return;
+  }
+  size_t l = std::upper_bound(rt_first.begin(), rt_first.end(), rs.rs_start) - rt_first.begin();
+  l = l == 0 ? 0 : l - 1;
+  auto &leaf = rt_leaves[l];
+  auto it = std::lower_bound(leaf.begin(), leaf.end(), rs, [](const range_seg32 &a, const range_seg32 &b) {
+    return a.rs_start < b.rs_start;
+  });
+  leaf.insert(it, rs);
+  rt_first[l] = leaf.front().rs_start;
+
+  if (leaf.size() > RANGE_TREE_LEAF_MAX) {
+    std::vector<range_seg32> right(leaf.begin() + leaf.size() / 2, leaf.end());
+    leaf.resize(leaf.size() / 2);
+    leaf.shrink_to_fit();
+    rt_first.insert(rt_first.begin() + l + 1, right.front().rs_start);
+    rt_leaves.insert(rt_leaves.begin() + l + 1, std::move(right));
+  }
+}
+
+void range_tree::add(uint64_t start, uint64_t size) {
+  assert(start >= rt_start && size > 0);
+  uint64_t s64 = (start - rt_start) >> rt_shift;
+  uint64_t e64 = (start - rt_start + size) >> rt_shift;
+  assert(e64 <= UINT32_MAX);
+  auto s = (uint32_t)s64, e = (uint32_t)e64;
+
+  // swallow every segment that overlaps or touches [s, e)
+  for (auto p = first_ending_at_or_after(s); valid(p) && seg(p).rs_start <= e; p = first_ending_at_or_after(s)) {
+    s = std::min(s, seg(p).rs_start);
+    e = std::max(e, seg(p).rs_end);
+    erase(p);
+  }
+  insert(range_seg32{s, e});
+}
+
+void range_tree::remove(uint64_t start, uint64_t size) {
+  assert(start >= rt_start && size > 0);
+  uint64_t e64 = (start - rt_start + size) >> rt_shift;
+  assert(e64 <= UINT32_MAX);
+  auto s = (uint32_t)((start - rt_start) >> rt_shift), e = (uint32_t)e64;
+
+  std::vector<range_seg32> overlapping;
+  for (auto p = first_ending_at_or_after(s + 1); valid(p) && seg(p).rs_start < e;
+       p = first_ending_at_or_after(s + 1)) {
+    overlapping.push_back(seg(p));
+    erase(p);
+  }
+  for (auto &rs : overlapping) {
+    if (rs.rs_start < s) {
+      insert(range_seg32{rs.rs_start, s});
+    }
+    if (rs.rs_end > e) {
+      insert(range_seg32{e, rs.rs_end});
+    }
+  }
+}
+
+size_t range_tree::memory_used() const {
+  size_t bytes = sizeof(*this) + rt_first.capacity() * sizeof(uint32_t) +
+      rt_leaves.capacity() * sizeof(std::vector<range_seg32>);
+  for (auto &leaf : rt_leaves) {
+    bytes += leaf.capacity() * sizeof(range_seg32);
+  }
+  return bytes;
+}
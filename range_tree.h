@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * A set of disjoint [start, end) segments within one metaslab.
+ *
+ * Like the kernel's range_seg32 trees, segments are stored as 32 bit
+ * start/end pairs relative to rt_start in units of 1 << rt_shift, 8 bytes
+ * a segment instead of a ~48 byte std::map node.  They live in a B+-tree
+ * of height two: sorted leaves of at most RANGE_TREE_LEAF_MAX segments and
+ * one interior level holding the first start of each leaf.
+ */
+struct range_seg32 {
+  uint32_t rs_start;
+  uint32_t rs_end;
+};
+
+#define RANGE_TREE_LEAF_MAX 512
+
+class range_tree {
+ public:
+  range_tree(uint64_t start, uint64_t shift) : rt_start(start), rt_shift(shift), rt_space(0), rt_numsegs(0) {}
+
+  // adjacent and overlapping segments are merged
+  void add(uint64_t start, uint64_t size);
+  // removes whatever part of [start, start + size) is in the tree
+  void remove(uint64_t start, uint64_t size);
+
+  uint64_t space() const { return rt_space; }
+  uint64_t numsegs() const { return rt_numsegs; }
+
+  // f(start, size) in byte offsets, in ascending order
+  template <typename F>
+  void walk(F f) const {
+    for (auto &leaf : rt_leaves) {
+      for (auto &rs : leaf) {
+        f(rt_start + ((uint64_t)rs.rs_start << rt_shift), (uint64_t)(rs.rs_end - rs.rs_start) << rt_shift);
+      }
+    }
+  }
+
+  size_t memory_used() const;
+
+ private:
+  struct pos {
+    size_t leaf;
+    size_t idx;
+  };
+
+  pos first_ending_at_or_after(uint32_t s) const;
+  bool valid(const pos &p) const { return p.leaf < rt_leaves.size(); }
+  const range_seg32 &seg(const pos &p) const { return rt_leaves[p.leaf][p.idx]; }
+  void erase(const pos &p);
+  void insert(range_seg32 rs);
+
+  uint64_t rt_start;
+  uint64_t rt_shift;
+  uint64_t rt_space;
+  uint64_t rt_numsegs;
+  std::vector<uint32_t> rt_first;                 // rs_start of each leaf's first segment
+  std::vector<std::vector<range_seg32>> rt_leaves;
+};
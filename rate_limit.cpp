@@ -0,0 +1,38 @@
+#include <algorithm>
+#include <thread>
+
+#include "rate_limit.h"
+
+void rate_limit_init(rate_limiter *rl, uint64_t bytes_per_sec, uint64_t iops) {
+  rl->bytes_per_sec = bytes_per_sec;
+  rl->iops = iops;
+  rl->byte_tokens = bytes_per_sec;
+  rl->io_tokens = iops;
+  rl->last = std::chrono::steady_clock::now();
+}
+
+void rate_limit_acquire(rate_limiter *rl, uint64_t bytes) {
+  if (rl->bytes_per_sec == 0 && rl->iops == 0) {
+    return;
+  }
+  double wait = 0;
+  {
+    std::lock_guard<std::mutex> guard(rl->lock);
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - rl->last).count();
+    rl->last = now;
+    if (rl->bytes_per_sec != 0) {
+      rl->byte_tokens = std::min<double>(rl->byte_tokens + elapsed * rl->bytes_per_sec, rl->bytes_per_sec);
+      rl->byte_tokens -= bytes;
+      wait = std::max(wait, -rl->byte_tokens / rl->bytes_per_sec);
+    }
+    if (rl->iops != 0) {
+      rl->io_tokens = std::min<double>(rl->io_tokens + elapsed * rl->iops, rl->iops);
+      rl->io_tokens -= 1;
+      wait = std::max(wait, -rl->io_tokens / rl->iops);
+    }
+  }
+  if (wait > 0) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+  }
+}
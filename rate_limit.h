@@ -0,0 +1,25 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * A token bucket over bytes and I/Os, so a long scan can run next to a live
+ * workload.  Each bucket holds at most one second of its rate; a request
+ * that overdraws it is let through and the caller sleeps until the debt is
+ * paid back, which keeps large reads from starving behind small ones.
+ */
+struct rate_limiter {
+  uint64_t bytes_per_sec;     // 0 for no limit
+  uint64_t iops;              // 0 for no limit
+  std::mutex lock;
+  double byte_tokens;
+  double io_tokens;
+  std::chrono::steady_clock::time_point last;
+};
+
+void rate_limit_init(rate_limiter *rl, uint64_t bytes_per_sec, uint64_t iops);
+
+// account for one I/O of bytes, sleeping as long as the limits require; thread safe
+void rate_limit_acquire(rate_limiter *rl, uint64_t bytes);
@@ -0,0 +1,221 @@
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <time.h>
+
+#include <lz4.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "recompress.h"
+#include "traverse.h"
+
+// two sided 95% confidence
+#define RECOMPRESS_Z 1.96
+
+// zfs prefixes lz4 output with its length, big endian
+static size_t lz4_compress(const void *src, size_t s_len, void *dst, size_t d_len, int) {
+  if (d_len <= sizeof(uint32_t)) {
+    return 0;
+  }
+  int n = LZ4_compress_default((const char*)src, (char*)dst + sizeof(uint32_t), s_len, d_len - sizeof(uint32_t));
+  return n <= 0 ? 0 : n + sizeof(uint32_t);
+}
+
+static size_t gzip_compress(const void *src, size_t s_len, void *dst, size_t d_len, int level) {
+  uLongf n = d_len;
+  if (compress2((Bytef*)dst, &n, (const Bytef*)src, s_len, level) != Z_OK) {
+    return 0;
+  }
+  return n;
+}
+
+#ifdef HAVE_ZSTD
+// zfs prefixes zstd output with its length and level, 8 bytes
+static size_t zstd_compress(const void *src, size_t s_len, void *dst, size_t d_len, int level) {
+  if (d_len <= 2 * sizeof(uint32_t)) {
+    return 0;
+  }
+  size_t n = ZSTD_compress((char*)dst + 2 * sizeof(uint32_t), d_len - 2 * sizeof(uint32_t), src, s_len, level);
+  return ZSTD_isError(n) ? 0 : n + 2 * sizeof(uint32_t);
+}
+#endif
+
+std::vector<recompress_algo> recompress_algos() {
+  std::vector<recompress_algo> algos;
+  algos.push_back(recompress_algo{"lz4", 0, lz4_compress});
+  for (int level = 1; level <= 9; level++) {
+    algos.push_back(recompress_algo{"gzip-" + std::to_string(level), level, gzip_compress});
+  }
+#ifdef HAVE_ZSTD
+  for (int level = 1; level <= 19; level++) {
+    algos.push_back(recompress_algo{"zstd-" + std::to_string(level), level, zstd_compress});
+  }
+#endif
+  return algos;
+}
+
+namespace {
+
+// per algorithm sums over the sample, for the ratio estimator and its variance
+struct recompress_sums {
+  double c;
+  double c2;
+  double cl;
+  double seconds;
+};
+
+}
+
+static double thread_cpu_seconds() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool all_zero(const std::vector<uint8_t> &data) {
+  for (uint8_t b : data) {
+    if (b != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// what zio_compress_data() and zio_write_compress() would allocate for a c_len result
+static uint64_t stored_size(size_t c_len, uint64_t lsize, uint64_t sector) {
+  if (c_len == 0) {
+    return lsize;
+  }
+  uint64_t psize = P2ROUNDUP((uint64_t)c_len, sector);
+  return psize >= lsize ? lsize : psize;
+}
+
+void recompress_estimate(uint64_t objset, const blkptr_t *os_bp, const void *dev_base_ptr, uint64_t ashift,
+                         double percent, unsigned nthreads, recompress_report *report) {
+  auto algos = recompress_algos();
+  uint64_t stride = std::max<uint64_t>(1, (uint64_t)std::llround(100.0 / percent));
+  uint64_t sector = 1ULL << ashift;
+
+  std::atomic<uint64_t> blocks(0), lsize(0), psize(0), skipped(0);
+  std::mutex lock;
+  uint64_t n = 0;
+  double sum_l = 0, sum_l2 = 0;
+  std::vector<recompress_sums> sums(algos.size(), recompress_sums());
+
+  traverse_stats ts;
+  traverse_objset(objset, os_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &zb, const blkptr_t *bp) {
+    auto type = BP_GET_TYPE(bp);
+    if (BP_GET_LEVEL(bp) != 0 || (type != DMU_OT_PLAIN_FILE_CONTENTS && type != DMU_OT_ZVOL)) {
+      return;
+    }
+    uint64_t bp_lsize = BP_GET_LSIZE(bp);
+    blocks++;
+    lsize += bp_lsize;
+    psize += BP_GET_PSIZE(bp);
+
+    // a different phase per object spreads the sample over both objects and offsets
+    uint64_t phase = (zb.zb_object * 0x9e3779b97f4a7c15ULL >> 32) % stride;
+    if ((zb.zb_blkid + phase) % stride != 0) {
+      return;
+    }
+    if (BP_IS_EMBEDDED(bp) || BP_USES_CRYPT(bp) || !can_decompress(BP_GET_COMPRESS(bp))) {
+      skipped++;
+      return;
+    }
+
+    auto data = read_block(bp, dev_base_ptr);
+    bool zero = all_zero(data);
+    static thread_local std::vector<uint8_t> out;
+    // anything that does not save an eighth is stored uncompressed
+    out.resize(bp_lsize - (bp_lsize >> 3));
+    std::vector<recompress_sums> local(algos.size(), recompress_sums());
+    for (size_t a = 0; a < algos.size(); a++) {
+      double c = 0;
+      if (!zero) {
+        double start = thread_cpu_seconds();
+        size_t c_len = algos[a].compress(data.data(), data.size(), out.data(), out.size(), algos[a].level);
+        local[a].seconds = thread_cpu_seconds() - start;
+        c = stored_size(c_len, bp_lsize, sector);
+      }
+      local[a].c = c;
+      local[a].c2 = c * c;
+      local[a].cl = c * bp_lsize;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    n++;
+    sum_l += bp_lsize;
+    sum_l2 += (double)bp_lsize * bp_lsize;
+    for (size_t a = 0; a < algos.size(); a++) {
+      sums[a].c += local[a].c;
+      sums[a].c2 += local[a].c2;
+      sums[a].cl += local[a].cl;
+      sums[a].seconds += local[a].seconds;
+    }
+  }, &ts);
+
+  report->blocks = blocks;
+  report->lsize = lsize;
+  report->psize = psize;
+  report->sampled = n;
+  report->sampled_lsize = sum_l;
+  report->skipped = skipped;
+  report->algos.clear();
+  if (n == 0) {
+    return;
+  }
+
+  /*
+   * Ratio estimator: new psize = R * lsize with R = sum(c) / sum(l) over
+   * the sample, and Var(R) ~= (1 - n/N) * s^2 / (n * mean(l)^2) where s^2
+   * is the sample variance of c - R * l.
+   */
+  double mean_l = sum_l / n;
+  double fpc = std::max(0.0, 1.0 - (double)n / report->blocks);
+  for (size_t a = 0; a < algos.size(); a++) {
+    auto &s = sums[a];
+    double r = s.c / sum_l;
+    double s2 = n > 1 ? std::max(0.0, s.c2 - 2 * r * s.cl + r * r * sum_l2) / (n - 1) : 0;
+    double se = std::sqrt(fpc * s2 / n) / mean_l;
+    double r_lo = std::max(r - RECOMPRESS_Z * se, 1e-9), r_hi = r + RECOMPRESS_Z * se;
+
+    recompress_result res;
+    res.name = algos[a].name;
+    res.ratio = r == 0 ? INFINITY : 1 / r;
+    res.ratio_lo = 1 / r_hi;
+    res.ratio_hi = 1 / r_lo;
+    res.est_psize = r * report->lsize;
+    res.seconds = s.seconds;
+    res.est_seconds = s.seconds * report->lsize / sum_l;
+    report->algos.push_back(res);
+  }
+}
+
+void print_recompress_report(const recompress_report &report) {
+  printf("%" PRIu64 " data blocks, %s logical, %s physical now (%.2fx)\n", report.blocks,
+         nicenum(report.lsize).c_str(), nicenum(report.psize).c_str(),
+         report.psize == 0 ? 1.0 : (double)report.lsize / report.psize);
+  printf("sampled %" PRIu64 " blocks (%.2f%%), %s logical", report.sampled,
+         report.blocks == 0 ? 0.0 : 100.0 * report.sampled / report.blocks, nicenum(report.sampled_lsize).c_str());
+  if (report.skipped != 0) {
+    printf(", %" PRIu64 " embedded, encrypted or undecodable blocks skipped", report.skipped);
+  }
+  printf("\n\n");
+  if (report.algos.empty()) {
+    return;
+  }
+
+  printf("%-10s %7s %17s %9s %9s %10s\n", "algorithm", "ratio", "95% interval", "PSIZE", "MB/s", "CPU time");
+  for (auto &r : report.algos) {
+    printf("%-10s %6.2fx %7.2fx - %6.2fx %9s %9.1f %9.1fs\n", r.name.c_str(), r.ratio, r.ratio_lo, r.ratio_hi,
+           nicenum(r.est_psize).c_str(), r.seconds == 0 ? 0.0 : report.sampled_lsize / r.seconds / 1e6,
+           r.est_seconds);
+  }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "zfs_reader.h"
+
+/*
+ * What-if estimate of a dataset's size and compression cost under other
+ * compression algorithms, from a sample of its level 0 data blocks.
+ *
+ * Sampling is systematic within each object: every stride'th block
+ * starting at a per object offset, so every file and every region of a
+ * large file is represented.  Each sampled block, gang blocks reassembled
+ * from their members, is decompressed through read_block() and recompressed
+ * with every candidate the way zio_compress_data() would store it: not at
+ * all unless it saves 1/8, rounded up to the vdev's sector size, and all
+ * zero blocks become holes.
+ */
+
+struct recompress_algo {
+  std::string name;
+  int level;
+  // compressed size, 0 if it did not fit in d_len
+  size_t (*compress)(const void *src, size_t s_len, void *dst, size_t d_len, int level);
+};
+
+// lz4, gzip-1..9 and, when built with zstd, zstd-1..19
+std::vector<recompress_algo> recompress_algos();
+
+struct recompress_result {
+  std::string name;
+  double ratio;               // estimated lsize / new psize over the whole dataset
+  double ratio_lo;            // 95% confidence interval of the ratio
+  double ratio_hi;
+  uint64_t est_psize;         // estimated new psize of the whole dataset
+  double seconds;             // CPU time spent compressing the sample
+  double est_seconds;         // extrapolated to the whole dataset
+};
+
+struct recompress_report {
+  uint64_t blocks;            // candidate blocks in the dataset
+  uint64_t lsize;
+  uint64_t psize;
+  uint64_t sampled;
+  uint64_t sampled_lsize;
+  uint64_t skipped;           // sampled but not readable: embedded, encrypted or unknown compression
+  std::vector<recompress_result> algos;
+};
+
+// sample about percent% of the blocks of the dataset whose objset is os_bp
+void recompress_estimate(uint64_t objset, const blkptr_t *os_bp, const void *dev_base_ptr, uint64_t ashift,
+                         double percent, unsigned nthreads, recompress_report *report);
+
+void print_recompress_report(const recompress_report &report);
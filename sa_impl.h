@@ -0,0 +1,49 @@
+#pragma once
+
+#include "spa.h"
+
+/*
+ * On-disk layout of the system attributes that ZPL keeps in the bonus
+ * buffer (and spill block) of each znode.
+ *
+ * The SA master node is a zap with a REGISTRY and a LAYOUTS zap.  The
+ * registry maps attribute names to an encoded (number, length, byteswap)
+ * triple, a length of 0 meaning the attribute is variable sized.  Each
+ * layout is a zap entry named by its decimal layout number whose value is
+ * the array of uint16_t attribute numbers, in the order they are stored.
+ */
+#define	SA_LAYOUTS	"LAYOUTS"
+#define	SA_REGISTRY	"REGISTRY"
+
+#define	ATTR_BSWAP(x)	BF32_GET(x, 16, 8)
+#define	ATTR_LENGTH(x)	BF32_GET(x, 24, 16)
+#define	ATTR_NUM(x)	BF32_GET(x, 0, 16)
+
+#define	SA_MAGIC	0x2F505A
+
+/*
+ * sa_hdr_phys -> sa_layout_info
+ *
+ * 16      10       0
+ * +--------+-------+
+ * | hdrsz  |layout |
+ * +--------+-------+
+ *
+ * Bits 0-10 are the layout number
+ * Bits 11-16 are the size of the header.
+ * The hdrsize is the number * 8
+ *
+ * For example.
+ * hdrsz of 1 ==> 8 byte header
+ *          2 ==> 16 byte header
+ *
+ */
+#define	SA_HDR_LAYOUT_NUM(hdr) BF32_GET(hdr->sa_layout_info, 0, 10)
+#define	SA_HDR_SIZE(hdr) BF32_GET_SB(hdr->sa_layout_info, 10, 6, 3, 0)
+
+typedef struct sa_hdr_phys {
+  uint32_t sa_magic;
+  uint16_t sa_layout_info;
+  uint16_t sa_lengths[1];	/* optional sizes for variable length attrs */
+  /* ... Data follows the lengths.  */
+} sa_hdr_phys_t;
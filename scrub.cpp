@@ -0,0 +1,342 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+
+#include "scrub.h"
+#include "checkpoint.h"
+#include "checksum.h"
+#include "parallel.h"
+#include "rate_limit.h"
+#include "stage_stats.h"
+
+// entries a traversal thread collects before taking the queue lock
+#define SCRUB_BATCH 4096
+
+namespace {
+
+struct scrub_entry {
+  uint64_t offset;
+  uint64_t asize;
+  blkptr_t bp;
+  zbookmark_phys_t zb;
+};
+
+// neighbouring entries read together
+struct scrub_range {
+  uint64_t start;
+  uint64_t end;
+  size_t first;
+  size_t last;
+};
+
+struct scrub_ctx {
+  int dev_fd;
+  uint64_t dev_data_off;
+  const void *dev_base_ptr;
+  unsigned nthreads;
+  uint64_t queue_bytes;
+  const vdev_map *map;
+  rate_limiter rate;
+  scan_checkpoint *ckpt = nullptr;
+  bool ckpt_ok = true;
+  double prior_seconds = 0;
+  std::chrono::steady_clock::time_point start;
+
+  std::mutex lock;
+  std::vector<scrub_entry> queue;
+
+  std::atomic<uint64_t> copies, shared, unverified, unreachable, reads, bytes;
+  uint64_t passes = 0;
+  std::mutex errors_lock;
+  std::vector<scrub_error> errors;
+
+  scrub_ctx() : copies(0), shared(0), unverified(0), unreachable(0), reads(0), bytes(0) {}
+};
+
+// which batch this thread fills, valid for one scrub_pool() call
+struct scrub_slot {
+  uint64_t generation;
+  std::vector<scrub_entry> *batch;
+};
+
+}
+
+static std::atomic<uint64_t> scrub_generation(0);
+static thread_local scrub_slot scrub_local = {0, nullptr};
+static thread_local std::vector<uint8_t> scrub_read_buf;
+
+static void add_error(scrub_ctx *ctx, const scrub_entry &e, bool io) {
+  std::lock_guard<std::mutex> guard(ctx->errors_lock);
+  ctx->errors.push_back(scrub_error{e.zb, 0, e.offset, BP_GET_PSIZE(&e.bp), io});
+}
+
+static bool read_range(scrub_ctx *ctx, const scrub_range &r, uint8_t *buf) {
+  uint64_t len = r.end - r.start, done = 0;
+  rate_limit_acquire(&ctx->rate, len);
+  uint64_t start = stage_begin();
+  while (done < len) {
+    ssize_t n = pread(ctx->dev_fd, buf + done, len - done, ctx->dev_data_off + r.start + done);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  stage_end(STAGE_READ, start, len);
+  return true;
+}
+
+static void scrub_issue_range(scrub_ctx *ctx, const scrub_range &r) {
+  auto &q = ctx->queue;
+  scrub_read_buf.resize(std::max<size_t>(scrub_read_buf.size(), r.end - r.start));
+  bool ok = read_range(ctx, r, scrub_read_buf.data());
+  ctx->reads++;
+  ctx->bytes += r.end - r.start;
+  for (size_t i = r.first; i < r.last; i++) {
+    auto &e = q[i];
+    ctx->copies++;
+    if (i > r.first && e.offset == q[i - 1].offset &&
+        memcmp(&e.bp.blk_cksum, &q[i - 1].bp.blk_cksum, sizeof(zio_cksum_t)) == 0) {
+      ctx->shared++;
+      continue;
+    }
+    if (!ok) {
+      add_error(ctx, e, true);
+      continue;
+    }
+    const uint8_t *data = scrub_read_buf.data() + (e.offset - r.start);
+    // a gang DVA points at a copy of the gang header, the checksum covers its members' data
+    std::vector<uint8_t> gang;
+    if (BP_IS_GANG(&e.bp)) {
+      if (!gang_header_verify(&e.bp, (const zio_gbh_phys_t*)data)) {
+        add_error(ctx, e, false);
+        continue;
+      }
+      gang = read_block_raw(&e.bp, ctx->dev_base_ptr);
+      data = gang.data();
+    }
+    switch (checksum_verify(&e.bp, data)) {
+      case CHECKSUM_OK:
+        break;
+      case CHECKSUM_BAD:
+        add_error(ctx, e, false);
+        break;
+      case CHECKSUM_UNVERIFIED:
+        ctx->unverified++;
+        break;
+    }
+  }
+  if (ctx->map != nullptr) {
+    vdev_map_scanned(*ctx->map, ctx->dev_data_off + r.start, r.end - r.start);
+  }
+}
+
+// the counters of a checkpoint's state, followed by its errors
+enum scrub_state_field {
+  SS_COPIES, SS_SHARED, SS_UNVERIFIED, SS_UNREACHABLE, SS_READS, SS_BYTES, SS_PASSES, SS_NANOSECONDS,
+  SS_FIELDS
+};
+
+static std::vector<uint8_t> scrub_state(scrub_ctx *ctx) {
+  double seconds = ctx->prior_seconds +
+                   std::chrono::duration<double>(std::chrono::steady_clock::now() - ctx->start).count();
+  uint64_t fields[SS_FIELDS] = {ctx->copies, ctx->shared, ctx->unverified, ctx->unreachable, ctx->reads,
+                                ctx->bytes, ctx->passes, (uint64_t)(seconds * 1e9)};
+  std::vector<uint8_t> state((const uint8_t*)fields, (const uint8_t*)(fields + SS_FIELDS));
+  std::lock_guard<std::mutex> guard(ctx->errors_lock);
+  auto errors = (const uint8_t*)ctx->errors.data();
+  state.insert(state.end(), errors, errors + ctx->errors.size() * sizeof(scrub_error));
+  return state;
+}
+
+static void scrub_restore(scrub_ctx *ctx, const std::vector<uint8_t> &state) {
+  if (state.size() < SS_FIELDS * sizeof(uint64_t)) {
+    return;
+  }
+  auto fields = (const uint64_t*)state.data();
+  ctx->copies = fields[SS_COPIES];
+  ctx->shared = fields[SS_SHARED];
+  ctx->unverified = fields[SS_UNVERIFIED];
+  ctx->unreachable = fields[SS_UNREACHABLE];
+  ctx->reads = fields[SS_READS];
+  ctx->bytes = fields[SS_BYTES];
+  ctx->passes = fields[SS_PASSES];
+  ctx->prior_seconds = fields[SS_NANOSECONDS] / 1e9;
+  auto errors = (const scrub_error*)(fields + SS_FIELDS);
+  ctx->errors.assign(errors, errors + (state.size() - SS_FIELDS * sizeof(uint64_t)) / sizeof(scrub_error));
+}
+
+// sort the queue, read it range by range and empty it; called with ctx->lock held
+static void scrub_issue(scrub_ctx *ctx) {
+  auto &q = ctx->queue;
+  if (q.empty()) {
+    return;
+  }
+  std::sort(q.begin(), q.end(), [](const scrub_entry &a, const scrub_entry &b) {
+    return a.offset < b.offset;
+  });
+  std::vector<scrub_range> ranges;
+  for (size_t i = 0; i < q.size(); i++) {
+    uint64_t end = q[i].offset + q[i].asize;
+    if (!ranges.empty()) {
+      auto &r = ranges.back();
+      if (q[i].offset <= r.end + SCRUB_AGG_GAP && std::max(end, r.end) - r.start <= SCRUB_AGG_MAX) {
+        r.end = std::max(end, r.end);
+        r.last = i + 1;
+        continue;
+      }
+    }
+    ranges.push_back(scrub_range{q[i].offset, end, i, i + 1});
+  }
+  // ranges are handed out in order, so the threads sweep the disk together
+  if (ctx->map != nullptr) {
+    vdev_map_access(*ctx->map, VDEV_ACCESS_SCAN);
+  }
+  parallel_for(ranges.size(), ctx->nthreads, [&](uint64_t i) {
+    scrub_issue_range(ctx, ranges[i]);
+  });
+  if (ctx->map != nullptr) {
+    vdev_map_access(*ctx->map, VDEV_ACCESS_LOOKUP);
+  }
+  q.clear();
+  ctx->passes++;
+  // every dnode block finished so far had its blocks in this pass or an earlier one
+  if (ctx->ckpt != nullptr && !checkpoint_commit(ctx->ckpt, scrub_state(ctx), false)) {
+    ctx->ckpt_ok = false;
+  }
+}
+
+static void scrub_flush(scrub_ctx *ctx, std::vector<scrub_entry> *batch) {
+  std::lock_guard<std::mutex> guard(ctx->lock);
+  ctx->queue.insert(ctx->queue.end(), batch->begin(), batch->end());
+  batch->clear();
+  if (ctx->queue.size() * sizeof(scrub_entry) >= ctx->queue_bytes) {
+    scrub_issue(ctx);
+  }
+}
+
+bool scrub_pool(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr, int dev_fd,
+                uint64_t dev_data_off, unsigned nthreads, const scrub_options &opts, scrub_report *report) {
+  scrub_ctx ctx;
+  ctx.start = std::chrono::steady_clock::now();
+  ctx.dev_fd = dev_fd;
+  ctx.dev_data_off = dev_data_off;
+  ctx.dev_base_ptr = dev_base_ptr;
+  ctx.nthreads = nthreads;
+  ctx.queue_bytes = opts.queue_bytes;
+  ctx.map = opts.map;
+  rate_limit_init(&ctx.rate, opts.bytes_per_sec, opts.iops);
+  scan_checkpoint ckpt;
+  traverse_resume resume;
+  if (!opts.checkpoint.empty()) {
+    if (!checkpoint_open(opts.checkpoint, "scrub", mos_bp, &ckpt)) {
+      return false;
+    }
+    ctx.ckpt = &ckpt;
+    scrub_restore(&ctx, ckpt.state);
+    resume.skip = [&](const zbookmark_phys_t &zb) {
+      return checkpoint_done(ckpt, zb);
+    };
+  }
+  report->resumed = ctx.ckpt != nullptr && ckpt.resumed;
+  uint64_t generation = ++scrub_generation;
+  std::vector<std::unique_ptr<std::vector<scrub_entry>>> batches;
+  std::mutex batches_lock;
+  auto local_batch = [&]() {
+    if (scrub_local.generation != generation) {
+      std::lock_guard<std::mutex> guard(batches_lock);
+      batches.emplace_back(new std::vector<scrub_entry>());
+      scrub_local = scrub_slot{generation, batches.back().get()};
+    }
+    return scrub_local.batch;
+  };
+  if (ctx.ckpt != nullptr) {
+    // a dnode block only counts as finished once its blocks are queued, so they are checked before it is recorded
+    resume.done = [&](const zbookmark_phys_t &zb) {
+      auto batch = local_batch();
+      std::lock_guard<std::mutex> guard(ctx.lock);
+      ctx.queue.insert(ctx.queue.end(), batch->begin(), batch->end());
+      batch->clear();
+      checkpoint_finish(&ckpt, zb);
+      if (ctx.queue.size() * sizeof(scrub_entry) >= ctx.queue_bytes) {
+        scrub_issue(&ctx);
+      }
+    };
+  }
+
+  traverse_pool(mos, mos_bp, dev_base_ptr, nthreads, [&](const zbookmark_phys_t &zb, const blkptr_t *bp) {
+    if (BP_IS_EMBEDDED(bp)) {
+      ctx.unverified++;
+      return;
+    }
+    auto batch = local_batch();
+    // an encrypted block keeps its IV and salt in the third DVA, as in bp_get_asize()
+    bool encrypted = BP_USES_CRYPT(bp) && BP_GET_LEVEL(bp) == 0 && BP_GET_TYPE(bp) != DMU_OT_OBJSET;
+    for (int d = 0; d < (encrypted ? SPA_DVAS_PER_BP - 1 : SPA_DVAS_PER_BP); d++) {
+      auto dva = &bp->blk_dva[d];
+      if (DVA_GET_ASIZE(dva) == 0) {
+        continue;
+      }
+      if (DVA_GET_VDEV(dva) != 0) {
+        ctx.unreachable++;
+        continue;
+      }
+      batch->push_back(scrub_entry{DVA_GET_OFFSET(dva), DVA_GET_ASIZE(dva), *bp, zb});
+    }
+    if (batch->size() >= SCRUB_BATCH) {
+      scrub_flush(&ctx, batch);
+    }
+  }, &report->traverse, 0, ctx.ckpt != nullptr ? &resume : nullptr);
+
+  for (auto &b : batches) {
+    ctx.queue.insert(ctx.queue.end(), b->begin(), b->end());
+  }
+  scrub_issue(&ctx);
+
+  // blocks outside the dnode blocks are checked on every run, report their errors once
+  auto &errors = ctx.errors;
+  std::sort(errors.begin(), errors.end(), [](const scrub_error &a, const scrub_error &b) {
+    return a.offset < b.offset || (a.offset == b.offset && memcmp(&a.zb, &b.zb, sizeof(a.zb)) < 0);
+  });
+  errors.erase(std::unique(errors.begin(), errors.end(), [](const scrub_error &a, const scrub_error &b) {
+    return a.offset == b.offset && memcmp(&a.zb, &b.zb, sizeof(a.zb)) == 0;
+  }), errors.end());
+  report->copies = ctx.copies;
+  report->shared = ctx.shared;
+  report->unverified = ctx.unverified;
+  report->unreachable = ctx.unreachable;
+  report->reads = ctx.reads;
+  report->bytes = ctx.bytes;
+  report->passes = ctx.passes;
+  report->errors = std::move(ctx.errors);
+  report->seconds = ctx.prior_seconds +
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - ctx.start).count();
+  if (ctx.ckpt != nullptr && ctx.ckpt_ok) {
+    checkpoint_remove(&ckpt);
+  }
+  return ctx.ckpt_ok;
+}
+
+void print_scrub_report(const scrub_report &report) {
+  for (auto &e : report.errors) {
+    printf("%s error at %" PRIu64 ":0x%" PRIx64 " psize 0x%" PRIx64 ", <%" PRIu64 ", %" PRIu64 ", %" PRId64 ", %" PRIu64
+           ">\n", e.io ? "read" : "checksum", e.vdev, e.offset, e.psize, e.zb.zb_objset, e.zb.zb_object, e.zb.zb_level,
+           e.zb.zb_blkid);
+  }
+  printf("%" PRIu64 " blocks in %" PRIu64 " objsets, %" PRIu64 " copies checked (%" PRIu64 " shared), %" PRIu64
+         " unverified, %" PRIu64 " on other vdevs\n", report.traverse.blocks, report.traverse.objsets, report.copies,
+         report.shared, report.unverified, report.unreachable);
+  double mb = report.bytes / 1048576.0;
+  printf("%" PRIu64 " reads of %s in %" PRIu64 " passes, %.1f s, %.1f MB/s\n", report.reads,
+         nicenum(report.bytes).c_str(), report.passes, report.seconds,
+         report.seconds > 0 ? mb / report.seconds : 0.0);
+  if (report.resumed) {
+    printf("resumed, %" PRIu64 " dnode blocks were already scrubbed\n", report.traverse.skipped);
+  }
+  printf("%zu errors\n", report.errors.size());
+}
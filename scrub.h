@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "traverse.h"
+#include "vdev_map.h"
+
+// gathered DVAs kept in memory before they are sorted and read
+#define SCRUB_QUEUE_BYTES (512ULL << 20)
+// largest gap read through to join two blocks into one read
+#define SCRUB_AGG_GAP (64 << 10)
+// largest single read
+#define SCRUB_AGG_MAX (16 << 20)
+
+struct scrub_error {
+  zbookmark_phys_t zb;
+  uint64_t vdev;
+  uint64_t offset;
+  uint64_t psize;
+  bool io;                    // the read failed, rather than the checksum
+};
+
+struct scrub_options {
+  uint64_t queue_bytes;       // SCRUB_QUEUE_BYTES unless smaller memory is wanted
+  uint64_t bytes_per_sec;     // read bandwidth limit, 0 for none
+  uint64_t iops;              // read limit, 0 for none
+  std::string checkpoint;     // file to resume from and record progress in, empty for none
+  const vdev_map *map;        // of the device, told about the sorted passes; null for none
+};
+
+struct scrub_report {
+  traverse_stats traverse;
+  uint64_t copies;            // DVAs checked
+  uint64_t shared;            // of those, the same DVA reached again (dedup, clones), checked once
+  uint64_t unverified;        // embedded and log blocks and checksums that can't be computed here
+  uint64_t unreachable;       // on vdevs other than the first, which the image doesn't cover
+  uint64_t reads;             // coalesced reads issued
+  uint64_t bytes;             // bytes read, gaps included
+  uint64_t passes;            // times the queue was sorted and issued
+  double seconds;             // including the runs before a resume
+  bool resumed;
+  std::vector<scrub_error> errors;
+};
+
+/*
+ * Scrub the pool in two phases, like the sorted scan of zfs scrub: the
+ * traversal only gathers the DVAs of every block pointer into a queue, and
+ * whenever the queue reaches queue_bytes (and once at the end) it is sorted
+ * by offset, cut into ranges of neighbouring blocks and read with one large
+ * pread() per range from dev_fd.  Each block is then checked against its
+ * checksum.  The ranges are issued in offset order by nthreads threads,
+ * with the map, if any, switched to VDEV_ACCESS_SCAN for the pass.
+ *
+ * With a checkpoint, every issue pass records the dnode blocks whose blocks
+ * have all been checked along with the counts and errors so far, at most
+ * every CHECKPOINT_INTERVAL seconds, and a later run on the same pool state
+ * skips them.  The file is removed once the scrub completes.  Blocks outside
+ * the dnode blocks are checked again after a resume, so the counts are
+ * approximate then.  False if the checkpoint can't be read or written.
+ */
+bool scrub_pool(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr, int dev_fd,
+                uint64_t dev_data_off, unsigned nthreads, const scrub_options &opts, scrub_report *report);
+
+void print_scrub_report(const scrub_report &report);
@@ -0,0 +1,520 @@
+#include <cassert>
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "send.h"
+#include "checksum.h"
+
+enum send_job_kind {
+  SEND_JOB_RECORD,            // record and payload are complete
+  SEND_JOB_READ,              // payload is the block behind bp, decompressed
+  SEND_JOB_READ_RAW,          // payload is the block behind bp as stored
+};
+
+namespace {
+
+struct send_job {
+  dmu_replay_record_t drr;
+  int kind;
+  blkptr_t bp;
+  std::vector<uint8_t> payload;
+  bool ready;
+};
+
+/*
+ * Jobs live in a ring indexed by sequence number.  The planner fills slot
+ * queued, workers take slots in order starting at claimed and mark them
+ * ready, and the writer consumes slot written once it is ready.  A slot is
+ * only reused after the writer is done with it.
+ */
+struct send_ctx {
+  const void *dev_base_ptr;
+  const send_options *opts;
+  uint64_t fromtxg;
+  uint64_t toguid;
+  uint64_t featureflags;
+  FILE *out;
+  send_stats *stats;
+
+  std::mutex lock;
+  std::condition_variable space, work, ready;
+  std::vector<send_job> ring;
+  uint64_t queued = 0, claimed = 0, written = 0;
+  bool done = false;
+  bool failed = false;
+
+  // a FREE or FREEOBJECTS record the planner may still extend
+  dmu_replay_record_t pending;
+  bool has_pending = false;
+
+  zio_cksum_t zc = {};
+};
+
+typedef std::function<bool(uint64_t blkid, const blkptr_t *bp)> send_block_cb_t;
+typedef std::function<bool(uint64_t blkid, uint64_t nblks)> send_hole_cb_t;
+
+}
+
+static bool write_job(send_ctx *ctx, send_job *job) {
+  auto drr = &job->drr;
+  if (drr->drr_type == DRR_END) {
+    drr->drr_u.drr_end.drr_checksum = ctx->zc;
+  }
+  fletcher_4_incremental_native(drr, offsetof(dmu_replay_record_t, drr_u.drr_checksum.drr_checksum), &ctx->zc);
+  if (drr->drr_type != DRR_BEGIN) {
+    drr->drr_u.drr_checksum.drr_checksum = ctx->zc;
+  }
+  fletcher_4_incremental_native(&drr->drr_u.drr_checksum.drr_checksum, sizeof(zio_cksum_t), &ctx->zc);
+  fletcher_4_incremental_native(job->payload.data(), job->payload.size(), &ctx->zc);
+
+  if (fwrite(drr, sizeof(*drr), 1, ctx->out) != 1 ||
+      fwrite(job->payload.data(), 1, job->payload.size(), ctx->out) != job->payload.size()) {
+    std::cerr << "failed to write the stream, err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  ctx->stats->records[drr->drr_type]++;
+  ctx->stats->bytes += sizeof(*drr) + job->payload.size();
+  return true;
+}
+
+static void writer_thread(send_ctx *ctx) {
+  std::unique_lock<std::mutex> guard(ctx->lock);
+  for (;;) {
+    ctx->ready.wait(guard, [&]() {
+      return ctx->written < ctx->queued ? ctx->ring[ctx->written % SEND_QUEUE_DEPTH].ready : ctx->done;
+    });
+    if (ctx->written == ctx->queued) {
+      return;
+    }
+    auto &job = ctx->ring[ctx->written % SEND_QUEUE_DEPTH];
+    bool failed = ctx->failed;
+    guard.unlock();
+    // after a failure keep draining so the planner and the workers can finish
+    if (!failed && !write_job(ctx, &job)) {
+      failed = true;
+    }
+    job.payload = std::vector<uint8_t>();
+    guard.lock();
+    ctx->failed |= failed;
+    ctx->written++;
+    ctx->space.notify_one();
+  }
+}
+
+static void encode_job(send_ctx *ctx, send_job *job) {
+  if (job->kind == SEND_JOB_RECORD) {
+    return;
+  }
+  job->payload = job->kind == SEND_JOB_READ_RAW ? read_block_raw(&job->bp, ctx->dev_base_ptr)
+                                                : read_block(&job->bp, ctx->dev_base_ptr);
+  job->drr.drr_payloadlen = job->payload.size();
+  if (job->drr.drr_type == DRR_WRITE && job->kind == SEND_JOB_READ_RAW) {
+    job->drr.drr_u.drr_write.drr_compressed_size = job->payload.size();
+  }
+}
+
+static void worker_thread(send_ctx *ctx) {
+  std::unique_lock<std::mutex> guard(ctx->lock);
+  for (;;) {
+    ctx->work.wait(guard, [&]() { return ctx->claimed < ctx->queued || ctx->done; });
+    if (ctx->claimed == ctx->queued) {
+      return;
+    }
+    auto &job = ctx->ring[ctx->claimed++ % SEND_QUEUE_DEPTH];
+    bool failed = ctx->failed;
+    guard.unlock();
+    if (!failed) {
+      encode_job(ctx, &job);
+    }
+    guard.lock();
+    job.ready = true;
+    ctx->ready.notify_one();
+  }
+}
+
+static bool queue_job(send_ctx *ctx, send_job job) {
+  std::unique_lock<std::mutex> guard(ctx->lock);
+  ctx->space.wait(guard, [&]() { return ctx->queued - ctx->written < SEND_QUEUE_DEPTH; });
+  if (ctx->failed) {
+    return false;
+  }
+  job.ready = false;
+  ctx->ring[ctx->queued++ % SEND_QUEUE_DEPTH] = std::move(job);
+  ctx->work.notify_one();
+  return true;
+}
+
+static bool flush_pending(send_ctx *ctx) {
+  if (!ctx->has_pending) {
+    return true;
+  }
+  ctx->has_pending = false;
+  return queue_job(ctx, send_job{ctx->pending, SEND_JOB_RECORD, {}, {}, false});
+}
+
+static bool queue_record(send_ctx *ctx, const dmu_replay_record_t &drr, std::vector<uint8_t> payload = {}) {
+  if (!flush_pending(ctx)) {
+    return false;
+  }
+  send_job job{drr, SEND_JOB_RECORD, {}, std::move(payload), false};
+  job.drr.drr_payloadlen = job.payload.size();
+  return queue_job(ctx, std::move(job));
+}
+
+static bool queue_read(send_ctx *ctx, const dmu_replay_record_t &drr, int kind, const blkptr_t *bp) {
+  if (!flush_pending(ctx)) {
+    return false;
+  }
+  prefetch_block(bp, ctx->dev_base_ptr);
+  ctx->stats->blocks_read++;
+  return queue_job(ctx, send_job{drr, kind, *bp, {}, false});
+}
+
+static dmu_replay_record_t new_record(int type) {
+  dmu_replay_record_t drr;
+  memset(&drr, 0, sizeof(drr));
+  drr.drr_type = type;
+  return drr;
+}
+
+// consecutive frees of one object are sent as one record, like dump_free() does
+static bool send_free(send_ctx *ctx, uint64_t object, uint64_t offset, uint64_t length) {
+  if (length != DMU_OBJECT_END && offset + length < offset) {
+    length = DMU_OBJECT_END;
+  }
+  auto p = &ctx->pending.drr_u.drr_free;
+  if (ctx->has_pending && ctx->pending.drr_type == DRR_FREE && p->drr_object == object &&
+      p->drr_length != DMU_OBJECT_END && p->drr_offset + p->drr_length == offset) {
+    p->drr_length = length == DMU_OBJECT_END ? DMU_OBJECT_END : p->drr_length + length;
+    return true;
+  }
+  if (!flush_pending(ctx)) {
+    return false;
+  }
+  ctx->pending = new_record(DRR_FREE);
+  *p = drr_free{object, offset, length, ctx->toguid};
+  ctx->has_pending = true;
+  return true;
+}
+
+static bool send_freeobjects(send_ctx *ctx, uint64_t firstobj, uint64_t numobjs) {
+  auto p = &ctx->pending.drr_u.drr_freeobjects;
+  if (ctx->has_pending && ctx->pending.drr_type == DRR_FREEOBJECTS && p->drr_firstobj + p->drr_numobjs == firstobj) {
+    p->drr_numobjs += numobjs;
+    return true;
+  }
+  if (!flush_pending(ctx)) {
+    return false;
+  }
+  ctx->pending = new_record(DRR_FREEOBJECTS);
+  *p = drr_freeobjects{firstobj, numobjs, ctx->toguid};
+  ctx->has_pending = true;
+  return true;
+}
+
+/*
+ * Visit the block pointers of dn's tree born after fromtxg in blkid order:
+ * level 0 blocks, and holes at any level, which stand for nblks blocks
+ * freed since.  Everything older is pruned without being read.
+ */
+static bool walk_bp(send_ctx *ctx, const dnode_phys_t *dn, const blkptr_t *bp, int level, uint64_t blkid,
+                    const send_block_cb_t &block_cb, const send_hole_cb_t &hole_cb) {
+  if (bp->blk_birth <= ctx->fromtxg) {
+    return true;
+  }
+  int shift = level * (dn->dn_indblkshift - SPA_BLKPTRSHIFT);
+  if (BP_IS_HOLE(bp)) {
+    return hole_cb(shift < 64 ? blkid << shift : DMU_OBJECT_END, shift < 64 ? 1ULL << shift : DMU_OBJECT_END);
+  }
+  if (level == 0) {
+    return block_cb(blkid, bp);
+  }
+  auto data = read_block(bp, ctx->dev_base_ptr);
+  auto bps = (const blkptr_t*)data.data();
+  uint64_t epb = data.size() / sizeof(blkptr_t);
+  for (uint64_t i = 0; i < epb; i++) {
+    if (!walk_bp(ctx, dn, &bps[i], level - 1, blkid * epb + i, block_cb, hole_cb)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool walk_dnode(send_ctx *ctx, const dnode_phys_t *dn, const send_block_cb_t &block_cb,
+                       const send_hole_cb_t &hole_cb) {
+  for (int i = 0; i < dn->dn_nblkptr; i++) {
+    if (!walk_bp(ctx, dn, &dn->dn_blkptr[i], dn->dn_nlevels - 1, i, block_cb, hole_cb)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool send_block(send_ctx *ctx, uint64_t object, const dnode_phys_t *dn, uint64_t blkid, const blkptr_t *bp) {
+  uint64_t blksz = dn->dn_datablkszsec << SPA_MINBLOCKSHIFT;
+  if (BP_USES_CRYPT(bp)) {
+    std::cerr << "object " << object << " block " << blkid << " is encrypted, can't be sent" << std::endl;
+    return false;
+  }
+  int compress = BP_GET_COMPRESS(bp);
+  if (BP_IS_EMBEDDED(bp)) {
+    if (ctx->opts->embedded && BPE_GET_ETYPE(bp) == BP_EMBEDDED_TYPE_DATA) {
+      auto drr = new_record(DRR_WRITE_EMBEDDED);
+      auto w = &drr.drr_u.drr_write_embedded;
+      w->drr_object = object;
+      w->drr_offset = blkid * blksz;
+      w->drr_length = blksz;
+      w->drr_toguid = ctx->toguid;
+      w->drr_compression = compress;
+      w->drr_etype = BPE_GET_ETYPE(bp);
+      w->drr_lsize = BPE_GET_LSIZE(bp);
+      w->drr_psize = BPE_GET_PSIZE(bp);
+      std::vector<uint8_t> payload(P2ROUNDUP(w->drr_psize, 8), 0);
+      decode_embedded_bp_compressed(bp, payload.data());
+      return queue_record(ctx, drr, std::move(payload));
+    }
+  }
+
+  auto drr = new_record(DRR_WRITE);
+  auto w = &drr.drr_u.drr_write;
+  w->drr_object = object;
+  w->drr_type = dn->dn_type;
+  w->drr_offset = blkid * blksz;
+  w->drr_logical_size = blksz;
+  w->drr_toguid = ctx->toguid;
+  if (!BP_IS_EMBEDDED(bp)) {
+    w->drr_checksumtype = BP_GET_CHECKSUM(bp);
+    DDK_SET_LSIZE(&w->drr_key, BP_GET_LSIZE(bp));
+    DDK_SET_PSIZE(&w->drr_key, BP_GET_PSIZE(bp));
+    DDK_SET_COMPRESS(&w->drr_key, compress);
+    w->drr_key.ddk_cksum = bp->blk_cksum;
+  }
+  bool raw = ctx->opts->compressed && !BP_IS_EMBEDDED(bp) && compress != ZIO_COMPRESS_OFF &&
+             compress != ZIO_COMPRESS_INHERIT && compress != ZIO_COMPRESS_EMPTY &&
+             (compress != ZIO_COMPRESS_ZSTD || (ctx->featureflags & DMU_BACKUP_FEATURE_ZSTD));
+  if (raw) {
+    w->drr_compressiontype = compress;
+    ctx->stats->passthrough++;
+    return queue_read(ctx, drr, SEND_JOB_READ_RAW, bp);
+  }
+  if (!can_decompress(compress)) {
+    std::cerr << "object " << object << " block " << blkid << " uses compression " << compress
+              << ", which can't be decompressed" << std::endl;
+    return false;
+  }
+  return queue_read(ctx, drr, SEND_JOB_READ, bp);
+}
+
+static bool send_object(send_ctx *ctx, uint64_t object, const dnode_phys_t *dn) {
+  uint64_t blksz = dn->dn_datablkszsec << SPA_MINBLOCKSHIFT;
+  auto drr = new_record(DRR_OBJECT);
+  auto o = &drr.drr_u.drr_object;
+  o->drr_object = object;
+  o->drr_type = dn->dn_type;
+  o->drr_bonustype = dn->dn_bonustype;
+  o->drr_blksz = blksz;
+  o->drr_bonuslen = dn->dn_bonuslen;
+  o->drr_dn_slots = dn->dn_extra_slots + 1;
+  o->drr_checksumtype = dn->dn_checksum;
+  o->drr_compress = dn->dn_compress;
+  o->drr_toguid = ctx->toguid;
+  if (dn->dn_flags & DNODE_FLAG_SPILL_BLKPTR) {
+    o->drr_flags |= DRR_OBJECT_SPILL;
+  }
+  std::vector<uint8_t> bonus(P2ROUNDUP(dn->dn_bonuslen, 8), 0);
+  memcpy(bonus.data(), DN_BONUS(dn), dn->dn_bonuslen);
+  if (!queue_record(ctx, drr, std::move(bonus)) ||
+      !send_free(ctx, object, (dn->dn_maxblkid + 1) * blksz, DMU_OBJECT_END)) {
+    return false;
+  }
+
+  bool ok = walk_dnode(ctx, dn, [&](uint64_t blkid, const blkptr_t *bp) {
+    return send_block(ctx, object, dn, blkid, bp);
+  }, [&](uint64_t blkid, uint64_t nblks) {
+    return send_free(ctx, object, blkid * blksz, nblks == DMU_OBJECT_END ? DMU_OBJECT_END : nblks * blksz);
+  });
+  if (!ok) {
+    return false;
+  }
+
+  if (dn->dn_flags & DNODE_FLAG_SPILL_BLKPTR) {
+    auto spill = DN_SPILL_BLKPTR(dn);
+    if (spill->blk_birth > ctx->fromtxg && !BP_IS_HOLE(spill)) {
+      auto drr = new_record(DRR_SPILL);
+      auto s = &drr.drr_u.drr_spill;
+      s->drr_object = object;
+      s->drr_length = BP_GET_LSIZE(spill);
+      s->drr_toguid = ctx->toguid;
+      s->drr_type = BP_GET_TYPE(spill);
+      return queue_read(ctx, drr, SEND_JOB_READ, spill);
+    }
+  }
+  return true;
+}
+
+// the objects of one changed meta dnode block
+static bool send_dnode_block(send_ctx *ctx, uint64_t blkid, const blkptr_t *bp) {
+  auto data = read_block(bp, ctx->dev_base_ptr);
+  auto dnodes = (const dnode_phys_t*)data.data();
+  uint64_t per_blk = data.size() >> DNODE_SHIFT;
+  for (uint64_t i = 0; i < per_blk; i++) {
+    uint64_t object = blkid * per_blk + i;
+    auto dn = &dnodes[i];
+    bool ok = true;
+    if (object == DMU_META_DNODE_OBJECT) {
+      continue;
+    } else if (dn->dn_type == DMU_OT_NONE) {
+      ok = send_freeobjects(ctx, object, 1);
+    } else {
+      ok = send_object(ctx, object, dn);
+      i += dn->dn_extra_slots;
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint64_t dataset_features(const objset_phys_t *mos, uint64_t ds_obj, const void *dev_base_ptr) {
+  auto data = read_dnode(mos, ds_obj, dev_base_ptr);
+  auto dn = (const dnode_phys_t*)data.data();
+  uint64_t features = 0, value;
+  // a dataset only becomes a zap once some per dataset feature is activated on it
+  if (dn->dn_type != DMU_OTN_ZAP_METADATA) {
+    return features;
+  }
+  if (zap_lookup(dn, "org.open-zfs:large_blocks", dev_base_ptr, &value)) {
+    features |= DMU_BACKUP_FEATURE_LARGE_BLOCKS;
+  }
+  if (zap_lookup(dn, "org.zfsonlinux:large_dnode", dev_base_ptr, &value)) {
+    features |= DMU_BACKUP_FEATURE_LARGE_DNODE;
+  }
+  if (zap_lookup(dn, "org.freebsd:zstd_compress", dev_base_ptr, &value)) {
+    features |= DMU_BACKUP_FEATURE_ZSTD;
+  }
+  return features;
+}
+
+// whether from is to itself or one of the snapshots before it, following the origin of clones
+static bool is_before(const objset_phys_t *mos, const dataset_info &to, const dataset_info &from,
+                      const void *dev_base_ptr) {
+  uint64_t obj = to.ds.ds_prev_snap_obj;
+  while (obj != 0) {
+    if (obj == from.ds_obj) {
+      return true;
+    }
+    auto data = read_dnode(mos, obj, dev_base_ptr);
+    auto ds = (const dsl_dataset_phys_t*)DN_BONUS((const dnode_phys_t*)data.data());
+    if (ds->ds_creation_txg < from.ds.ds_creation_txg) {
+      return false;
+    }
+    obj = ds->ds_prev_snap_obj;
+  }
+  return false;
+}
+
+bool send_stream(const objset_phys_t *mos, const dataset_info &to, const dataset_info *from, const std::string &toname,
+                 const void *dev_base_ptr, const send_options &opts, unsigned nthreads, FILE *out, send_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (from != nullptr && !is_before(mos, to, *from, dev_base_ptr)) {
+    std::cerr << from->name << " is not an earlier snapshot of " << to.name << std::endl;
+    return false;
+  }
+  auto os_data = read_objset(&to.ds.ds_bp, dev_base_ptr);
+  auto os = (const objset_phys_t*)os_data.data();
+
+  send_ctx ctx;
+  ctx.dev_base_ptr = dev_base_ptr;
+  ctx.opts = &opts;
+  ctx.fromtxg = from != nullptr ? from->ds.ds_creation_txg : 0;
+  ctx.toguid = to.ds.ds_guid;
+  ctx.out = out;
+  ctx.stats = stats;
+  ctx.ring.resize(SEND_QUEUE_DEPTH);
+  ctx.featureflags = DMU_BACKUP_FEATURE_SA_SPILL | dataset_features(mos, to.ds_obj, dev_base_ptr);
+  if (opts.embedded) {
+    ctx.featureflags |= DMU_BACKUP_FEATURE_EMBED_DATA;
+  }
+  if (opts.compressed) {
+    ctx.featureflags |= DMU_BACKUP_FEATURE_COMPRESSED;
+  } else {
+    ctx.featureflags &= ~DMU_BACKUP_FEATURE_ZSTD;
+  }
+  if (opts.embedded || opts.compressed) {
+    ctx.featureflags |= DMU_BACKUP_FEATURE_LZ4;
+  }
+
+  std::thread writer(writer_thread, &ctx);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < std::max(nthreads, 1U); t++) {
+    workers.emplace_back(worker_thread, &ctx);
+  }
+
+  auto drr = new_record(DRR_BEGIN);
+  auto b = &drr.drr_u.drr_begin;
+  b->drr_magic = DMU_BACKUP_MAGIC;
+  DMU_SET_STREAM_HDRTYPE(b->drr_versioninfo, DMU_SUBSTREAM);
+  DMU_SET_FEATUREFLAGS(b->drr_versioninfo, ctx.featureflags);
+  b->drr_creation_time = to.ds.ds_creation_time;
+  b->drr_type = os->os_type;
+  b->drr_flags = DRR_FLAG_FREERECORDS | DRR_FLAG_SPILL_BLOCK;
+  if (to.ds.ds_flags & DS_FLAG_CI_DATASET) {
+    b->drr_flags |= DRR_FLAG_CI_DATA;
+  }
+  if (from != nullptr && from->dir_obj != to.dir_obj) {
+    b->drr_flags |= DRR_FLAG_CLONE;
+  }
+  b->drr_toguid = ctx.toguid;
+  b->drr_fromguid = from != nullptr ? from->ds.ds_guid : 0;
+  strncpy(b->drr_toname, toname.c_str(), sizeof(b->drr_toname) - 1);
+
+  auto mdn = &os->os_meta_dnode;
+  uint64_t per_blk = (mdn->dn_datablkszsec << SPA_MINBLOCKSHIFT) >> DNODE_SHIFT;
+  bool ok = queue_record(&ctx, drr) && walk_dnode(&ctx, mdn, [&](uint64_t blkid, const blkptr_t *bp) {
+    return send_dnode_block(&ctx, blkid, bp);
+  }, [&](uint64_t blkid, uint64_t nblks) {
+    return send_freeobjects(&ctx, blkid * per_blk, nblks == DMU_OBJECT_END ? DMU_OBJECT_END - blkid * per_blk
+                                                                         : nblks * per_blk);
+  });
+  if (ok) {
+    drr = new_record(DRR_END);
+    drr.drr_u.drr_end.drr_toguid = ctx.toguid;
+    ok = queue_record(&ctx, drr);
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(ctx.lock);
+    ctx.done = true;
+    ctx.work.notify_all();
+    ctx.ready.notify_all();
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  writer.join();
+  return ok && !ctx.failed && fflush(out) == 0;
+}
+
+void print_send_stats(const send_stats &stats) {
+  static const char *names[DRR_NUMTYPES] = {
+      "BEGIN", "OBJECT", "FREEOBJECTS", "WRITE", "FREE", "END", "WRITE_BYREF",
+      "SPILL", "WRITE_EMBEDDED", "OBJECT_RANGE", "REDACT",
+  };
+  fprintf(stderr, "%s stream, %" PRIu64 " data blocks read, %" PRIu64 " sent compressed as stored\n",
+          nicenum(stats.bytes).c_str(), stats.blocks_read, stats.passthrough);
+  for (int t = 0; t < DRR_NUMTYPES; t++) {
+    if (stats.records[t] != 0) {
+      fprintf(stderr, "  %-15s %12" PRIu64 "\n", names[t], stats.records[t]);
+    }
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "zfs_reader.h"
+#include "send_stream.h"
+
+// jobs the stream writer may run ahead of the output
+#define SEND_QUEUE_DEPTH 1024
+
+struct send_options {
+  bool compressed;            // copy compressed blocks as stored, like zfs send -c
+  bool embedded;              // keep embedded block pointers as WRITE_EMBEDDED records, like zfs send -e
+};
+
+struct send_stats {
+  uint64_t records[DRR_NUMTYPES];
+  uint64_t bytes;             // length of the stream
+  uint64_t blocks_read;       // data blocks read for WRITE and SPILL records
+  uint64_t passthrough;       // of those, copied without decompressing
+};
+
+/*
+ * Generate a zfs send stream of to, a snapshot or, since the image is not
+ * changing under us, a head dataset.  With from it is an incremental stream
+ * from that earlier snapshot of to's dataset (or of its origin), otherwise a
+ * full stream.  toname is the snapshot name written into the stream.
+ *
+ * Like zfs send, only blocks born after from's creation txg are visited.
+ * The stream is produced by a pipeline: this thread walks the metadata and
+ * queues one job per record, nthreads workers read the data blocks and
+ * encode the records, and a writer thread checksums and writes them out in
+ * order.  Blocks using encryption can't be sent and fail the stream.
+ */
+bool send_stream(const objset_phys_t *mos, const dataset_info &to, const dataset_info *from, const std::string &toname,
+                 const void *dev_base_ptr, const send_options &opts, unsigned nthreads, FILE *out, send_stats *stats);
+
+void print_send_stats(const send_stats &stats);
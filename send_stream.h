@@ -0,0 +1,172 @@
+#pragma once
+
+#include "spa.h"
+#include "ddt.h"
+
+/*
+ * zfs send stream records, as in zfs_ioctl.h.
+ *
+ * A stream is a DRR_BEGIN record, the records of one objset and a DRR_END
+ * record.  Every record after DRR_BEGIN carries in its last 32 bytes the
+ * fletcher-4 of the stream up to that point; payloads follow their record
+ * and count towards the checksum of the next one.
+ */
+#define	DMU_BACKUP_MAGIC 0x2F5bacbacULL
+
+#define	DMU_SUBSTREAM 0x1
+
+#define	DMU_SET_STREAM_HDRTYPE(vi, x)	BF64_SET((vi), 0, 2, x)
+#define	DMU_SET_FEATUREFLAGS(vi, x)	BF64_SET((vi), 2, 30, x)
+
+#define	DMU_BACKUP_FEATURE_SA_SPILL		(1 << 2)
+#define	DMU_BACKUP_FEATURE_EMBED_DATA		(1 << 16)
+#define	DMU_BACKUP_FEATURE_LZ4			(1 << 17)
+#define	DMU_BACKUP_FEATURE_LARGE_BLOCKS		(1 << 19)
+#define	DMU_BACKUP_FEATURE_COMPRESSED		(1 << 22)
+#define	DMU_BACKUP_FEATURE_LARGE_DNODE		(1 << 23)
+#define	DMU_BACKUP_FEATURE_ZSTD			(1 << 25)
+
+/* drr_begin.drr_flags */
+#define	DRR_FLAG_CLONE		(1 << 0)
+#define	DRR_FLAG_CI_DATA	(1 << 1)
+#define	DRR_FLAG_FREERECORDS	(1 << 2)
+#define	DRR_FLAG_SPILL_BLOCK	(1 << 3)
+
+/* drr_object.drr_flags */
+#define	DRR_OBJECT_SPILL	(1 << 2)
+
+#define	DMU_OBJECT_END		(~0ULL)
+
+enum drr_type {
+  DRR_BEGIN, DRR_OBJECT, DRR_FREEOBJECTS,
+  DRR_WRITE, DRR_FREE, DRR_END, DRR_WRITE_BYREF,
+  DRR_SPILL, DRR_WRITE_EMBEDDED, DRR_OBJECT_RANGE, DRR_REDACT,
+  DRR_NUMTYPES
+};
+
+struct drr_begin {
+  uint64_t drr_magic;
+  uint64_t drr_versioninfo;	/* was drr_version */
+  uint64_t drr_creation_time;
+  uint32_t drr_type;		/* dmu_objset_type_t */
+  uint32_t drr_flags;
+  uint64_t drr_toguid;
+  uint64_t drr_fromguid;
+  char drr_toname[256];
+};
+
+struct drr_end {
+  zio_cksum_t drr_checksum;
+  uint64_t drr_toguid;
+};
+
+struct drr_object {
+  uint64_t drr_object;
+  uint32_t drr_type;		/* dmu_object_type_t */
+  uint32_t drr_bonustype;
+  uint32_t drr_blksz;
+  uint32_t drr_bonuslen;
+  uint8_t drr_checksumtype;
+  uint8_t drr_compress;
+  uint8_t drr_dn_slots;
+  uint8_t drr_flags;
+  uint32_t drr_raw_bonuslen;
+  uint64_t drr_toguid;
+  /* only (possibly) nonzero for raw streams */
+  uint8_t drr_indblkshift;
+  uint8_t drr_nlevels;
+  uint8_t drr_nblkptr;
+  uint8_t drr_pad[5];
+  uint64_t drr_maxblkid;
+  /* bonus content follows */
+};
+
+struct drr_freeobjects {
+  uint64_t drr_firstobj;
+  uint64_t drr_numobjs;
+  uint64_t drr_toguid;
+};
+
+struct drr_write {
+  uint64_t drr_object;
+  uint32_t drr_type;
+  uint32_t drr_pad;
+  uint64_t drr_offset;
+  uint64_t drr_logical_size;
+  uint64_t drr_toguid;
+  uint8_t drr_checksumtype;
+  uint8_t drr_flags;
+  uint8_t drr_compressiontype;
+  uint8_t drr_pad2[5];
+  /* deduplication key */
+  ddt_key_t drr_key;
+  /* only nonzero if drr_compressiontype is not 0 */
+  uint64_t drr_compressed_size;
+  /* only nonzero for raw streams */
+  uint8_t drr_salt[8];
+  uint8_t drr_iv[12];
+  uint8_t drr_mac[16];
+  /* content follows */
+};
+
+struct drr_free {
+  uint64_t drr_object;
+  uint64_t drr_offset;
+  uint64_t drr_length;
+  uint64_t drr_toguid;
+};
+
+struct drr_spill {
+  uint64_t drr_object;
+  uint64_t drr_length;
+  uint64_t drr_toguid;
+  uint8_t drr_flags;
+  uint8_t drr_compressiontype;
+  uint8_t drr_pad[6];
+  /* only nonzero for raw streams */
+  uint64_t drr_compressed_size;
+  uint8_t drr_salt[8];
+  uint8_t drr_iv[12];
+  uint8_t drr_mac[16];
+  uint32_t drr_type;
+  /* spill data follows */
+};
+
+struct drr_write_embedded {
+  uint64_t drr_object;
+  uint64_t drr_offset;
+  /* logical length, should equal blocksize */
+  uint64_t drr_length;
+  uint64_t drr_toguid;
+  uint8_t drr_compression;
+  uint8_t drr_etype;
+  uint8_t drr_pad[6];
+  uint32_t drr_lsize;	/* uncompressed size of payload */
+  uint32_t drr_psize;	/* compr. (real) size of payload */
+  /* (possibly compressed) content follows */
+};
+
+typedef struct dmu_replay_record {
+  uint32_t drr_type;
+  uint32_t drr_payloadlen;
+  union {
+    struct drr_begin drr_begin;
+    struct drr_end drr_end;
+    struct drr_object drr_object;
+    struct drr_freeobjects drr_freeobjects;
+    struct drr_write drr_write;
+    struct drr_free drr_free;
+    struct drr_spill drr_spill;
+    struct drr_write_embedded drr_write_embedded;
+    struct drr_checksum {
+      uint64_t drr_pad[34];
+      /*
+       * fletcher-4 checksum of everything preceding the
+       * checksum.
+       */
+      zio_cksum_t drr_checksum;
+    } drr_checksum;
+  } drr_u;
+} dmu_replay_record_t;
+
+static_assert(sizeof(dmu_replay_record_t) == 312, "dmu_replay_record_t must match the stream format");
@@ -0,0 +1,275 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sidecar.h"
+#include "parallel.h"
+
+namespace {
+
+// an objset's part of the sidecar while it is being built
+struct objset_blocks {
+  sidecar_objset os;
+  std::vector<sidecar_block> blocks;
+};
+
+}
+
+static bool in_file(const sidecar &sc, uint64_t off, uint64_t count, size_t elem) {
+  return off <= sc.size && count <= (sc.size - off) / elem;
+}
+
+bool sidecar_open(const std::string &path, sidecar *sc) {
+  sc->data = nullptr;
+  sc->size = 0;
+  sc->by_meta_cksum.clear();
+  sc->cache = metadata_cache();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(sidecar_header)) {
+    close(fd);
+    return false;
+  }
+  void *m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    std::cerr << "failed to mmap " << path << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  sc->data = (const uint8_t*)m;
+  sc->size = st.st_size;
+  sc->hdr = (const sidecar_header*)sc->data;
+  auto h = sc->hdr;
+  if (h->sc_magic != SIDECAR_MAGIC || h->sc_version != SIDECAR_VERSION ||
+      !in_file(*sc, h->sc_datasets_off, h->sc_ndatasets, sizeof(sidecar_dataset)) ||
+      !in_file(*sc, h->sc_objsets_off, h->sc_nobjsets, sizeof(sidecar_objset)) ||
+      !in_file(*sc, h->sc_blocks_off, h->sc_nblocks, sizeof(sidecar_block)) ||
+      !in_file(*sc, h->sc_names_off, h->sc_names_size, 1)) {
+    std::cerr << path << " is not a sidecar index" << std::endl;
+    sidecar_close(sc);
+    return false;
+  }
+  sc->datasets = (const sidecar_dataset*)(sc->data + h->sc_datasets_off);
+  sc->objsets = (const sidecar_objset*)(sc->data + h->sc_objsets_off);
+  sc->blocks = (const sidecar_block*)(sc->data + h->sc_blocks_off);
+  sc->names = (const char*)(sc->data + h->sc_names_off);
+  for (uint64_t i = 0; i < h->sc_nobjsets; i++) {
+    auto &os = sc->objsets[i];
+    if (os.so_first_block > h->sc_nblocks || os.so_nblocks > h->sc_nblocks - os.so_first_block) {
+      std::cerr << path << " has a bad objset table" << std::endl;
+      sidecar_close(sc);
+      return false;
+    }
+    sc->by_meta_cksum[os.so_meta_bp.blk_cksum.zc_word[0]] = i;
+  }
+  for (uint64_t i = 0; i < h->sc_ndatasets; i++) {
+    auto &ds = sc->datasets[i];
+    if (ds.sd_name_off > h->sc_names_size || ds.sd_name_len > h->sc_names_size - ds.sd_name_off) {
+      std::cerr << path << " has a bad dataset table" << std::endl;
+      sidecar_close(sc);
+      return false;
+    }
+  }
+
+  sc->cache.datasets = [sc](std::vector<dataset_info> *datasets) {
+    for (uint64_t i = 0; i < sc->hdr->sc_ndatasets; i++) {
+      auto &ds = sc->datasets[i];
+      dataset_info info;
+      info.name.assign(sc->names + ds.sd_name_off, ds.sd_name_len);
+      info.dir_obj = ds.sd_dir_obj;
+      info.ds_obj = ds.sd_ds_obj;
+      info.ds = ds.sd_ds;
+      datasets->push_back(info);
+    }
+    return true;
+  };
+  sc->cache.dnode_block = [sc](const objset_phys_t *os, uint64_t blkid, blkptr_t *bp) {
+    auto &meta_bp = os->os_meta_dnode.dn_blkptr[0];
+    auto it = sc->by_meta_cksum.find(meta_bp.blk_cksum.zc_word[0]);
+    if (it == sc->by_meta_cksum.end()) {
+      return false;
+    }
+    auto &so = sc->objsets[it->second];
+    if (memcmp(&so.so_meta_bp, &meta_bp, sizeof(blkptr_t)) != 0) {
+      return false;
+    }
+    auto first = sc->blocks + so.so_first_block, last = first + so.so_nblocks;
+    auto b = std::lower_bound(first, last, blkid, [](const sidecar_block &sb, uint64_t id) {
+      return sb.sb_blkid < id;
+    });
+    // holes are not in the index, let the reader zero fill them
+    if (b == last || b->sb_blkid != blkid) {
+      return false;
+    }
+    *bp = b->sb_bp;
+    return true;
+  };
+  return true;
+}
+
+void sidecar_close(sidecar *sc) {
+  if (sc->data != nullptr) {
+    munmap((void*)sc->data, sc->size);
+  }
+  sc->data = nullptr;
+  sc->size = 0;
+  sc->by_meta_cksum.clear();
+  sc->cache = metadata_cache();
+}
+
+bool sidecar_valid(const sidecar &sc, uint64_t pool_guid, const blkptr_t *rootbp) {
+  return sc.data != nullptr && sc.hdr->sc_pool_guid == pool_guid &&
+         memcmp(&sc.hdr->sc_rootbp, rootbp, sizeof(blkptr_t)) == 0;
+}
+
+/*
+ * Collect the level 0 blocks under bp, which covers blkids [first, first +
+ * (1 << level * epb_shift)).  A subtree born no later than old_txg is the
+ * same as when old was built, so its blocks are copied from old instead.
+ */
+static void collect_blocks(const blkptr_t *bp, int level, uint64_t first, int epb_shift, const void *dev_base_ptr,
+                           uint64_t old_txg, const sidecar_block *old, uint64_t nold,
+                           std::vector<sidecar_block> *out) {
+  if (BP_IS_HOLE(bp)) {
+    return;
+  }
+  uint64_t span = 1ULL << (level * epb_shift);
+  if (old != nullptr && bp->blk_birth <= old_txg) {
+    auto it = std::lower_bound(old, old + nold, first, [](const sidecar_block &sb, uint64_t id) {
+      return sb.sb_blkid < id;
+    });
+    for (; it != old + nold && it->sb_blkid < first + span; ++it) {
+      out->push_back(*it);
+    }
+    return;
+  }
+  if (level == 0) {
+    out->push_back(sidecar_block{first, *bp});
+    return;
+  }
+  auto data = read_block(bp, dev_base_ptr);
+  auto children = (const blkptr_t*)data.data();
+  uint64_t child_span = span >> epb_shift;
+  for (uint64_t i = 0; i < data.size() / sizeof(blkptr_t); i++) {
+    collect_blocks(&children[i], level - 1, first + i * child_span, epb_shift, dev_base_ptr, old_txg, old, nold,
+                   out);
+  }
+}
+
+static void collect_objset(objset_blocks *ob, const void *dev_base_ptr, const sidecar *old,
+                           const sidecar_objset *old_os) {
+  if (old_os != nullptr && memcmp(&old_os->so_bp, &ob->os.so_bp, sizeof(blkptr_t)) == 0) {
+    ob->os.so_meta_bp = old_os->so_meta_bp;
+    ob->blocks.assign(old->blocks + old_os->so_first_block,
+                      old->blocks + old_os->so_first_block + old_os->so_nblocks);
+    return;
+  }
+  auto os_data = read_objset(&ob->os.so_bp, dev_base_ptr);
+  auto mdn = &((const objset_phys_t*)os_data.data())->os_meta_dnode;
+  ob->os.so_meta_bp = mdn->dn_blkptr[0];
+  int epb_shift = mdn->dn_indblkshift - SPA_BLKPTRSHIFT;
+  int top = mdn->dn_nlevels - 1;
+  for (int i = 0; i < mdn->dn_nblkptr; i++) {
+    collect_blocks(&mdn->dn_blkptr[i], top, (uint64_t)i << (top * epb_shift), epb_shift, dev_base_ptr,
+                   old_os != nullptr ? old->hdr->sc_txg : 0,
+                   old_os != nullptr ? old->blocks + old_os->so_first_block : nullptr,
+                   old_os != nullptr ? old_os->so_nblocks : 0, &ob->blocks);
+  }
+}
+
+static bool write_sidecar(const std::string &path, const sidecar_header &h, const std::vector<sidecar_dataset> &ds,
+                          const std::vector<objset_blocks> &objsets, const std::string &names) {
+  std::string tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (f == nullptr) {
+    std::cerr << "failed to create " << tmp << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  sidecar_header hdr = h;
+  hdr.sc_ndatasets = ds.size();
+  hdr.sc_datasets_off = sizeof(hdr);
+  hdr.sc_nobjsets = objsets.size();
+  hdr.sc_objsets_off = hdr.sc_datasets_off + ds.size() * sizeof(sidecar_dataset);
+  hdr.sc_blocks_off = hdr.sc_objsets_off + objsets.size() * sizeof(sidecar_objset);
+  hdr.sc_nblocks = 0;
+  for (auto &ob : objsets) {
+    hdr.sc_nblocks += ob.blocks.size();
+  }
+  hdr.sc_names_off = hdr.sc_blocks_off + hdr.sc_nblocks * sizeof(sidecar_block);
+  hdr.sc_names_size = names.size();
+
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(ds.data(), sizeof(sidecar_dataset), ds.size(), f);
+  uint64_t first = 0;
+  for (auto &ob : objsets) {
+    sidecar_objset so = ob.os;
+    so.so_first_block = first;
+    so.so_nblocks = ob.blocks.size();
+    fwrite(&so, sizeof(so), 1, f);
+    first += so.so_nblocks;
+  }
+  for (auto &ob : objsets) {
+    fwrite(ob.blocks.data(), sizeof(sidecar_block), ob.blocks.size(), f);
+  }
+  fwrite(names.data(), 1, names.size(), f);
+  if (ferror(f) || fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+    std::cerr << "failed to write " << path << ", err: " << strerror(errno) << std::endl;
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool sidecar_build(const objset_phys_t *mos, const blkptr_t *rootbp, const void *dev_base_ptr, const char *pool_name,
+                   uint64_t pool_guid, uint64_t txg, unsigned nthreads, const sidecar *old, const std::string &path) {
+  // an index from another pool, or from after a rewind, says nothing about this state
+  if (old != nullptr && (old->hdr->sc_pool_guid != pool_guid || old->hdr->sc_txg >= txg)) {
+    old = nullptr;
+  }
+
+  std::vector<sidecar_dataset> datasets;
+  std::vector<objset_blocks> objsets;
+  std::string names;
+  objset_blocks mos_ob = {};
+  mos_ob.os.so_objset = 0;
+  mos_ob.os.so_bp = *rootbp;
+  objsets.push_back(mos_ob);
+  for (auto &ds : list_datasets(mos, pool_name, dev_base_ptr, true, true)) {
+    datasets.push_back(sidecar_dataset{ds.ds_obj, ds.dir_obj, names.size(), ds.name.size(), ds.ds});
+    names += ds.name;
+    if (!BP_IS_HOLE(&ds.ds.ds_bp)) {
+      objset_blocks ob = {};
+      ob.os.so_objset = ds.ds_obj;
+      ob.os.so_bp = ds.ds.ds_bp;
+      objsets.push_back(ob);
+    }
+  }
+
+  std::unordered_map<uint64_t, const sidecar_objset*> old_objsets;
+  if (old != nullptr) {
+    for (uint64_t i = 0; i < old->hdr->sc_nobjsets; i++) {
+      old_objsets[old->objsets[i].so_objset] = &old->objsets[i];
+    }
+  }
+  parallel_for(objsets.size(), nthreads, [&](uint64_t i) {
+    auto it = old_objsets.find(objsets[i].os.so_objset);
+    collect_objset(&objsets[i], dev_base_ptr, old, it == old_objsets.end() ? nullptr : it->second);
+  });
+
+  sidecar_header hdr = {};
+  hdr.sc_magic = SIDECAR_MAGIC;
+  hdr.sc_version = SIDECAR_VERSION;
+  hdr.sc_pool_guid = pool_guid;
+  hdr.sc_txg = txg;
+  hdr.sc_rootbp = *rootbp;
+  return write_sidecar(path, hdr, datasets, objsets, names);
+}
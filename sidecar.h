@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "zfs_reader.h"
+
+/*
+ * A sidecar index of the pool metadata every run would otherwise decode
+ * again: the dataset tree, each objset's blkptr and where each objset's
+ * dnode blocks live.  Installed as the reader's metadata_cache, it lets
+ * list_datasets() skip the dsl_dir walk and read_dnode() skip the meta
+ * dnode's indirect blocks.
+ *
+ * The file is a header followed by flat arrays that are used in place from
+ * the mapping: datasets, objsets, each objset's level 0 meta dnode blocks
+ * sorted by blkid, and the dataset names.  It is only valid for the pool
+ * state whose MOS blkptr it records.
+ */
+#define SIDECAR_MAGIC 0x7a66736964656361ULL   // "acedisfz" on disk
+#define SIDECAR_VERSION 1
+
+struct sidecar_header {
+  uint64_t sc_magic;
+  uint64_t sc_version;
+  uint64_t sc_pool_guid;
+  uint64_t sc_txg;
+  blkptr_t sc_rootbp;
+  uint64_t sc_ndatasets;
+  uint64_t sc_datasets_off;
+  uint64_t sc_nobjsets;
+  uint64_t sc_objsets_off;
+  uint64_t sc_nblocks;
+  uint64_t sc_blocks_off;
+  uint64_t sc_names_off;
+  uint64_t sc_names_size;
+};
+
+struct sidecar_dataset {
+  uint64_t sd_ds_obj;
+  uint64_t sd_dir_obj;
+  uint64_t sd_name_off;
+  uint64_t sd_name_len;
+  dsl_dataset_phys_t sd_ds;
+};
+
+struct sidecar_objset {
+  uint64_t so_objset;         // dataset object, 0 for the MOS
+  blkptr_t so_bp;
+  blkptr_t so_meta_bp;        // os_meta_dnode.dn_blkptr[0], identifies the objset_phys_t
+  uint64_t so_first_block;
+  uint64_t so_nblocks;
+};
+
+struct sidecar_block {
+  uint64_t sb_blkid;
+  blkptr_t sb_bp;
+};
+
+struct sidecar {
+  const uint8_t *data;
+  size_t size;
+  const sidecar_header *hdr;
+  const sidecar_dataset *datasets;
+  const sidecar_objset *objsets;
+  const sidecar_block *blocks;
+  const char *names;
+  std::unordered_map<uint64_t, uint64_t> by_meta_cksum;   // so_meta_bp checksum word 0 -> objset index
+  metadata_cache cache;
+};
+
+// map a sidecar file, false if it is missing or malformed
+bool sidecar_open(const std::string &path, sidecar *sc);
+
+void sidecar_close(sidecar *sc);
+
+// whether sc describes exactly the pool state rooted at rootbp
+bool sidecar_valid(const sidecar &sc, uint64_t pool_guid, const blkptr_t *rootbp);
+
+/*
+ * Decode the pool's metadata into a new sidecar at path.  With old from an
+ * earlier txg of the same pool, objsets whose blkptr has not changed are
+ * copied and only meta dnode subtrees born after old's txg are read again.
+ */
+bool sidecar_build(const objset_phys_t *mos, const blkptr_t *rootbp, const void *dev_base_ptr, const char *pool_name,
+                   uint64_t pool_guid, uint64_t txg, unsigned nthreads, const sidecar *old, const std::string &path);
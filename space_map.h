@@ -0,0 +1,97 @@
+#pragma once
+
+#include "spa.h"
+
+/*
+ * The size of the space map object has increased to include a histogram.
+ * The SPACE_MAP_SIZE_V0 designates the original size and is used to
+ * maintain backward compatibility.
+ */
+#define	SPACE_MAP_SIZE_V0	(3 * sizeof (uint64_t))
+#define	SPACE_MAP_HISTOGRAM_SIZE	32
+
+/*
+ * The space_map_phys is the on-disk representation of the space map.
+ * Consumers of space maps should never reference any of the members of this
+ * structure directly. These members may only be updated in syncing context.
+ *
+ * Note the smp_object is no longer used but remains in the structure
+ * for backward compatibility.
+ */
+typedef struct space_map_phys {
+  /* object number: not needed but kept for backwards compatibility */
+  uint64_t	smp_object;
+
+  /* length of the object in bytes */
+  uint64_t	smp_length;
+
+  /* space allocated from the map */
+  int64_t		smp_alloc;
+
+  /* reserved */
+  uint64_t	smp_pad[5];
+
+  /*
+   * The smp_histogram maintains a histogram of free regions. Each
+   * bucket, smp_histogram[i], contains the number of free regions
+   * whose size is:
+   * 2^(i+sm_shift) <= size of free region in bytes < 2^(i+sm_shift+1)
+   *
+   * Note that, if log space map feature is enabled, histograms of
+   * space maps that belong to metaslabs will take into account any
+   * unflushed changes for their metaslabs, even though the actual
+   * space map doesn't have entries for these changes.
+   */
+  uint64_t	smp_histogram[SPACE_MAP_HISTOGRAM_SIZE];
+} space_map_phys_t;
+
+typedef enum {
+  SM_ALLOC,
+  SM_FREE
+} maptype_t;
+
+/*
+ * The one-word space map entry:
+ *
+ *    1  47                                   1           15
+ *   +-----------------------------------------------------------+
+ *   |0|   offset (47 bits)                    | type |   run     |
+ *   +-----------------------------------------------------------+
+ *
+ * The two-word space map entry:
+ *
+ *    2   2     36                   24
+ *   +-----------------------------------------------------------+
+ *   |11| pad |    run (36 bits)   |  vdev (24 bits)              |
+ *   +-----------------------------------------------------------+
+ *   | type |            offset (63 bits)                        |
+ *   +-----------------------------------------------------------+
+ *
+ * Debug entries carry the txg, sync pass and action of the block of
+ * entries that follows them and are skipped when replaying.
+ *
+ * Offsets and runs are in units of the space map's sm_shift, and offsets
+ * are relative to the start of the metaslab.
+ */
+#define	SM_DEBUG_PREFIX	2
+#define	SM2_PREFIX	3
+#define	SM_PREFIX_DECODE(x)	BF64_DECODE(x, 62, 2)
+
+#define	SM_RUN_BITS		15
+#define	SM_RUN_DECODE(x)	(BF64_DECODE(x, 0, SM_RUN_BITS) + 1)
+#define	SM_TYPE_DECODE(x)	BF64_DECODE(x, SM_RUN_BITS, 1)
+#define	SM_OFFSET_BITS		47
+#define	SM_OFFSET_DECODE(x)	BF64_DECODE(x, SM_RUN_BITS + 1, SM_OFFSET_BITS)
+
+#define	SM_DEBUG_ACTION_DECODE(x)	BF64_DECODE(x, 60, 2)
+#define	SM_DEBUG_SYNCPASS_DECODE(x)	BF64_DECODE(x, 50, 10)
+#define	SM_DEBUG_TXG_DECODE(x)		BF64_DECODE(x, 0, 50)
+
+#define	SM_VDEV_BITS		24
+#define	SM_VDEV_DECODE(x)	BF64_DECODE(x, 0, SM_VDEV_BITS)
+#define	SM_NO_VDEVID		((1 << SM_VDEV_BITS) - 1)
+#define	SM2_RUN_BITS		36
+#define	SM2_RUN_DECODE(x)	(BF64_DECODE(x, SM_VDEV_BITS, SM2_RUN_BITS) + 1)
+#define	SM2_OFFSET_BITS		63
+#define	SM2_TYPE_DECODE(x)	BF64_DECODE(x, SM2_OFFSET_BITS, 1)
+#define	SM2_OFFSET_DECODE(x)	BF64_DECODE(x, 0, SM2_OFFSET_BITS)
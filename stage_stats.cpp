@@ -0,0 +1,202 @@
+#include <cinttypes>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stage_stats.h"
+
+bool stage_stats_enabled = false;
+
+namespace {
+
+/*
+ * One thread's counters.  Only the owning thread writes them, so updates
+ * are plain relaxed loads and stores; the atomics only make the concurrent
+ * reads of a periodic dump well defined.
+ */
+struct stage_counters {
+  std::atomic<uint64_t> ops;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> ns;
+  std::atomic<uint64_t> max_ns;
+  std::atomic<uint64_t> hist[STAGE_BUCKETS];
+};
+
+struct thread_stages {
+  stage_counters stages[STAGE_COUNT];
+};
+
+// hands a thread's counters back for the next thread to continue, so short-lived workers don't pile up
+struct thread_stages_slot {
+  thread_stages *stats = nullptr;
+  ~thread_stages_slot();
+};
+
+struct stage_registry {
+  std::mutex lock;
+  std::vector<std::unique_ptr<thread_stages>> all;
+  std::vector<thread_stages*> free;
+};
+
+struct stage_dumper {
+  unsigned interval;
+  FILE *out;
+  std::mutex lock;
+  std::condition_variable stop_cv;
+  bool stop = false;
+  std::thread thread;
+};
+
+}
+
+static stage_registry *registry = new stage_registry();   // never freed, threads may outlive static destructors
+static thread_local thread_stages_slot local_stages;
+static stage_dumper *dumper = nullptr;
+
+thread_stages_slot::~thread_stages_slot() {
+  if (stats != nullptr) {
+    std::lock_guard<std::mutex> guard(registry->lock);
+    registry->free.push_back(stats);
+  }
+}
+
+static thread_stages *my_stages() {
+  if (local_stages.stats == nullptr) {
+    std::lock_guard<std::mutex> guard(registry->lock);
+    if (!registry->free.empty()) {
+      local_stages.stats = registry->free.back();
+      registry->free.pop_back();
+    } else {
+      registry->all.emplace_back(new thread_stages());
+      local_stages.stats = registry->all.back().get();
+    }
+  }
+  return local_stages.stats;
+}
+
+static int stage_bucket(uint64_t ns) {
+  if (ns < STAGE_SUB_BUCKETS) {
+    return ns;
+  }
+  int e = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (e - 4)) & (STAGE_SUB_BUCKETS - 1);
+  return (e - 3) * STAGE_SUB_BUCKETS + sub;
+}
+
+// the smallest value that lands in bucket b
+static uint64_t stage_bucket_value(int b) {
+  if (b < STAGE_SUB_BUCKETS) {
+    return b;
+  }
+  int e = b / STAGE_SUB_BUCKETS + 3;
+  return (uint64_t)(STAGE_SUB_BUCKETS + b % STAGE_SUB_BUCKETS) << (e - 4);
+}
+
+static inline void bump(std::atomic<uint64_t> &c, uint64_t v) {
+  c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+void stage_end(int stage, uint64_t start, uint64_t bytes) {
+  if (start == 0) {
+    return;
+  }
+  uint64_t ns = stage_now_ns() - start;
+  auto &c = my_stages()->stages[stage];
+  bump(c.ops, 1);
+  bump(c.bytes, bytes);
+  bump(c.ns, ns);
+  if (ns > c.max_ns.load(std::memory_order_relaxed)) {
+    c.max_ns.store(ns, std::memory_order_relaxed);
+  }
+  bump(c.hist[stage_bucket(ns)], 1);
+}
+
+static std::string stage_time(uint64_t ns) {
+  char buf[32];
+  if (ns < 10000) {
+    snprintf(buf, sizeof(buf), "%" PRIu64 "ns", ns);
+  } else if (ns < 10000000) {
+    snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+  } else {
+    snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+  }
+  return buf;
+}
+
+void stage_stats_print(FILE *out) {
+  static const char *names[STAGE_COUNT] = {"read", "decompress", "checksum", "visit"};
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  std::lock_guard<std::mutex> guard(registry->lock);
+  fprintf(out, "%-10s %12s %10s %10s %9s %9s %9s %9s %9s\n", "stage", "ops", "MB", "MB/s", "avg", "p50", "p90",
+          "p99", "p99.9");
+  for (int s = 0; s < STAGE_COUNT; s++) {
+    uint64_t ops = 0, bytes = 0, ns = 0, max_ns = 0;
+    std::vector<uint64_t> hist(STAGE_BUCKETS, 0);
+    for (auto &t : registry->all) {
+      auto &c = t->stages[s];
+      ops += c.ops.load(std::memory_order_relaxed);
+      bytes += c.bytes.load(std::memory_order_relaxed);
+      ns += c.ns.load(std::memory_order_relaxed);
+      max_ns = std::max(max_ns, c.max_ns.load(std::memory_order_relaxed));
+      for (int b = 0; b < STAGE_BUCKETS; b++) {
+        hist[b] += c.hist[b].load(std::memory_order_relaxed);
+      }
+    }
+    if (ops == 0) {
+      continue;
+    }
+    // time summed over threads, so MB/s is per thread busy in the stage
+    fprintf(out, "%-10s %12" PRIu64 " %10.1f %10.1f %9s", names[s], ops, bytes / 1048576.0,
+            ns != 0 ? bytes / 1048576.0 / (ns / 1e9) : 0.0, stage_time(ns / ops).c_str());
+    uint64_t seen = 0;
+    int b = 0;
+    for (double q : quantiles) {
+      uint64_t rank = std::max<uint64_t>(1, (uint64_t)(q * ops + 0.5));
+      while (b < STAGE_BUCKETS && seen + hist[b] < rank) {
+        seen += hist[b++];
+      }
+      fprintf(out, " %9s", stage_time(std::min(stage_bucket_value(b), max_ns)).c_str());
+    }
+    fprintf(out, "  max %s\n", stage_time(max_ns).c_str());
+  }
+  fflush(out);
+}
+
+static void stage_stats_exit() {
+  {
+    std::lock_guard<std::mutex> guard(dumper->lock);
+    dumper->stop = true;
+  }
+  dumper->stop_cv.notify_all();
+  if (dumper->thread.joinable()) {
+    dumper->thread.join();
+  }
+  stage_stats_print(dumper->out);
+}
+
+void stage_stats_start(unsigned interval, FILE *out) {
+  if (dumper != nullptr) {
+    return;
+  }
+  stage_stats_enabled = true;
+  dumper = new stage_dumper();
+  dumper->interval = interval;
+  dumper->out = out;
+  if (interval != 0) {
+    dumper->thread = std::thread([]() {
+      std::unique_lock<std::mutex> guard(dumper->lock);
+      while (!dumper->stop_cv.wait_for(guard, std::chrono::seconds(dumper->interval), []() {
+        return dumper->stop;
+      })) {
+        stage_stats_print(dumper->out);
+      }
+    });
+  }
+  atexit(stage_stats_exit);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+
+/*
+ * Latency histograms and counters for the stages of reading a block, to
+ * tell whether a scan is bound by I/O, decompression, checksums or its own
+ * visitor.  Off unless stage_stats_start() was called, in which case every
+ * timed call costs two clock reads.
+ *
+ * The image is mapped, so a block's read is when its pages are first
+ * touched: for an uncompressed block that is the copy out of the mapping
+ * (STAGE_READ), for a compressed one it happens inside STAGE_DECOMPRESS.
+ * A gang block's members are each copied out under STAGE_READ before the
+ * assembled block is decompressed.  Only scrub issues explicit preads.
+ */
+enum pipeline_stage {
+  STAGE_READ,
+  STAGE_DECOMPRESS,
+  STAGE_CHECKSUM,
+  STAGE_VISIT,                // traverse callbacks
+  STAGE_COUNT
+};
+
+/*
+ * Log-linear buckets like an HDR histogram: values below 16 ns exactly,
+ * above that 16 buckets per power of two, so any value is off by at most
+ * 1/16.
+ */
+#define STAGE_SUB_BUCKETS 16
+#define STAGE_BUCKETS (61 * STAGE_SUB_BUCKETS)
+
+extern bool stage_stats_enabled;
+
+inline uint64_t stage_now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the start of a timed stage, 0 when stats are off
+inline uint64_t stage_begin() {
+  return stage_stats_enabled ? stage_now_ns() : 0;
+}
+
+// record a stage that began at start and processed bytes; nothing when start is 0
+void stage_end(int stage, uint64_t start, uint64_t bytes);
+
+/*
+ * Turn stats on.  They are printed to out when the process exits and, with
+ * a non-zero interval, every interval seconds until then.  Call before any
+ * worker threads are started.
+ */
+void stage_stats_start(unsigned interval, FILE *out);
+
+// the totals of every thread so far
+void stage_stats_print(FILE *out);
@@ -0,0 +1,438 @@
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sys/stat.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "tar_export.h"
+
+#define TAR_BLOCK_SIZE 512
+
+enum tar_job_kind {
+  TAR_JOB_BYTES,              // payload is ready
+  TAR_JOB_ZERO,               // length zero bytes, a hole
+  TAR_JOB_BLOCK,              // the first length bytes of the block behind bp
+};
+
+namespace {
+
+struct tar_header {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+};
+
+static_assert(sizeof(tar_header) == TAR_BLOCK_SIZE, "tar_header must be one tar block");
+
+struct tar_job {
+  int kind;
+  blkptr_t bp;
+  uint64_t length;
+  std::vector<uint8_t> payload;
+  bool ready;
+};
+
+/*
+ * The same ring as the send stream, except that workers don't take jobs
+ * in sequence: reads waiting in the window are kept in DVA order and each
+ * worker takes the next one at or after the last offset taken, wrapping
+ * around at the end.
+ */
+struct tar_ctx {
+  const zil_overlay *ov;
+  const void *dev_base_ptr;
+  FILE *out;
+  tar_stats *stats;
+
+  std::mutex lock;
+  std::condition_variable space, work, ready;
+  std::vector<tar_job> ring;
+  std::set<std::pair<uint64_t, uint64_t>> reads;      // (DVA offset, sequence)
+  uint64_t head = 0;
+  uint64_t queued = 0, written = 0;
+  uint64_t window_bytes = 0;
+  bool done = false;
+  bool failed = false;
+
+  std::unordered_map<uint64_t, std::string> links;   // first path of each multiply linked file
+};
+
+}
+
+static bool write_job(tar_ctx *ctx, const tar_job &job) {
+  if (job.kind == TAR_JOB_ZERO) {
+    static const std::vector<uint8_t> zeros(1 << 20, 0);
+    for (uint64_t left = job.length; left > 0;) {
+      size_t n = std::min<uint64_t>(left, zeros.size());
+      if (fwrite(zeros.data(), 1, n, ctx->out) != n) {
+        return false;
+      }
+      left -= n;
+    }
+  } else if (fwrite(job.payload.data(), 1, job.length, ctx->out) != job.length) {
+    return false;
+  }
+  ctx->stats->bytes += job.length;
+  return true;
+}
+
+static void writer_thread(tar_ctx *ctx) {
+  std::unique_lock<std::mutex> guard(ctx->lock);
+  for (;;) {
+    ctx->ready.wait(guard, [&]() {
+      return ctx->written < ctx->queued ? ctx->ring[ctx->written % TAR_WINDOW_JOBS].ready : ctx->done;
+    });
+    if (ctx->written == ctx->queued) {
+      return;
+    }
+    auto &job = ctx->ring[ctx->written % TAR_WINDOW_JOBS];
+    bool failed = ctx->failed;
+    guard.unlock();
+    // after a failure keep draining so the walk and the workers can finish
+    if (!failed && !write_job(ctx, job)) {
+      std::cerr << "failed to write the archive, err: " << strerror(errno) << std::endl;
+      failed = true;
+    }
+    job.payload = std::vector<uint8_t>();
+    guard.lock();
+    ctx->failed |= failed;
+    if (job.kind != TAR_JOB_ZERO) {
+      ctx->window_bytes -= job.length;
+    }
+    ctx->written++;
+    ctx->space.notify_one();
+  }
+}
+
+static void worker_thread(tar_ctx *ctx) {
+  std::unique_lock<std::mutex> guard(ctx->lock);
+  for (;;) {
+    ctx->work.wait(guard, [&]() { return !ctx->reads.empty() || ctx->done; });
+    if (ctx->reads.empty()) {
+      return;
+    }
+    auto it = ctx->reads.lower_bound(std::make_pair(ctx->head, (uint64_t)0));
+    if (it == ctx->reads.end()) {
+      it = ctx->reads.begin();
+    }
+    ctx->head = it->first;
+    auto &job = ctx->ring[it->second % TAR_WINDOW_JOBS];
+    ctx->reads.erase(it);
+    bool failed = ctx->failed;
+    guard.unlock();
+    if (!failed) {
+      job.payload = read_block(&job.bp, ctx->dev_base_ptr);
+      assert(job.payload.size() >= job.length);
+    }
+    guard.lock();
+    job.ready = true;
+    ctx->ready.notify_one();
+  }
+}
+
+static bool queue_job(tar_ctx *ctx, tar_job job) {
+  std::unique_lock<std::mutex> guard(ctx->lock);
+  uint64_t bytes = job.kind == TAR_JOB_ZERO ? 0 : job.length;
+  // a single job bigger than the window still goes through once the window is empty
+  ctx->space.wait(guard, [&]() {
+    return ctx->queued - ctx->written < TAR_WINDOW_JOBS &&
+           (ctx->window_bytes + bytes <= TAR_WINDOW_BYTES || ctx->queued == ctx->written);
+  });
+  if (ctx->failed) {
+    return false;
+  }
+  uint64_t seq = ctx->queued++;
+  ctx->window_bytes += bytes;
+  job.ready = job.kind != TAR_JOB_BLOCK;
+  if (job.kind == TAR_JOB_BLOCK) {
+    uint64_t offset = BP_IS_EMBEDDED(&job.bp) ? 0 : DVA_GET_OFFSET(&job.bp.blk_dva[0]);
+    ctx->reads.emplace(offset, seq);
+    ctx->work.notify_one();
+  } else {
+    ctx->ready.notify_one();
+  }
+  ctx->ring[seq % TAR_WINDOW_JOBS] = std::move(job);
+  return true;
+}
+
+static bool queue_bytes(tar_ctx *ctx, std::vector<uint8_t> bytes) {
+  uint64_t length = bytes.size();
+  return length == 0 || queue_job(ctx, tar_job{TAR_JOB_BYTES, {}, length, std::move(bytes), false});
+}
+
+// octal, NUL terminated, or false if it doesn't fit
+static bool tar_octal(char *field, size_t size, uint64_t value) {
+  if (size - 1 < 22 && value >> (3 * (size - 1)) != 0) {
+    return false;
+  }
+  snprintf(field, size, "%0*llo", (int)size - 1, (unsigned long long)value);
+  return true;
+}
+
+// a pax record, "<length> <key>=<value>\n" where length counts itself
+static void pax_record(std::string *pax, const std::string &key, const std::string &value) {
+  size_t len = key.size() + value.size() + 3;
+  size_t digits = 1;
+  while (std::to_string(len + digits).size() != digits) {
+    digits++;
+  }
+  size_t total = len + digits;
+  *pax += std::to_string(total) + " " + key + "=" + value + "\n";
+}
+
+static std::vector<uint8_t> tar_block(const tar_header &h) {
+  tar_header hdr = h;
+  memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+  unsigned sum = 0;
+  for (size_t i = 0; i < sizeof(hdr); i++) {
+    sum += ((const uint8_t*)&hdr)[i];
+  }
+  snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", sum);
+  return std::vector<uint8_t>((const uint8_t*)&hdr, (const uint8_t*)(&hdr + 1));
+}
+
+static void pad_to_block(std::vector<uint8_t> *v) {
+  v->resize((v->size() + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE, 0);
+}
+
+// the header blocks of one entry, preceded by a pax header when a field doesn't fit ustar
+static std::vector<uint8_t> entry_header(const std::string &path, const zpl_attr &attr, char type, uint64_t size,
+                                         const std::string &link) {
+  tar_header h;
+  memset(&h, 0, sizeof(h));
+  std::string pax;
+  strncpy(h.name, path.c_str(), sizeof(h.name));
+  if (path.size() > sizeof(h.name)) {
+    pax_record(&pax, "path", path);
+  }
+  strncpy(h.linkname, link.c_str(), sizeof(h.linkname));
+  if (link.size() > sizeof(h.linkname)) {
+    pax_record(&pax, "linkpath", link);
+  }
+  tar_octal(h.mode, sizeof(h.mode), attr.mode & 07777);
+  if (!tar_octal(h.uid, sizeof(h.uid), attr.uid)) {
+    pax_record(&pax, "uid", std::to_string(attr.uid));
+  }
+  if (!tar_octal(h.gid, sizeof(h.gid), attr.gid)) {
+    pax_record(&pax, "gid", std::to_string(attr.gid));
+  }
+  if (!tar_octal(h.size, sizeof(h.size), size)) {
+    pax_record(&pax, "size", std::to_string(size));
+  }
+  tar_octal(h.mtime, sizeof(h.mtime), attr.mtime[0]);
+  h.typeflag = type;
+  memcpy(h.magic, "ustar", 6);
+  memcpy(h.version, "00", 2);
+
+  std::vector<uint8_t> out;
+  if (!pax.empty()) {
+    tar_header x;
+    memset(&x, 0, sizeof(x));
+    strncpy(x.name, "./PaxHeaders/entry", sizeof(x.name));
+    tar_octal(x.mode, sizeof(x.mode), 0644);
+    tar_octal(x.uid, sizeof(x.uid), 0);
+    tar_octal(x.gid, sizeof(x.gid), 0);
+    tar_octal(x.size, sizeof(x.size), pax.size());
+    tar_octal(x.mtime, sizeof(x.mtime), attr.mtime[0]);
+    x.typeflag = 'x';
+    memcpy(x.magic, "ustar", 6);
+    memcpy(x.version, "00", 2);
+    out = tar_block(x);
+    out.insert(out.end(), pax.begin(), pax.end());
+    pad_to_block(&out);
+  }
+  auto hdr = tar_block(h);
+  out.insert(out.end(), hdr.begin(), hdr.end());
+  return out;
+}
+
+/*
+ * Queue the first size bytes of the object described by dn block by block,
+ * holes as zeros, adding what was queued to *covered.  Subtrees past the end
+ * of the file are not visited.
+ */
+static bool queue_tree(tar_ctx *ctx, const dnode_phys_t *dn, const blkptr_t *bp, int level, uint64_t blkid,
+                       uint64_t size, uint64_t *covered) {
+  uint64_t blksz = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  uint64_t nblocks = (size + blksz - 1) / blksz;
+  int shift = level * (dn->dn_indblkshift - SPA_BLKPTRSHIFT);
+  uint64_t first, span;
+  if (shift >= 64 || (blkid << shift) >> shift != blkid) {
+    // wider than any block id, only the first subtree at this level starts inside the file
+    if (blkid != 0) {
+      return true;
+    }
+    first = 0;
+    span = nblocks;
+  } else {
+    first = blkid << shift;
+    if (first >= nblocks) {
+      return true;
+    }
+    span = std::min<uint64_t>(nblocks - first, 1ULL << shift);
+  }
+  uint64_t length = std::min(span * blksz, size - first * blksz);
+  if (BP_IS_HOLE(bp)) {
+    *covered += length;
+    return queue_job(ctx, tar_job{TAR_JOB_ZERO, {}, length, {}, false});
+  }
+  if (level == 0) {
+    ctx->stats->blocks++;
+    *covered += length;
+    return queue_job(ctx, tar_job{TAR_JOB_BLOCK, *bp, length, {}, false});
+  }
+  auto data = read_block(bp, ctx->dev_base_ptr);
+  auto bps = (const blkptr_t*)data.data();
+  uint64_t epb = data.size() / sizeof(blkptr_t);
+  for (uint64_t i = 0; i < epb; i++) {
+    if (!queue_tree(ctx, dn, &bps[i], level - 1, blkid * epb + i, size, covered)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool queue_file_data(tar_ctx *ctx, uint64_t obj, uint64_t size) {
+  auto it = ctx->ov->objs.find(obj);
+  if (it != ctx->ov->objs.end()) {
+    // written by the intent log, small enough to merge through the overlay here
+    std::vector<uint8_t> buf(1 << 20);
+    for (uint64_t off = 0; off < size;) {
+      uint64_t n = zil_overlay_read(*ctx->ov, obj, off, std::min<uint64_t>(buf.size(), size - off), buf.data());
+      if (n == 0) {
+        // the file ends early, keep the header's size
+        return queue_job(ctx, tar_job{TAR_JOB_ZERO, {}, size - off, {}, false});
+      }
+      if (!queue_bytes(ctx, std::vector<uint8_t>(buf.begin(), buf.begin() + n))) {
+        return false;
+      }
+      off += n;
+    }
+    return true;
+  }
+  auto dn_data = read_dnode(ctx->ov->fs->os(), obj, ctx->dev_base_ptr);
+  auto dn = (const dnode_phys_t*)dn_data.data();
+  uint64_t covered = 0;
+  for (int i = 0; i < dn->dn_nblkptr; i++) {
+    if (!queue_tree(ctx, dn, &dn->dn_blkptr[i], dn->dn_nlevels - 1, i, size, &covered)) {
+      return false;
+    }
+  }
+  // a file grown past its block tree, e.g. by truncate, reads as zeros to its size
+  if (covered < size) {
+    return queue_job(ctx, tar_job{TAR_JOB_ZERO, {}, size - covered, {}, false});
+  }
+  return true;
+}
+
+static bool queue_entry(tar_ctx *ctx, const std::string &path, uint64_t obj, const zpl_attr &attr);
+
+static bool queue_dir(tar_ctx *ctx, const std::string &path, uint64_t dir_obj) {
+  std::vector<std::pair<std::string, uint64_t>> entries;
+  zil_overlay_readdir(*ctx->ov, dir_obj, [&](const std::string &name, uint64_t obj, int) {
+    entries.emplace_back(name, obj);
+    return true;
+  });
+  std::sort(entries.begin(), entries.end());
+  for (auto &e : entries) {
+    zpl_attr attr;
+    if (!zil_overlay_getattr(*ctx->ov, e.second, &attr)) {
+      std::cerr << "cannot stat object " << e.second << " (" << path << e.first << ")" << std::endl;
+      ctx->stats->skipped++;
+      continue;
+    }
+    if (!queue_entry(ctx, path + e.first, e.second, attr)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool queue_entry(tar_ctx *ctx, const std::string &path, uint64_t obj, const zpl_attr &attr) {
+  if (S_ISDIR(attr.mode)) {
+    ctx->stats->dirs++;
+    return queue_bytes(ctx, entry_header(path + "/", attr, '5', 0, "")) && queue_dir(ctx, path + "/", obj);
+  }
+  if (attr.links > 1) {
+    auto it = ctx->links.find(obj);
+    if (it != ctx->links.end()) {
+      ctx->stats->hardlinks++;
+      return queue_bytes(ctx, entry_header(path, attr, '1', 0, it->second));
+    }
+    ctx->links[obj] = path;
+  }
+  if (S_ISLNK(attr.mode)) {
+    ctx->stats->symlinks++;
+    return queue_bytes(ctx, entry_header(path, attr, '2', 0, attr.symlink));
+  }
+  if (S_ISFIFO(attr.mode)) {
+    return queue_bytes(ctx, entry_header(path, attr, '6', 0, ""));
+  }
+  if (!S_ISREG(attr.mode)) {
+    ctx->stats->skipped++;
+    return true;
+  }
+  ctx->stats->files++;
+  if (!queue_bytes(ctx, entry_header(path, attr, '0', attr.size, "")) || !queue_file_data(ctx, obj, attr.size)) {
+    return false;
+  }
+  return queue_bytes(ctx, std::vector<uint8_t>((TAR_BLOCK_SIZE - attr.size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE, 0));
+}
+
+bool tar_export(const zil_overlay &ov, unsigned nthreads, FILE *out, tar_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  tar_ctx ctx;
+  ctx.ov = &ov;
+  ctx.dev_base_ptr = ov.fs->dev_base_ptr;
+  ctx.out = out;
+  ctx.stats = stats;
+  ctx.ring.resize(TAR_WINDOW_JOBS);
+
+  std::thread writer(writer_thread, &ctx);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < std::max(nthreads, 1U); t++) {
+    workers.emplace_back(worker_thread, &ctx);
+  }
+
+  zpl_attr root;
+  bool ok = zil_overlay_getattr(ov, ov.fs->root_obj, &root);
+  if (ok) {
+    stats->dirs++;
+    // an archive ends with two zero blocks
+    ok = queue_bytes(&ctx, entry_header("./", root, '5', 0, "")) && queue_dir(&ctx, "./", ov.fs->root_obj) &&
+         queue_bytes(&ctx, std::vector<uint8_t>(2 * TAR_BLOCK_SIZE, 0));
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(ctx.lock);
+    ctx.done = true;
+    ctx.work.notify_all();
+    ctx.ready.notify_all();
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  writer.join();
+  return ok && !ctx.failed && fflush(out) == 0;
+}
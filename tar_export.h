@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+
+#include "zil_replay.h"
+
+// jobs, and bytes of file data, the reads may run ahead of the output
+#define TAR_WINDOW_JOBS 4096
+#define TAR_WINDOW_BYTES (64ULL << 20)
+
+struct tar_stats {
+  uint64_t files;
+  uint64_t dirs;
+  uint64_t symlinks;
+  uint64_t hardlinks;
+  uint64_t skipped;           // devices and sockets, which tar can't restore from what we decode
+  uint64_t blocks;            // file blocks read
+  uint64_t bytes;             // length of the archive
+};
+
+/*
+ * Stream the filesystem behind ov as a POSIX tar archive, with pax headers
+ * for long names and big files.  This thread walks the tree in name order
+ * and queues the archive as a sequence of jobs; nthreads workers read and
+ * decompress the file blocks within a window of TAR_WINDOW_JOBS jobs in
+ * ascending DVA order (one elevator sweep after another) rather than file
+ * order, so reads stay close to sequential on disks; a writer thread puts
+ * everything out in archive order.  Files touched by the intent log are
+ * read through the overlay instead.
+ */
+bool tar_export(const zil_overlay &ov, unsigned nthreads, FILE *out, tar_stats *stats);
@@ -0,0 +1,277 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
+#include "traverse.h"
+#include "bpobj.h"
+#include "parallel.h"
+#include "perf_counters.h"
+#include "probes.h"
+#include "stage_stats.h"
+#include "zil_walk.h"
+
+namespace {
+
+// a level 0 block of some objset's meta dnode, the unit of parallel work
+struct dnode_block_work {
+  uint64_t objset;
+  uint64_t min_txg;
+  uint64_t blkid;
+  blkptr_t bp;
+};
+
+struct traverse_ctx {
+  const void *dev_base_ptr;
+  const traverse_cb_t &cb;
+  const traverse_resume *resume;
+  std::atomic<uint64_t> blocks;
+
+  traverse_ctx(const void *dev_base_ptr, const traverse_cb_t &cb, const traverse_resume *resume = nullptr)
+      : dev_base_ptr(dev_base_ptr), cb(cb), resume(resume), blocks(0) {}
+};
+
+}
+
+static void report_bp(traverse_ctx *ctx, const zbookmark_phys_t &zb, const blkptr_t *bp) {
+  ctx->blocks++;
+  PROBE5(visit__start, zb.zb_objset, zb.zb_object, zb.zb_level, zb.zb_blkid, BP_GET_TYPE(bp));
+  uint64_t start = stage_begin();
+  ctx->cb(zb, bp);
+  stage_end(STAGE_VISIT, start, 0);
+  PROBE5(visit__done, zb.zb_objset, zb.zb_object, zb.zb_level, zb.zb_blkid, BP_GET_TYPE(bp));
+}
+
+/*
+ * Report bp and everything below it.  While walking a meta dnode, level 0
+ * blocks are dnode blocks and go to collect instead, to be fanned out to
+ * the worker threads.
+ */
+static void visit_bp(traverse_ctx *ctx, const zbookmark_phys_t &zb, const blkptr_t *bp, uint64_t min_txg,
+                     std::vector<dnode_block_work> *collect) {
+  if (BP_IS_HOLE(bp) || bp->blk_birth <= min_txg) {
+    return;
+  }
+  if (collect != nullptr && BP_GET_LEVEL(bp) == 0) {
+    collect->push_back(dnode_block_work{zb.zb_objset, min_txg, zb.zb_blkid, *bp});
+    return;
+  }
+  report_bp(ctx, zb, bp);
+  if (BP_GET_LEVEL(bp) == 0 || BP_IS_EMBEDDED(bp)) {
+    return;
+  }
+  auto data = read_block(bp, ctx->dev_base_ptr);
+  auto children = (const blkptr_t*)data.data();
+  uint64_t epb = data.size() / sizeof(blkptr_t);
+  // the children are read next, indirect blocks here and dnode blocks by the workers
+  if (BP_GET_LEVEL(bp) > 1 || collect != nullptr) {
+    prefetch_blocks(children, epb, ctx->dev_base_ptr);
+  }
+  for (uint64_t i = 0; i < epb; i++) {
+    zbookmark_phys_t czb;
+    SET_BOOKMARK(&czb, zb.zb_objset, zb.zb_object, zb.zb_level - 1, zb.zb_blkid * epb + i);
+    visit_bp(ctx, czb, &children[i], min_txg, collect);
+  }
+}
+
+static void visit_dnode(traverse_ctx *ctx, uint64_t objset, uint64_t object, const dnode_phys_t *dn,
+                        uint64_t min_txg, std::vector<dnode_block_work> *collect) {
+  zbookmark_phys_t zb;
+  for (int i = 0; i < dn->dn_nblkptr; i++) {
+    SET_BOOKMARK(&zb, objset, object, dn->dn_nlevels - 1, i);
+    visit_bp(ctx, zb, &dn->dn_blkptr[i], min_txg, collect);
+  }
+  if (dn->dn_flags & DNODE_FLAG_SPILL_BLKPTR) {
+    SET_BOOKMARK(&zb, objset, object, 0, DMU_SPILL_BLKID);
+    visit_bp(ctx, zb, DN_SPILL_BLKPTR(dn), min_txg, nullptr);
+  }
+}
+
+void dnode_block_objects(const dnode_phys_t *dnodes, uint64_t n, std::vector<uint64_t> *objects) {
+  perf_sample ps;
+  perf_begin(&ps);
+  objects->clear();
+  objects->reserve(n);
+  for (uint64_t i = 0; i < n; i++) {
+    if (dnodes[i].dn_type == DMU_OT_NONE) {
+      continue;
+    }
+    objects->push_back(i);
+    i += dnodes[i].dn_extra_slots;
+  }
+  perf_end(PERF_DNODE_DECODE, ps, n * sizeof(dnode_phys_t));
+}
+
+static void visit_dnode_block(traverse_ctx *ctx, const dnode_block_work &w) {
+  zbookmark_phys_t zb;
+  SET_BOOKMARK(&zb, w.objset, DMU_META_DNODE_OBJECT, 0, w.blkid);
+  report_bp(ctx, zb, &w.bp);
+
+  auto data = read_block(&w.bp, ctx->dev_base_ptr);
+  uint64_t per_blk = data.size() >> DNODE_SHIFT;
+  auto dnodes = (const dnode_phys_t*)data.data();
+  // find the objects first, so the decoding can be measured apart from the visiting
+  std::vector<uint64_t> objects;
+  dnode_block_objects(dnodes, per_blk, &objects);
+  for (uint64_t i : objects) {
+    visit_dnode(ctx, w.objset, w.blkid * per_blk + i, &dnodes[i], w.min_txg, nullptr);
+  }
+  if (ctx->resume != nullptr && ctx->resume->done) {
+    ctx->resume->done(zb);
+  }
+}
+
+// the objset block, its accounting dnodes and intent log; the meta dnode's dnode blocks go to collect
+static void visit_objset(traverse_ctx *ctx, uint64_t objset, const blkptr_t *bp, uint64_t min_txg,
+                         std::vector<dnode_block_work> *collect) {
+  if (BP_IS_HOLE(bp) || bp->blk_birth <= min_txg) {
+    return;
+  }
+  zbookmark_phys_t zb;
+  SET_BOOKMARK(&zb, objset, ZB_ROOT_OBJECT, ZB_ROOT_LEVEL, ZB_ROOT_BLKID);
+  report_bp(ctx, zb, bp);
+
+  auto os_data = read_objset(bp, ctx->dev_base_ptr);
+  auto os = (const objset_phys_t*)os_data.data();
+  visit_dnode(ctx, objset, DMU_META_DNODE_OBJECT, &os->os_meta_dnode, min_txg, collect);
+  // older, smaller objset_phys_t's have no room for the accounting dnodes
+  if (BP_GET_LSIZE(bp) >= OBJSET_PHYS_SIZE_V2) {
+    visit_dnode(ctx, objset, DMU_USERUSED_OBJECT, &os->os_userused_dnode, min_txg, nullptr);
+    visit_dnode(ctx, objset, DMU_GROUPUSED_OBJECT, &os->os_groupused_dnode, min_txg, nullptr);
+  }
+  if (BP_GET_LSIZE(bp) >= OBJSET_PHYS_SIZE_V3) {
+    visit_dnode(ctx, objset, DMU_PROJECTUSED_OBJECT, &os->os_projectused_dnode, min_txg, nullptr);
+  }
+
+  /*
+   * Like traverse_zil(): the blocks of a log nobody has claimed since the
+   * pool went down are not allocated in the space maps, and neither are
+   * those written at or after the claim txg.
+   */
+  uint64_t claim_txg = os->os_zil_header.zh_claim_txg;
+  if (objset != 0 && claim_txg != 0) {
+    zil_walk_stats zs;
+    zil_walk(&os->os_zil_header, ctx->dev_base_ptr, [](const zil_record &) {
+      return true;
+    }, &zs, [&](const blkptr_t &lbp) {
+      if (lbp.blk_birth <= min_txg || lbp.blk_birth >= claim_txg) {
+        return true;
+      }
+      zbookmark_phys_t lzb;
+      SET_BOOKMARK(&lzb, objset, ZB_ZIL_OBJECT, ZB_ZIL_LEVEL, lbp.blk_cksum.zc_word[ZIL_ZC_SEQ]);
+      report_bp(ctx, lzb, &lbp);
+      return true;
+    });
+  }
+}
+
+// the blocks listed in a bpobj are each freed on their own, so they are reported but not descended
+static void visit_bpobj(traverse_ctx *ctx, const objset_phys_t *mos, uint64_t obj, uint64_t min_txg) {
+  auto dn_data = read_dnode(mos, obj, ctx->dev_base_ptr);
+  auto dn = (const dnode_phys_t*)dn_data.data();
+  bpobj_phys_t bpo = {};
+  memcpy(&bpo, DN_BONUS(dn), std::min<size_t>(dn->dn_bonuslen, sizeof(bpo)));
+
+  uint64_t blksz = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  uint64_t per_blk = blksz / sizeof(blkptr_t);
+  for (uint64_t blkid = 0; blkid * per_blk < bpo.bpo_num_blkptrs; blkid++) {
+    auto data = read_dnode_block(dn, blkid, ctx->dev_base_ptr);
+    auto bps = (const blkptr_t*)data.data();
+    uint64_t n = std::min(per_blk, bpo.bpo_num_blkptrs - blkid * per_blk);
+    for (uint64_t i = 0; i < n; i++) {
+      if (BP_IS_HOLE(&bps[i]) || bps[i].blk_birth <= min_txg) {
+        continue;
+      }
+      zbookmark_phys_t zb;
+      SET_BOOKMARK(&zb, ZB_DESTROYED_OBJSET, obj, 0, blkid * per_blk + i);
+      report_bp(ctx, zb, &bps[i]);
+    }
+  }
+
+  if (bpo.bpo_subobjs != 0) {
+    auto sub_data = read_dnode(mos, bpo.bpo_subobjs, ctx->dev_base_ptr);
+    auto sub_dn = (const dnode_phys_t*)sub_data.data();
+    auto raw = read_object(sub_dn, 0, bpo.bpo_num_subobjs * sizeof(uint64_t), ctx->dev_base_ptr);
+    auto subobjs = (const uint64_t*)raw.data();
+    for (uint64_t i = 0; i < bpo.bpo_num_subobjs; i++) {
+      visit_bpobj(ctx, mos, subobjs[i], min_txg);
+    }
+  }
+}
+
+namespace {
+
+struct objset_root {
+  uint64_t objset;
+  blkptr_t bp;
+  uint64_t min_txg;
+};
+
+}
+
+// first the objsets and their meta dnode indirect blocks, then every dnode block in parallel
+static void visit_roots(traverse_ctx *ctx, const std::vector<objset_root> &roots, unsigned nthreads,
+                        traverse_stats *stats) {
+  std::vector<dnode_block_work> work;
+  std::mutex work_lock;
+  parallel_for(roots.size(), nthreads, [&](uint64_t i) {
+    std::vector<dnode_block_work> collect;
+    visit_objset(ctx, roots[i].objset, &roots[i].bp, roots[i].min_txg, &collect);
+    std::lock_guard<std::mutex> guard(work_lock);
+    work.insert(work.end(), collect.begin(), collect.end());
+  });
+  stats->objsets = roots.size();
+  if (ctx->resume != nullptr && ctx->resume->skip) {
+    auto end = std::remove_if(work.begin(), work.end(), [&](const dnode_block_work &w) {
+      zbookmark_phys_t zb;
+      SET_BOOKMARK(&zb, w.objset, DMU_META_DNODE_OBJECT, 0, w.blkid);
+      return ctx->resume->skip(zb);
+    });
+    stats->skipped = work.end() - end;
+    work.erase(end, work.end());
+  }
+  stats->dnode_blocks = work.size();
+  parallel_for(work.size(), nthreads, [&](uint64_t i) {
+    visit_dnode_block(ctx, work[i]);
+  });
+}
+
+void traverse_pool(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                   unsigned nthreads, const traverse_cb_t &cb, traverse_stats *stats, uint64_t min_txg,
+                   const traverse_resume *resume) {
+  traverse_ctx ctx(dev_base_ptr, cb, resume);
+  memset(stats, 0, sizeof(*stats));
+
+  std::vector<objset_root> roots;
+  roots.push_back(objset_root{0, *mos_bp, min_txg});
+  for (auto &ds : list_datasets(mos, "", dev_base_ptr, true, true)) {
+    roots.push_back(objset_root{ds.ds_obj, ds.ds.ds_bp, std::max(ds.ds.ds_prev_snap_txg, min_txg)});
+  }
+  visit_roots(&ctx, roots, nthreads, stats);
+
+  // freed blocks the pool has not got around to releasing yet
+  auto dir_data = read_dnode(mos, DMU_POOL_DIRECTORY_OBJECT, dev_base_ptr);
+  auto dir_dn = (const dnode_phys_t*)dir_data.data();
+  for (auto name : {DMU_POOL_FREE_BPOBJ, DMU_POOL_SYNC_BPOBJ}) {
+    uint64_t obj;
+    if (zap_lookup(dir_dn, name, dev_base_ptr, &obj) && obj != 0) {
+      visit_bpobj(&ctx, mos, obj, min_txg);
+    }
+  }
+  uint64_t bptree_obj;
+  if (zap_lookup(dir_dn, DMU_POOL_BPTREE_OBJ, dev_base_ptr, &bptree_obj)) {
+    std::cerr << "pool has an async destroy in progress, its blocks are not traversed" << std::endl;
+  }
+
+  stats->blocks = ctx.blocks;
+}
+
+void traverse_objset(uint64_t objset, const blkptr_t *os_bp, const void *dev_base_ptr, unsigned nthreads,
+                     const traverse_cb_t &cb, traverse_stats *stats, uint64_t min_txg) {
+  traverse_ctx ctx(dev_base_ptr, cb);
+  memset(stats, 0, sizeof(*stats));
+  visit_roots(&ctx, {objset_root{objset, *os_bp, min_txg}}, nthreads, stats);
+  stats->blocks = ctx.blocks;
+}
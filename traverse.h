@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "zfs_reader.h"
+
+/*
+ * Called once for every block pointer reachable from the pool: the MOS,
+ * every dataset and snapshot, their claimed intent logs and the pool's
+ * free_bpobj.  Blocks shared with an earlier snapshot are only reported
+ * under the snapshot that first references them (birth txg >
+ * ds_prev_snap_txg), like traverse_dataset() does.  Holes are skipped,
+ * embedded block pointers are reported.
+ *
+ * zb_objset is the dataset object in the MOS, 0 for the MOS itself and
+ * ZB_DESTROYED_OBJSET for blocks in a bpobj waiting to be freed.  The
+ * callback runs on the traversal threads and must be thread safe.
+ *
+ * With min_txg only blocks born after it are visited, which prunes every
+ * subtree unchanged since then.
+ */
+typedef std::function<void(const zbookmark_phys_t &zb, const blkptr_t *bp)> traverse_cb_t;
+
+struct traverse_stats {
+  uint64_t objsets;
+  uint64_t dnode_blocks;      // units of parallel work
+  uint64_t blocks;
+  uint64_t skipped;           // dnode blocks a resumed scan had already finished
+};
+
+/*
+ * Hooks for a resumable scan.  The parallel work units are the dnode blocks
+ * of every objset, bookmark <objset, 0, 0, blkid>: one that skip returns
+ * true for is not visited, and done is called on the traversal thread once
+ * everything below a dnode block has been reported.  The objsets, their
+ * meta dnode indirect blocks, intent logs and the free bpobjs are not
+ * tracked and are visited on every run.
+ */
+typedef std::function<bool(const zbookmark_phys_t &zb)> traverse_skip_cb_t;
+typedef std::function<void(const zbookmark_phys_t &zb)> traverse_done_cb_t;
+
+struct traverse_resume {
+  traverse_skip_cb_t skip;
+  traverse_done_cb_t done;
+};
+
+void traverse_pool(const objset_phys_t *mos, const blkptr_t *mos_bp, const void *dev_base_ptr,
+                   unsigned nthreads, const traverse_cb_t &cb, traverse_stats *stats, uint64_t min_txg = 0,
+                   const traverse_resume *resume = nullptr);
+
+/*
+ * Every block of a single objset, including those shared with its earlier
+ * snapshots.  objset is what ends up in zb_objset.
+ */
+void traverse_objset(uint64_t objset, const blkptr_t *os_bp, const void *dev_base_ptr, unsigned nthreads,
+                     const traverse_cb_t &cb, traverse_stats *stats, uint64_t min_txg = 0);
+
+/*
+ * The slots of the allocated dnodes among the n of a dnode block, how the
+ * traversal finds the objects to visit.  A large dnode is listed once, at
+ * its first slot.  objects is overwritten.
+ */
+void dnode_block_objects(const dnode_phys_t *dnodes, uint64_t n, std::vector<uint64_t> *objects);
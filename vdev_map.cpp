@@ -0,0 +1,158 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "vdev_map.h"
+
+static const struct {
+  vdev_map_policy policy;
+  const char *name;
+} policy_names[] = {
+  {VDEV_MAP_AUTO, "auto"},
+  {VDEV_MAP_PLAIN, "plain"},
+  {VDEV_MAP_PHASED, "phased"},
+  {VDEV_MAP_RANDOM, "random"},
+  {VDEV_MAP_POPULATE, "populate"},
+  {VDEV_MAP_WINDOW, "window"},
+};
+
+bool parse_vdev_map_policy(const std::string &name, vdev_map_policy *policy) {
+  for (auto &p : policy_names) {
+    if (name == p.name) {
+      *policy = p.policy;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *vdev_map_policy_name(vdev_map_policy policy) {
+  for (auto &p : policy_names) {
+    if (policy == p.policy) {
+      return p.name;
+    }
+  }
+  return "unknown";
+}
+
+static uint64_t page_size() {
+  static const uint64_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+static vdev_map_policy resolve_auto(int fd, uint64_t size) {
+  uint64_t memory = (uint64_t)sysconf(_SC_PHYS_PAGES) * page_size();
+  struct stat st;
+  uint64_t allocated = fstat(fd, &st) == 0 ? (uint64_t)st.st_blocks * 512 : size;
+  if (size <= VDEV_MAP_SMALL && size <= memory / 8) {
+    return VDEV_MAP_POPULATE;
+  }
+  return allocated > memory / 2 ? VDEV_MAP_WINDOW : VDEV_MAP_PHASED;
+}
+
+/*
+ * A file mapping only gets huge pages where the address and file offset
+ * agree modulo the huge page size, so reserve enough address space to slide
+ * the mapping up to an aligned address and map the file over it there.
+ */
+static void *map_aligned(int fd, uint64_t size, int flags) {
+  uint64_t len = (size + page_size() - 1) & ~(page_size() - 1);
+  void *reserved = mmap(nullptr, len + VDEV_MAP_HUGE_ALIGN, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1, 0);
+  if (reserved == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  auto base = (uintptr_t)reserved;
+  auto aligned = (base + VDEV_MAP_HUGE_ALIGN - 1) & ~(uintptr_t)(VDEV_MAP_HUGE_ALIGN - 1);
+  void *m = mmap((void*)aligned, size, PROT_READ, MAP_PRIVATE | MAP_FIXED | flags, fd, 0);
+  if (m == MAP_FAILED) {
+    int err = errno;
+    munmap(reserved, len + VDEV_MAP_HUGE_ALIGN);
+    errno = err;
+    return MAP_FAILED;
+  }
+  if (aligned > base) {
+    munmap(reserved, aligned - base);
+  }
+  if (base + VDEV_MAP_HUGE_ALIGN > aligned) {
+    munmap((void*)(aligned + len), base + VDEV_MAP_HUGE_ALIGN - aligned);
+  }
+  return m;
+}
+
+bool vdev_map_open(int fd, uint64_t size, vdev_map_policy policy, vdev_map *map) {
+  map->ptr = nullptr;
+  map->size = size;
+  map->fd = fd;
+  map->policy = policy == VDEV_MAP_AUTO ? resolve_auto(fd, size) : policy;
+
+  struct rlimit as;
+  if (getrlimit(RLIMIT_AS, &as) == 0 && as.rlim_cur != RLIM_INFINITY && size > as.rlim_cur) {
+    std::cerr << "the image is larger than the address space limit of " << as.rlim_cur
+              << " bytes, it has to be mapped whole" << std::endl;
+    return false;
+  }
+  void *m;
+  if (map->policy == VDEV_MAP_POPULATE) {
+    m = map_aligned(fd, size, MAP_POPULATE);
+  } else {
+    m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  if (m == MAP_FAILED) {
+    std::cerr << "failed to mmap the image, err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  map->ptr = (const char*)m;
+#ifdef MADV_HUGEPAGE
+  if (map->policy == VDEV_MAP_POPULATE) {
+    // advisory only: file THPs need CONFIG_READ_ONLY_THP_FOR_FS, and khugepaged collapses them later
+    madvise(m, size, MADV_HUGEPAGE);
+  }
+#endif
+  vdev_map_access(*map, VDEV_ACCESS_LOOKUP);
+  return true;
+}
+
+void vdev_map_close(vdev_map *map) {
+  if (map->ptr != nullptr) {
+    munmap((void*)map->ptr, map->size);
+    map->ptr = nullptr;
+  }
+}
+
+void vdev_map_access(const vdev_map &map, vdev_access access) {
+  if (map.policy == VDEV_MAP_PLAIN || map.ptr == nullptr) {
+    return;
+  }
+  int advice = MADV_NORMAL, fadvice = POSIX_FADV_NORMAL;
+  if (access == VDEV_ACCESS_SCAN) {
+    advice = MADV_SEQUENTIAL;
+    fadvice = POSIX_FADV_SEQUENTIAL;
+  } else if (map.policy == VDEV_MAP_RANDOM) {
+    advice = MADV_RANDOM;
+    fadvice = POSIX_FADV_RANDOM;
+  }
+  // advisory only, a failure just means the kernel keeps guessing
+  madvise((void*)map.ptr, map.size, advice);
+  posix_fadvise(map.fd, 0, 0, fadvice);
+}
+
+void vdev_map_scanned(const vdev_map &map, uint64_t offset, uint64_t len) {
+  if (map.policy != VDEV_MAP_WINDOW || map.ptr == nullptr || offset >= map.size) {
+    return;
+  }
+  // only whole pages inside the range, the ones at its ends may hold blocks still to come
+  uint64_t start = (offset + page_size() - 1) & ~(page_size() - 1);
+  uint64_t end = std::min(offset + len, map.size) & ~(page_size() - 1);
+  if (end <= start) {
+    return;
+  }
+  madvise((void*)(map.ptr + start), end - start, MADV_DONTNEED);
+  posix_fadvise(map.fd, start, end - start, POSIX_FADV_DONTNEED);
+}
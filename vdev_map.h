@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/*
+ * The read-only mapping of a vdev image that dev_base_ptr points into, and
+ * what the kernel is told about how it will be read.  Left to itself the
+ * kernel reads around every fault, which is the wrong guess both for
+ * metadata lookups, which touch one block here and one there, and for the
+ * sorted scans, which would be better served by aggressive read-ahead and
+ * by not keeping what they passed.
+ *
+ * The traversal already asks for the blocks ahead of its frontier with
+ * prefetch_blocks() (MADV_WILLNEED), whatever the policy; under
+ * VDEV_MAP_RANDOM that is the only read-ahead there is.
+ */
+enum vdev_map_policy {
+  VDEV_MAP_AUTO,              // POPULATE up to VDEV_MAP_SMALL, WINDOW beyond half of memory, PHASED otherwise
+  VDEV_MAP_PLAIN,             // mmap() and nothing else
+  VDEV_MAP_PHASED,            // the kernel's read-around for lookups, MADV_SEQUENTIAL during sorted scans
+  VDEV_MAP_RANDOM,            // PHASED with MADV_RANDOM for lookups
+  VDEV_MAP_POPULATE,          // MAP_POPULATE and MADV_HUGEPAGE on a 2M aligned mapping, then PHASED
+  VDEV_MAP_WINDOW,            // PHASED, and sorted scans drop the ranges they are done with
+};
+
+// images up to this size are faulted in whole by VDEV_MAP_AUTO
+#define VDEV_MAP_SMALL (1ULL << 30)
+// the mapping is aligned to this for MADV_HUGEPAGE, the size of a PMD page on x86-64 and arm64
+#define VDEV_MAP_HUGE_ALIGN (2ULL << 20)
+
+enum vdev_access {
+  VDEV_ACCESS_LOOKUP,         // traversals and lookups: blocks anywhere, a few at a time
+  VDEV_ACCESS_SCAN,           // a pass in offset order over much of the device
+};
+
+struct vdev_map {
+  const char *ptr;
+  uint64_t size;
+  int fd;                     // not owned
+  vdev_map_policy policy;     // what AUTO resolved to, never AUTO itself
+};
+
+/*
+ * Map the size bytes of fd.  The reader wants the device in one piece, so
+ * an image larger than the address space limit (RLIMIT_AS) can't be read
+ * and fails here with a message; on a memory budget VDEV_MAP_WINDOW keeps
+ * what stays resident down instead.  False, with a message, on errors.
+ */
+bool vdev_map_open(int fd, uint64_t size, vdev_map_policy policy, vdev_map *map);
+void vdev_map_close(vdev_map *map);
+
+// the pattern of the reads that follow, for the whole mapping and fd; nothing for PLAIN
+void vdev_map_access(const vdev_map &map, vdev_access access);
+
+/*
+ * A sorted scan is done with [offset, offset + len) of the device, whether
+ * it read it through the mapping or the fd.  WINDOW drops the range from
+ * the mapping and the page cache, so a scan of a device larger than memory
+ * doesn't push everything else out; nothing for other policies.
+ */
+void vdev_map_scanned(const vdev_map &map, uint64_t offset, uint64_t len);
+
+bool parse_vdev_map_policy(const std::string &name, vdev_map_policy *policy);
+const char *vdev_map_policy_name(vdev_map_policy policy);
@@ -1,10 +1,12 @@
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -12,160 +14,205 @@
 #include <vector>
 
 #include <libnvpair.h>
-#include "spa.h"
-#include "dmu.h"
-#include "dnode.h"
-#include "dmu_objset.h"
-#include "dsl_dir.h"
+#include "zfs_reader.h"
 #include "zap_impl.h"
 #include "zap_leaf.h"
-#include <lz4.h>
+#include "zil_walk.h"
+#include "zil_replay.h"
+#include "zpl.h"
+#include "metaslab.h"
+#include "leak_check.h"
+#include "block_index.h"
+#include "ddt_reader.h"
+#include "dedup_sim.h"
+#include "block_stats.h"
+#include "recompress.h"
+#include "sidecar.h"
+#include "bp_export.h"
+#include "objset_diff.h"
+#include "send.h"
+#include "zvol_export.h"
+#include "tar_export.h"
+#include "scrub.h"
+#include "perf_counters.h"
+#include "stage_stats.h"
+#include "vdev_map.h"
+#include "parallel.h"
 
+using namespace std;
 
-enum zio_compress {
-  ZIO_COMPRESS_INHERIT = 0,
-  ZIO_COMPRESS_ON,
-  ZIO_COMPRESS_OFF,
-  ZIO_COMPRESS_LZJB,
-  ZIO_COMPRESS_EMPTY,
-  ZIO_COMPRESS_GZIP_1,
-  ZIO_COMPRESS_GZIP_2,
-  ZIO_COMPRESS_GZIP_3,
-  ZIO_COMPRESS_GZIP_4,
-  ZIO_COMPRESS_GZIP_5,
-  ZIO_COMPRESS_GZIP_6,
-  ZIO_COMPRESS_GZIP_7,
-  ZIO_COMPRESS_GZIP_8,
-  ZIO_COMPRESS_GZIP_9,
-  ZIO_COMPRESS_ZLE,
-  ZIO_COMPRESS_LZ4,
-  ZIO_COMPRESS_FUNCTIONS
-};
-
-/*
- * NB: lzc_dataset_type should be updated whenever a new objset type is added,
- * if it represents a real type of a dataset that can be created from userland.
- */
-typedef enum dmu_objset_type {
-  DMU_OST_NONE,
-  DMU_OST_META,
-  DMU_OST_ZFS,
-  DMU_OST_ZVOL,
-  DMU_OST_OTHER,			/* For testing only! */
-  DMU_OST_ANY,			/* Be careful! */
-  DMU_OST_NUMTYPES
-} dmu_objset_type_t;
-
+static void dump_zil(const objset_phys_t *mos, const char *pool_name, const void *dev_base_ptr) {
+  for (const auto &ds : list_datasets(mos, pool_name, dev_base_ptr, false)) {
+    auto os_data = read_objset(&ds.ds.ds_bp, dev_base_ptr);
+    auto os = (const objset_phys_t*)os_data.data();
+    auto zh = &os->os_zil_header;
+    cout << "dataset " << ds.name << " zil claim_txg " << dec << zh->zh_claim_txg
+         << " replay_seq " << zh->zh_replay_seq << endl;
+
+    zil_walk_stats stats;
+    zil_walk(zh, dev_base_ptr, [](const zil_record &r) {
+      print_zil_record(r);
+      return true;
+    }, &stats);
+    cout << "  " << stats.blocks << " blocks, " << stats.records << " records ("
+         << stats.records - stats.replayed << " unreplayed), " << stats.bytes << " bytes"
+         << (stats.chain_error ? ", chain broken" : "") << endl;
+  }
+}
 
-void print_blkptr(const blkptr_t *p) {
-  static const char *blkptr_types[] = {
-      "none", // 0
-      "object_directory",
-      "object_array",
-      "packed_nvlist",
-      "nvlist_size",
-      "bplist", // 5
-      "bplist_hdr",
-      "space_map_header",
-      "space_map",
-      "intent_log",
-      "dnode", // 10
-      "objset",
-      "dsl_dataset",
-  };
-  auto t = BP_GET_TYPE(p);
-  if (t < sizeof(blkptr_types)/sizeof(blkptr_types[0])) {
-    std::cout << "blkptr: type " << blkptr_types[t] << " ";
-  } else {
-    std::cout << "blkptr: type " << t << " ";
+// open a filesystem dataset with its unreplayed intent log applied on top
+static bool open_fs_view(const objset_phys_t *mos, const char *pool_name, const string &name,
+                         const void *dev_base_ptr, zpl_fs *fs, zil_overlay *ov) {
+  dataset_info ds;
+  if (!find_dataset(mos, pool_name, name, dev_base_ptr, &ds) || !zpl_open(&ds.ds.ds_bp, dev_base_ptr, fs)) {
+    return false;
   }
-  if (DMU_OT_NONE == t) {
-    std::cout << std::endl;
-    return;
+  zil_replay(*fs, &fs->os()->os_zil_header, ov);
+  if (ov->applied != 0) {
+    cerr << "applied " << ov->applied << " intent log records (" << ov->ignored << " ignored)" << endl;
   }
-  std::cout << (BP_GET_BYTEORDER(p) ? "LE" : "BE") << " ";
-  std::cout << std::endl;
+  return true;
+}
 
-  std::cout << "  level " << BP_GET_LEVEL(p) << " " << std::endl;
-  std::cout << "  psize 0x" << std::hex << BP_GET_PSIZE(p) << " " << std::endl;
-  std::cout << "  lsize 0x" << std::hex << BP_GET_LSIZE(p) << " " << std::endl;
-  std::cout << "  cksum 0x" << std::hex << BP_GET_CHECKSUM(p) << " " << std::endl;
-  std::cout << "  compression 0x" << std::hex << BP_GET_COMPRESS(p) << " " << std::endl;
-  std::cout << "  birth 0x" << std::hex << p->blk_birth << " " << std::endl;
-  std::cout << "  fill_count 0x" << std::hex << p->blk_fill << " " << std::endl;
-  for (const auto & i : p->blk_dva) {
-    std::cout << "  vdev 0x" << std::hex << DVA_GET_VDEV(&i) << " off 0x" << std::hex << DVA_GET_OFFSET(&i)
-        << " asize 0x" << std::hex << DVA_GET_ASIZE(&i) << " gang " << DVA_GET_GANG(&i) << std::endl;
+static bool resolve_path(const zil_overlay &ov, const string &path, uint64_t *obj) {
+  *obj = ov.fs->root_obj;
+  size_t pos = 0;
+  while (pos < path.size()) {
+    size_t next = path.find('/', pos);
+    if (next == string::npos) {
+      next = path.size();
+    }
+    auto component = path.substr(pos, next - pos);
+    pos = next + 1;
+    if (component.empty() || component == ".") {
+      continue;
+    }
+    if (!zil_overlay_lookup(ov, *obj, component, obj)) {
+      cerr << "no such file: " << path << endl;
+      return false;
+    }
   }
+  return true;
 }
 
-// output must be at least LSIZE
-std::vector<uint8_t> read_block(const blkptr_t *p, const void *dev_base_ptr) {
-  auto vdev1 = DVA_GET_VDEV(&p->blk_dva[0]);
-  uint64_t off1 = DVA_GET_OFFSET(&p->blk_dva[0]);
-  auto gang1 = DVA_GET_GANG(&p->blk_dva[0]);
-  int asize = DVA_GET_ASIZE(&p->blk_dva[0]);
-  int lsize = BP_GET_LSIZE(p);
-  assert(vdev1 == 0);
+static void list_dir(const zil_overlay &ov, uint64_t dir_obj, const string &path) {
+  zil_overlay_readdir(ov, dir_obj, [&](const string &name, uint64_t obj, int type) {
+    zpl_attr attr;
+    if (!zil_overlay_getattr(ov, obj, &attr)) {
+      cerr << "cannot stat object " << obj << endl;
+      return true;
+    }
+    cout << oct << setw(7) << attr.mode << dec << " " << setw(12) << attr.size << " "
+         << path << "/" << name;
+    if (!attr.symlink.empty()) {
+      cout << " -> " << attr.symlink;
+    }
+    cout << endl;
+    if (S_ISDIR(attr.mode)) {
+      list_dir(ov, obj, path + "/" + name);
+    }
+    return true;
+  });
+}
 
-  std::vector<uint8_t> output(lsize, 0);
-  auto *blk = (const char *)dev_base_ptr + off1;
-  // assert lz4 compression
-  if (BP_GET_COMPRESS(p) == ZIO_COMPRESS_OFF || BP_GET_COMPRESS(p) == ZIO_COMPRESS_INHERIT) {
-    memcpy(output.data(), blk, lsize);
-  } else if (BP_GET_COMPRESS(p) == ZIO_COMPRESS_LZ4) {
-    auto input_size = __builtin_bswap32 (*(uint32_t*)blk);
-    const int decompressed_size = LZ4_decompress_safe(
-        (const char*)blk+sizeof(int32_t),
-        (char*)output.data(), input_size, lsize
-    );
-    assert(decompressed_size == lsize);
-  } else {
-    std::cerr << "unknown blkptr compression type " << BP_GET_COMPRESS(p) << std::endl;
-    assert(0);
+static int cat_file(const zil_overlay &ov, const string &path) {
+  uint64_t obj;
+  if (!resolve_path(ov, path, &obj)) {
+    return 1;
   }
-  return std::move(output);
+  std::vector<uint8_t> buf(1 << 20);
+  uint64_t off = 0, n;
+  while ((n = zil_overlay_read(ov, obj, off, buf.size(), buf.data())) > 0) {
+    fwrite(buf.data(), 1, n, stdout);
+    off += n;
+  }
+  return 0;
 }
-#define ZFS_SEC_SIZE 512UL
-
-std::vector<uint8_t> read_obj(const objset_phys_t* objset, uint64_t id, const void *dev_base_ptr, int leaf_id) {
-  int level = objset->os_meta_dnode.dn_nlevels;
-  assert(objset->os_type == DMU_OST_META);
-  assert(objset->os_meta_dnode.dn_type == DMU_OT_DNODE);
-  auto data = read_block(&objset->os_meta_dnode.dn_blkptr[0], dev_base_ptr);
-  blkptr_t *blkptrs = (blkptr_t*)data.data();
-
-  // max indirection 6
-  std::vector<uint64_t> offsets;
-
-  size_t radix = (1UL << objset->os_meta_dnode.dn_indblkshift) / sizeof(blkptr_t);
-  size_t datablk_size = objset->os_meta_dnode.dn_datablkszsec * ZFS_SEC_SIZE;
 
-  while (level > 0) {
-    int curid = id % radix;
-    id = id / radix;
-    level--;
-    offsets.insert(offsets.begin(), curid);
+// report the blocks, and the files they belong to, behind device byte offsets such as bad LBAs
+static void blockmap_query(const objset_phys_t *mos, const char *pool_name, const block_index &bi,
+                           char **offsets, int n, uint64_t data_off, const void *dev_base_ptr) {
+  map<uint64_t, string> names;
+  names[0] = "MOS";
+  for (auto &ds : list_datasets(mos, pool_name, dev_base_ptr, true, true)) {
+    names[ds.ds_obj] = ds.name;
   }
-  dnode_phys_t *dnodeptrs;
-  data = read_block(&blkptrs[offsets[0]], dev_base_ptr);
-  dnodeptrs = (dnode_phys_t*)data.data();
-  for (int i = 1; i < offsets.size(); i++) {
-    auto dnode = &dnodeptrs[offsets[i]];
-//    assert(dnode->dn_nblkptr == 1);
-    int j = 0;
-    if (i == offsets.size() - 1) {
-      j = leaf_id;
-    }
-    data = read_block(&dnode->dn_blkptr[j], dev_base_ptr);
-    dnodeptrs = (dnode_phys_t*)data.data();
+  map<uint64_t, zpl_fs> filesystems;
+  auto open_fs = [&](uint64_t objset) -> const zpl_fs* {
+    auto it = filesystems.find(objset);
+    if (it == filesystems.end()) {
+      dataset_info ds;
+      zpl_fs fs;
+      if (objset == 0 || !find_dataset(mos, pool_name, names[objset], dev_base_ptr, &ds) ||
+          !zpl_open(&ds.ds.ds_bp, dev_base_ptr, &fs)) {
+        fs.dev_base_ptr = nullptr;
+      }
+      it = filesystems.emplace(objset, std::move(fs)).first;
+    }
+    return it->second.dev_base_ptr != nullptr ? &it->second : nullptr;
+  };
+
+  for (int i = 0; i < n; i++) {
+    // "offset" on vdev 0, or "vdev:offset"
+    uint64_t vdev = 0;
+    char *end;
+    uint64_t dev_off = strtoull(offsets[i], &end, 0);
+    if (*end == ':') {
+      vdev = dev_off;
+      dev_off = strtoull(end + 1, &end, 0);
+    }
+    cout << offsets[i] << ":";
+    if (dev_off < data_off) {
+      cout << " in the vdev labels" << endl;
+      continue;
+    }
+    auto entries = block_index_query(bi, vdev, dev_off - data_off);
+    if (entries.empty()) {
+      cout << " not allocated" << endl;
+      continue;
+    }
+    cout << endl;
+    for (auto &e : entries) {
+      auto name = names.find(e.objset);
+      cout << "  " << (name != names.end() ? name->second : "destroyed objset " + to_string(e.objset))
+           << " object " << e.object << " level " << e.level << " blkid " << e.blkid << " birth " << e.birth;
+      auto fs = e.level >= 0 ? open_fs(e.objset) : nullptr;
+      if (fs != nullptr) {
+        auto path = zpl_path(*fs, e.object);
+        if (!path.empty()) {
+          auto dn_data = read_dnode(fs->os(), e.object, dev_base_ptr);
+          auto dn = (const dnode_phys_t*)dn_data.data();
+          uint64_t span = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+          for (int64_t l = 0; l < e.level; l++) {
+            span <<= dn->dn_indblkshift - SPA_BLKPTRSHIFT;
+          }
+          cout << " " << path << " [0x" << hex << e.blkid * span << ", 0x" << (e.blkid + 1) * span << ")" << dec;
+        }
+      }
+      cout << endl;
+    }
   }
-  return std::move(data);
 }
 
-using namespace std;
-int main() {
-  const char *vdev_path = "test3";
+int main(int argc, char **argv) {
+  const char *vdev_path = argc > 1 ? argv[1] : "test3";
+  string command = argc > 2 ? argv[2] : "";
+  // ZFS_LABEL_STATS=<seconds> prints per-stage latencies that often, and at exit; 0 for only at exit
+  if (const char *stats_interval = getenv("ZFS_LABEL_STATS")) {
+    stage_stats_start(atoi(stats_interval), stderr);
+  }
+  // ZFS_LABEL_PERF=1 counts cycles, instructions and misses in the decode and checksum kernels
+  if (getenv("ZFS_LABEL_PERF") != nullptr) {
+    perf_counters_start(stderr);
+  }
+  // ZFS_LABEL_MAP=auto|plain|phased|random|populate|window picks how the image is mapped, see vdev_map.h
+  vdev_map_policy map_policy = VDEV_MAP_AUTO;
+  if (const char *map_name = getenv("ZFS_LABEL_MAP")) {
+    if (!parse_vdev_map_policy(map_name, &map_policy)) {
+      cerr << "unknown mapping policy " << map_name << endl;
+      return 1;
+    }
+  }
   int fd = open(vdev_path, O_RDONLY);
   if (fd < 0) {
     cerr << "failed to open file " << vdev_path << ", err: " << strerror(errno) << endl;
@@ -179,77 +226,298 @@ int main() {
   }
   size_t vdev_size = buf.st_size;
 
-  size_t block_size = 128 * 1024;
-  size_t label_offset = 16 * 1024;
-  size_t label_size = block_size - label_offset;
-  const char *vdev_ptr = (const char*)mmap(nullptr, vdev_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (vdev_ptr == MAP_FAILED) {
-    cerr << "failed to mmap " << vdev_path << ", err: " << strerror(errno) << endl;
+  vdev_map map;
+  if (!vdev_map_open(fd, vdev_size, map_policy, &map)) {
+    cerr << "failed to map " << vdev_path << endl;
     abort();
   }
-  const char *label_ptr = vdev_ptr + label_offset;
-
-  nvlist_t *list;
-  if (nvlist_unpack((char*)label_ptr, label_size, &list, 0) != 0) {
-    cerr << "failed unpack zfs labels" << endl;
-    abort();
-  }
-
-  size_t list_size;
-  if (nvlist_size(list, &list_size, NV_ENCODE_XDR) != 0) {
-    cerr << "Failed to get nvlist size" << endl;
+  pool_info pool;
+  if (!pool_open(map.ptr, &pool)) {
+    cerr << "failed to open the pool on " << vdev_path << endl;
     abort();
   }
+  const char *pool_name = pool.name.c_str();
+  uint64_t pool_guid = pool.guid;
 
   // print labels
-  nvlist_print(stdout, list);
-
-  // print uberblocks
-  uint64_t be_magic = 0x00bab10c;
-  std::vector<std::pair<int, uint64_t>> txgs;
-  for (int i = 0; i < 128; i++) {
-    auto ub = (uberblock*)(vdev_ptr + block_size*1 + i * 1024);
-    if (ub->ub_magic != 0) {
-//      assert(be_magic == ub->ub_magic);
-//      cout << "ub magic: " << std::hex << std::setfill('0') << std::setw(8) << i << ", " << ub->ub_magic << endl;
-
-      txgs.emplace_back(i, ub->ub_txg);
-//      cout << "ub: " << ub->ub_txg << endl;
-    }
-  }
-  if (txgs.empty()) {
-    cerr << "no txg in uberblocks found, aborting" << endl;
-    abort();
+  if (command.empty()) {
+    nvlist_print(stdout, pool.config);
   }
 
-  std::sort(txgs.begin(), txgs.end(), [](const std::pair<int, uint64_t> &a,const std::pair<int, uint64_t> &b) {
-    return a.second > b.second;
-  });
-  cout << "max txg: " << txgs[0].first << ", " << txgs[0].second << endl;
-
-  int chosen_txg = txgs[0].first;
-  auto main_ub = (uberblock*)(vdev_ptr + block_size*1 + chosen_txg * 1024);
-//  assert(main_ub->ub_txg == txgs[0].second && main_ub->ub_magic == be_magic);
-  cout << "ub_version: " << dec << main_ub->ub_version << endl;
+  // keep stdout for the command's own output
+  ostream &info = command.empty() ? cout : cerr;
+  info << "max txg: " << pool.ub_slot << ", " << pool.ub->ub_txg << endl;
+  auto main_ub = pool.ub;
+  info << "ub_version: " << dec << main_ub->ub_version << endl;
   auto rootbp = &main_ub->ub_rootbp;
-
-  /** get root dnode array from root bp */
-  // assert little endian
-  assert(BP_GET_BYTEORDER(rootbp) == 1);
-  cout << "rootbp: " << endl;
-  print_blkptr(rootbp);
+  if (command.empty()) {
+    cout << "rootbp: " << endl;
+    print_blkptr(rootbp);
+  }
 
   auto rootbp_type = BP_GET_TYPE(rootbp);
-  cout << "rootbp type 0x" << rootbp_type << endl;
-
-  uint64_t data_off = 0x400000;
-  auto dev_base_ptr = vdev_ptr + data_off;
-
-  auto output = read_block(rootbp, dev_base_ptr);
-  auto metadnode = (objset_phys_t*)output.data();
+  info << "rootbp type 0x" << rootbp_type << endl;
+
+  uint64_t data_off = VDEV_DATA_OFFSET;
+  auto dev_base_ptr = pool.dev_base_ptr;
+  auto metadnode = pool.mos();
+
+  // with a sidecar index next to the image the dataset tree and dnode locations come from there
+  string sidecar_path = string(vdev_path) + ".sidecar";
+  sidecar sc;
+  bool have_sidecar = sidecar_open(sidecar_path, &sc);
+  if (command == "sidecar" || (have_sidecar && !sidecar_valid(sc, pool_guid, rootbp))) {
+    bool ok = sidecar_build(metadnode, rootbp, dev_base_ptr, pool_name, pool_guid, main_ub->ub_txg,
+                            parallel_threads(), have_sidecar ? &sc : nullptr, sidecar_path);
+    if (have_sidecar) {
+      sidecar_close(&sc);
+    }
+    if (command == "sidecar") {
+      return ok ? 0 : 1;
+    }
+    have_sidecar = ok && sidecar_open(sidecar_path, &sc);
+  }
+  if (have_sidecar) {
+    set_metadata_cache(&sc.cache);
+  }
 
-  assert(metadnode->os_type == DMU_OST_META);
-  assert(metadnode->os_meta_dnode.dn_type == DMU_OT_DNODE);
+  if (command == "zil") {
+    dump_zil(metadnode, pool_name, dev_base_ptr);
+    return 0;
+  } else if ((command == "ls" && argc > 3) || (command == "cat" && argc > 4)) {
+    zpl_fs fs;
+    zil_overlay ov;
+    if (!open_fs_view(metadnode, pool_name, argv[3], dev_base_ptr, &fs, &ov)) {
+      return 1;
+    }
+    if (command == "cat") {
+      return cat_file(ov, argv[4]);
+    }
+    list_dir(ov, fs.root_obj, "");
+    return 0;
+  } else if (command == "metaslabs") {
+    std::vector<top_vdev_info> vdevs;
+    if (!load_vdev_tree(metadnode, dev_base_ptr, &vdevs)) {
+      return 1;
+    }
+    auto ms = metaslab_scan(metadnode, vdevs, dev_base_ptr, parallel_threads());
+    print_metaslab_report(vdevs, ms, argc > 3 && string(argv[3]) == "-v");
+    return 0;
+  } else if (command == "leaks") {
+    leak_check_result res;
+    bool clean = leak_check(metadnode, rootbp, dev_base_ptr, parallel_threads(), &res);
+    print_leak_check(res);
+    return clean ? 0 : 1;
+  } else if (command == "blockmap" && argc > 4) {
+    // blockmap build|refresh <index>, blockmap query <index> <device offset>...
+    string op = argv[3], path = argv[4];
+    block_index old;
+    bool have_old = block_index_open(path, &old);
+    if (op == "query") {
+      if (!have_old) {
+        cerr << "no block index at " << path << endl;
+        return 1;
+      }
+      if (old.hdr->bi_txg != main_ub->ub_txg) {
+        cerr << "index is from txg " << old.hdr->bi_txg << ", pool is at " << main_ub->ub_txg << endl;
+      }
+      blockmap_query(metadnode, pool_name, old, argv + 5, argc - 5, data_off, dev_base_ptr);
+      return 0;
+    }
+    bool ok = block_index_build(metadnode, rootbp, dev_base_ptr, pool_guid, main_ub->ub_txg, parallel_threads(),
+                                op == "refresh" && have_old ? &old : nullptr, path);
+    if (have_old) {
+      block_index_close(&old);
+    }
+    return ok ? 0 : 1;
+  } else if (command == "ddt") {
+    ddt_report report;
+    if (!ddt_load(metadnode, dev_base_ptr, parallel_threads(), &report)) {
+      cout << "pool has no dedup table" << endl;
+      return 0;
+    }
+    print_ddt_report(report);
+    return 0;
+  } else if (command == "dedup-sim") {
+    // -e trades exactness for fixed memory on pools too big for the table
+    if (argc > 3 && string(argv[3]) == "-e") {
+      dedup_sketch_result res;
+      dedup_estimate(metadnode, rootbp, dev_base_ptr, parallel_threads(), &res);
+      print_dedup_estimate(res);
+    } else {
+      dedup_sim_result res;
+      dedup_simulate(metadnode, rootbp, dev_base_ptr, parallel_threads(), &res);
+      print_dedup_sim(res);
+    }
+    return 0;
+  } else if (command == "blockstats") {
+    // blockstats [-o <csv>]
+    block_stats stats;
+    collect_block_stats(metadnode, rootbp, dev_base_ptr, parallel_threads(), &stats);
+    std::map<uint64_t, string> names;
+    for (auto &ds : list_datasets(metadnode, pool_name, dev_base_ptr, true, true)) {
+      names[ds.ds_obj] = ds.name;
+    }
+    print_block_stats(stats, names);
+    if (argc > 4 && string(argv[3]) == "-o") {
+      return write_block_stats_csv(stats, names, argv[4]) ? 0 : 1;
+    }
+    return 0;
+  } else if (command == "recompress" && argc > 3) {
+    // recompress <dataset> [percent]
+    dataset_info ds;
+    std::vector<top_vdev_info> vdevs;
+    if (!find_dataset(metadnode, pool_name, argv[3], dev_base_ptr, &ds) ||
+        !load_vdev_tree(metadnode, dev_base_ptr, &vdevs) || vdevs.empty()) {
+      return 1;
+    }
+    double percent = argc > 4 ? atof(argv[4]) : 1.0;
+    if (percent <= 0 || percent > 100) {
+      cerr << "sample percentage must be in (0, 100]" << endl;
+      return 1;
+    }
+    recompress_report report;
+    recompress_estimate(ds.ds_obj, &ds.ds.ds_bp, dev_base_ptr, vdevs[0].ashift, percent, parallel_threads(),
+                        &report);
+    print_recompress_report(report);
+    return 0;
+  } else if (command == "export" && argc > 3) {
+    // export <parquet file>
+    traverse_stats stats;
+    uint64_t rows;
+    bool ok = bp_export(metadnode, rootbp, dev_base_ptr, parallel_threads(), argv[3], &stats, &rows);
+    cerr << rows << " block pointers from " << stats.objsets << " objsets written to " << argv[3] << endl;
+    return ok ? 0 : 1;
+  } else if (command == "diff" && argc > 4) {
+    // diff <from dataset> <to dataset>, e.g. pool/fs@a pool/fs
+    dataset_info from, to;
+    if (!find_dataset(metadnode, pool_name, argv[3], dev_base_ptr, &from) ||
+        !find_dataset(metadnode, pool_name, argv[4], dev_base_ptr, &to)) {
+      return 1;
+    }
+    // name objects by path and tell reused object numbers apart when both sides are filesystems
+    zpl_fs from_fs, to_fs;
+    bool zpl = ((const objset_phys_t*)read_objset(&from.ds.ds_bp, dev_base_ptr).data())->os_type == DMU_OST_ZFS &&
+               ((const objset_phys_t*)read_objset(&to.ds.ds_bp, dev_base_ptr).data())->os_type == DMU_OST_ZFS &&
+               zpl_open(&from.ds.ds_bp, dev_base_ptr, &from_fs) && zpl_open(&to.ds.ds_bp, dev_base_ptr, &to_fs);
+    std::vector<diff_object> objects;
+    diff_stats stats;
+    diff_objsets(&from.ds.ds_bp, &to.ds.ds_bp, dev_base_ptr, zpl ? &from_fs : nullptr, zpl ? &to_fs : nullptr,
+                 parallel_threads(), &objects, &stats);
+    print_diff(objects, zpl ? &from_fs : nullptr, zpl ? &to_fs : nullptr);
+    cerr << objects.size() << " objects differ, " << stats.dnode_blocks << " dnode blocks and "
+         << stats.indirect_reads << " indirect blocks read" << endl;
+    return 0;
+  } else if (command == "send") {
+    // send [-c] [-e] [-i <from snapshot>] <dataset> <file, - for stdout>
+    send_options opts = {};
+    string from_name;
+    int i = 3;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != 0; i++) {
+      string opt = argv[i];
+      if (opt == "-c") {
+        opts.compressed = true;
+      } else if (opt == "-e") {
+        opts.embedded = true;
+      } else if (opt == "-i" && i + 1 < argc) {
+        from_name = argv[++i];
+      } else {
+        cerr << "unknown send option " << opt << endl;
+        return 1;
+      }
+    }
+    if (argc - i != 2) {
+      cerr << "usage: send [-c] [-e] [-i <from snapshot>] <dataset> <file>" << endl;
+      return 1;
+    }
+    dataset_info to, from;
+    if (!find_dataset(metadnode, pool_name, argv[i], dev_base_ptr, &to) ||
+        (!from_name.empty() && !find_dataset(metadnode, pool_name, from_name, dev_base_ptr, &from))) {
+      return 1;
+    }
+    // a head dataset is sent as a snapshot named after the txg of the image
+    string toname = to.name.find('@') != string::npos ? to.name : to.name + "@txg" + to_string(main_ub->ub_txg);
+    string path = argv[i + 1];
+    FILE *out = path == "-" ? stdout : fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+      cerr << "failed to create " << path << ", err: " << strerror(errno) << endl;
+      return 1;
+    }
+    send_stats stats;
+    bool ok = send_stream(metadnode, to, from_name.empty() ? nullptr : &from, toname, dev_base_ptr, opts,
+                          parallel_threads(), out, &stats);
+    if (out != stdout && fclose(out) != 0) {
+      cerr << "failed to write " << path << ", err: " << strerror(errno) << endl;
+      ok = false;
+    }
+    print_send_stats(stats);
+    return ok ? 0 : 1;
+  } else if (command == "zvol-export" && argc > 4) {
+    // zvol-export <volume> <image file or block device>
+    dataset_info ds;
+    if (!find_dataset(metadnode, pool_name, argv[3], dev_base_ptr, &ds)) {
+      return 1;
+    }
+    zvol_export_stats stats;
+    bool ok = zvol_export(&ds.ds.ds_bp, dev_base_ptr, fd, data_off, argv[4], parallel_threads(), &stats);
+    cerr << nicenum(stats.volsize) << " volume, " << stats.blocks << " blocks (" << nicenum(stats.bytes)
+         << ") written, " << stats.copied << " of them copied in the kernel" << endl;
+    return ok ? 0 : 1;
+  } else if (command == "tar" && argc > 3) {
+    // tar <filesystem or snapshot> [archive, stdout by default]
+    zpl_fs fs;
+    zil_overlay ov;
+    if (!open_fs_view(metadnode, pool_name, argv[3], dev_base_ptr, &fs, &ov)) {
+      return 1;
+    }
+    string path = argc > 4 ? argv[4] : "-";
+    FILE *out = path == "-" ? stdout : fopen(path.c_str(), "wb");
+    if (out == nullptr) {
+      cerr << "failed to create " << path << ", err: " << strerror(errno) << endl;
+      return 1;
+    }
+    tar_stats stats;
+    bool ok = tar_export(ov, parallel_threads(), out, &stats);
+    if (out != stdout && fclose(out) != 0) {
+      cerr << "failed to write " << path << ", err: " << strerror(errno) << endl;
+      ok = false;
+    }
+    cerr << stats.files << " files, " << stats.dirs << " directories, " << stats.symlinks << " symlinks, "
+         << stats.hardlinks << " hard links, " << stats.skipped << " skipped; " << stats.blocks
+         << " blocks read, " << nicenum(stats.bytes) << " archive" << endl;
+    return ok ? 0 : 1;
+  } else if (command == "scrub") {
+    // scrub [-m <queue MB>] [-r <MB/s>] [-i <IOPS>] [-c <checkpoint file>]
+    scrub_options opts = {SCRUB_QUEUE_BYTES, 0, 0, "", &map};
+    for (int i = 3; i < argc; i++) {
+      string opt = argv[i];
+      if (i + 1 >= argc || (opt != "-m" && opt != "-r" && opt != "-i" && opt != "-c")) {
+        cerr << "usage: scrub [-m <queue MB>] [-r <MB/s>] [-i <IOPS>] [-c <checkpoint file>]" << endl;
+        return 1;
+      }
+      const char *arg = argv[++i];
+      if (opt == "-m") {
+        opts.queue_bytes = strtoull(arg, nullptr, 0) << 20;
+      } else if (opt == "-r") {
+        opts.bytes_per_sec = strtoull(arg, nullptr, 0) << 20;
+      } else if (opt == "-i") {
+        opts.iops = strtoull(arg, nullptr, 0);
+      } else {
+        opts.checkpoint = arg;
+      }
+    }
+    if (opts.queue_bytes == 0) {
+      cerr << "queue size must be at least 1 MB" << endl;
+      return 1;
+    }
+    scrub_report report;
+    bool ok = scrub_pool(metadnode, rootbp, dev_base_ptr, fd, data_off, parallel_threads(), opts, &report);
+    print_scrub_report(report);
+    return ok && report.errors.empty() ? 0 : 1;
+  } else if (!command.empty()) {
+    cerr << "unknown command " << command << endl;
+    return 1;
+  }
 
   print_blkptr(&metadnode->os_meta_dnode.dn_blkptr[0]);
   std::cout << "root dnodes level " << (int)metadnode->os_meta_dnode.dn_nlevels << endl;
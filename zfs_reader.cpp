@@ -0,0 +1,736 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <endian.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "zfs_reader.h"
+#include "checksum.h"
+#include "perf_counters.h"
+#include "probes.h"
+#include "stage_stats.h"
+#include "zap_impl.h"
+#include "zap_leaf.h"
+#include <lz4.h>
+#include <zlib.h>
+
+uint64_t bp_get_asize(const blkptr_t *bp) {
+  if (BP_IS_EMBEDDED(bp)) {
+    return 0;
+  }
+  // an encrypted block keeps its IV and salt in the third DVA, objset blocks are only authenticated
+  bool encrypted = BP_USES_CRYPT(bp) && BP_GET_LEVEL(bp) == 0 && BP_GET_TYPE(bp) != DMU_OT_OBJSET;
+  int ndvas = encrypted ? SPA_DVAS_PER_BP - 1 : SPA_DVAS_PER_BP;
+  uint64_t asize = 0;
+  for (int d = 0; d < ndvas; d++) {
+    asize += DVA_GET_ASIZE(&bp->blk_dva[d]);
+  }
+  return asize;
+}
+
+std::string nicenum(uint64_t bytes) {
+  static const char units[] = "BKMGTPE";
+  int u = 0;
+  double v = bytes;
+  while (v >= 1024 && units[u + 1]) {
+    v /= 1024;
+    u++;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), v == (uint64_t)v ? "%.0f%c" : "%.1f%c", v, units[u]);
+  return buf;
+}
+
+void print_blkptr(const blkptr_t *p) {
+  static const char *blkptr_types[] = {
+      "none", // 0
+      "object_directory",
+      "object_array",
+      "packed_nvlist",
+      "nvlist_size",
+      "bplist", // 5
+      "bplist_hdr",
+      "space_map_header",
+      "space_map",
+      "intent_log",
+      "dnode", // 10
+      "objset",
+      "dsl_dataset",
+  };
+  auto t = BP_GET_TYPE(p);
+  if (t < sizeof(blkptr_types)/sizeof(blkptr_types[0])) {
+    std::cout << "blkptr: type " << blkptr_types[t] << " ";
+  } else {
+    std::cout << "blkptr: type " << t << " ";
+  }
+  if (DMU_OT_NONE == t) {
+    std::cout << std::endl;
+    return;
+  }
+  std::cout << (BP_GET_BYTEORDER(p) ? "LE" : "BE") << " ";
+  std::cout << std::endl;
+
+  std::cout << "  level " << BP_GET_LEVEL(p) << " " << std::endl;
+  std::cout << "  psize 0x" << std::hex << BP_GET_PSIZE(p) << " " << std::endl;
+  std::cout << "  lsize 0x" << std::hex << BP_GET_LSIZE(p) << " " << std::endl;
+  std::cout << "  cksum 0x" << std::hex << BP_GET_CHECKSUM(p) << " " << std::endl;
+  std::cout << "  compression 0x" << std::hex << BP_GET_COMPRESS(p) << " " << std::endl;
+  std::cout << "  birth 0x" << std::hex << p->blk_birth << " " << std::endl;
+  std::cout << "  fill_count 0x" << std::hex << p->blk_fill << " " << std::endl;
+  for (const auto & i : p->blk_dva) {
+    std::cout << "  vdev 0x" << std::hex << DVA_GET_VDEV(&i) << " off 0x" << std::hex << DVA_GET_OFFSET(&i)
+        << " asize 0x" << std::hex << DVA_GET_ASIZE(&i) << " gang " << DVA_GET_GANG(&i) << std::endl;
+  }
+}
+
+size_t zle_decompress(const void *src, void *dst, size_t s_len, size_t d_len, int n) {
+  auto s = (const uint8_t*)src, s_end = s + s_len;
+  auto d = (uint8_t*)dst, d_start = d, d_end = d + d_len;
+  // a length byte up to n - 1 copies that many + 1 bytes, above it writes zeros
+  while (s < s_end && d < d_end) {
+    int len = 1 + *s++;
+    if (len <= n) {
+      while (len-- != 0 && s < s_end && d < d_end) {
+        *d++ = *s++;
+      }
+    } else {
+      len -= n;
+      while (len-- != 0 && d < d_end) {
+        *d++ = 0;
+      }
+    }
+  }
+  return d - d_start;
+}
+
+bool can_decompress(int compress) {
+  return compress == ZIO_COMPRESS_OFF || compress == ZIO_COMPRESS_INHERIT || compress == ZIO_COMPRESS_LZ4 ||
+         compress == ZIO_COMPRESS_ZLE || (compress >= ZIO_COMPRESS_GZIP_1 && compress <= ZIO_COMPRESS_GZIP_9);
+}
+
+void decode_embedded_bp_compressed(const blkptr_t *bp, void *buf) {
+  auto buf8 = (uint8_t*)buf;
+  auto bp64 = (const uint64_t*)bp;
+  uint64_t w = 0;
+  for (uint64_t i = 0; i < BPE_GET_PSIZE(bp); i++) {
+    if (i % sizeof(w) == 0) {
+      // beginning of a word, blk_prop and blk_birth are not payload
+      w = *bp64++;
+      if (!BPE_IS_PAYLOADWORD(bp, bp64)) {
+        bp64++;
+      }
+    }
+    buf8[i] = BF64_GET(w, (i % sizeof(w)) * 8, 8);
+  }
+}
+
+// the PSIZE bytes of a gang block: its members' data in the order of the first
+// copy of the gang header that checks out
+static std::vector<uint8_t> read_gang(const blkptr_t *p, const void *dev_base_ptr) {
+  const zio_gbh_phys_t *gbh = nullptr;
+  for (auto &dva : p->blk_dva) {
+    if (DVA_IS_VALID(&dva) && DVA_GET_GANG(&dva) && DVA_GET_VDEV(&dva) == 0) {
+      auto copy = (const zio_gbh_phys_t*)((const uint8_t*)dev_base_ptr + DVA_GET_OFFSET(&dva));
+      if (gang_header_verify(p, copy)) {
+        gbh = copy;
+        break;
+      }
+    }
+  }
+  std::vector<uint8_t> output;
+  if (gbh == nullptr) {
+    std::cerr << "no valid gang header for the block at " << DVA_GET_OFFSET(&p->blk_dva[0]) << std::endl;
+    assert(0);
+    output.resize(BP_GET_PSIZE(p), 0);
+    return output;
+  }
+  for (size_t g = 0; g < SPA_GBH_NBLKPTRS && output.size() < BP_GET_PSIZE(p); g++) {
+    if (!BP_IS_HOLE(&gbh->zg_blkptr[g])) {
+      auto member = read_block_raw(&gbh->zg_blkptr[g], dev_base_ptr);
+      output.insert(output.end(), member.begin(), member.end());
+    }
+  }
+  output.resize(BP_GET_PSIZE(p), 0);
+  return output;
+}
+
+std::vector<uint8_t> read_block_raw(const blkptr_t *p, const void *dev_base_ptr) {
+  if (BP_IS_EMBEDDED(p)) {
+    std::vector<uint8_t> output(BPE_GET_PSIZE(p));
+    decode_embedded_bp_compressed(p, output.data());
+    return output;
+  }
+  assert(DVA_GET_VDEV(&p->blk_dva[0]) == 0);
+  if (DVA_GET_GANG(&p->blk_dva[0])) {
+    return read_gang(p, dev_base_ptr);
+  }
+  uint64_t off = DVA_GET_OFFSET(&p->blk_dva[0]);
+  auto *blk = (const uint8_t *)dev_base_ptr + off;
+  PROBE5(block__read__start, 0, off, BP_GET_PSIZE(p), BP_GET_LEVEL(p), BP_GET_TYPE(p));
+  uint64_t start = stage_begin();
+  std::vector<uint8_t> output(blk, blk + BP_GET_PSIZE(p));
+  stage_end(STAGE_READ, start, output.size());
+  PROBE5(block__read__done, 0, off, BP_GET_PSIZE(p), BP_GET_LEVEL(p), BP_GET_TYPE(p));
+  return output;
+}
+
+static void decompress_block(int compress, const void *src, size_t psize, void *dst, size_t lsize) {
+  if (compress == ZIO_COMPRESS_OFF || compress == ZIO_COMPRESS_INHERIT) {
+    memcpy(dst, src, lsize);
+  } else if (compress == ZIO_COMPRESS_LZ4) {
+    auto input_size = __builtin_bswap32 (*(uint32_t*)src);
+    perf_sample ps;
+    perf_begin(&ps);
+    const int decompressed_size = LZ4_decompress_safe(
+        (const char*)src+sizeof(int32_t),
+        (char*)dst, input_size, lsize
+    );
+    perf_end(PERF_LZ4, ps, lsize);
+    assert(decompressed_size == (int)lsize);
+  } else if (compress == ZIO_COMPRESS_ZLE) {
+    size_t decompressed_size = zle_decompress(src, dst, psize, lsize, 64);
+    assert(decompressed_size == lsize);
+  } else if (compress >= ZIO_COMPRESS_GZIP_1 && compress <= ZIO_COMPRESS_GZIP_9) {
+    uLongf decompressed_size = lsize;
+    int err = uncompress((Bytef*)dst, &decompressed_size, (const Bytef*)src, psize);
+    assert(err == Z_OK && decompressed_size == (uLongf)lsize);
+  } else {
+    std::cerr << "unknown blkptr compression type " << compress << std::endl;
+    assert(0);
+  }
+}
+
+// output must be at least LSIZE
+std::vector<uint8_t> read_block(const blkptr_t *p, const void *dev_base_ptr) {
+  if (BP_IS_EMBEDDED(p)) {
+    std::vector<uint8_t> output(BPE_GET_LSIZE(p), 0);
+    uint8_t payload[BPE_PAYLOAD_SIZE];
+    decode_embedded_bp_compressed(p, payload);
+    decompress_block(BP_GET_COMPRESS(p), payload, BPE_GET_PSIZE(p), output.data(), output.size());
+    return output;
+  }
+  auto vdev1 = DVA_GET_VDEV(&p->blk_dva[0]);
+  uint64_t off1 = DVA_GET_OFFSET(&p->blk_dva[0]);
+  int lsize = BP_GET_LSIZE(p);
+  assert(vdev1 == 0);
+
+  std::vector<uint8_t> output(lsize, 0);
+  auto *blk = (const char *)dev_base_ptr + off1;
+  std::vector<uint8_t> gang;
+  if (DVA_GET_GANG(&p->blk_dva[0])) {
+    gang = read_gang(p, dev_base_ptr);
+    blk = (const char*)gang.data();
+  }
+  int compress = BP_GET_COMPRESS(p);
+  uint64_t psize = BP_GET_PSIZE(p);
+  PROBE5(block__read__start, vdev1, off1, psize, BP_GET_LEVEL(p), BP_GET_TYPE(p));
+  PROBE4(decompress__start, off1, compress, psize, lsize);
+  uint64_t start = stage_begin();
+  decompress_block(compress, blk, psize, output.data(), lsize);
+  bool copied = compress == ZIO_COMPRESS_OFF || compress == ZIO_COMPRESS_INHERIT;
+  stage_end(copied ? STAGE_READ : STAGE_DECOMPRESS, start, lsize);
+  PROBE4(decompress__done, off1, compress, psize, lsize);
+  PROBE5(block__read__done, vdev1, off1, psize, BP_GET_LEVEL(p), BP_GET_TYPE(p));
+  return output;
+}
+
+void prefetch_block(const blkptr_t *p, const void *dev_base_ptr) {
+  if (BP_IS_EMBEDDED(p) || BP_IS_HOLE(p)) {
+    return;
+  }
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  auto start = (uintptr_t)dev_base_ptr + DVA_GET_OFFSET(&p->blk_dva[0]);
+  auto end = start + DVA_GET_ASIZE(&p->blk_dva[0]);
+  start = P2ALIGN(start, page_size);
+  // advisory only, a failure just means we take the page faults later
+  madvise((void*)start, end - start, MADV_WILLNEED);
+}
+
+// the indices of bps that are not holes or embedded, sorted by offset
+static std::vector<size_t> bps_by_offset(const blkptr_t *bps, size_t n) {
+  std::vector<size_t> order;
+  for (size_t i = 0; i < n; i++) {
+    if (!BP_IS_HOLE(&bps[i]) && !BP_IS_EMBEDDED(&bps[i])) {
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return DVA_GET_OFFSET(&bps[a].blk_dva[0]) < DVA_GET_OFFSET(&bps[b].blk_dva[0]);
+  });
+  return order;
+}
+
+static void prefetch_sorted(const blkptr_t *bps, const std::vector<size_t> &order, const void *dev_base_ptr,
+                            uint64_t gap) {
+  static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t start = 0, end = 0;
+  auto issue = [&]() {
+    if (end > start) {
+      auto p = P2ALIGN((uintptr_t)dev_base_ptr + start, page_size);
+      madvise((void*)p, (uintptr_t)dev_base_ptr + end - p, MADV_WILLNEED);
+    }
+  };
+  for (size_t i : order) {
+    uint64_t off = DVA_GET_OFFSET(&bps[i].blk_dva[0]);
+    uint64_t blk_end = off + DVA_GET_ASIZE(&bps[i].blk_dva[0]);
+    if (end > start && off <= end + gap && std::max(end, blk_end) - start <= READ_AGG_MAX) {
+      end = std::max(end, blk_end);
+      continue;
+    }
+    issue();
+    start = off;
+    end = blk_end;
+  }
+  issue();
+}
+
+void prefetch_blocks(const blkptr_t *bps, size_t n, const void *dev_base_ptr, uint64_t gap) {
+  prefetch_sorted(bps, bps_by_offset(bps, n), dev_base_ptr, gap);
+}
+
+void read_blocks(const blkptr_t *bps, size_t n, const void *dev_base_ptr, std::vector<std::vector<uint8_t>> *out,
+                 uint64_t gap) {
+  out->assign(n, std::vector<uint8_t>());
+  auto order = bps_by_offset(bps, n);
+  prefetch_sorted(bps, order, dev_base_ptr, gap);
+  for (size_t i : order) {
+    (*out)[i] = read_block(&bps[i], dev_base_ptr);
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (BP_IS_EMBEDDED(&bps[i])) {
+      (*out)[i] = read_block(&bps[i], dev_base_ptr);
+    }
+  }
+}
+
+std::vector<uint8_t> read_obj(const objset_phys_t* objset, uint64_t id, const void *dev_base_ptr, int leaf_id) {
+  int level = objset->os_meta_dnode.dn_nlevels;
+  assert(objset->os_type == DMU_OST_META);
+  assert(objset->os_meta_dnode.dn_type == DMU_OT_DNODE);
+  auto data = read_block(&objset->os_meta_dnode.dn_blkptr[0], dev_base_ptr);
+  blkptr_t *blkptrs = (blkptr_t*)data.data();
+
+  // max indirection 6
+  std::vector<uint64_t> offsets;
+
+  size_t radix = (1UL << objset->os_meta_dnode.dn_indblkshift) / sizeof(blkptr_t);
+  size_t datablk_size = objset->os_meta_dnode.dn_datablkszsec * ZFS_SEC_SIZE;
+
+  while (level > 0) {
+    int curid = id % radix;
+    id = id / radix;
+    level--;
+    offsets.insert(offsets.begin(), curid);
+  }
+  dnode_phys_t *dnodeptrs;
+  data = read_block(&blkptrs[offsets[0]], dev_base_ptr);
+  dnodeptrs = (dnode_phys_t*)data.data();
+  for (int i = 1; i < offsets.size(); i++) {
+    auto dnode = &dnodeptrs[offsets[i]];
+//    assert(dnode->dn_nblkptr == 1);
+    int j = 0;
+    if (i == offsets.size() - 1) {
+      j = leaf_id;
+    }
+    data = read_block(&dnode->dn_blkptr[j], dev_base_ptr);
+    dnodeptrs = (dnode_phys_t*)data.data();
+  }
+  return std::move(data);
+}
+
+std::vector<uint8_t> read_dnode_block(const dnode_phys_t *dn, uint64_t blkid, const void *dev_base_ptr) {
+  size_t datablk_size = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  int epbs = dn->dn_indblkshift - SPA_BLKPTRSHIFT;
+  int level = dn->dn_nlevels - 1;
+
+  uint64_t top = level == 0 ? blkid : blkid >> (epbs * level);
+  if (blkid > dn->dn_maxblkid || top >= dn->dn_nblkptr) {
+    return std::vector<uint8_t>(datablk_size, 0);
+  }
+  blkptr_t bp = dn->dn_blkptr[top];
+  while (level > 0) {
+    if (BP_IS_HOLE(&bp)) {
+      return std::vector<uint8_t>(datablk_size, 0);
+    }
+    auto data = read_block(&bp, dev_base_ptr);
+    level--;
+    uint64_t idx = (blkid >> (epbs * level)) & ((1ULL << epbs) - 1);
+    bp = ((const blkptr_t*)data.data())[idx];
+  }
+  if (BP_IS_HOLE(&bp)) {
+    return std::vector<uint8_t>(datablk_size, 0);
+  }
+  return read_block(&bp, dev_base_ptr);
+}
+
+// the level 0 block pointers below bp, which covers blkids from base, that fall into [first, first + out->size())
+static void collect_level0(const blkptr_t *bp, int level, uint64_t base, int epbs, uint64_t first,
+                           const void *dev_base_ptr, std::vector<blkptr_t> *out) {
+  uint64_t last = first + out->size();
+  uint64_t span = 1ULL << (epbs * level);
+  if (BP_IS_HOLE(bp) || base + span <= first || base >= last) {
+    return;
+  }
+  if (level == 0) {
+    (*out)[base - first] = *bp;
+    return;
+  }
+  auto data = read_block(bp, dev_base_ptr);
+  auto children = (const blkptr_t*)data.data();
+  uint64_t child_span = span >> epbs;
+  uint64_t begin = first > base ? (first - base) / child_span : 0;
+  uint64_t end = std::min<uint64_t>(data.size() / sizeof(blkptr_t), (last - base + child_span - 1) / child_span);
+  for (uint64_t i = begin; i < end; i++) {
+    collect_level0(&children[i], level - 1, base + i * child_span, epbs, first, dev_base_ptr, out);
+  }
+}
+
+void read_dnode_blocks(const dnode_phys_t *dn, uint64_t first, uint64_t last, const void *dev_base_ptr,
+                       std::vector<std::vector<uint8_t>> *out) {
+  size_t datablk_size = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  int epbs = dn->dn_indblkshift - SPA_BLKPTRSHIFT;
+  int level = dn->dn_nlevels - 1;
+  std::vector<blkptr_t> bps(last > first ? last - first : 0, blkptr_t());
+  for (int i = 0; i < dn->dn_nblkptr; i++) {
+    collect_level0(&dn->dn_blkptr[i], level, (uint64_t)i << (epbs * level), epbs, first, dev_base_ptr, &bps);
+  }
+  read_blocks(bps.data(), bps.size(), dev_base_ptr, out);
+  for (auto &data : *out) {
+    if (data.empty()) {
+      data.assign(datablk_size, 0);
+    }
+  }
+}
+
+std::vector<uint8_t> read_object(const dnode_phys_t *dn, uint64_t off, uint64_t len, const void *dev_base_ptr) {
+  std::vector<uint8_t> output(len, 0);
+  uint64_t blksz = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  for (uint64_t pos = off; pos < off + len; ) {
+    auto data = read_dnode_block(dn, pos / blksz, dev_base_ptr);
+    uint64_t blkoff = pos % blksz;
+    uint64_t n = std::min(blksz - blkoff, off + len - pos);
+    memcpy(output.data() + (pos - off), data.data() + blkoff, n);
+    pos += n;
+  }
+  return output;
+}
+
+static const metadata_cache *md_cache = nullptr;
+
+void set_metadata_cache(const metadata_cache *c) {
+  md_cache = c;
+}
+
+std::vector<uint8_t> read_dnode(const objset_phys_t *objset, uint64_t object, const void *dev_base_ptr) {
+  auto mdn = &objset->os_meta_dnode;
+  assert(mdn->dn_type == DMU_OT_DNODE);
+  uint64_t dnodes_per_blk = (mdn->dn_datablkszsec * ZFS_SEC_SIZE) >> DNODE_SHIFT;
+  uint64_t blkid = object / dnodes_per_blk;
+  blkptr_t bp;
+  bool cached = md_cache != nullptr && md_cache->dnode_block && md_cache->dnode_block(objset, blkid, &bp);
+  if (md_cache != nullptr) {
+    if (cached) {
+      PROBE2(cache__hit, objset, blkid);
+    } else {
+      PROBE2(cache__miss, objset, blkid);
+    }
+  }
+  auto data = cached ? read_block(&bp, dev_base_ptr) : read_dnode_block(mdn, blkid, dev_base_ptr);
+
+  uint64_t slot = object % dnodes_per_blk;
+  auto dn = (const dnode_phys_t*)data.data() + slot;
+  uint64_t slots = std::min<uint64_t>(dn->dn_extra_slots + 1, dnodes_per_blk - slot);
+  return std::vector<uint8_t>((const uint8_t*)dn, (const uint8_t*)(dn + slots));
+}
+
+std::vector<uint8_t> read_objset(const blkptr_t *bp, const void *dev_base_ptr) {
+  auto data = read_block(bp, dev_base_ptr);
+  // V1 objsets have no {user,group,project}used dnodes, leave them zeroed
+  if (data.size() < sizeof(objset_phys_t)) {
+    data.resize(sizeof(objset_phys_t), 0);
+  }
+  return data;
+}
+
+bool pool_open(const char *vdev, pool_info *pool) {
+  pool->config = nullptr;
+  pool->guid = 0;
+  pool->ub = nullptr;
+  pool->dev_base_ptr = vdev + VDEV_DATA_OFFSET;
+  if (nvlist_unpack((char*)vdev + VDEV_LABEL_CONFIG_OFFSET, VDEV_LABEL_CONFIG_SIZE, &pool->config, 0) != 0) {
+    std::cerr << "failed to unpack the label config" << std::endl;
+    pool->config = nullptr;
+    return false;
+  }
+  char *name;
+  if (nvlist_lookup_string(pool->config, "name", &name) != 0) {
+    std::cerr << "no pool name in the label config" << std::endl;
+    pool_close(pool);
+    return false;
+  }
+  pool->name = name;
+  nvlist_lookup_uint64(pool->config, "pool_guid", &pool->guid);
+
+  for (int i = 0; i < VDEV_UBERBLOCK_SLOTS; i++) {
+    auto ub = (const uberblock*)(vdev + VDEV_UBERBLOCK_RING_OFFSET + i * VDEV_UBERBLOCK_SLOT_SIZE);
+    if (ub->ub_magic == UBERBLOCK_MAGIC && (pool->ub == nullptr || ub->ub_txg > pool->ub->ub_txg)) {
+      pool->ub = ub;
+      pool->ub_slot = i;
+    }
+  }
+  if (pool->ub == nullptr) {
+    std::cerr << "no uberblock found" << std::endl;
+    pool_close(pool);
+    return false;
+  }
+  if (BP_GET_BYTEORDER(&pool->ub->ub_rootbp) != ZFS_HOST_BYTEORDER) {
+    std::cerr << "the pool is not in host byte order" << std::endl;
+    pool_close(pool);
+    return false;
+  }
+  pool->mos_data = read_objset(&pool->ub->ub_rootbp, pool->dev_base_ptr);
+  if (pool->mos()->os_type != DMU_OST_META || pool->mos()->os_meta_dnode.dn_type != DMU_OT_DNODE) {
+    std::cerr << "no MOS behind the uberblock" << std::endl;
+    pool_close(pool);
+    return false;
+  }
+  return true;
+}
+
+void pool_close(pool_info *pool) {
+  if (pool->config != nullptr) {
+    nvlist_free(pool->config);
+    pool->config = nullptr;
+  }
+}
+
+static std::vector<uint8_t> zap_leaf_array_read(const zap_leaf_chunk_t *chunks, int nchunks,
+                                                uint16_t chunk, size_t len) {
+  std::vector<uint8_t> output;
+  output.reserve(len);
+  while (chunk != ZAP_CHAIN_END && output.size() < len) {
+    assert(chunk < nchunks);
+    auto &la = chunks[chunk].l_array;
+    assert(la.la_type == ZAP_CHUNK_ARRAY);
+    size_t n = std::min(len - output.size(), (size_t)ZAP_LEAF_ARRAY_BYTES);
+    output.insert(output.end(), la.la_array, la.la_array + n);
+    chunk = la.la_next;
+  }
+  assert(output.size() == len);
+  return output;
+}
+
+// integers in zap leaf arrays are stored big endian
+static void zap_ints_to_host(std::vector<uint8_t> &buf, int intlen) {
+  for (size_t i = 0; i + intlen <= buf.size(); i += intlen) {
+    auto p = buf.data() + i;
+    if (intlen == 8) {
+      uint64_t v;
+      memcpy(&v, p, 8);
+      v = be64toh(v);
+      memcpy(p, &v, 8);
+    } else if (intlen == 4) {
+      uint32_t v;
+      memcpy(&v, p, 4);
+      v = be32toh(v);
+      memcpy(p, &v, 4);
+    } else if (intlen == 2) {
+      uint16_t v;
+      memcpy(&v, p, 2);
+      v = be16toh(v);
+      memcpy(p, &v, 2);
+    }
+  }
+}
+
+static bool zap_leaf_iterate(const zap_leaf_phys_t *leaf, int bs, bool uint64_key, const zap_cb_t &cb) {
+  auto chunks = (const zap_leaf_chunk_t *)(leaf->l_hash + ZAP_LEAF_HASH_NUMENTRIES_BS(bs));
+  int nchunks = ZAP_LEAF_NUMCHUNKS_BS(bs);
+  for (int i = 0; i < nchunks; i++) {
+    auto &le = chunks[i].l_entry;
+    if (le.le_type != ZAP_CHUNK_ENTRY) {
+      continue;
+    }
+    zap_attribute za;
+    int key_intlen = uint64_key ? 8 : 1;
+    auto name = zap_leaf_array_read(chunks, nchunks, le.le_name_chunk, le.le_name_numints * key_intlen);
+    if (uint64_key) {
+      zap_ints_to_host(name, 8);
+      za.za_key.assign((const uint64_t*)name.data(), (const uint64_t*)name.data() + le.le_name_numints);
+    } else {
+      za.za_name.assign((const char*)name.data(), strnlen((const char*)name.data(), name.size()));
+    }
+    za.za_integer_length = le.le_value_intlen;
+    za.za_num_integers = le.le_value_numints;
+    za.za_value = zap_leaf_array_read(chunks, nchunks, le.le_value_chunk,
+                                      (size_t)le.le_value_numints * le.le_value_intlen);
+    zap_ints_to_host(za.za_value, le.le_value_intlen);
+    za.za_first_integer = 0;
+    if (le.le_value_numints > 0) {
+      switch (le.le_value_intlen) {
+        case 1: za.za_first_integer = za.za_value[0]; break;
+        case 2: za.za_first_integer = *(const uint16_t*)za.za_value.data(); break;
+        case 4: za.za_first_integer = *(const uint32_t*)za.za_value.data(); break;
+        case 8: za.za_first_integer = *(const uint64_t*)za.za_value.data(); break;
+      }
+    }
+    if (!cb(za)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void zap_iterate(const dnode_phys_t *dn, const void *dev_base_ptr, const zap_cb_t &cb) {
+  auto header = read_dnode_block(dn, 0, dev_base_ptr);
+  auto block_type = *(const uint64_t*)header.data();
+
+  if (block_type == ZBT_MICRO) {
+    auto mzap = (const mzap_phys_t*)header.data();
+    size_t nents = header.size() / MZAP_ENT_LEN - 1;
+    for (size_t i = 0; i < nents; i++) {
+      auto &mze = mzap->mz_chunk[i];
+      if (mze.mze_name[0] == 0) {
+        continue;
+      }
+      zap_attribute za;
+      za.za_name.assign(mze.mze_name, strnlen(mze.mze_name, MZAP_NAME_LEN));
+      za.za_integer_length = 8;
+      za.za_num_integers = 1;
+      za.za_first_integer = mze.mze_value;
+      za.za_value.assign((const uint8_t*)&mze.mze_value, (const uint8_t*)(&mze.mze_value + 1));
+      if (!cb(za)) {
+        return;
+      }
+    }
+    return;
+  }
+
+  assert(block_type == ZBT_HEADER);
+  auto zap = (const zap_phys_t*)header.data();
+  zap_iterate_blocks(dn, dev_base_ptr, 1, zap->zap_freeblk, cb);
+}
+
+uint64_t zap_leaf_blocks(const dnode_phys_t *dn, const void *dev_base_ptr) {
+  auto header = read_dnode_block(dn, 0, dev_base_ptr);
+  auto zap = (const zap_phys_t*)header.data();
+  return zap->zap_block_type == ZBT_HEADER ? zap->zap_freeblk : 0;
+}
+
+// leaf blocks read together by zap_iterate_blocks()
+#define ZAP_READ_BATCH 64
+
+void zap_iterate_blocks(const dnode_phys_t *dn, const void *dev_base_ptr, uint64_t first, uint64_t last,
+                        const zap_cb_t &cb) {
+  auto header = read_dnode_block(dn, 0, dev_base_ptr);
+  auto zap = (const zap_phys_t*)header.data();
+  assert(zap->zap_block_type == ZBT_HEADER && zap->zap_magic == ZAP_MAGIC);
+  bool uint64_key = zap->zap_flags & ZAP_FLAG_UINT64_KEY;
+  int bs = __builtin_ctzll(header.size());
+  // leaves are never freed, so every leaf lives below zap_freeblk.  external
+  // pointer table blocks in the same range are skipped by their block type.
+  last = std::min(last, zap->zap_freeblk);
+  std::vector<std::vector<uint8_t>> batch;
+  for (uint64_t blkid = std::max<uint64_t>(first, 1); blkid < last; blkid += ZAP_READ_BATCH) {
+    read_dnode_blocks(dn, blkid, std::min<uint64_t>(blkid + ZAP_READ_BATCH, last), dev_base_ptr, &batch);
+    for (auto &data : batch) {
+      auto leaf = (const zap_leaf_phys_t*)data.data();
+      if (leaf->l_hdr.lh_block_type != ZBT_LEAF || leaf->l_hdr.lh_magic != ZAP_LEAF_MAGIC) {
+        continue;
+      }
+      if (!zap_leaf_iterate(leaf, bs, uint64_key, cb)) {
+        return;
+      }
+    }
+  }
+}
+
+bool zap_lookup(const dnode_phys_t *dn, const char *name, const void *dev_base_ptr, uint64_t *value) {
+  bool found = false;
+  zap_iterate(dn, dev_base_ptr, [&](const zap_attribute &za) {
+    if (za.za_name != name) {
+      return true;
+    }
+    *value = za.za_first_integer;
+    found = true;
+    return false;
+  });
+  return found;
+}
+
+static void list_dsl_dir(const objset_phys_t *mos, uint64_t dir_obj, const std::string &name,
+                         const void *dev_base_ptr, bool snapshots, bool internal, std::vector<dataset_info> *out) {
+  auto dir_data = read_dnode(mos, dir_obj, dev_base_ptr);
+  auto dir_dn = (const dnode_phys_t*)dir_data.data();
+  assert(dir_dn->dn_type == DMU_OT_DSL_DIR);
+  auto dir = *(const dsl_dir_phys_t*)DN_BONUS(dir_dn);
+
+  if (dir.dd_head_dataset_obj != 0) {
+    auto ds_data = read_dnode(mos, dir.dd_head_dataset_obj, dev_base_ptr);
+    auto ds_dn = (const dnode_phys_t*)ds_data.data();
+    assert(ds_dn->dn_bonustype == DMU_OT_DSL_DATASET);
+    auto ds = (const dsl_dataset_phys_t*)DN_BONUS(ds_dn);
+    out->push_back(dataset_info{name, dir_obj, dir.dd_head_dataset_obj, *ds});
+
+    if (snapshots && ds->ds_snapnames_zapobj != 0) {
+      auto snap_zap = read_dnode(mos, ds->ds_snapnames_zapobj, dev_base_ptr);
+      zap_iterate((const dnode_phys_t*)snap_zap.data(), dev_base_ptr, [&](const zap_attribute &za) {
+        auto snap_data = read_dnode(mos, za.za_first_integer, dev_base_ptr);
+        auto snap = (const dsl_dataset_phys_t*)DN_BONUS((const dnode_phys_t*)snap_data.data());
+        out->push_back(dataset_info{name + "@" + za.za_name, dir_obj, za.za_first_integer, *snap});
+        return true;
+      });
+    }
+  }
+
+  if (dir.dd_child_dir_zapobj != 0) {
+    auto child_zap = read_dnode(mos, dir.dd_child_dir_zapobj, dev_base_ptr);
+    zap_iterate((const dnode_phys_t*)child_zap.data(), dev_base_ptr, [&](const zap_attribute &za) {
+      // $MOS, $FREE and $ORIGIN are internal to the pool
+      if (internal || za.za_name[0] != '$') {
+        list_dsl_dir(mos, za.za_first_integer, name + "/" + za.za_name, dev_base_ptr, snapshots, internal, out);
+      }
+      return true;
+    });
+  }
+}
+
+std::vector<dataset_info> list_datasets(const objset_phys_t *mos, const char *pool_name,
+                                        const void *dev_base_ptr, bool snapshots, bool internal) {
+  std::vector<dataset_info> cached;
+  if (md_cache != nullptr && md_cache->datasets && md_cache->datasets(&cached)) {
+    std::vector<dataset_info> datasets;
+    for (auto &ds : cached) {
+      if ((snapshots || ds.name.find('@') == std::string::npos) &&
+          (internal || ds.name.find('$') == std::string::npos)) {
+        datasets.push_back(ds);
+      }
+    }
+    return datasets;
+  }
+  auto dir_data = read_dnode(mos, DMU_POOL_DIRECTORY_OBJECT, dev_base_ptr);
+  uint64_t root_dir_obj;
+  if (!zap_lookup((const dnode_phys_t*)dir_data.data(), DMU_POOL_ROOT_DATASET, dev_base_ptr, &root_dir_obj)) {
+    std::cerr << "no " << DMU_POOL_ROOT_DATASET << " in the MOS object directory" << std::endl;
+    return {};
+  }
+  std::vector<dataset_info> datasets;
+  list_dsl_dir(mos, root_dir_obj, pool_name, dev_base_ptr, snapshots, internal, &datasets);
+  return datasets;
+}
+
+bool find_dataset(const objset_phys_t *mos, const char *pool_name, const std::string &name,
+                  const void *dev_base_ptr, dataset_info *info) {
+  bool snapshot = name.find('@') != std::string::npos;
+  for (auto &ds : list_datasets(mos, pool_name, dev_base_ptr, snapshot)) {
+    if (ds.name == name) {
+      *info = ds;
+      return true;
+    }
+  }
+  std::cerr << "dataset " << name << " not found" << std::endl;
+  return false;
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// the zfs headers below take their SPL types from libspl, which libnvpair pulls in
+#include <libnvpair.h>
+#include "spa.h"
+#include "dmu.h"
+#include "dnode.h"
+#include "dmu_objset.h"
+#include "dsl_dir.h"
+#include "dsl_dataset.h"
+
+enum zio_compress {
+  ZIO_COMPRESS_INHERIT = 0,
+  ZIO_COMPRESS_ON,
+  ZIO_COMPRESS_OFF,
+  ZIO_COMPRESS_LZJB,
+  ZIO_COMPRESS_EMPTY,
+  ZIO_COMPRESS_GZIP_1,
+  ZIO_COMPRESS_GZIP_2,
+  ZIO_COMPRESS_GZIP_3,
+  ZIO_COMPRESS_GZIP_4,
+  ZIO_COMPRESS_GZIP_5,
+  ZIO_COMPRESS_GZIP_6,
+  ZIO_COMPRESS_GZIP_7,
+  ZIO_COMPRESS_GZIP_8,
+  ZIO_COMPRESS_GZIP_9,
+  ZIO_COMPRESS_ZLE,
+  ZIO_COMPRESS_LZ4,
+  ZIO_COMPRESS_ZSTD,
+  ZIO_COMPRESS_FUNCTIONS
+};
+
+/*
+ * NB: lzc_dataset_type should be updated whenever a new objset type is added,
+ * if it represents a real type of a dataset that can be created from userland.
+ */
+typedef enum dmu_objset_type {
+  DMU_OST_NONE,
+  DMU_OST_META,
+  DMU_OST_ZFS,
+  DMU_OST_ZVOL,
+  DMU_OST_OTHER,			/* For testing only! */
+  DMU_OST_ANY,			/* Be careful! */
+  DMU_OST_NUMTYPES
+} dmu_objset_type_t;
+
+#define ZFS_SEC_SIZE 512UL
+
+/*
+ * zap_flags_t, stored in zap_phys_t.zap_flags of fat zaps.
+ */
+#define ZAP_FLAG_HASH64 (1ULL << 0)
+#define ZAP_FLAG_UINT64_KEY (1ULL << 1)
+#define ZAP_FLAG_PRE_HASHED_KEY (1ULL << 2)
+
+#define ZAP_CHAIN_END 0xffff
+
+// BP_GET_ASIZE() without the object type table, which this tool does not link
+uint64_t bp_get_asize(const blkptr_t *bp);
+
+// human readable size: 4K, 1.5M
+std::string nicenum(uint64_t bytes);
+
+void print_blkptr(const blkptr_t *p);
+
+// zero length encoding, n is the run length threshold (64 for blocks and the DDT)
+size_t zle_decompress(const void *src, void *dst, size_t s_len, size_t d_len, int n);
+
+// whether read_block() knows the compression function
+bool can_decompress(int compress);
+
+// output must be at least LSIZE. embedded block pointers are decoded from the payload,
+// gang blocks are put together from their members
+std::vector<uint8_t> read_block(const blkptr_t *p, const void *dev_base_ptr);
+
+// the block as stored, PSIZE bytes still compressed; the payload of an embedded block pointer,
+// the members of a gang block
+std::vector<uint8_t> read_block_raw(const blkptr_t *p, const void *dev_base_ptr);
+
+// copy the BPE_GET_PSIZE() payload bytes of an embedded block pointer to buf
+void decode_embedded_bp_compressed(const blkptr_t *bp, void *buf);
+
+// hint the kernel to start paging in the block behind p, without waiting for it
+void prefetch_block(const blkptr_t *p, const void *dev_base_ptr);
+
+// blocks of a batch no further apart than this are paged in as one range
+#define READ_AGG_GAP (32 << 10)
+// largest range paged in at once
+#define READ_AGG_MAX (1 << 20)
+
+// prefetch_block() for n blocks, with neighbouring DVAs merged into one madvise() per range
+void prefetch_blocks(const blkptr_t *bps, size_t n, const void *dev_base_ptr, uint64_t gap = READ_AGG_GAP);
+
+/*
+ * read_block() for n blocks at once.  The DVAs are sorted and merged into
+ * ranges as by prefetch_blocks(), then the blocks are decompressed in offset
+ * order so the mapping is faulted in sequentially.  (*out)[i] belongs to
+ * bps[i] and is empty for a hole.
+ */
+void read_blocks(const blkptr_t *bps, size_t n, const void *dev_base_ptr, std::vector<std::vector<uint8_t>> *out,
+                 uint64_t gap = READ_AGG_GAP);
+
+std::vector<uint8_t> read_obj(const objset_phys_t* objset, uint64_t id, const void *dev_base_ptr, int leaf_id);
+
+// read logical block blkid of the object described by dn, walking its indirect blocks.
+// holes and blocks past dn_maxblkid come back zero filled.
+std::vector<uint8_t> read_dnode_block(const dnode_phys_t *dn, uint64_t blkid, const void *dev_base_ptr);
+
+// read_dnode_block() for blkids [first, last), the blocks read with read_blocks()
+void read_dnode_blocks(const dnode_phys_t *dn, uint64_t first, uint64_t last, const void *dev_base_ptr,
+                       std::vector<std::vector<uint8_t>> *out);
+
+// read [off, off + len) of the object described by dn, holes read as zeros
+std::vector<uint8_t> read_object(const dnode_phys_t *dn, uint64_t off, uint64_t len, const void *dev_base_ptr);
+
+// read the dnode of object id in objset, including the extra slots of a large dnode
+std::vector<uint8_t> read_dnode(const objset_phys_t *objset, uint64_t object, const void *dev_base_ptr);
+
+// read the objset_phys_t behind a dataset's or the MOS's root blkptr, padded to sizeof(objset_phys_t)
+std::vector<uint8_t> read_objset(const blkptr_t *bp, const void *dev_base_ptr);
+
+// the front label: its config nvlist, and the ring of uberblocks behind it
+#define VDEV_LABEL_CONFIG_OFFSET (16 << 10)
+#define VDEV_LABEL_CONFIG_SIZE (112 << 10)
+#define VDEV_UBERBLOCK_RING_OFFSET (128 << 10)
+#define VDEV_UBERBLOCK_SLOTS 128
+#define VDEV_UBERBLOCK_SLOT_SIZE 1024
+#define UBERBLOCK_MAGIC 0x00bab10cULL
+// the two front labels and the boot block, dev_base_ptr points behind them
+#define VDEV_DATA_OFFSET (4ULL << 20)
+
+struct pool_info {
+  nvlist_t *config;           // the front label's, owned
+  std::string name;
+  uint64_t guid;
+  int ub_slot;                // of the newest uberblock in the ring
+  const uberblock *ub;        // in the device
+  const char *dev_base_ptr;
+  std::vector<uint8_t> mos_data;
+
+  const objset_phys_t *mos() const {
+    return (const objset_phys_t*)mos_data.data();
+  }
+};
+
+/*
+ * What every command does first, given the whole device at vdev: unpack
+ * the config of the front label, pick the uberblock with the highest txg
+ * and read the MOS behind it.  False, with a message, if any of them is
+ * missing or the pool is not in host byte order.  pool_close() frees the
+ * config, the device stays the caller's.
+ */
+bool pool_open(const char *vdev, pool_info *pool);
+void pool_close(pool_info *pool);
+
+struct zap_attribute {
+  std::string za_name;            // string keys
+  std::vector<uint64_t> za_key;   // keys of ZAP_FLAG_UINT64_KEY zaps
+  int za_integer_length;
+  uint64_t za_num_integers;
+  uint64_t za_first_integer;
+  std::vector<uint8_t> za_value;  // za_num_integers integers, in host byte order
+};
+
+// return false to stop the iteration
+typedef std::function<bool(const zap_attribute &)> zap_cb_t;
+
+// visit every entry of the micro or fat zap object described by dn
+void zap_iterate(const dnode_phys_t *dn, const void *dev_base_ptr, const zap_cb_t &cb);
+
+/*
+ * For splitting a fat zap between threads: the leaves of the fat zap dn all
+ * live in blocks [1, zap_leaf_blocks()), and zap_iterate_blocks() visits the
+ * entries of the leaves among blocks [first, last).  zap_leaf_blocks() is 0
+ * for a micro zap.
+ */
+uint64_t zap_leaf_blocks(const dnode_phys_t *dn, const void *dev_base_ptr);
+void zap_iterate_blocks(const dnode_phys_t *dn, const void *dev_base_ptr, uint64_t first, uint64_t last,
+                        const zap_cb_t &cb);
+
+// returns false if name is not in the zap
+bool zap_lookup(const dnode_phys_t *dn, const char *name, const void *dev_base_ptr, uint64_t *value);
+
+struct dataset_info {
+  std::string name;
+  uint64_t dir_obj;
+  uint64_t ds_obj;
+  dsl_dataset_phys_t ds;
+};
+
+// walk the dsl_dir tree from the MOS root dataset, head datasets first then their snapshots.
+// internal also lists the pool's own $ORIGIN dataset.
+std::vector<dataset_info> list_datasets(const objset_phys_t *mos, const char *pool_name,
+                                        const void *dev_base_ptr, bool snapshots, bool internal = false);
+
+bool find_dataset(const objset_phys_t *mos, const char *pool_name, const std::string &name,
+                  const void *dev_base_ptr, dataset_info *info);
+
+/*
+ * Decoded pool metadata that list_datasets() and read_dnode() consult
+ * before walking the pool, e.g. from a sidecar index.  Either hook may be
+ * empty or return false to fall back to the pool.  Both are called from
+ * the traversal threads and must be thread safe.
+ */
+struct metadata_cache {
+  // every dataset and snapshot, internal ones included, in list_datasets() order
+  std::function<bool(std::vector<dataset_info> *datasets)> datasets;
+  // the level 0 meta dnode block blkid of the objset os
+  std::function<bool(const objset_phys_t *os, uint64_t blkid, blkptr_t *bp)> dnode_block;
+};
+
+// nullptr to stop using a cache; it must outlive every reader call
+void set_metadata_cache(const metadata_cache *cache);
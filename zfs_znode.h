@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Special attributes for master node.
+ * "userquota@", "groupquota@" and "projectquota@" are also valid (from
+ * zfs_userquota_prop_prefixes[]).
+ */
+#define	ZFS_FSID		"FSID"
+#define	ZFS_UNLINKED_SET	"DELETE_QUEUE"
+#define	ZFS_ROOT_OBJ		"ROOT"
+#define	ZPL_VERSION_STR		"VERSION"
+#define	ZFS_FUID_TABLES		"FUID"
+#define	ZFS_SHARES_DIR		"SHARES"
+#define	ZFS_SA_ATTRS		"SA_ATTRS"
+
+#define	MASTER_NODE_OBJ	1
+
+/*
+ * The directory entry has the type (currently unused on Solaris) in the
+ * top 4 bits, and the object number in the low 48 bits.  The "middle"
+ * 12 bits are unused.
+ */
+#define	ZFS_DIRENT_TYPE(de) BF64_GET(de, 60, 4)
+#define	ZFS_DIRENT_OBJ(de) BF64_GET(de, 0, 48)
+
+/*
+ * This is the persistent portion of the znode.  It is stored
+ * in the "bonus buffer" of the file.  Short symbolic links
+ * are also stored in the bonus buffer.
+ */
+typedef struct znode_phys {
+  uint64_t zp_atime[2];		/*  0 - last file access time */
+  uint64_t zp_mtime[2];		/* 16 - last file modification time */
+  uint64_t zp_ctime[2];		/* 32 - last file change time */
+  uint64_t zp_crtime[2];		/* 48 - creation time */
+  uint64_t zp_gen;		/* 64 - generation (txg of creation) */
+  uint64_t zp_mode;		/* 72 - file mode bits */
+  uint64_t zp_size;		/* 80 - size of file */
+  uint64_t zp_parent;		/* 88 - directory parent (`..') */
+  uint64_t zp_links;		/* 96 - number of links to file */
+  uint64_t zp_xattr;		/* 104 - DMU object for xattrs */
+  uint64_t zp_rdev;		/* 112 - dev_t for VBLK & VCHR files */
+  uint64_t zp_flags;		/* 120 - persistent flags */
+  uint64_t zp_uid;		/* 128 - file owner */
+  uint64_t zp_gid;		/* 136 - owning group */
+  uint64_t zp_zap;		/* 144 - extra attributes */
+  uint64_t zp_pad[3];		/* 152 - future */
+  /* 176 - zfs_acl_phys_t zp_acl, not decoded here */
+} znode_phys_t;
+
+// znode_phys_t with its ACL, where a short symlink target starts in the bonus buffer
+#define ZFS_OLD_ZNODE_PHYS_SIZE 0x108
@@ -0,0 +1,353 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <sys/stat.h>
+
+#include "zil_replay.h"
+#include "zfs_znode.h"
+
+/*
+ * lr_setattr_t.lr_mask bits.  ZoL logs the Linux iattr flags.
+ */
+#define ZIL_ATTR_MODE (1 << 0)
+#define ZIL_ATTR_UID (1 << 1)
+#define ZIL_ATTR_GID (1 << 2)
+#define ZIL_ATTR_SIZE (1 << 3)
+
+static void zil_extent_advance(zil_extent *ext, uint64_t delta) {
+  if (ext->data) {
+    ext->data += delta;
+  } else {
+    ext->bp_off += delta;
+  }
+}
+
+// insert [start, ext.end), trimming or splitting whatever it overlaps
+static void zil_extent_insert(std::map<uint64_t, zil_extent> &extents, uint64_t start, zil_extent ext) {
+  uint64_t end = ext.end;
+  auto it = extents.lower_bound(start);
+  if (it != extents.begin()) {
+    auto prev = std::prev(it);
+    if (prev->second.end > start) {
+      zil_extent tail = prev->second;
+      uint64_t prev_start = prev->first;
+      prev->second.end = start;
+      if (tail.end > end) {
+        zil_extent_advance(&tail, end - prev_start);
+        extents[end] = tail;
+      }
+    }
+  }
+  it = extents.lower_bound(start);
+  while (it != extents.end() && it->first < end) {
+    if (it->second.end > end) {
+      zil_extent tail = it->second;
+      zil_extent_advance(&tail, end - it->first);
+      extents.erase(it);
+      extents[end] = tail;
+      break;
+    }
+    it = extents.erase(it);
+  }
+  extents[start] = ext;
+}
+
+static void zil_extent_zero(std::map<uint64_t, zil_extent> &extents, uint64_t start, uint64_t end) {
+  zil_extent ext = zil_extent();
+  ext.end = end;
+  ext.zero = true;
+  zil_extent_insert(extents, start, ext);
+}
+
+static uint64_t dirent_value(const zil_overlay &ov, uint64_t obj) {
+  zpl_attr attr;
+  uint64_t type = zil_overlay_getattr(ov, obj, &attr) ? (attr.mode & S_IFMT) >> 12 : 0;
+  return obj | (type << 60);
+}
+
+static zil_overlay_obj &overlay_obj(zil_overlay *ov, uint64_t obj) {
+  auto it = ov->objs.find(obj);
+  if (it != ov->objs.end()) {
+    return it->second;
+  }
+  auto &o = ov->objs[obj];
+  o = zil_overlay_obj();
+  return o;
+}
+
+static void overlay_set_size(zil_overlay *ov, uint64_t obj, uint64_t size) {
+  zpl_attr attr;
+  uint64_t old_size = zil_overlay_getattr(*ov, obj, &attr) ? attr.size : 0;
+  auto &o = overlay_obj(ov, obj);
+  // whatever was beyond the old end must read back as zeros if the file grows again
+  if (size < old_size) {
+    zil_extent_zero(o.extents, size, UINT64_MAX);
+  }
+  o.size_set = true;
+  o.attr.size = size;
+}
+
+static void zil_replay_record(const zil_record &r, zil_overlay *ov) {
+  switch (r.txtype) {
+    case TX_CREATE:
+    case TX_MKDIR:
+    case TX_SYMLINK:
+    case TX_CREATE_ATTR:
+    case TX_MKDIR_ATTR:
+    case TX_CREATE_ACL:
+    case TX_MKDIR_ACL:
+    case TX_CREATE_ACL_ATTR:
+    case TX_MKDIR_ACL_ATTR: {
+      auto lr = lr_as<lr_create_t>(r);
+      uint64_t obj = LR_FOID_GET_OBJ(lr->lr_foid);
+      auto &o = ov->objs[obj];
+      o = zil_overlay_obj();
+      o.created = o.size_set = o.mode_set = true;
+      o.attr.mode = lr->lr_mode;
+      o.attr.uid = lr->lr_uid;
+      o.attr.gid = lr->lr_gid;
+      o.attr.gen = lr->lr_gen;
+      o.attr.parent = lr->lr_doid;
+      o.attr.links = 1;
+      if (r.txtype == TX_SYMLINK) {
+        o.attr.symlink = r.name2;
+        o.attr.size = o.attr.symlink.size();
+      }
+      if (S_ISDIR(lr->lr_mode)) {
+        ov->dirs[obj] = zil_overlay_dir();
+      }
+      auto &dir = ov->dirs[lr->lr_doid];
+      dir.removed.erase(r.name);
+      dir.added[r.name] = dirent_value(*ov, obj);
+      break;
+    }
+    case TX_LINK: {
+      auto lr = lr_as<lr_link_t>(r);
+      auto &dir = ov->dirs[lr->lr_doid];
+      dir.removed.erase(r.name);
+      dir.added[r.name] = dirent_value(*ov, lr->lr_link_obj);
+      break;
+    }
+    case TX_REMOVE:
+    case TX_RMDIR: {
+      auto &dir = ov->dirs[lr_as<lr_remove_t>(r)->lr_doid];
+      dir.added.erase(r.name);
+      dir.removed.insert(r.name);
+      break;
+    }
+    case TX_RENAME: {
+      auto lr = lr_as<lr_rename_t>(r);
+      uint64_t obj;
+      if (!zil_overlay_lookup(*ov, lr->lr_sdoid, r.name, &obj)) {
+        ov->ignored++;
+        return;
+      }
+      auto &sdir = ov->dirs[lr->lr_sdoid];
+      sdir.added.erase(r.name);
+      sdir.removed.insert(r.name);
+      auto &tdir = ov->dirs[lr->lr_tdoid];
+      tdir.removed.erase(r.name2);
+      tdir.added[r.name2] = dirent_value(*ov, obj);
+      break;
+    }
+    case TX_WRITE: {
+      auto lr = lr_as<lr_write_t>(r);
+      if (lr->lr_length == 0) {
+        break;
+      }
+      zil_extent ext = zil_extent();
+      ext.end = lr->lr_offset + lr->lr_length;
+      if (r.data) {
+        ext.data = r.data;
+        ext.end = lr->lr_offset + r.data_len;
+      } else if (BP_IS_HOLE(&lr->lr_blkptr)) {
+        ext.zero = true;
+      } else {
+        // indirect writes log the whole block lr_offset falls in
+        ext.bp = lr->lr_blkptr;
+        ext.bp_off = lr->lr_offset % BP_GET_LSIZE(&lr->lr_blkptr);
+      }
+      zpl_attr attr;
+      uint64_t size = zil_overlay_getattr(*ov, lr->lr_foid, &attr) ? attr.size : 0;
+      zil_extent_insert(overlay_obj(ov, lr->lr_foid).extents, lr->lr_offset, ext);
+      if (ext.end > size) {
+        overlay_set_size(ov, lr->lr_foid, ext.end);
+      }
+      break;
+    }
+    case TX_WRITE2: {
+      // the data already made it into the txg, only the size may be missing
+      auto lr = lr_as<lr_write_t>(r);
+      zpl_attr attr;
+      uint64_t end = lr->lr_offset + lr->lr_length;
+      if (zil_overlay_getattr(*ov, lr->lr_foid, &attr) && end > attr.size) {
+        overlay_set_size(ov, lr->lr_foid, end);
+      }
+      break;
+    }
+    case TX_TRUNCATE: {
+      auto lr = lr_as<lr_truncate_t>(r);
+      if (lr->lr_length == 0) {
+        overlay_set_size(ov, lr->lr_foid, lr->lr_offset);
+      } else {
+        zil_extent_zero(overlay_obj(ov, lr->lr_foid).extents, lr->lr_offset, lr->lr_offset + lr->lr_length);
+      }
+      break;
+    }
+    case TX_SETATTR: {
+      auto lr = lr_as<lr_setattr_t>(r);
+      if (lr->lr_mask & ZIL_ATTR_SIZE) {
+        overlay_set_size(ov, lr->lr_foid, lr->lr_size);
+      }
+      zpl_attr attr;
+      if (!zil_overlay_getattr(*ov, lr->lr_foid, &attr)) {
+        break;
+      }
+      auto &o = overlay_obj(ov, lr->lr_foid);
+      if (lr->lr_mask & ZIL_ATTR_MODE) {
+        o.mode_set = true;
+        o.attr.mode = (attr.mode & S_IFMT) | (lr->lr_mode & ~S_IFMT);
+      }
+      if (lr->lr_mask & ZIL_ATTR_UID) {
+        o.attr.uid = lr->lr_uid;
+      }
+      if (lr->lr_mask & ZIL_ATTR_GID) {
+        o.attr.gid = lr->lr_gid;
+      }
+      break;
+    }
+    default:
+      ov->ignored++;
+      return;
+  }
+  ov->applied++;
+}
+
+void zil_replay(const zpl_fs &fs, const zil_header_t *zh, zil_overlay *ov) {
+  ov->fs = &fs;
+  ov->objs.clear();
+  ov->dirs.clear();
+  ov->applied = ov->ignored = 0;
+
+  zil_walk_stats stats;
+  zil_walk(zh, fs.dev_base_ptr, [&](const zil_record &r) {
+    if (!r.replayed) {
+      zil_replay_record(r, ov);
+    }
+    return true;
+  }, &stats);
+}
+
+bool zil_overlay_getattr(const zil_overlay &ov, uint64_t obj, zpl_attr *attr) {
+  auto it = ov.objs.find(obj);
+  if (it == ov.objs.end()) {
+    return zpl_getattr(*ov.fs, obj, attr);
+  }
+  auto &o = it->second;
+  if (o.created) {
+    *attr = o.attr;
+    return true;
+  }
+  if (!zpl_getattr(*ov.fs, obj, attr)) {
+    return false;
+  }
+  if (o.size_set) {
+    attr->size = o.attr.size;
+  }
+  if (o.mode_set) {
+    attr->mode = o.attr.mode;
+  }
+  return true;
+}
+
+void zil_overlay_readdir(const zil_overlay &ov, uint64_t dir_obj, const zpl_dirent_cb_t &cb) {
+  auto it = ov.dirs.find(dir_obj);
+  if (it == ov.dirs.end()) {
+    zpl_readdir(*ov.fs, dir_obj, cb);
+    return;
+  }
+  auto &dir = it->second;
+  auto created = ov.objs.find(dir_obj);
+  bool stopped = false;
+  if (created == ov.objs.end() || !created->second.created) {
+    zpl_readdir(*ov.fs, dir_obj, [&](const std::string &name, uint64_t obj, int type) {
+      if (dir.removed.count(name) || dir.added.count(name)) {
+        return true;
+      }
+      stopped = !cb(name, obj, type);
+      return !stopped;
+    });
+  }
+  for (auto &entry : dir.added) {
+    if (stopped || !cb(entry.first, ZFS_DIRENT_OBJ(entry.second), ZFS_DIRENT_TYPE(entry.second))) {
+      return;
+    }
+  }
+}
+
+bool zil_overlay_lookup(const zil_overlay &ov, uint64_t dir_obj, const std::string &name, uint64_t *obj) {
+  auto it = ov.dirs.find(dir_obj);
+  if (it != ov.dirs.end()) {
+    auto added = it->second.added.find(name);
+    if (added != it->second.added.end()) {
+      *obj = ZFS_DIRENT_OBJ(added->second);
+      return true;
+    }
+    if (it->second.removed.count(name)) {
+      return false;
+    }
+    auto created = ov.objs.find(dir_obj);
+    if (created != ov.objs.end() && created->second.created) {
+      return false;
+    }
+  }
+  return zpl_lookup(*ov.fs, dir_obj, name, obj);
+}
+
+uint64_t zil_overlay_read(const zil_overlay &ov, uint64_t obj, uint64_t off, uint64_t len, uint8_t *buf) {
+  auto it = ov.objs.find(obj);
+  if (it == ov.objs.end()) {
+    return zpl_read(*ov.fs, obj, off, len, buf);
+  }
+  zpl_attr attr;
+  if (!zil_overlay_getattr(ov, obj, &attr) || off >= attr.size) {
+    return 0;
+  }
+  len = std::min(len, attr.size - off);
+
+  auto &o = it->second;
+  uint64_t base = o.created ? 0 : zpl_read(*ov.fs, obj, off, len, buf);
+  memset(buf + base, 0, len - base);
+
+  uint64_t end = off + len;
+  auto ext = o.extents.upper_bound(off);
+  if (ext != o.extents.begin()) {
+    ext = std::prev(ext);
+  }
+  std::vector<uint8_t> block;
+  const blkptr_t *block_bp = nullptr;
+  for (; ext != o.extents.end() && ext->first < end; ++ext) {
+    uint64_t s = std::max(off, ext->first);
+    uint64_t e = std::min(end, ext->second.end);
+    if (s >= e) {
+      continue;
+    }
+    auto &x = ext->second;
+    if (x.zero) {
+      memset(buf + (s - off), 0, e - s);
+    } else if (x.data) {
+      memcpy(buf + (s - off), x.data + (s - ext->first), e - s);
+    } else {
+      // consecutive pieces of one indirect block only read it once
+      if (block_bp == nullptr || !BP_EQUAL(block_bp, &x.bp)) {
+        block = read_block(&x.bp, ov.fs->dev_base_ptr);
+        block_bp = &x.bp;
+      }
+      uint64_t boff = x.bp_off + (s - ext->first);
+      assert(boff + (e - s) <= block.size());
+      memcpy(buf + (s - off), block.data() + boff, e - s);
+    }
+  }
+  return len;
+}
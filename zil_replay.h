@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include "zil_walk.h"
+#include "zpl.h"
+
+/*
+ * A logged write or free over [start, end) of an object.  WR_COPIED data
+ * points straight into the mapped log block and WR_INDIRECT data stays
+ * behind its blkptr until read, so replaying a log copies no file data.
+ */
+struct zil_extent {
+  uint64_t end;
+  const uint8_t *data;    // WR_COPIED payload
+  blkptr_t bp;            // WR_INDIRECT block, when data is null
+  uint64_t bp_off;        // offset of the extent start within bp's block
+  bool zero;              // freed by TX_TRUNCATE / a shrinking TX_SETATTR
+};
+
+struct zil_overlay_obj {
+  bool created;           // created by the log: nothing to read from disk
+  bool size_set;
+  bool mode_set;
+  zpl_attr attr;          // for created objects, or the overridden fields
+  std::map<uint64_t, zil_extent> extents;   // keyed by start, never overlapping
+};
+
+struct zil_overlay_dir {
+  std::map<std::string, uint64_t> added;    // name -> directory entry value
+  std::set<std::string> removed;
+};
+
+/*
+ * A read only view of a filesystem with its unreplayed intent log applied
+ * in memory.  The on-disk objset is untouched, reads merge log data over
+ * the on-disk blocks.
+ */
+struct zil_overlay {
+  const zpl_fs *fs;
+  std::unordered_map<uint64_t, zil_overlay_obj> objs;
+  std::unordered_map<uint64_t, zil_overlay_dir> dirs;
+  uint64_t applied;
+  uint64_t ignored;       // record types with no effect on names or contents
+};
+
+// apply every unreplayed record of zh on top of fs
+void zil_replay(const zpl_fs &fs, const zil_header_t *zh, zil_overlay *ov);
+
+bool zil_overlay_getattr(const zil_overlay &ov, uint64_t obj, zpl_attr *attr);
+
+void zil_overlay_readdir(const zil_overlay &ov, uint64_t dir_obj, const zpl_dirent_cb_t &cb);
+
+bool zil_overlay_lookup(const zil_overlay &ov, uint64_t dir_obj, const std::string &name, uint64_t *obj);
+
+uint64_t zil_overlay_read(const zil_overlay &ov, uint64_t obj, uint64_t off, uint64_t len, uint8_t *buf);
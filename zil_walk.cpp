@@ -0,0 +1,268 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+
+#include "zil_walk.h"
+
+const char *zil_txtype_name(uint64_t txtype) {
+  static const char *names[TX_MAX_TYPE] = {
+      "TX_COMMIT",
+      "TX_CREATE",
+      "TX_MKDIR",
+      "TX_MKXATTR",
+      "TX_SYMLINK",
+      "TX_REMOVE", // 5
+      "TX_RMDIR",
+      "TX_LINK",
+      "TX_RENAME",
+      "TX_WRITE",
+      "TX_TRUNCATE", // 10
+      "TX_SETATTR",
+      "TX_ACL_V0",
+      "TX_ACL",
+      "TX_CREATE_ACL",
+      "TX_CREATE_ATTR", // 15
+      "TX_CREATE_ACL_ATTR",
+      "TX_MKDIR_ACL",
+      "TX_MKDIR_ATTR",
+      "TX_MKDIR_ACL_ATTR",
+      "TX_WRITE2", // 20
+  };
+  return txtype < TX_MAX_TYPE ? names[txtype] : "TX_UNKNOWN";
+}
+
+// names of create records follow the optional xvattr, ACL and fuid sections
+static const char *lr_create_name(const zil_record &r) {
+  auto lr = lr_as<lr_create_t>(r);
+  switch (r.txtype) {
+    case TX_CREATE:
+    case TX_MKDIR:
+    case TX_MKXATTR:
+    case TX_SYMLINK:
+      return (const char*)(lr + 1);
+    case TX_CREATE_ATTR:
+    case TX_MKDIR_ATTR: {
+      auto xva = (const lr_attr_t*)(lr + 1);
+      return (const char*)xva + ZIL_XVAT_SIZE(xva->lr_attr_masksize);
+    }
+    case TX_CREATE_ACL:
+    case TX_MKDIR_ACL:
+    case TX_CREATE_ACL_ATTR:
+    case TX_MKDIR_ACL_ATTR: {
+      auto lracl = lr_as<lr_acl_create_t>(r);
+      auto p = (const char*)(lracl + 1);
+      if (r.txtype == TX_CREATE_ACL_ATTR || r.txtype == TX_MKDIR_ACL_ATTR) {
+        p += ZIL_XVAT_SIZE(((const lr_attr_t*)p)->lr_attr_masksize);
+      }
+      p += ZIL_ACE_LENGTH(lracl->lr_acl_bytes);
+      p += lracl->lr_fuidcnt * sizeof(uint64_t);
+      // one NUL terminated string per fuid domain
+      for (uint64_t i = 0; i < lracl->lr_domcnt; i++) {
+        p += strlen(p) + 1;
+      }
+      return p;
+    }
+    default:
+      return nullptr;
+  }
+}
+
+static void zil_decode_record(zil_record *r) {
+  r->name = r->name2 = nullptr;
+  r->data = nullptr;
+  r->data_len = 0;
+  switch (r->txtype) {
+    case TX_CREATE:
+    case TX_MKDIR:
+    case TX_MKXATTR:
+    case TX_SYMLINK:
+    case TX_CREATE_ATTR:
+    case TX_MKDIR_ATTR:
+    case TX_CREATE_ACL:
+    case TX_MKDIR_ACL:
+    case TX_CREATE_ACL_ATTR:
+    case TX_MKDIR_ACL_ATTR:
+      r->name = lr_create_name(*r);
+      if (r->txtype == TX_SYMLINK) {
+        r->name2 = r->name + strlen(r->name) + 1;
+      }
+      break;
+    case TX_REMOVE:
+    case TX_RMDIR:
+      r->name = (const char*)(lr_as<lr_remove_t>(*r) + 1);
+      break;
+    case TX_LINK:
+      r->name = (const char*)(lr_as<lr_link_t>(*r) + 1);
+      break;
+    case TX_RENAME:
+      r->name = (const char*)(lr_as<lr_rename_t>(*r) + 1);
+      r->name2 = r->name + strlen(r->name) + 1;
+      break;
+    case TX_WRITE:
+    case TX_WRITE2: {
+      // a bare lr_write_t is an indirect write, the data lives behind lr_blkptr
+      auto lr = lr_as<lr_write_t>(*r);
+      if (r->lr->lrc_reclen > sizeof(lr_write_t)) {
+        r->data = (const uint8_t*)(lr + 1);
+        r->data_len = std::min<uint64_t>(lr->lr_length, r->lr->lrc_reclen - sizeof(lr_write_t));
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+void zil_walk(const zil_header_t *zh, const void *dev_base_ptr, const zil_record_cb_t &cb,
+              zil_walk_stats *stats, const zil_block_cb_t &block_cb) {
+  memset(stats, 0, sizeof(*stats));
+
+  // a claimed log is only valid up to what the claim saw
+  uint64_t claim_blk_seq = zh->zh_claim_txg != 0 ? zh->zh_claim_blk_seq : UINT64_MAX;
+  uint64_t claim_lr_seq = (zh->zh_flags & ZIL_CLAIM_LR_SEQ_VALID) ? zh->zh_claim_lr_seq : UINT64_MAX;
+
+  blkptr_t bp = zh->zh_log;
+  while (!BP_IS_HOLE(&bp)) {
+    uint64_t blk_seq = bp.blk_cksum.zc_word[ZIL_ZC_SEQ];
+    if (blk_seq > claim_blk_seq) {
+      break;
+    }
+    assert(DVA_GET_VDEV(&bp.blk_dva[0]) == 0);
+    uint64_t lsize = BP_GET_LSIZE(&bp);
+    auto blk = (const uint8_t*)dev_base_ptr + DVA_GET_OFFSET(&bp.blk_dva[0]);
+
+    // log blocks are never compressed, so we decode straight out of the mapping
+    const zil_chain_t *zilc;
+    const uint8_t *lr_start;
+    uint64_t lr_len;
+    if (BP_GET_CHECKSUM(&bp) == ZIO_CHECKSUM_ZILOG2) {
+      zilc = (const zil_chain_t*)blk;
+      lr_start = blk + sizeof(zil_chain_t);
+      lr_len = zilc->zc_nused > sizeof(zil_chain_t) ? zilc->zc_nused - sizeof(zil_chain_t) : 0;
+    } else {
+      zilc = (const zil_chain_t*)(blk + lsize) - 1;
+      lr_start = blk;
+      lr_len = zilc->zc_nused;
+    }
+
+    // the log has no length, it ends at the first block whose trailer does not
+    // carry our sequence number: a block that was never written
+    zio_cksum_t next_cksum = bp.blk_cksum;
+    next_cksum.zc_word[ZIL_ZC_SEQ]++;
+    if (zilc->zc_eck.zec_magic != ZEC_MAGIC ||
+        memcmp(&next_cksum, &zilc->zc_next_blk.blk_cksum, sizeof(next_cksum)) != 0 ||
+        lr_len > lsize - sizeof(zil_chain_t)) {
+      // ... unless the claim already vouched for this block
+      stats->chain_error = zh->zh_claim_txg != 0;
+      break;
+    }
+    blkptr_t next = zilc->zc_next_blk;
+    // start paging in the next block while we decode this one
+    prefetch_block(&next, dev_base_ptr);
+
+    stats->blocks++;
+    stats->bytes += lr_len;
+    if (block_cb && !block_cb(bp)) {
+      return;
+    }
+    for (uint64_t off = 0; off + sizeof(lr_t) <= lr_len;) {
+      auto lr = (const lr_t*)(lr_start + off);
+      if (lr->lrc_reclen < sizeof(lr_t) || off + lr->lrc_reclen > lr_len) {
+        std::cerr << "zil block seq " << std::dec << blk_seq << ": bad record length "
+                  << lr->lrc_reclen << " at offset " << off << std::endl;
+        stats->chain_error = true;
+        return;
+      }
+      off += lr->lrc_reclen;
+      if (lr->lrc_seq > claim_lr_seq) {
+        continue;
+      }
+
+      zil_record r;
+      r.blk_seq = blk_seq;
+      r.txtype = lr->lrc_txtype & ~TX_CI;
+      r.case_insensitive = (lr->lrc_txtype & TX_CI) != 0;
+      r.replayed = lr->lrc_seq <= zh->zh_replay_seq;
+      r.lr = lr;
+      zil_decode_record(&r);
+
+      stats->records++;
+      stats->replayed += r.replayed;
+      if (r.txtype < TX_MAX_TYPE) {
+        stats->by_type[r.txtype]++;
+      }
+      if (!cb(r)) {
+        return;
+      }
+    }
+    bp = next;
+  }
+}
+
+void print_zil_record(const zil_record &r) {
+  auto lr = r.lr;
+  std::cout << std::dec << "  blk " << r.blk_seq << " seq " << lr->lrc_seq << " txg " << lr->lrc_txg
+            << " " << zil_txtype_name(r.txtype) << (r.case_insensitive ? "(CI)" : "")
+            << (r.replayed ? " [replayed]" : "");
+  switch (r.txtype) {
+    case TX_CREATE:
+    case TX_MKDIR:
+    case TX_MKXATTR:
+    case TX_SYMLINK:
+    case TX_CREATE_ATTR:
+    case TX_MKDIR_ATTR:
+    case TX_CREATE_ACL:
+    case TX_MKDIR_ACL:
+    case TX_CREATE_ACL_ATTR:
+    case TX_MKDIR_ACL_ATTR: {
+      auto c = lr_as<lr_create_t>(r);
+      std::cout << " dir " << c->lr_doid << " obj " << LR_FOID_GET_OBJ(c->lr_foid)
+                << " mode 0" << std::oct << c->lr_mode << std::dec << " name " << r.name;
+      if (r.name2) {
+        std::cout << " -> " << r.name2;
+      }
+      break;
+    }
+    case TX_REMOVE:
+    case TX_RMDIR:
+      std::cout << " dir " << lr_as<lr_remove_t>(r)->lr_doid << " name " << r.name;
+      break;
+    case TX_LINK: {
+      auto l = lr_as<lr_link_t>(r);
+      std::cout << " dir " << l->lr_doid << " obj " << l->lr_link_obj << " name " << r.name;
+      break;
+    }
+    case TX_RENAME: {
+      auto rn = lr_as<lr_rename_t>(r);
+      std::cout << " " << rn->lr_sdoid << "/" << r.name << " -> " << rn->lr_tdoid << "/" << r.name2;
+      break;
+    }
+    case TX_WRITE:
+    case TX_WRITE2: {
+      auto w = lr_as<lr_write_t>(r);
+      std::cout << " obj " << w->lr_foid << " off 0x" << std::hex << w->lr_offset
+                << " len 0x" << w->lr_length << std::dec << (r.data ? " copied" : " indirect");
+      break;
+    }
+    case TX_TRUNCATE: {
+      auto t = lr_as<lr_truncate_t>(r);
+      std::cout << " obj " << t->lr_foid << " off 0x" << std::hex << t->lr_offset
+                << " len 0x" << t->lr_length << std::dec;
+      break;
+    }
+    case TX_SETATTR: {
+      auto s = lr_as<lr_setattr_t>(r);
+      std::cout << " obj " << s->lr_foid << " mask 0x" << std::hex << s->lr_mask
+                << " size 0x" << s->lr_size << std::dec;
+      break;
+    }
+    case TX_ACL_V0:
+    case TX_ACL:
+      std::cout << " obj " << lr_as<lr_ooo_t>(r)->lr_foid;
+      break;
+    default:
+      break;
+  }
+  std::cout << std::endl;
+}
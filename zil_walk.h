@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+#include "zfs_reader.h"
+#include "zil.h"
+
+/*
+ * One decoded intent log record.  All pointers point into the log block
+ * being walked and are only valid for the duration of the callback.
+ */
+struct zil_record {
+  uint64_t blk_seq;         // sequence number of the log block holding it
+  uint64_t txtype;          // TX_*, with TX_CI stripped
+  bool case_insensitive;    // TX_CI was set
+  bool replayed;            // lrc_seq <= zh_replay_seq
+  const lr_t *lr;           // the whole record, cast with lr_as<>()
+
+  const char *name;         // create/remove/link name, rename source
+  const char *name2;        // rename target, symlink content
+  const uint8_t *data;      // TX_WRITE immediate data, null for indirect writes
+  uint64_t data_len;
+};
+
+template <typename T>
+const T *lr_as(const zil_record &r) {
+  return (const T*)r.lr;
+}
+
+struct zil_walk_stats {
+  uint64_t blocks;
+  uint64_t records;
+  uint64_t replayed;
+  uint64_t bytes;
+  uint64_t by_type[TX_MAX_TYPE];
+  bool chain_error;         // the chain ended on a bad block rather than a clean end
+};
+
+// return false to stop the walk
+typedef std::function<bool(const zil_record &)> zil_record_cb_t;
+typedef std::function<bool(const blkptr_t &)> zil_block_cb_t;
+
+/*
+ * Follow the log chain from zh->zh_log, validating each block's trailer and
+ * sequence number, and hand every record to cb in log order.  Records already
+ * replayed are passed too, with replayed set.  block_cb, if given, sees the
+ * blkptr of every valid log block before its records.
+ */
+void zil_walk(const zil_header_t *zh, const void *dev_base_ptr, const zil_record_cb_t &cb,
+              zil_walk_stats *stats, const zil_block_cb_t &block_cb = nullptr);
+
+const char *zil_txtype_name(uint64_t txtype);
+
+void print_zil_record(const zil_record &r);
@@ -0,0 +1,227 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "zpl.h"
+#include "sa_impl.h"
+#include "zfs_znode.h"
+
+static const char *zpl_sa_attr_names[ZPL_SA_NUM] = {
+    "ZPL_MODE",
+    "ZPL_SIZE",
+    "ZPL_GEN",
+    "ZPL_PARENT",
+    "ZPL_LINKS",
+    "ZPL_UID",
+    "ZPL_GID",
+    "ZPL_MTIME",
+    "ZPL_SYMLINK",
+};
+
+static void zpl_load_sa(const uint64_t sa_obj, zpl_fs *fs) {
+  auto sa_data = read_dnode(fs->os(), sa_obj, fs->dev_base_ptr);
+  auto sa_dn = (const dnode_phys_t*)sa_data.data();
+  uint64_t registry_obj = 0, layouts_obj = 0;
+  zap_lookup(sa_dn, SA_REGISTRY, fs->dev_base_ptr, &registry_obj);
+  zap_lookup(sa_dn, SA_LAYOUTS, fs->dev_base_ptr, &layouts_obj);
+  assert(registry_obj != 0 && layouts_obj != 0);
+
+  auto reg_data = read_dnode(fs->os(), registry_obj, fs->dev_base_ptr);
+  zap_iterate((const dnode_phys_t*)reg_data.data(), fs->dev_base_ptr, [&](const zap_attribute &za) {
+    uint64_t attr_num = ATTR_NUM(za.za_first_integer);
+    if (fs->sa_attr_length.size() <= attr_num) {
+      fs->sa_attr_length.resize(attr_num + 1, 0);
+    }
+    fs->sa_attr_length[attr_num] = ATTR_LENGTH(za.za_first_integer);
+    for (int i = 0; i < ZPL_SA_NUM; i++) {
+      if (za.za_name == zpl_sa_attr_names[i]) {
+        fs->sa_attr_num[i] = attr_num;
+      }
+    }
+    return true;
+  });
+
+  auto layouts_data = read_dnode(fs->os(), layouts_obj, fs->dev_base_ptr);
+  zap_iterate((const dnode_phys_t*)layouts_data.data(), fs->dev_base_ptr, [&](const zap_attribute &za) {
+    assert(za.za_integer_length == 2);
+    auto attrs = (const uint16_t*)za.za_value.data();
+    fs->sa_layouts[std::stoull(za.za_name)].assign(attrs, attrs + za.za_num_integers);
+    return true;
+  });
+}
+
+bool zpl_open(const blkptr_t *os_bp, const void *dev_base_ptr, zpl_fs *fs) {
+  fs->dev_base_ptr = dev_base_ptr;
+  fs->os_data = read_objset(os_bp, dev_base_ptr);
+  std::fill(fs->sa_attr_num, fs->sa_attr_num + ZPL_SA_NUM, -1);
+  if (fs->os()->os_type != DMU_OST_ZFS) {
+    std::cerr << "objset type " << fs->os()->os_type << " is not a filesystem" << std::endl;
+    return false;
+  }
+
+  auto master_data = read_dnode(fs->os(), MASTER_NODE_OBJ, dev_base_ptr);
+  auto master = (const dnode_phys_t*)master_data.data();
+  if (!zap_lookup(master, ZFS_ROOT_OBJ, dev_base_ptr, &fs->root_obj)) {
+    std::cerr << "no " << ZFS_ROOT_OBJ << " in the master node" << std::endl;
+    return false;
+  }
+  uint64_t sa_obj;
+  if (zap_lookup(master, ZFS_SA_ATTRS, dev_base_ptr, &sa_obj)) {
+    zpl_load_sa(sa_obj, fs);
+  }
+  return true;
+}
+
+static void zpl_decode_sa(const zpl_fs &fs, const dnode_phys_t *dn, zpl_attr *attr) {
+  auto hdr = (const sa_hdr_phys_t*)DN_BONUS(dn);
+  assert(hdr->sa_magic == SA_MAGIC);
+  auto layout = fs.sa_layouts.find(SA_HDR_LAYOUT_NUM(hdr));
+  assert(layout != fs.sa_layouts.end());
+
+  auto base = (const uint8_t*)hdr;
+  uint64_t off = SA_HDR_SIZE(hdr);
+  int var_idx = 0;
+  for (uint16_t attr_num : layout->second) {
+    uint64_t len = fs.sa_attr_length[attr_num];
+    if (len == 0) {
+      len = hdr->sa_lengths[var_idx++];
+    }
+    auto p = base + off;
+    off += P2ROUNDUP(len, 8ULL);
+    if (off > DN_MAX_BONUS_LEN(dn)) {
+      // the rest lives in the spill block, which carries nothing we need
+      break;
+    }
+
+    auto u64 = (const uint64_t*)p;
+    if (attr_num == fs.sa_attr_num[ZPL_SA_MODE]) {
+      attr->mode = *u64;
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_SIZE]) {
+      attr->size = *u64;
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_GEN]) {
+      attr->gen = *u64;
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_PARENT]) {
+      attr->parent = *u64;
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_LINKS]) {
+      attr->links = *u64;
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_UID]) {
+      attr->uid = *u64;
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_GID]) {
+      attr->gid = *u64;
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_MTIME]) {
+      attr->mtime[0] = u64[0];
+      attr->mtime[1] = u64[1];
+    } else if (attr_num == fs.sa_attr_num[ZPL_SA_SYMLINK]) {
+      attr->symlink.assign((const char*)p, len);
+    }
+  }
+}
+
+bool zpl_dnode_attr(const zpl_fs &fs, const dnode_phys_t *dn, zpl_attr *attr) {
+  *attr = zpl_attr();
+  if (dn->dn_bonustype == DMU_OT_SA) {
+    zpl_decode_sa(fs, dn, attr);
+  } else if (dn->dn_bonustype == DMU_OT_ZNODE) {
+    auto zp = (const znode_phys_t*)DN_BONUS(dn);
+    attr->mode = zp->zp_mode;
+    attr->size = zp->zp_size;
+    attr->gen = zp->zp_gen;
+    attr->parent = zp->zp_parent;
+    attr->links = zp->zp_links;
+    attr->uid = zp->zp_uid;
+    attr->gid = zp->zp_gid;
+    attr->mtime[0] = zp->zp_mtime[0];
+    attr->mtime[1] = zp->zp_mtime[1];
+    // the target follows the znode in the bonus buffer, or is block 0 of the object when it doesn't fit
+    if (S_ISLNK(zp->zp_mode)) {
+      if (ZFS_OLD_ZNODE_PHYS_SIZE + zp->zp_size <= dn->dn_bonuslen) {
+        attr->symlink.assign((const char*)DN_BONUS(dn) + ZFS_OLD_ZNODE_PHYS_SIZE, zp->zp_size);
+      } else {
+        uint64_t len = std::min<uint64_t>(zp->zp_size, dn->dn_datablkszsec * ZFS_SEC_SIZE);
+        auto target = read_object(dn, 0, len, fs.dev_base_ptr);
+        attr->symlink.assign(target.begin(), target.end());
+      }
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool zpl_getattr(const zpl_fs &fs, uint64_t obj, zpl_attr *attr) {
+  auto dn_data = read_dnode(fs.os(), obj, fs.dev_base_ptr);
+  return zpl_dnode_attr(fs, (const dnode_phys_t*)dn_data.data(), attr);
+}
+
+void zpl_readdir(const zpl_fs &fs, uint64_t dir_obj, const zpl_dirent_cb_t &cb) {
+  auto dn_data = read_dnode(fs.os(), dir_obj, fs.dev_base_ptr);
+  auto dn = (const dnode_phys_t*)dn_data.data();
+  assert(dn->dn_type == DMU_OT_DIRECTORY_CONTENTS);
+  zap_iterate(dn, fs.dev_base_ptr, [&](const zap_attribute &za) {
+    return cb(za.za_name, ZFS_DIRENT_OBJ(za.za_first_integer), ZFS_DIRENT_TYPE(za.za_first_integer));
+  });
+}
+
+bool zpl_lookup(const zpl_fs &fs, uint64_t dir_obj, const std::string &name, uint64_t *obj) {
+  auto dn_data = read_dnode(fs.os(), dir_obj, fs.dev_base_ptr);
+  uint64_t de;
+  if (!zap_lookup((const dnode_phys_t*)dn_data.data(), name.c_str(), fs.dev_base_ptr, &de)) {
+    return false;
+  }
+  *obj = ZFS_DIRENT_OBJ(de);
+  return true;
+}
+
+std::string zpl_path(const zpl_fs &fs, uint64_t obj) {
+  std::string path;
+  // a cycle or a lost parent would otherwise loop forever
+  for (int depth = 0; obj != fs.root_obj; depth++) {
+    zpl_attr attr;
+    if (depth > 4096 || !zpl_getattr(fs, obj, &attr)) {
+      return "";
+    }
+    // xattr directories hang off their file, not a directory
+    auto parent_data = read_dnode(fs.os(), attr.parent, fs.dev_base_ptr);
+    if (((const dnode_phys_t*)parent_data.data())->dn_type != DMU_OT_DIRECTORY_CONTENTS) {
+      return "";
+    }
+    std::string name;
+    zpl_readdir(fs, attr.parent, [&](const std::string &n, uint64_t o, int) {
+      if (o != obj) {
+        return true;
+      }
+      name = n;
+      return false;
+    });
+    if (name.empty()) {
+      return "";
+    }
+    path = "/" + name + path;
+    obj = attr.parent;
+  }
+  return path.empty() ? "/" : path;
+}
+
+uint64_t zpl_read(const zpl_fs &fs, uint64_t obj, uint64_t off, uint64_t len, uint8_t *buf) {
+  zpl_attr attr;
+  if (!zpl_getattr(fs, obj, &attr) || off >= attr.size) {
+    return 0;
+  }
+  len = std::min(len, attr.size - off);
+
+  auto dn_data = read_dnode(fs.os(), obj, fs.dev_base_ptr);
+  auto dn = (const dnode_phys_t*)dn_data.data();
+  uint64_t blksz = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  uint64_t done = 0;
+  while (done < len) {
+    uint64_t pos = off + done;
+    uint64_t blk_off = pos % blksz;
+    uint64_t n = std::min(len - done, blksz - blk_off);
+    auto data = read_dnode_block(dn, pos / blksz, fs.dev_base_ptr);
+    memcpy(buf + done, data.data() + blk_off, n);
+    done += n;
+  }
+  return done;
+}
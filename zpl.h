@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "zfs_reader.h"
+
+// the subset of znode attributes the readers need
+struct zpl_attr {
+  uint64_t mode;
+  uint64_t size;
+  uint64_t gen;
+  uint64_t parent;
+  uint64_t links;
+  uint64_t uid;
+  uint64_t gid;
+  uint64_t mtime[2];
+  std::string symlink;
+};
+
+enum zpl_sa_attr {
+  ZPL_SA_MODE,
+  ZPL_SA_SIZE,
+  ZPL_SA_GEN,
+  ZPL_SA_PARENT,
+  ZPL_SA_LINKS,
+  ZPL_SA_UID,
+  ZPL_SA_GID,
+  ZPL_SA_MTIME,
+  ZPL_SA_SYMLINK,
+  ZPL_SA_NUM
+};
+
+// an opened ZPL objset
+struct zpl_fs {
+  const void *dev_base_ptr;
+  std::vector<uint8_t> os_data;
+  uint64_t root_obj;
+
+  // system attribute tables, empty on pre-SA (ZPL version < 5) filesystems
+  std::vector<uint16_t> sa_attr_length;               // by attribute number, 0 if variable
+  std::map<uint64_t, std::vector<uint16_t>> sa_layouts;
+  int sa_attr_num[ZPL_SA_NUM];                        // -1 if not registered
+
+  const objset_phys_t *os() const {
+    return (const objset_phys_t*)os_data.data();
+  }
+};
+
+bool zpl_open(const blkptr_t *os_bp, const void *dev_base_ptr, zpl_fs *fs);
+
+bool zpl_getattr(const zpl_fs &fs, uint64_t obj, zpl_attr *attr);
+
+// the attributes in the bonus buffer of an already read dnode of fs
+bool zpl_dnode_attr(const zpl_fs &fs, const dnode_phys_t *dn, zpl_attr *attr);
+
+// return false to stop; type is the DT_* type recorded in the directory entry
+typedef std::function<bool(const std::string &name, uint64_t obj, int type)> zpl_dirent_cb_t;
+
+void zpl_readdir(const zpl_fs &fs, uint64_t dir_obj, const zpl_dirent_cb_t &cb);
+
+bool zpl_lookup(const zpl_fs &fs, uint64_t dir_obj, const std::string &name, uint64_t *obj);
+
+// the path of obj from the filesystem root, following the parent of its first link.
+// empty if it can't be resolved, e.g. for objects that are not files
+std::string zpl_path(const zpl_fs &fs, uint64_t obj);
+
+// read [off, off + len) of obj's data, holes read as zeros. returns the bytes read,
+// which is short only at the end of the file
+uint64_t zpl_read(const zpl_fs &fs, uint64_t obj, uint64_t off, uint64_t len, uint8_t *buf);
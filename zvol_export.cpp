@@ -0,0 +1,203 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "zvol_export.h"
+#include "parallel.h"
+
+namespace {
+
+// a subtree with data in it, rooted at level 1 or, for single level volumes, level 0
+struct zvol_unit {
+  int level;
+  uint64_t blkid;
+  blkptr_t bp;
+};
+
+struct zvol_ctx {
+  const void *dev_base_ptr;
+  int dev_fd;
+  uint64_t dev_data_off;
+  int out_fd;
+  uint64_t volsize;
+  uint64_t blksz;
+  uint64_t epb;
+  std::atomic<bool> copy_range;     // cleared once the kernel can't copy between the two files
+  std::atomic<bool> failed;
+  std::atomic<uint64_t> blocks, copied, bytes;
+};
+
+}
+
+static bool pwrite_all(int fd, const void *buf, size_t len, uint64_t off) {
+  auto p = (const char*)buf;
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "failed to write the volume image, err: " << strerror(errno) << std::endl;
+      return false;
+    }
+    p += n;
+    len -= n;
+    off += n;
+  }
+  return true;
+}
+
+// false if copy_file_range() isn't supported between the files; write errors are reported through ctx->failed
+static bool copy_range(zvol_ctx *ctx, uint64_t src, uint64_t dst, size_t len) {
+  loff_t in = src, out = dst;
+  while (len > 0) {
+    ssize_t n = copy_file_range(ctx->dev_fd, &in, ctx->out_fd, &out, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && in == (loff_t)src && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      return false;
+    }
+    if (n <= 0) {
+      std::cerr << "failed to copy to the volume image, err: " << (n == 0 ? "short copy" : strerror(errno))
+                << std::endl;
+      ctx->failed = true;
+      return true;
+    }
+    len -= n;
+  }
+  return true;
+}
+
+static void export_block(zvol_ctx *ctx, uint64_t blkid, const blkptr_t *bp) {
+  uint64_t off = blkid * ctx->blksz;
+  if (BP_IS_HOLE(bp) || off >= ctx->volsize) {
+    return;
+  }
+  size_t len = std::min(ctx->blksz, ctx->volsize - off);
+  ctx->blocks++;
+  ctx->bytes += len;
+  // a gang block's data is spread over its members, read_block() puts it together
+  if (!BP_IS_EMBEDDED(bp) && !BP_IS_GANG(bp) &&
+      (BP_GET_COMPRESS(bp) == ZIO_COMPRESS_OFF || BP_GET_COMPRESS(bp) == ZIO_COMPRESS_INHERIT)) {
+    uint64_t src = DVA_GET_OFFSET(&bp->blk_dva[0]);
+    assert(DVA_GET_VDEV(&bp->blk_dva[0]) == 0);
+    if (ctx->copy_range && copy_range(ctx, ctx->dev_data_off + src, off, len)) {
+      ctx->copied++;
+      return;
+    }
+    ctx->copy_range = false;
+    if (!pwrite_all(ctx->out_fd, (const char*)ctx->dev_base_ptr + src, len, off)) {
+      ctx->failed = true;
+    }
+    return;
+  }
+  auto data = read_block(bp, ctx->dev_base_ptr);
+  if (!pwrite_all(ctx->out_fd, data.data(), len, off)) {
+    ctx->failed = true;
+  }
+}
+
+static bool collect_units(zvol_ctx *ctx, const blkptr_t *bp, int level, uint64_t blkid, std::vector<zvol_unit> *units) {
+  if (BP_IS_HOLE(bp)) {
+    return true;
+  }
+  if (level <= 1) {
+    units->push_back(zvol_unit{level, blkid, *bp});
+    return true;
+  }
+  auto data = read_block(bp, ctx->dev_base_ptr);
+  auto bps = (const blkptr_t*)data.data();
+  for (uint64_t i = 0; i < ctx->epb; i++) {
+    if (!collect_units(ctx, &bps[i], level - 1, blkid * ctx->epb + i, units)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void export_unit(zvol_ctx *ctx, const zvol_unit &u) {
+  if (u.level == 0) {
+    export_block(ctx, u.blkid, &u.bp);
+    return;
+  }
+  auto data = read_block(&u.bp, ctx->dev_base_ptr);
+  auto bps = (const blkptr_t*)data.data();
+  for (uint64_t i = 0; i < ctx->epb && !ctx->failed; i++) {
+    export_block(ctx, u.blkid * ctx->epb + i, &bps[i]);
+  }
+}
+
+bool zvol_export(const blkptr_t *os_bp, const void *dev_base_ptr, int dev_fd, uint64_t dev_data_off,
+                 const std::string &path, unsigned nthreads, zvol_export_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  auto os_data = read_objset(os_bp, dev_base_ptr);
+  auto os = (const objset_phys_t*)os_data.data();
+  if (os->os_type != DMU_OST_ZVOL) {
+    std::cerr << "objset type " << os->os_type << " is not a volume" << std::endl;
+    return false;
+  }
+  auto zap_data = read_dnode(os, ZVOL_ZAP_OBJ, dev_base_ptr);
+  auto vol_data = read_dnode(os, ZVOL_OBJ, dev_base_ptr);
+  auto dn = (const dnode_phys_t*)vol_data.data();
+  if (!zap_lookup((const dnode_phys_t*)zap_data.data(), "size", dev_base_ptr, &stats->volsize)) {
+    std::cerr << "no volume size in the zvol zap" << std::endl;
+    return false;
+  }
+
+  int out_fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (out_fd < 0) {
+    std::cerr << "failed to create " << path << ", err: " << strerror(errno) << std::endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (ftruncate(out_fd, 0) < 0 || ftruncate(out_fd, stats->volsize) < 0) {
+      std::cerr << "failed to size " << path << ", err: " << strerror(errno) << std::endl;
+      close(out_fd);
+      return false;
+    }
+  } else if (fallocate(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, stats->volsize) < 0) {
+    std::cerr << "can't punch holes in " << path << ", holes in the volume are left as they are, err: "
+              << strerror(errno) << std::endl;
+  }
+
+  zvol_ctx ctx;
+  ctx.dev_base_ptr = dev_base_ptr;
+  ctx.dev_fd = dev_fd;
+  ctx.dev_data_off = dev_data_off;
+  ctx.out_fd = out_fd;
+  ctx.volsize = stats->volsize;
+  ctx.blksz = dn->dn_datablkszsec * ZFS_SEC_SIZE;
+  ctx.epb = 1ULL << (dn->dn_indblkshift - SPA_BLKPTRSHIFT);
+  ctx.copy_range = true;
+  ctx.failed = false;
+  ctx.blocks = ctx.copied = ctx.bytes = 0;
+
+  std::vector<zvol_unit> units;
+  bool ok = true;
+  for (int i = 0; i < dn->dn_nblkptr && ok; i++) {
+    ok = collect_units(&ctx, &dn->dn_blkptr[i], dn->dn_nlevels - 1, i, &units);
+  }
+  if (ok) {
+    parallel_for(units.size(), nthreads, [&](uint64_t i) {
+      if (!ctx.failed) {
+        export_unit(&ctx, units[i]);
+      }
+    });
+  }
+  stats->blocks = ctx.blocks;
+  stats->copied = ctx.copied;
+  stats->bytes = ctx.bytes;
+  if (close(out_fd) < 0) {
+    std::cerr << "failed to write " << path << ", err: " << strerror(errno) << std::endl;
+    ok = false;
+  }
+  return ok && !ctx.failed;
+}
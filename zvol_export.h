@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "zfs_reader.h"
+
+// objects of a zvol objset
+#define ZVOL_OBJ 1ULL
+#define ZVOL_ZAP_OBJ 2ULL
+
+struct zvol_export_stats {
+  uint64_t volsize;
+  uint64_t blocks;            // data blocks written
+  uint64_t copied;            // of those, copied from the image by copy_file_range()
+  uint64_t bytes;             // data written, everything else is left a hole
+};
+
+/*
+ * Write the volume of a DMU_OST_ZVOL objset to path as a raw image.  Holes
+ * are pruned at whatever level of the block tree they appear and never
+ * written: a regular file is truncated to the volume size and stays sparse
+ * there, anything else (a block device) gets the whole range punched up
+ * front.  Uncompressed blocks are copied with copy_file_range() straight
+ * from dev_fd, which holds the data region at dev_data_off, so they never
+ * pass through user space; the rest are decompressed and written.  The
+ * level 1 blocks are split between nthreads threads.
+ */
+bool zvol_export(const blkptr_t *os_bp, const void *dev_base_ptr, int dev_fd, uint64_t dev_data_off,
+                 const std::string &path, unsigned nthreads, zvol_export_stats *stats);